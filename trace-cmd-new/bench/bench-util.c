@@ -0,0 +1,22 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * What the trace-cmd objects linked into the benchmarks expect
+ * the trace-cmd program to supply.
+ */
+#include <stdio.h>
+#include <stdarg.h>
+
+#include "trace-local.h"
+#include "trace-msg.h"
+
+int debug;
+int quiet;
+
+void plog(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+}
@@ -0,0 +1,284 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * hash-bench - compare the chained and the open addressing hashes
+ *
+ * Adds, finds and deletes the same items in a trace_hash of a fixed
+ * number of buckets, the way trace-cmd profile sizes them, and in a
+ * trace_ohash, and reports the best wall time of the iterations.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "trace-local.h"
+#include "trace-hash.h"
+#include "trace-hash-local.h"
+#include "list.h"
+
+#define DEFAULT_ITEMS	100000
+#define DEFAULT_BUCKETS	1024
+
+struct bench_item {
+	struct trace_hash_item	hash;
+	unsigned long long	val;
+};
+
+struct hash_test {
+	const char		*name;
+	void (*run)(struct bench_item *items, int nr_items,
+		    unsigned long long *times);
+};
+
+enum {
+	HASH_ADD,
+	HASH_FIND,
+	HASH_MISS,
+	HASH_DEL,
+	NR_HASH_OPS,
+};
+
+static const char *op_names[NR_HASH_OPS] = {
+	"add", "find", "miss", "del"
+};
+
+static int nr_buckets = DEFAULT_BUCKETS;
+static unsigned long long rand_state = 1;
+
+static unsigned long long bench_rand(void)
+{
+	rand_state ^= rand_state >> 12;
+	rand_state ^= rand_state << 25;
+	rand_state ^= rand_state >> 27;
+	return rand_state * 2685821657736338717ULL;
+}
+
+static unsigned long long get_time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* The misses look for the values of the items plus one */
+static unsigned long long miss_val(unsigned long long val)
+{
+	return val + 1;
+}
+
+static int match_item(struct trace_hash_item *hitem, void *data)
+{
+	struct bench_item *item = container_of(hitem, struct bench_item, hash);
+
+	return item->val == *(unsigned long long *)data;
+}
+
+static int match_oitem(void *obj, void *data)
+{
+	struct bench_item *item = obj;
+
+	return item->val == *(unsigned long long *)data;
+}
+
+static void bench_chained(struct bench_item *items, int nr_items,
+			  unsigned long long *times)
+{
+	struct trace_hash hash;
+	unsigned long long start;
+	unsigned long long val;
+	int found = 0;
+	int i;
+
+	if (trace_hash_init(&hash, nr_buckets) < 0)
+		die("malloc");
+
+	start = get_time_ns();
+	for (i = 0; i < nr_items; i++) {
+		items[i].hash.key = trace_hash(items[i].val);
+		trace_hash_add(&hash, &items[i].hash);
+	}
+	times[HASH_ADD] = get_time_ns() - start;
+
+	start = get_time_ns();
+	for (i = 0; i < nr_items; i++) {
+		val = items[i].val;
+		if (trace_hash_find(&hash, trace_hash(val), match_item, &val))
+			found++;
+	}
+	times[HASH_FIND] = get_time_ns() - start;
+
+	start = get_time_ns();
+	for (i = 0; i < nr_items; i++) {
+		val = miss_val(items[i].val);
+		if (trace_hash_find(&hash, trace_hash(val), match_item, &val))
+			found++;
+	}
+	times[HASH_MISS] = get_time_ns() - start;
+
+	start = get_time_ns();
+	for (i = 0; i < nr_items; i++)
+		trace_hash_del(&items[i].hash);
+	times[HASH_DEL] = get_time_ns() - start;
+
+	if (found != nr_items)
+		die("chained hash found %d of %d items", found, nr_items);
+
+	trace_hash_free(&hash);
+}
+
+static void bench_open(struct bench_item *items, int nr_items,
+		       unsigned long long *times)
+{
+	struct trace_ohash hash;
+	unsigned long long start;
+	unsigned long long val;
+	int found = 0;
+	int i;
+
+	/* Start small, like the profile hashes do, to time the growing */
+	if (trace_ohash_init(&hash, 0) < 0)
+		die("malloc");
+
+	start = get_time_ns();
+	for (i = 0; i < nr_items; i++) {
+		if (trace_ohash_add(&hash, trace_hash(items[i].val),
+				    &items[i]) < 0)
+			die("malloc");
+	}
+	times[HASH_ADD] = get_time_ns() - start;
+
+	start = get_time_ns();
+	for (i = 0; i < nr_items; i++) {
+		val = items[i].val;
+		if (trace_ohash_find(&hash, trace_hash(val), match_oitem, &val))
+			found++;
+	}
+	times[HASH_FIND] = get_time_ns() - start;
+
+	start = get_time_ns();
+	for (i = 0; i < nr_items; i++) {
+		val = miss_val(items[i].val);
+		if (trace_ohash_find(&hash, trace_hash(val), match_oitem, &val))
+			found++;
+	}
+	times[HASH_MISS] = get_time_ns() - start;
+
+	start = get_time_ns();
+	for (i = 0; i < nr_items; i++)
+		trace_ohash_del(&hash, trace_hash(items[i].val), &items[i]);
+	times[HASH_DEL] = get_time_ns() - start;
+
+	if (found != nr_items || !trace_ohash_empty(&hash))
+		die("open hash found %d of %d items", found, nr_items);
+
+	trace_ohash_free(&hash);
+}
+
+static struct hash_test tests[] = {
+	{ "chained",	bench_chained },
+	{ "open",	bench_open },
+};
+
+static void run_test(struct hash_test *test, struct bench_item *items,
+		     int nr_items, int loops)
+{
+	unsigned long long best[NR_HASH_OPS];
+	unsigned long long times[NR_HASH_OPS];
+	int i;
+	int o;
+
+	for (o = 0; o < NR_HASH_OPS; o++)
+		best[o] = -1ULL;
+
+	for (i = 0; i < loops; i++) {
+		test->run(items, nr_items, times);
+		for (o = 0; o < NR_HASH_OPS; o++) {
+			if (times[o] < best[o])
+				best[o] = times[o];
+		}
+	}
+
+	for (o = 0; o < NR_HASH_OPS; o++) {
+		printf("%-8s %-6s %12.3f", test->name, op_names[o],
+		       best[o] / 1000000.0);
+		if (best[o])
+			printf(" %14.0f", nr_items * 1000000000.0 / best[o]);
+		printf("\n");
+	}
+}
+
+static void bench_usage(char **argv)
+{
+	char *p = argv[0];
+
+	printf("\n"
+	       "usage: %s [-n items][-b buckets][-l loops][-S seed][-s]\n"
+	       "\n"
+	       "  -n number of items to add (default %d)\n"
+	       "  -b buckets of the chained hash (default %d)\n"
+	       "  -l number of times to run each test (default 3)\n"
+	       "  -S seed for the item values (default 1)\n"
+	       "  -s use small sequential values, like pids\n"
+	       "\n", p, DEFAULT_ITEMS, DEFAULT_BUCKETS);
+	exit(-1);
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_item *items;
+	int nr_items = DEFAULT_ITEMS;
+	int sequential = 0;
+	int loops = 3;
+	int c;
+	int i;
+
+	while ((c = getopt(argc, argv, "hn:b:l:S:s")) >= 0) {
+		switch (c) {
+		case 'n':
+			nr_items = atoi(optarg);
+			break;
+		case 'b':
+			nr_buckets = atoi(optarg);
+			break;
+		case 'l':
+			loops = atoi(optarg);
+			break;
+		case 'S':
+			rand_state = strtoull(optarg, NULL, 0);
+			break;
+		case 's':
+			sequential = 1;
+			break;
+		case 'h':
+		default:
+			bench_usage(argv);
+		}
+	}
+
+	if (loops <= 0 || nr_items <= 0 || nr_buckets <= 0)
+		bench_usage(argv);
+	if (!rand_state)
+		rand_state = 1;
+
+	items = calloc(nr_items, sizeof(*items));
+	if (!items)
+		die("malloc");
+
+	/* Keep the values even, so that none of them is a miss value */
+	for (i = 0; i < nr_items; i++) {
+		if (sequential)
+			items[i].val = i * 2;
+		else
+			items[i].val = bench_rand() & ~1ULL;
+	}
+
+	printf("%-8s %-6s %12s %14s\n", "hash", "op", "best(ms)", "ops/s");
+
+	for (i = 0; i < ARRAY_SIZE(tests); i++)
+		run_test(&tests[i], items, nr_items, loops);
+
+	free(items);
+	return 0;
+}
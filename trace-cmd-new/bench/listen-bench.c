@@ -0,0 +1,694 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * listen-bench - load test trace-cmd listen with loopback clients
+ *
+ * Starts trace-cmd listen, and has many clients connect to it over the
+ * loopback at once. Each client speaks the v2 protocol like trace-cmd
+ * record -N does: it sends the headers of the given file as the
+ * metadata and the pages of its CPUs over the data ports. The best
+ * wall time until the listener put all the files together is reported,
+ * for the forking listener and for the event driven one (--epoll),
+ * with the records that did not make it into the files. With -M the
+ * clients use the v3 protocol like trace-cmd record -N --mux, and send
+ * the pages of all their CPUs over their one connection.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <signal.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "trace-local.h"
+#include "trace-cmd-local.h"
+#include "trace-msg.h"
+
+#define DEFAULT_CLIENTS	8
+#define DEFAULT_PORT	"18000"
+
+/* How long to wait for the listener, in milliseconds */
+#define LISTEN_WAIT	10000
+
+struct src_cpu {
+	char			*pages;
+	int			nr_pages;
+	unsigned long long	nr_records;
+};
+
+static const char *modes[] = { "fork", "epoll" };
+
+static const char *trace_cmd = "trace-cmd";
+static const char *port = DEFAULT_PORT;
+static char *dir;
+static int nr_clients = DEFAULT_CLIENTS;
+static int nr_cpus;
+static int use_tcp = 1;
+static int use_mux;
+static int use_compress;
+
+static char *meta;
+static int meta_size;
+static struct src_cpu *src_cpus;
+static int nr_src_cpus;
+
+static int listener_pid;
+static int bench_pid;
+
+static unsigned long long get_time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_ms(int ms)
+{
+	struct timespec ts;
+
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (ms % 1000) * 1000000;
+	nanosleep(&ts, NULL);
+}
+
+static void read_full(int fd, void *buf, int size)
+{
+	int n = 0;
+	int r;
+
+	while (n < size) {
+		r = read(fd, buf + n, size - n);
+		if (r <= 0)
+			die("reading from the listener");
+		n += r;
+	}
+}
+
+/* The metadata is all of the file up to the CPU count */
+static void load_metadata(const char *file)
+{
+	struct tracecmd_input *handle;
+	off_t size;
+	int nfd;
+	int fd;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0)
+		die("opening %s", file);
+
+	handle = tracecmd_alloc_fd(fd);
+	if (!handle)
+		die("reading %s", file);
+
+	nfd = open("/dev/null", O_WRONLY);
+	if (nfd < 0 || tracecmd_copy_headers(handle, nfd) < 0)
+		die("reading the headers of %s", file);
+	close(nfd);
+
+	size = lseek(fd, 0, SEEK_CUR);
+	meta = malloc(size);
+	if (!meta)
+		die("malloc");
+	if (pread(fd, meta, size, 0) != size)
+		die("reading %s", file);
+	meta_size = size;
+
+	tracecmd_close(handle);
+}
+
+static void load_pages(const char *file)
+{
+	struct tracecmd_page_index **index;
+	struct tracecmd_input *handle;
+	struct src_cpu *src;
+	int *nr_pages;
+	int cpu;
+	int fd;
+	int i;
+
+	handle = tracecmd_open(file);
+	if (!handle)
+		die("error reading %s", file);
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0)
+		die("opening %s", file);
+
+	page_size = tracecmd_page_size(handle);
+	nr_src_cpus = tracecmd_cpus(handle);
+	src_cpus = calloc(nr_src_cpus, sizeof(*src_cpus));
+	index = calloc(nr_src_cpus, sizeof(*index));
+	nr_pages = calloc(nr_src_cpus, sizeof(*nr_pages));
+	if (!src_cpus || !index || !nr_pages)
+		die("malloc");
+
+	if (tracecmd_read_page_index(handle, index, nr_pages) < 0)
+		die("reading the pages of %s", file);
+
+	for (cpu = 0; cpu < nr_src_cpus; cpu++) {
+		src = &src_cpus[cpu];
+		src->pages = malloc((unsigned long)nr_pages[cpu] * page_size + 1);
+		if (!src->pages)
+			die("malloc");
+
+		for (i = 0; i < nr_pages[cpu]; i++) {
+			if (pread(fd, src->pages + (unsigned long)i * page_size,
+				  page_size, index[cpu][i].offset) != page_size)
+				die("reading %s", file);
+			src->nr_records += index[cpu][i].nr_records;
+		}
+		src->nr_pages = nr_pages[cpu];
+		free(index[cpu]);
+	}
+	free(index);
+	free(nr_pages);
+
+	close(fd);
+	tracecmd_close(handle);
+}
+
+static int connect_port(const char *host, const char *service, int type)
+{
+	struct addrinfo hints;
+	struct addrinfo *result, *rp;
+	int sfd = -1;
+	int s;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = type;
+
+	s = getaddrinfo(host, service, &hints, &result);
+	if (s != 0)
+		die("getaddrinfo: %s", gai_strerror(s));
+
+	for (rp = result; rp != NULL; rp = rp->ai_next) {
+		sfd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+		if (sfd < 0)
+			continue;
+		if (connect(sfd, rp->ai_addr, rp->ai_addrlen) == 0)
+			break;
+		close(sfd);
+		sfd = -1;
+	}
+	freeaddrinfo(result);
+
+	return sfd;
+}
+
+static int connect_retry(const char *service, int type)
+{
+	int fd;
+	int i;
+
+	/* The forking listener starts listening on the CPU ports late */
+	for (i = 0; i < LISTEN_WAIT / 10; i++) {
+		fd = connect_port("127.0.0.1", service, type);
+		if (fd >= 0)
+			return fd;
+		sleep_ms(10);
+	}
+
+	die("connecting to port %s", service);
+	return -1;
+}
+
+/* Interleave the CPUs, like the recorders do */
+static void send_pages(int *fds)
+{
+	struct src_cpu *src;
+	int page;
+	int more;
+	int cpu;
+
+	for (page = 0, more = 1; more; page++) {
+		more = 0;
+		for (cpu = 0; cpu < nr_cpus; cpu++) {
+			src = &src_cpus[cpu % nr_src_cpus];
+			if (page >= src->nr_pages)
+				continue;
+			if (__do_write_check(fds[cpu], src->pages +
+					     (unsigned long)page * page_size,
+					     page_size) < 0)
+				die("sending the pages of cpu %d", cpu);
+			more = 1;
+		}
+	}
+}
+
+/* The pages go through pipes to the mux, as from the recorders */
+static void send_pages_mux(struct tracecmd_msg_handle *msg_handle)
+{
+	int (*pipes)[2];
+	int *fds;
+	int pid;
+	int cpu;
+
+	pipes = malloc(sizeof(*pipes) * nr_cpus);
+	fds = malloc(sizeof(*fds) * nr_cpus);
+	if (!pipes || !fds)
+		die("malloc");
+
+	for (cpu = 0; cpu < nr_cpus; cpu++) {
+		if (pipe(pipes[cpu]) < 0)
+			die("pipe");
+	}
+
+	pid = fork();
+	if (pid < 0)
+		die("fork");
+	if (!pid) {
+		for (cpu = 0; cpu < nr_cpus; cpu++) {
+			close(pipes[cpu][0]);
+			fds[cpu] = pipes[cpu][1];
+		}
+		send_pages(fds);
+		exit(0);
+	}
+
+	for (cpu = 0; cpu < nr_cpus; cpu++) {
+		close(pipes[cpu][1]);
+		fds[cpu] = pipes[cpu][0];
+	}
+
+	if (tracecmd_msg_send_data(msg_handle, fds, nr_cpus) < 0)
+		die("sending the pages");
+	waitpid(pid, NULL, 0);
+
+	for (cpu = 0; cpu < nr_cpus; cpu++)
+		close(fds[cpu]);
+	free(fds);
+	free(pipes);
+}
+
+/* Does what trace-cmd record -N does over the v2 or v3 protocol */
+static void run_client(void)
+{
+	struct tracecmd_msg_handle *msg_handle;
+	char buf[BUFSIZ];
+	int *ports;
+	int *fds;
+	int cpu;
+	int fd;
+
+	fd = connect_retry(port, SOCK_STREAM);
+
+	msg_handle = tracecmd_msg_handle_alloc(fd, TRACECMD_MSG_FL_CLIENT);
+	if (!msg_handle)
+		die("malloc");
+	msg_handle->cpu_count = nr_cpus;
+	msg_handle->version = use_mux ? V3_PROTOCOL : V2_PROTOCOL;
+	if (use_tcp)
+		msg_handle->flags |= TRACECMD_MSG_FL_USE_TCP;
+	if (use_compress)
+		msg_handle->flags |= TRACECMD_MSG_FL_COMPRESS;
+
+	read_full(fd, buf, 8);
+	if (memcmp(buf, "tracecmd", 8) != 0)
+		die("not a trace-cmd listener");
+
+	if (use_mux) {
+		write(fd, V3_CPU, sizeof(V3_CPU));
+		read_full(fd, buf, 3);
+		if (memcmp(buf, "V3", 3) != 0)
+			die("listener does not speak the v3 protocol");
+	} else {
+		write(fd, V2_CPU, sizeof(V2_CPU));
+		read_full(fd, buf, 3);
+		if (memcmp(buf, "V2", 3) != 0)
+			die("listener does not speak the v2 protocol");
+	}
+
+	write(fd, V2_MAGIC, sizeof(V2_MAGIC));
+	read_full(fd, buf, 2);
+	if (memcmp(buf, "OK", 2) != 0)
+		die("listener did not accept the v2 protocol");
+
+	if (tracecmd_msg_send_init_data(msg_handle, &ports) < 0)
+		die("sending the init message");
+
+	if (tracecmd_msg_metadata_send(msg_handle, meta, meta_size) < 0 ||
+	    tracecmd_msg_finish_sending_metadata(msg_handle) < 0)
+		die("sending the metadata");
+
+	if (use_mux) {
+		send_pages_mux(msg_handle);
+		tracecmd_msg_send_close_msg(msg_handle);
+		tracecmd_msg_handle_close(msg_handle);
+		return;
+	}
+
+	fds = malloc(sizeof(*fds) * nr_cpus);
+	if (!fds)
+		die("malloc");
+
+	for (cpu = 0; cpu < nr_cpus; cpu++) {
+		snprintf(buf, BUFSIZ, "%d", ports[cpu]);
+		fds[cpu] = connect_retry(buf, use_tcp ? SOCK_STREAM : SOCK_DGRAM);
+	}
+
+	send_pages(fds);
+
+	for (cpu = 0; cpu < nr_cpus; cpu++)
+		close(fds[cpu]);
+
+	tracecmd_msg_send_close_msg(msg_handle);
+	tracecmd_msg_handle_close(msg_handle);
+
+	free(fds);
+	free(ports);
+}
+
+static int start_listener(const char *mode)
+{
+	char log[PATH_MAX];
+	int pid;
+	int fd;
+
+	snprintf(log, PATH_MAX, "%s/listen.log", dir);
+
+	fflush(stdout);
+	pid = fork();
+	if (pid < 0)
+		die("fork");
+	if (!pid) {
+		/* What is not in the log is only noise here */
+		fd = open("/dev/null", O_WRONLY);
+		if (fd >= 0) {
+			dup2(fd, STDOUT_FILENO);
+			dup2(fd, STDERR_FILENO);
+			close(fd);
+		}
+		if (strcmp(mode, "epoll") == 0)
+			execlp(trace_cmd, trace_cmd, "listen", "--epoll",
+			       "-p", port, "-d", dir, "-l", log, NULL);
+		else
+			execlp(trace_cmd, trace_cmd, "listen",
+			       "-p", port, "-d", dir, "-l", log, NULL);
+		die("running %s", trace_cmd);
+	}
+
+	/* Wait for it to take connections, the connection is just dropped */
+	fd = connect_retry(port, SOCK_STREAM);
+	close(fd);
+
+	return pid;
+}
+
+static void stop_listener(void)
+{
+	if (!listener_pid || getpid() != bench_pid)
+		return;
+	kill(listener_pid, SIGINT);
+	waitpid(listener_pid, NULL, 0);
+	listener_pid = 0;
+}
+
+/* Counts the files of the clients and the temp files of their CPUs */
+static void count_files(int *nr_files, int *nr_temp)
+{
+	struct dirent *dent;
+	DIR *dirp;
+	int len;
+
+	*nr_files = 0;
+	*nr_temp = 0;
+
+	dirp = opendir(dir);
+	if (!dirp)
+		die("opening %s", dir);
+
+	while ((dent = readdir(dirp))) {
+		len = strlen(dent->d_name);
+		if (strncmp(dent->d_name, "trace.", 6) != 0)
+			continue;
+		if (len > 4 && strcmp(dent->d_name + len - 4, ".dat") == 0)
+			(*nr_files)++;
+		else if (strstr(dent->d_name, ".cpu"))
+			(*nr_temp)++;
+	}
+	closedir(dirp);
+}
+
+static void wait_for_files(void)
+{
+	int nr_files;
+	int nr_temp;
+	int i;
+
+	for (i = 0; i < LISTEN_WAIT; i++) {
+		count_files(&nr_files, &nr_temp);
+		if (nr_files == nr_clients && !nr_temp)
+			return;
+		sleep_ms(1);
+	}
+
+	die("the listener did not finish (%d files, %d temp files)",
+	    nr_files, nr_temp);
+}
+
+/*
+ * Counts the records that are missing from the files of the clients,
+ * and removes the files.
+ */
+static unsigned long long check_files(void)
+{
+	struct tracecmd_page_index **index;
+	struct tracecmd_input *handle;
+	unsigned long long expected = 0;
+	unsigned long long records;
+	unsigned long long lost = 0;
+	struct dirent *dent;
+	char file[PATH_MAX];
+	int *nr_pages;
+	DIR *dirp;
+	int len;
+	int cpu;
+	int i;
+
+	for (cpu = 0; cpu < nr_cpus; cpu++)
+		expected += src_cpus[cpu % nr_src_cpus].nr_records;
+
+	dirp = opendir(dir);
+	if (!dirp)
+		die("opening %s", dir);
+
+	while ((dent = readdir(dirp))) {
+		len = strlen(dent->d_name);
+		if (strncmp(dent->d_name, "trace.", 6) != 0 ||
+		    len <= 4 || strcmp(dent->d_name + len - 4, ".dat") != 0)
+			continue;
+
+		snprintf(file, PATH_MAX, "%s/%s", dir, dent->d_name);
+		handle = tracecmd_open(file);
+		if (!handle) {
+			lost += expected;
+			unlink(file);
+			continue;
+		}
+
+		index = calloc(tracecmd_cpus(handle), sizeof(*index));
+		nr_pages = calloc(tracecmd_cpus(handle), sizeof(*nr_pages));
+		if (!index || !nr_pages)
+			die("malloc");
+		if (tracecmd_read_page_index(handle, index, nr_pages) < 0)
+			die("reading the pages of %s", file);
+
+		records = 0;
+		for (cpu = 0; cpu < tracecmd_cpus(handle); cpu++) {
+			for (i = 0; i < nr_pages[cpu]; i++)
+				records += index[cpu][i].nr_records;
+			free(index[cpu]);
+		}
+		free(index);
+		free(nr_pages);
+		tracecmd_close(handle);
+
+		if (records > expected)
+			die("%s has %llu records, expected %llu",
+			    file, records, expected);
+		lost += expected - records;
+
+		unlink(file);
+	}
+	closedir(dirp);
+
+	return lost;
+}
+
+static void run_mode(const char *mode, int loops)
+{
+	unsigned long long best = -1ULL;
+	unsigned long long lost = 0;
+	unsigned long long start;
+	unsigned long long bytes = 0;
+	unsigned long long t;
+	int status;
+	int pid;
+	int cpu;
+	int i;
+	int c;
+
+	for (cpu = 0; cpu < nr_cpus; cpu++)
+		bytes += (unsigned long long)src_cpus[cpu % nr_src_cpus].nr_pages *
+			page_size;
+	bytes = (bytes + meta_size) * nr_clients;
+
+	listener_pid = start_listener(mode);
+
+	for (i = 0; i < loops; i++) {
+		fflush(stdout);
+		start = get_time_ns();
+
+		for (c = 0; c < nr_clients; c++) {
+			pid = fork();
+			if (pid < 0)
+				die("fork");
+			if (!pid) {
+				run_client();
+				exit(0);
+			}
+		}
+
+		for (c = 0; c < nr_clients; c++) {
+			if (wait(&status) < 0 || !WIFEXITED(status) ||
+			    WEXITSTATUS(status))
+				die("a client failed");
+		}
+
+		wait_for_files();
+
+		t = get_time_ns() - start;
+		if (t < best)
+			best = t;
+
+		lost += check_files();
+	}
+
+	stop_listener();
+
+	printf("%-6s %8d %6d %12.3f %10.1f %10llu\n", mode, nr_clients,
+	       nr_cpus, best / 1000000.0,
+	       bytes / 1048576.0 * 1000000000.0 / best, lost / loops);
+}
+
+static void bench_usage(char **argv)
+{
+	char *p = argv[0];
+
+	printf("\n"
+	       "usage: %s -i file [-x trace-cmd][-c clients][-C cpus][-l loops]\n"
+	       "          [-p port][-d dir][-m mode][-u][-M][-z]\n"
+	       "\n"
+	       "  -i file to take the metadata and the pages from\n"
+	       "  -x the trace-cmd to run listen with (default trace-cmd)\n"
+	       "  -c number of clients at once (default %d)\n"
+	       "  -C number of CPUs of each client (default the CPUs of the file)\n"
+	       "  -l number of times to run each listener (default 3)\n"
+	       "  -p port for the listener (default %s)\n"
+	       "  -d directory for the files of the listener (default a temp one)\n"
+	       "  -m only run the 'fork' or the 'epoll' listener\n"
+	       "  -u send the pages over UDP instead of TCP\n"
+	       "  -M send the pages over the connection of the client (v3)\n"
+	       "  -z compress the metadata, and with -M the data of the CPUs too\n"
+	       "\n", p, DEFAULT_CLIENTS, DEFAULT_PORT);
+	exit(-1);
+}
+
+int main(int argc, char **argv)
+{
+	char tmpdir[] = "/tmp/listen-bench.XXXXXX";
+	char log[PATH_MAX];
+	const char *mode = NULL;
+	const char *file = NULL;
+	int loops = 3;
+	int c;
+	int i;
+
+	while ((c = getopt(argc, argv, "hi:x:c:C:l:p:d:m:uMz")) >= 0) {
+		switch (c) {
+		case 'i':
+			file = optarg;
+			break;
+		case 'x':
+			trace_cmd = optarg;
+			break;
+		case 'c':
+			nr_clients = atoi(optarg);
+			break;
+		case 'C':
+			nr_cpus = atoi(optarg);
+			break;
+		case 'l':
+			loops = atoi(optarg);
+			break;
+		case 'p':
+			port = optarg;
+			break;
+		case 'd':
+			dir = optarg;
+			break;
+		case 'm':
+			mode = optarg;
+			break;
+		case 'u':
+			use_tcp = 0;
+			break;
+		case 'M':
+			use_mux = 1;
+			break;
+		case 'z':
+			use_compress = 1;
+			break;
+		case 'h':
+		default:
+			bench_usage(argv);
+		}
+	}
+
+	if (!file || loops <= 0 || nr_clients <= 0 || nr_cpus < 0)
+		bench_usage(argv);
+	if (mode && strcmp(mode, "fork") != 0 && strcmp(mode, "epoll") != 0)
+		bench_usage(argv);
+
+	load_metadata(file);
+	load_pages(file);
+	if (!nr_cpus)
+		nr_cpus = nr_src_cpus;
+
+	if (!dir) {
+		dir = mkdtemp(tmpdir);
+		if (!dir)
+			die("creating a temp directory");
+	}
+
+	/* The writes to a client that went away should not kill us */
+	signal(SIGPIPE, SIG_IGN);
+
+	/* Do not leave the listener running if something fails */
+	bench_pid = getpid();
+	atexit(stop_listener);
+
+	printf("%-6s %8s %6s %12s %10s %10s\n", "listen", "clients", "cpus",
+	       "best(ms)", "MB/s", "lost");
+
+	for (i = 0; i < ARRAY_SIZE(modes); i++) {
+		if (!mode || strcmp(mode, modes[i]) == 0)
+			run_mode(modes[i], loops);
+	}
+
+	snprintf(log, PATH_MAX, "%s/listen.log", dir);
+	unlink(log);
+	if (dir == tmpdir)
+		rmdir(dir);
+
+	return 0;
+}
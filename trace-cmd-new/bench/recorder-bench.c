@@ -0,0 +1,389 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * recorder-bench - measure the recorders of trace-cmd record
+ *
+ * Takes the pages of the CPUs of the given file, and writes them into
+ * files laid out like a ring buffer of the tracing directory
+ * (buffer/per_cpu/cpuN/trace_pipe_raw). A recorder per CPU, each in its
+ * own process like trace-cmd record has them, then moves the pages into
+ * the output files next to it. The best wall time and throughput are
+ * reported for splice and read (--nosplice), with and without the
+ * io_uring batching (--io-uring). Give -d a directory on tmpfs (like
+ * /dev/shm) or on a disk to compare the targets.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "trace-local.h"
+
+struct src_cpu {
+	char			*pages;
+	int			nr_pages;
+};
+
+struct bench_mode {
+	const char		*name;
+	unsigned		flags;
+};
+
+static struct bench_mode modes[] = {
+	{ "splice",		0 },
+	{ "read",		TRACECMD_RECORD_NOSPLICE },
+	{ "splice+uring",	TRACECMD_RECORD_URING },
+	{ "read+uring",		TRACECMD_RECORD_NOSPLICE | TRACECMD_RECORD_URING },
+};
+
+static char *dir;
+static char *buffer;
+static int nr_cpus;
+static int repeat = 1;
+static int do_sync;
+
+static struct src_cpu *src_cpus;
+static int nr_src_cpus;
+static int src_page_size;
+
+static unsigned long long get_time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void load_pages(const char *file)
+{
+	struct tracecmd_page_index **index;
+	struct tracecmd_input *handle;
+	struct src_cpu *src;
+	int *nr_pages;
+	int cpu;
+	int fd;
+	int i;
+
+	handle = tracecmd_open(file);
+	if (!handle)
+		die("error reading %s", file);
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0)
+		die("opening %s", file);
+
+	src_page_size = tracecmd_page_size(handle);
+	if (src_page_size != getpagesize())
+		die("the pages of %s are not of the size of the system", file);
+
+	nr_src_cpus = tracecmd_cpus(handle);
+	src_cpus = calloc(nr_src_cpus, sizeof(*src_cpus));
+	index = calloc(nr_src_cpus, sizeof(*index));
+	nr_pages = calloc(nr_src_cpus, sizeof(*nr_pages));
+	if (!src_cpus || !index || !nr_pages)
+		die("malloc");
+
+	if (tracecmd_read_page_index(handle, index, nr_pages) < 0)
+		die("reading the pages of %s", file);
+
+	for (cpu = 0; cpu < nr_src_cpus; cpu++) {
+		src = &src_cpus[cpu];
+		src->pages = malloc((unsigned long)nr_pages[cpu] * src_page_size + 1);
+		if (!src->pages)
+			die("malloc");
+
+		for (i = 0; i < nr_pages[cpu]; i++) {
+			if (pread(fd, src->pages + (unsigned long)i * src_page_size,
+				  src_page_size, index[cpu][i].offset) != src_page_size)
+				die("reading %s", file);
+		}
+		src->nr_pages = nr_pages[cpu];
+		free(index[cpu]);
+	}
+	free(index);
+	free(nr_pages);
+
+	close(fd);
+	tracecmd_close(handle);
+}
+
+static unsigned long long cpu_size(int cpu)
+{
+	struct src_cpu *src = &src_cpus[cpu % nr_src_cpus];
+
+	return (unsigned long long)src->nr_pages * src_page_size * repeat;
+}
+
+static void make_dir(const char *fmt, ...)
+{
+	char path[PATH_MAX];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(path, PATH_MAX, fmt, ap);
+	va_end(ap);
+
+	if (mkdir(path, 0755) < 0 && errno != EEXIST)
+		die("creating %s", path);
+}
+
+/* The files the recorders read, in place of the ring buffer */
+static void write_buffer(void)
+{
+	struct src_cpu *src;
+	char path[PATH_MAX];
+	size_t size;
+	int cpu;
+	int fd;
+	int r;
+
+	if (asprintf(&buffer, "%s/buffer", dir) < 0)
+		die("malloc");
+
+	make_dir("%s", buffer);
+	make_dir("%s/per_cpu", buffer);
+
+	for (cpu = 0; cpu < nr_cpus; cpu++) {
+		src = &src_cpus[cpu % nr_src_cpus];
+		size = (size_t)src->nr_pages * src_page_size;
+
+		make_dir("%s/per_cpu/cpu%d", buffer, cpu);
+		snprintf(path, PATH_MAX, "%s/per_cpu/cpu%d/trace_pipe_raw",
+			 buffer, cpu);
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0)
+			die("creating %s", path);
+
+		for (r = 0; r < repeat; r++) {
+			if (write(fd, src->pages, size) != size)
+				die("writing %s", path);
+		}
+		close(fd);
+	}
+}
+
+static void remove_buffer(void)
+{
+	char path[PATH_MAX];
+	int cpu;
+
+	for (cpu = 0; cpu < nr_cpus; cpu++) {
+		snprintf(path, PATH_MAX, "%s/per_cpu/cpu%d/trace_pipe_raw",
+			 buffer, cpu);
+		unlink(path);
+		snprintf(path, PATH_MAX, "%s/per_cpu/cpu%d", buffer, cpu);
+		rmdir(path);
+	}
+	snprintf(path, PATH_MAX, "%s/per_cpu", buffer);
+	rmdir(path);
+	rmdir(buffer);
+	free(buffer);
+}
+
+static void output_file(char *path, int cpu)
+{
+	snprintf(path, PATH_MAX, "%s/out.cpu%d", dir, cpu);
+}
+
+static void run_recorder(struct bench_mode *mode, int cpu)
+{
+	struct tracecmd_recorder *recorder;
+	char path[PATH_MAX];
+	int fd;
+
+	output_file(path, cpu);
+	recorder = tracecmd_create_buffer_recorder(path, cpu, mode->flags,
+						   buffer);
+	if (!recorder)
+		die("creating the recorder of CPU %d", cpu);
+
+	if (tracecmd_flush_recording(recorder) < 0)
+		die("recording CPU %d", cpu);
+
+	tracecmd_free_recorder(recorder);
+
+	if (do_sync) {
+		fd = open(path, O_WRONLY);
+		if (fd < 0 || fsync(fd) < 0)
+			die("syncing %s", path);
+		close(fd);
+	}
+}
+
+/* What the recorders wrote must be the pages, in the same order */
+static void check_files(void)
+{
+	struct src_cpu *src;
+	char path[PATH_MAX];
+	size_t size;
+	char *buf;
+	int cpu;
+	int fd;
+	int r;
+
+	for (cpu = 0; cpu < nr_cpus; cpu++) {
+		src = &src_cpus[cpu % nr_src_cpus];
+		size = (size_t)src->nr_pages * src_page_size;
+
+		output_file(path, cpu);
+		fd = open(path, O_RDONLY);
+		if (fd < 0)
+			die("opening %s", path);
+
+		if (lseek(fd, 0, SEEK_END) != cpu_size(cpu))
+			die("%s is not of the size of the pages", path);
+		lseek(fd, 0, SEEK_SET);
+
+		buf = malloc(size + 1);
+		if (!buf)
+			die("malloc");
+		for (r = 0; r < repeat; r++) {
+			if (read(fd, buf, size) != size ||
+			    memcmp(buf, src->pages, size) != 0)
+				die("%s does not have the pages", path);
+		}
+		free(buf);
+		close(fd);
+		unlink(path);
+	}
+}
+
+static void run_mode(struct bench_mode *mode, int loops)
+{
+	unsigned long long best = -1ULL;
+	unsigned long long bytes = 0;
+	unsigned long long start;
+	unsigned long long t;
+	int status;
+	int pid;
+	int cpu;
+	int i;
+
+	for (cpu = 0; cpu < nr_cpus; cpu++)
+		bytes += cpu_size(cpu);
+
+	for (i = 0; i < loops; i++) {
+		fflush(stdout);
+		start = get_time_ns();
+
+		for (cpu = 0; cpu < nr_cpus; cpu++) {
+			pid = fork();
+			if (pid < 0)
+				die("fork");
+			if (!pid) {
+				run_recorder(mode, cpu);
+				exit(0);
+			}
+		}
+
+		for (cpu = 0; cpu < nr_cpus; cpu++) {
+			if (wait(&status) < 0 || !WIFEXITED(status) ||
+			    WEXITSTATUS(status))
+				die("a recorder failed");
+		}
+
+		t = get_time_ns() - start;
+		if (t < best)
+			best = t;
+
+		check_files();
+	}
+
+	printf("%-14s %6d %10.1f %12.3f %10.1f\n", mode->name, nr_cpus,
+	       bytes / 1048576.0, best / 1000000.0,
+	       bytes / 1048576.0 * 1000000000.0 / best);
+}
+
+static void bench_usage(char **argv)
+{
+	char *p = argv[0];
+
+	printf("\n"
+	       "usage: %s -i file [-c cpus][-r repeat][-l loops][-d dir][-m mode][-s]\n"
+	       "\n"
+	       "  -i file to take the pages from\n"
+	       "  -c number of CPUs to record (default the CPUs of the file)\n"
+	       "  -r number of times the pages of a CPU are in its buffer (default 1)\n"
+	       "  -l number of times to run each recorder (default 3)\n"
+	       "  -d directory for the buffer and the output (default a temp one)\n"
+	       "  -m only run the given mode (splice, read, splice+uring, read+uring)\n"
+	       "  -s sync the output before a recorder is done\n"
+	       "\n", p);
+	exit(-1);
+}
+
+int main(int argc, char **argv)
+{
+	char tmpdir[] = "/tmp/recorder-bench.XXXXXX";
+	const char *mode = NULL;
+	const char *file = NULL;
+	int loops = 3;
+	int c;
+	int i;
+
+	while ((c = getopt(argc, argv, "hi:c:r:l:d:m:s")) >= 0) {
+		switch (c) {
+		case 'i':
+			file = optarg;
+			break;
+		case 'c':
+			nr_cpus = atoi(optarg);
+			break;
+		case 'r':
+			repeat = atoi(optarg);
+			break;
+		case 'l':
+			loops = atoi(optarg);
+			break;
+		case 'd':
+			dir = optarg;
+			break;
+		case 'm':
+			mode = optarg;
+			break;
+		case 's':
+			do_sync = 1;
+			break;
+		case 'h':
+		default:
+			bench_usage(argv);
+		}
+	}
+
+	if (!file || loops <= 0 || repeat <= 0 || nr_cpus < 0)
+		bench_usage(argv);
+
+	load_pages(file);
+	if (!nr_cpus)
+		nr_cpus = nr_src_cpus;
+
+	if (!dir) {
+		dir = mkdtemp(tmpdir);
+		if (!dir)
+			die("creating a temp directory");
+	}
+
+	write_buffer();
+
+	printf("%-14s %6s %10s %12s %10s\n", "recorder", "cpus", "MB",
+	       "best(ms)", "MB/s");
+
+	for (i = 0; i < ARRAY_SIZE(modes); i++) {
+		if (!mode || strcmp(mode, modes[i].name) == 0)
+			run_mode(&modes[i], loops);
+	}
+
+	remove_buffer();
+	if (dir == tmpdir)
+		rmdir(dir);
+
+	return 0;
+}
@@ -0,0 +1,389 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * trace-bench - time the common read paths over a trace.dat file
+ *
+ * Each test runs the same code trace-cmd report, split and kernelshark
+ * run, over the given file, and reports the best wall time of the
+ * iterations. Use trace-gen to create a file of a known shape.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "trace-local.h"
+#include "libkshark.h"
+
+#define NR_SEEKS	1000
+
+#define DEFAULT_FILTER	"sched_switch: prev_state == 0 || next_pid > 200"
+
+struct bench_result {
+	unsigned long long	records;
+	unsigned long long	bytes;
+};
+
+struct bench_test {
+	const char		*name;
+	const char		*desc;
+	void (*run)(const char *file, struct bench_result *result);
+};
+
+static const char *filter_str = DEFAULT_FILTER;
+static unsigned long long rand_state = 1;
+
+static unsigned long long bench_rand(void)
+{
+	rand_state ^= rand_state >> 12;
+	rand_state ^= rand_state << 25;
+	rand_state ^= rand_state >> 27;
+	return rand_state * 2685821657736338717ULL;
+}
+
+static unsigned long long get_time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static struct tracecmd_input *open_file(const char *file)
+{
+	struct tracecmd_input *handle;
+
+	handle = tracecmd_open(file);
+	if (!handle)
+		die("error reading %s", file);
+	return handle;
+}
+
+static void bench_open(const char *file, struct bench_result *result)
+{
+	struct tracecmd_input *handle;
+
+	handle = open_file(file);
+	tracecmd_close(handle);
+}
+
+static void bench_read(const char *file, struct bench_result *result)
+{
+	struct tracecmd_input *handle;
+	struct pevent_record *record;
+	int cpus;
+	int cpu;
+
+	handle = open_file(file);
+	cpus = tracecmd_cpus(handle);
+
+	for (cpu = 0; cpu < cpus; cpu++) {
+		while ((record = tracecmd_read_data(handle, cpu))) {
+			result->records++;
+			result->bytes += record->size;
+			free_record(record);
+		}
+	}
+
+	tracecmd_close(handle);
+}
+
+static void bench_merge(const char *file, struct bench_result *result)
+{
+	struct tracecmd_input *handle;
+	struct pevent_record *record;
+	int cpu;
+
+	handle = open_file(file);
+
+	while ((record = tracecmd_read_next_data(handle, &cpu))) {
+		result->records++;
+		result->bytes += record->size;
+		free_record(record);
+	}
+
+	tracecmd_close(handle);
+}
+
+static void bench_seek(const char *file, struct bench_result *result)
+{
+	struct tracecmd_input *handle;
+	struct pevent_record *record;
+	unsigned long long first = -1ULL;
+	unsigned long long last = 0;
+	unsigned long long ts;
+	int cpus;
+	int cpu;
+	int i;
+
+	handle = open_file(file);
+	cpus = tracecmd_cpus(handle);
+
+	for (cpu = 0; cpu < cpus; cpu++) {
+		record = tracecmd_read_cpu_first(handle, cpu);
+		if (record) {
+			if (record->ts < first)
+				first = record->ts;
+			free_record(record);
+		}
+		record = tracecmd_read_cpu_last(handle, cpu);
+		if (record) {
+			if (record->ts > last)
+				last = record->ts;
+			free_record(record);
+		}
+	}
+
+	if (last <= first)
+		goto out;
+
+	for (i = 0; i < NR_SEEKS; i++) {
+		ts = first + bench_rand() % (last - first);
+		tracecmd_set_all_cpus_to_timestamp(handle, ts);
+		record = tracecmd_read_next_data(handle, &cpu);
+		if (record) {
+			result->records++;
+			result->bytes += record->size;
+			free_record(record);
+		}
+	}
+ out:
+	tracecmd_close(handle);
+}
+
+static void bench_filter(const char *file, struct bench_result *result)
+{
+	struct tracecmd_input *handle;
+	struct pevent_record *record;
+	struct event_filter *filter;
+	struct pevent *pevent;
+	char errstr[200];
+	int ret;
+	int cpu;
+
+	handle = open_file(file);
+	pevent = tracecmd_get_pevent(handle);
+
+	filter = pevent_filter_alloc(pevent);
+	if (!filter)
+		die("Failed to allocate filter");
+
+	ret = pevent_filter_add_filter_str(filter, filter_str);
+	if (ret < 0) {
+		pevent_strerror(pevent, ret, errstr, sizeof(errstr));
+		die("Error filtering: %s\n%s", filter_str, errstr);
+	}
+
+	while ((record = tracecmd_read_next_data(handle, &cpu))) {
+		if (pevent_filter_match(filter, record) == FILTER_MATCH) {
+			result->records++;
+			result->bytes += record->size;
+		}
+		free_record(record);
+	}
+
+	pevent_filter_free(filter);
+	tracecmd_close(handle);
+}
+
+static void bench_print(const char *file, struct bench_result *result)
+{
+	struct tracecmd_input *handle;
+	struct pevent_record *record;
+	struct pevent *pevent;
+	struct trace_seq s;
+	int cpu;
+
+	handle = open_file(file);
+	pevent = tracecmd_get_pevent(handle);
+
+	trace_seq_init(&s);
+
+	while ((record = tracecmd_read_next_data(handle, &cpu))) {
+		pevent_print_event(pevent, &s, record, false);
+		result->records++;
+		result->bytes += s.len;
+		trace_seq_reset(&s);
+		free_record(record);
+	}
+
+	trace_seq_destroy(&s);
+	tracecmd_close(handle);
+}
+
+static void bench_kshark(const char *file, struct bench_result *result)
+{
+	struct kshark_context *kshark_ctx = NULL;
+	struct kshark_entry **data = NULL;
+	ssize_t n_rows;
+	ssize_t r;
+
+	if (!kshark_instance(&kshark_ctx))
+		die("Failed to create kshark instance");
+
+	if (!kshark_open(kshark_ctx, file))
+		die("kshark failed to open %s", file);
+
+	n_rows = kshark_load_data_entries(kshark_ctx, &data);
+	if (n_rows < 0)
+		die("kshark failed to load %s", file);
+
+	result->records = n_rows;
+	result->bytes = n_rows * sizeof(struct kshark_entry);
+
+	for (r = 0; r < n_rows; r++)
+		free(data[r]);
+	free(data);
+
+	kshark_close(kshark_ctx);
+	kshark_free(kshark_ctx);
+}
+
+static void bench_split(const char *file, struct bench_result *result)
+{
+	char dir[] = "/tmp/trace-bench.XXXXXX";
+	char *output;
+	char *cmd;
+	char *argv[] = { "trace-cmd", "split", "-i", (char *)file,
+			 "-o", NULL, "-m", "10", "-r", NULL };
+	int argc = ARRAY_SIZE(argv) - 1;
+
+	if (!mkdtemp(dir))
+		die("Can not create temp directory");
+
+	if (asprintf(&output, "%s/split.dat", dir) < 0)
+		die("Failed to allocate output name");
+	argv[5] = output;
+
+	/* trace_split() parses its own options */
+	optind = 0;
+	trace_split(argc, argv);
+
+	if (asprintf(&cmd, "rm -rf '%s'", dir) >= 0) {
+		if (system(cmd))
+			warning("Failed to remove %s", dir);
+		free(cmd);
+	}
+	free(output);
+}
+
+static struct bench_test tests[] = {
+	{ "open",	"open and close the file",	bench_open },
+	{ "read",	"read each CPU in turn",	bench_read },
+	{ "merge",	"read all CPUs in time order",	bench_merge },
+	{ "seek",	"seek to random timestamps",	bench_seek },
+	{ "filter",	"match an event filter",	bench_filter },
+	{ "print",	"format every event",		bench_print },
+	{ "kshark",	"load kshark entries",		bench_kshark },
+	{ "split",	"split into 10ms files",	bench_split },
+};
+
+static void run_test(struct bench_test *test, const char *file, int loops)
+{
+	struct bench_result result;
+	unsigned long long start;
+	unsigned long long best = -1ULL;
+	unsigned long long total = 0;
+	unsigned long long delta;
+	int i;
+
+	for (i = 0; i < loops; i++) {
+		memset(&result, 0, sizeof(result));
+		start = get_time_ns();
+		test->run(file, &result);
+		delta = get_time_ns() - start;
+		total += delta;
+		if (delta < best)
+			best = delta;
+	}
+
+	printf("%-8s %12.3f %12.3f %12llu %14llu", test->name,
+	       best / 1000000.0, total / 1000000.0 / loops,
+	       result.records, result.bytes);
+	if (result.records && best)
+		printf(" %12.0f", result.records * 1000000000.0 / best);
+	printf("\n");
+}
+
+static void bench_usage(char **argv)
+{
+	char *p = argv[0];
+	int i;
+
+	printf("\n"
+	       "usage: %s [-i file][-l loops][-f filter][-S seed] [test ...]\n"
+	       "\n"
+	       "  -i input file (default trace.dat)\n"
+	       "  -l number of times to run each test (default 3)\n"
+	       "  -f filter for the filter test (default '%s')\n"
+	       "  -S seed for the random seeks (default 1)\n"
+	       "\n"
+	       "  tests:\n", p, DEFAULT_FILTER);
+	for (i = 0; i < ARRAY_SIZE(tests); i++)
+		printf("    %-8s %s\n", tests[i].name, tests[i].desc);
+	printf("\n");
+	exit(-1);
+}
+
+int main(int argc, char **argv)
+{
+	const char *file = "trace.dat";
+	int loops = 3;
+	int arg;
+	int c;
+	int i;
+
+	while ((c = getopt(argc, argv, "hi:l:f:S:")) >= 0) {
+		switch (c) {
+		case 'i':
+			file = optarg;
+			break;
+		case 'l':
+			loops = atoi(optarg);
+			break;
+		case 'f':
+			filter_str = optarg;
+			break;
+		case 'S':
+			rand_state = strtoull(optarg, NULL, 0);
+			break;
+		case 'h':
+		default:
+			bench_usage(argv);
+		}
+	}
+
+	if (loops <= 0)
+		bench_usage(argv);
+	if (!rand_state)
+		rand_state = 1;
+
+	/* Keep split from printing the CPU data of each file it writes */
+	quiet = 1;
+
+	printf("%-8s %12s %12s %12s %14s %12s\n", "test", "best(ms)",
+	       "avg(ms)", "records", "bytes", "records/s");
+
+	if (optind >= argc) {
+		for (i = 0; i < ARRAY_SIZE(tests); i++)
+			run_test(&tests[i], file, loops);
+		return 0;
+	}
+
+	/* The split test resets optind, do not use it from here on */
+	for (arg = optind; arg < argc; arg++) {
+		char *name = argv[arg];
+
+		for (i = 0; i < ARRAY_SIZE(tests); i++) {
+			if (strcmp(tests[i].name, name) == 0)
+				break;
+		}
+		if (i == ARRAY_SIZE(tests))
+			die("Unknown test '%s'", name);
+		run_test(&tests[i], file, loops);
+	}
+
+	return 0;
+}
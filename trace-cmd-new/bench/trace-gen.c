@@ -0,0 +1,920 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * trace-gen - write a synthetic trace.dat file
+ *
+ * This creates a trace.dat file from made up events, without needing
+ * tracefs or root. A fake tracing directory holding the event formats
+ * is created, and handed to tracecmd_create_init_file_override() like
+ * a real one would be. The ring buffer pages of each CPU are then
+ * built by hand and attached with tracecmd_append_cpu_data().
+ */
+#define _LARGEFILE64_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <stdarg.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "trace-local.h"
+
+/* The header_page we fake has an 8 byte commit field */
+#define PAGE_HEADER_SIZE	16
+#define COMMON_HEADER_SIZE	8
+
+#define TASK_COMM_LEN		16
+
+#define TS_SHIFT		27
+#define TS_MASK			((1ULL << TS_SHIFT) - 1)
+
+#define MAX_PAYLOAD		256
+
+#define START_TS		1000000000ULL
+
+#define COMMON_FIELDS							\
+	"\tfield:unsigned short common_type;\toffset:0;\tsize:2;\tsigned:0;\n" \
+	"\tfield:unsigned char common_flags;\toffset:2;\tsize:1;\tsigned:0;\n" \
+	"\tfield:unsigned char common_preempt_count;\toffset:3;\tsize:1;\tsigned:0;\n" \
+	"\tfield:int common_pid;\toffset:4;\tsize:4;\tsigned:1;\n\n"
+
+static const char header_page[] =
+	"\tfield: u64 timestamp;\toffset:0;\tsize:8;\tsigned:0;\n"
+	"\tfield: local_t commit;\toffset:8;\tsize:8;\tsigned:1;\n"
+	"\tfield: int overwrite;\toffset:8;\tsize:1;\tsigned:1;\n"
+	"\tfield: char data;\toffset:16;\tsize:4080;\tsigned:1;\n";
+
+static const char header_event[] =
+	"# compressed entry header\n"
+	"\ttype_len    :    5 bits\n"
+	"\ttime_delta  :   27 bits\n"
+	"\tarray       :   32 bits\n"
+	"\n"
+	"\tpadding     : type == 29\n"
+	"\ttime_extend : type == 30\n"
+	"\tdata max type_len  == 28\n";
+
+enum gen_event_type {
+	GEN_SCHED_SWITCH,
+	GEN_SCHED_WAKEUP,
+	GEN_IRQ_ENTRY,
+	GEN_IRQ_EXIT,
+	GEN_HRTIMER_START,
+	GEN_PRINT,
+	/* Only made when asked for with -e */
+	GEN_KMALLOC,
+	GEN_KFREE,
+	GEN_FUNCTION,
+	GEN_NR_EVENTS,
+};
+
+struct gen_event {
+	const char		*system;
+	const char		*name;
+	int			id;
+	const char		*fields;
+	const char		*print_fmt;
+};
+
+static struct gen_event gen_events[GEN_NR_EVENTS] = {
+	[GEN_SCHED_SWITCH] = {
+		"sched", "sched_switch", 316,
+		"\tfield:char prev_comm[16];\toffset:8;\tsize:16;\tsigned:1;\n"
+		"\tfield:pid_t prev_pid;\toffset:24;\tsize:4;\tsigned:1;\n"
+		"\tfield:int prev_prio;\toffset:28;\tsize:4;\tsigned:1;\n"
+		"\tfield:long prev_state;\toffset:32;\tsize:8;\tsigned:1;\n"
+		"\tfield:char next_comm[16];\toffset:40;\tsize:16;\tsigned:1;\n"
+		"\tfield:pid_t next_pid;\toffset:56;\tsize:4;\tsigned:1;\n"
+		"\tfield:int next_prio;\toffset:60;\tsize:4;\tsigned:1;\n",
+		"\"prev_comm=%s prev_pid=%d prev_prio=%d prev_state=%s%s ==> "
+		"next_comm=%s next_pid=%d next_prio=%d\", REC->prev_comm, "
+		"REC->prev_pid, REC->prev_prio, REC->prev_state & (2048-1) ? "
+		"__print_flags(REC->prev_state & (2048-1), \"|\", { 1, \"S\"} , "
+		"{ 2, \"D\" }, { 4, \"T\" }, { 8, \"t\" }, { 16, \"Z\" }, "
+		"{ 32, \"X\" }, { 64, \"x\" }, { 128, \"K\" }, { 256, \"W\" }, "
+		"{ 512, \"P\" }, { 1024, \"N\" }) : \"R\", "
+		"REC->prev_state & 2048 ? \"+\" : \"\", REC->next_comm, "
+		"REC->next_pid, REC->next_prio",
+	},
+	[GEN_SCHED_WAKEUP] = {
+		"sched", "sched_wakeup", 318,
+		"\tfield:char comm[16];\toffset:8;\tsize:16;\tsigned:1;\n"
+		"\tfield:pid_t pid;\toffset:24;\tsize:4;\tsigned:1;\n"
+		"\tfield:int prio;\toffset:28;\tsize:4;\tsigned:1;\n"
+		"\tfield:int success;\toffset:32;\tsize:4;\tsigned:1;\n"
+		"\tfield:int target_cpu;\toffset:36;\tsize:4;\tsigned:1;\n",
+		"\"comm=%s pid=%d prio=%d target_cpu=%03d\", REC->comm, "
+		"REC->pid, REC->prio, REC->target_cpu",
+	},
+	[GEN_IRQ_ENTRY] = {
+		"irq", "irq_handler_entry", 120,
+		"\tfield:int irq;\toffset:8;\tsize:4;\tsigned:1;\n"
+		"\tfield:__data_loc char[] name;\toffset:12;\tsize:4;\tsigned:1;\n",
+		"\"irq=%d name=%s\", REC->irq, __get_str(name)",
+	},
+	[GEN_IRQ_EXIT] = {
+		"irq", "irq_handler_exit", 121,
+		"\tfield:int irq;\toffset:8;\tsize:4;\tsigned:1;\n"
+		"\tfield:int ret;\toffset:12;\tsize:4;\tsigned:1;\n",
+		"\"irq=%d ret=%s\", REC->irq, REC->ret ? \"handled\" : \"unhandled\"",
+	},
+	[GEN_HRTIMER_START] = {
+		"timer", "hrtimer_start", 90,
+		"\tfield:void * hrtimer;\toffset:8;\tsize:8;\tsigned:0;\n"
+		"\tfield:void * function;\toffset:16;\tsize:8;\tsigned:0;\n"
+		"\tfield:s64 expires;\toffset:24;\tsize:8;\tsigned:1;\n"
+		"\tfield:s64 softexpires;\toffset:32;\tsize:8;\tsigned:1;\n",
+		"\"hrtimer=%p function=%pf expires=%llu softexpires=%llu\", "
+		"REC->hrtimer, REC->function, REC->expires, REC->softexpires",
+	},
+	[GEN_PRINT] = {
+		"ftrace", "print", 5,
+		"\tfield:unsigned long ip;\toffset:8;\tsize:8;\tsigned:0;\n"
+		"\tfield:char buf[];\toffset:16;\tsize:0;\tsigned:0;\n",
+		"\"%ps: %s\", REC->ip, REC->buf",
+	},
+	[GEN_KMALLOC] = {
+		"kmem", "kmalloc", 420,
+		"\tfield:unsigned long call_site;\toffset:8;\tsize:8;\tsigned:0;\n"
+		"\tfield:const void * ptr;\toffset:16;\tsize:8;\tsigned:0;\n"
+		"\tfield:size_t bytes_req;\toffset:24;\tsize:8;\tsigned:0;\n"
+		"\tfield:size_t bytes_alloc;\toffset:32;\tsize:8;\tsigned:0;\n"
+		"\tfield:gfp_t gfp_flags;\toffset:40;\tsize:4;\tsigned:0;\n",
+		"\"call_site=%lx ptr=%p bytes_req=%zu bytes_alloc=%zu gfp_flags=%x\", "
+		"REC->call_site, REC->ptr, REC->bytes_req, REC->bytes_alloc, "
+		"REC->gfp_flags",
+	},
+	[GEN_KFREE] = {
+		"kmem", "kfree", 422,
+		"\tfield:unsigned long call_site;\toffset:8;\tsize:8;\tsigned:0;\n"
+		"\tfield:const void * ptr;\toffset:16;\tsize:8;\tsigned:0;\n",
+		"\"call_site=%lx ptr=%p\", REC->call_site, REC->ptr",
+	},
+	[GEN_FUNCTION] = {
+		"ftrace", "function", 1,
+		"\tfield:unsigned long ip;\toffset:8;\tsize:8;\tsigned:0;\n"
+		"\tfield:unsigned long parent_ip;\toffset:16;\tsize:8;\tsigned:0;\n",
+		"\" %ps <-- %ps\", REC->ip, REC->parent_ip",
+	},
+};
+
+static const char *irq_names[] = {
+	"timer", "eth0", "ahci", "i8042", "nvme0q1", "xhci_hcd",
+};
+
+static const struct {
+	unsigned long long	addr;
+	const char		*name;
+} gen_syms[] = {
+	{ 0xffffffff81000000ULL, "_stext" },
+	{ 0xffffffff810a1000ULL, "tick_sched_timer" },
+	{ 0xffffffff810a2000ULL, "hrtimer_wakeup" },
+	{ 0xffffffff810a3000ULL, "it_real_fn" },
+	{ 0xffffffff810a4000ULL, "watchdog_timer_fn" },
+	{ 0xffffffff81180000ULL, "trace_marker_write" },
+	{ 0xffffffff81200000ULL, "alloc_pipe_info" },
+	{ 0xffffffff81201000ULL, "__d_alloc" },
+	{ 0xffffffff81202000ULL, "prepare_creds" },
+	{ 0xffffffff81203000ULL, "mm_alloc" },
+	{ 0xffffffff81204000ULL, "journal_start" },
+	{ 0xffffffff81205000ULL, "anon_vma_alloc" },
+	{ 0xffffffff81300000ULL, "_etext" },
+};
+
+#define GEN_FIRST_KMEM_SYM	6
+#define GEN_NR_KMEM_SYMS	6
+
+/* The functions the function events call, named gen_func_<n> */
+#define GEN_FUNC_ADDR		0xffffffff81210000ULL
+#define GEN_FUNC_SIZE		0x100
+#define GEN_NR_FUNCS		256
+#define GEN_MAX_DEPTH		24
+
+/* The kmalloc and kfree pointers, enough for many to stay live */
+#define GEN_NR_KMEM_PTRS	(1 << 20)
+
+struct gen_task {
+	int			pid;
+	char			comm[TASK_COMM_LEN];
+};
+
+struct gen_cpu {
+	unsigned long long	ts;
+	unsigned long long	page_ts;
+	unsigned long long	size;
+	unsigned long		events;
+	char			*page;
+	char			*file;
+	int			index;
+	int			fd;
+	int			curr;	/* index into tasks, -1 for idle */
+	int			depth;
+	int			stack[GEN_MAX_DEPTH];
+};
+
+static int page_size;
+static int nr_tasks = 64;
+static struct gen_task *tasks;
+static unsigned long long rand_state = 1;
+
+static int weights[GEN_NR_EVENTS];
+static int total_weight;
+
+/* xorshift64*, so the same seed always gives the same file */
+static unsigned long long gen_rand(void)
+{
+	rand_state ^= rand_state >> 12;
+	rand_state ^= rand_state << 25;
+	rand_state ^= rand_state >> 27;
+	return rand_state * 2685821657736338717ULL;
+}
+
+static void write_file(const char *dir, const char *name,
+		       const char *fmt, ...)
+{
+	va_list ap;
+	char *path;
+	FILE *fp;
+
+	if (asprintf(&path, "%s/%s", dir, name) < 0)
+		die("Failed to allocate path for %s", name);
+
+	fp = fopen(path, "w");
+	if (!fp)
+		die("Can not create %s", path);
+
+	va_start(ap, fmt);
+	vfprintf(fp, fmt, ap);
+	va_end(ap);
+
+	fclose(fp);
+	free(path);
+}
+
+static void make_dir(const char *dir, const char *name)
+{
+	char *path;
+
+	if (asprintf(&path, "%s/%s", dir, name) < 0)
+		die("Failed to allocate path for %s", name);
+	if (mkdir(path, 0755) < 0 && errno != EEXIST)
+		die("Can not create %s", path);
+	free(path);
+}
+
+static void create_tracing_dir(const char *dir)
+{
+	struct gen_event *event;
+	char *path;
+	int i;
+
+	make_dir(dir, "events");
+	write_file(dir, "events/header_page", "%s", header_page);
+	write_file(dir, "events/header_event", "%s", header_event);
+
+	for (i = 0; i < GEN_NR_EVENTS; i++) {
+		event = &gen_events[i];
+
+		if (asprintf(&path, "events/%s", event->system) < 0)
+			die("Failed to allocate event path");
+		make_dir(dir, path);
+		free(path);
+
+		if (asprintf(&path, "events/%s/%s",
+			     event->system, event->name) < 0)
+			die("Failed to allocate event path");
+		make_dir(dir, path);
+		free(path);
+
+		if (asprintf(&path, "events/%s/%s/format",
+			     event->system, event->name) < 0)
+			die("Failed to allocate event path");
+		write_file(dir, path,
+			   "name: %s\nID: %d\nformat:\n" COMMON_FIELDS
+			   "%s\nprint fmt: %s\n",
+			   event->name, event->id, event->fields,
+			   event->print_fmt);
+		free(path);
+	}
+
+	write_file(dir, "trace_clock", "[local] global counter\n");
+	write_file(dir, "printk_formats", "");
+
+	path = NULL;
+	for (i = 0; i < nr_tasks; i++) {
+		char *old = path;
+
+		if (asprintf(&path, "%s%d %s\n", old ? old : "",
+			     tasks[i].pid, tasks[i].comm) < 0)
+			die("Failed to allocate cmdlines");
+		free(old);
+	}
+	write_file(dir, "saved_cmdlines", "%s", path ? path : "");
+	free(path);
+
+	path = NULL;
+	for (i = 0; i < ARRAY_SIZE(gen_syms); i++) {
+		char *old = path;
+
+		if (asprintf(&path, "%s%016llx T %s\n", old ? old : "",
+			     gen_syms[i].addr, gen_syms[i].name) < 0)
+			die("Failed to allocate kallsyms");
+		free(old);
+	}
+	for (i = 0; i < GEN_NR_FUNCS; i++) {
+		char *old = path;
+
+		if (asprintf(&path, "%s%016llx T gen_func_%d\n", old,
+			     GEN_FUNC_ADDR + i * GEN_FUNC_SIZE, i) < 0)
+			die("Failed to allocate kallsyms");
+		free(old);
+	}
+	write_file(dir, "kallsyms", "%s", path);
+	free(path);
+}
+
+static void remove_tracing_dir(const char *dir)
+{
+	char *cmd;
+
+	if (asprintf(&cmd, "rm -rf '%s'", dir) < 0)
+		return;
+	if (system(cmd))
+		warning("Failed to remove %s", dir);
+	free(cmd);
+}
+
+static void parse_mix(char *mix)
+{
+	char *save;
+	char *tok;
+	char *val;
+	int i;
+
+	memset(weights, 0, sizeof(weights));
+
+	for (tok = strtok_r(mix, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		val = strchr(tok, '=');
+		if (val)
+			*val++ = '\0';
+		for (i = 0; i < GEN_NR_EVENTS; i++) {
+			if (strcmp(tok, gen_events[i].name) == 0)
+				break;
+		}
+		if (i == GEN_NR_EVENTS)
+			die("Unknown event '%s'", tok);
+		weights[i] = val ? atoi(val) : 1;
+		if (weights[i] < 0)
+			die("Bad weight for '%s'", tok);
+	}
+}
+
+static void init_tasks(void)
+{
+	int i;
+
+	tasks = malloc(sizeof(*tasks) * nr_tasks);
+	if (!tasks)
+		die("Failed to allocate tasks");
+
+	for (i = 0; i < nr_tasks; i++) {
+		tasks[i].pid = 100 + i * 7;
+		snprintf(tasks[i].comm, TASK_COMM_LEN, "task-%d", i);
+	}
+}
+
+static int pick_event(void)
+{
+	int r = gen_rand() % total_weight;
+	int i;
+
+	for (i = 0; i < GEN_NR_EVENTS; i++) {
+		r -= weights[i];
+		if (r < 0)
+			break;
+	}
+	return i;
+}
+
+static void flush_page(struct gen_cpu *cpu_data)
+{
+	unsigned long long commit = cpu_data->index - PAGE_HEADER_SIZE;
+
+	memcpy(cpu_data->page + 8, &commit, 8);
+
+	if (write(cpu_data->fd, cpu_data->page, page_size) != page_size)
+		die("Failed writing to %s", cpu_data->file);
+
+	cpu_data->size += page_size;
+	memset(cpu_data->page, 0, page_size);
+	cpu_data->index = 0;
+}
+
+static void *reserve_event(struct gen_cpu *cpu_data, int len)
+{
+	unsigned long long delta;
+	unsigned int header;
+	int type_len;
+	int needed;
+	char *ptr;
+
+	len = (len + 3) & ~3;
+	needed = len + 4;
+	if (len > 28 * 4) {
+		type_len = 0;
+		needed += 4;
+	} else
+		type_len = len / 4;
+
+	delta = cpu_data->ts - cpu_data->page_ts;
+	if (delta > TS_MASK)
+		needed += 8;
+
+	if (cpu_data->index && cpu_data->index + needed > page_size)
+		flush_page(cpu_data);
+
+	/* The deltas of the page start from the time stamp in its header */
+	if (!cpu_data->index) {
+		cpu_data->index = PAGE_HEADER_SIZE;
+		cpu_data->page_ts = cpu_data->ts;
+		memcpy(cpu_data->page, &cpu_data->page_ts, 8);
+		delta = 0;
+	}
+
+	ptr = cpu_data->page + cpu_data->index;
+
+	if (delta > TS_MASK) {
+		header = RINGBUF_TYPE_TIME_EXTEND |
+			((delta & TS_MASK) << 5);
+		memcpy(ptr, &header, 4);
+		header = delta >> TS_SHIFT;
+		memcpy(ptr + 4, &header, 4);
+		ptr += 8;
+		delta = 0;
+	}
+
+	header = type_len | (delta << 5);
+	memcpy(ptr, &header, 4);
+	ptr += 4;
+
+	if (!type_len) {
+		header = len + 4;
+		memcpy(ptr, &header, 4);
+		ptr += 4;
+	}
+
+	cpu_data->index = ptr - cpu_data->page + len;
+	cpu_data->page_ts = cpu_data->ts;
+	cpu_data->events++;
+
+	memset(ptr, 0, len);
+	return ptr;
+}
+
+static void write_common(void *ptr, int type, int pid)
+{
+	unsigned short common_type = gen_events[type].id;
+	int common_pid = pid;
+
+	memcpy(ptr, &common_type, 2);
+	memcpy(ptr + 4, &common_pid, 4);
+}
+
+static int curr_pid(struct gen_cpu *cpu_data)
+{
+	return cpu_data->curr < 0 ? 0 : tasks[cpu_data->curr].pid;
+}
+
+static const char *curr_comm(struct gen_cpu *cpu_data)
+{
+	return cpu_data->curr < 0 ? "swapper" : tasks[cpu_data->curr].comm;
+}
+
+static void gen_sched_switch(struct gen_cpu *cpu_data)
+{
+	long long prev_state = gen_rand() % 3;
+	int prev_prio = 120;
+	int next_prio = 120;
+	int next;
+	int pid;
+	char *ptr;
+
+	/* A quarter of the switches go idle */
+	next = gen_rand() % (nr_tasks + nr_tasks / 3 + 1);
+	if (next >= nr_tasks)
+		next = -1;
+
+	ptr = reserve_event(cpu_data, 64);
+	write_common(ptr, GEN_SCHED_SWITCH, curr_pid(cpu_data));
+	strncpy(ptr + 8, curr_comm(cpu_data), TASK_COMM_LEN);
+	pid = curr_pid(cpu_data);
+	memcpy(ptr + 24, &pid, 4);
+	memcpy(ptr + 28, &prev_prio, 4);
+	memcpy(ptr + 32, &prev_state, 8);
+
+	cpu_data->curr = next;
+	strncpy(ptr + 40, curr_comm(cpu_data), TASK_COMM_LEN);
+	pid = curr_pid(cpu_data);
+	memcpy(ptr + 56, &pid, 4);
+	memcpy(ptr + 60, &next_prio, 4);
+}
+
+static void gen_sched_wakeup(struct gen_cpu *cpu_data, int cpus)
+{
+	struct gen_task *task = &tasks[gen_rand() % nr_tasks];
+	int target_cpu = gen_rand() % cpus;
+	int success = 1;
+	int prio = 120;
+	char *ptr;
+
+	ptr = reserve_event(cpu_data, 40);
+	write_common(ptr, GEN_SCHED_WAKEUP, curr_pid(cpu_data));
+	strncpy(ptr + 8, task->comm, TASK_COMM_LEN);
+	memcpy(ptr + 24, &task->pid, 4);
+	memcpy(ptr + 28, &prio, 4);
+	memcpy(ptr + 32, &success, 4);
+	memcpy(ptr + 36, &target_cpu, 4);
+}
+
+static void gen_irq_entry(struct gen_cpu *cpu_data)
+{
+	int irq = gen_rand() % ARRAY_SIZE(irq_names);
+	const char *name = irq_names[irq];
+	int len = strlen(name) + 1;
+	int data_loc = 16 | (len << 16);
+	char *ptr;
+
+	ptr = reserve_event(cpu_data, 16 + len);
+	write_common(ptr, GEN_IRQ_ENTRY, curr_pid(cpu_data));
+	memcpy(ptr + 8, &irq, 4);
+	memcpy(ptr + 12, &data_loc, 4);
+	memcpy(ptr + 16, name, len);
+}
+
+static void gen_irq_exit(struct gen_cpu *cpu_data)
+{
+	int irq = gen_rand() % ARRAY_SIZE(irq_names);
+	int ret = 1;
+	char *ptr;
+
+	ptr = reserve_event(cpu_data, 16);
+	write_common(ptr, GEN_IRQ_EXIT, curr_pid(cpu_data));
+	memcpy(ptr + 8, &irq, 4);
+	memcpy(ptr + 12, &ret, 4);
+}
+
+static void gen_hrtimer_start(struct gen_cpu *cpu_data)
+{
+	unsigned long long hrtimer = 0xffff880000000000ULL +
+		(gen_rand() % 1024) * 64;
+	unsigned long long function;
+	long long expires;
+	char *ptr;
+
+	/* skip _stext */
+	function = gen_syms[1 + gen_rand() % 4].addr;
+	expires = cpu_data->ts + 1000000 + gen_rand() % 1000000;
+
+	ptr = reserve_event(cpu_data, 40);
+	write_common(ptr, GEN_HRTIMER_START, curr_pid(cpu_data));
+	memcpy(ptr + 8, &hrtimer, 8);
+	memcpy(ptr + 16, &function, 8);
+	memcpy(ptr + 24, &expires, 8);
+	memcpy(ptr + 32, &expires, 8);
+}
+
+static void gen_print(struct gen_cpu *cpu_data, int max_len)
+{
+	unsigned long long ip = gen_syms[5].addr;
+	int len;
+	int i;
+	char *ptr;
+
+	len = 8 + gen_rand() % (max_len - 8 + 1);
+
+	ptr = reserve_event(cpu_data, 16 + len + 1);
+	write_common(ptr, GEN_PRINT, curr_pid(cpu_data));
+	memcpy(ptr + 8, &ip, 8);
+	for (i = 0; i < len; i++)
+		ptr[16 + i] = 'a' + (i + cpu_data->events) % 26;
+	ptr[16 + len] = '\0';
+}
+
+static unsigned long long gen_kmem_ptr(void)
+{
+	return 0xffff880000000000ULL + (gen_rand() % GEN_NR_KMEM_PTRS) * 64;
+}
+
+static void gen_kmalloc(struct gen_cpu *cpu_data)
+{
+	unsigned long long call_site;
+	unsigned long long ptr = gen_kmem_ptr();
+	unsigned long long req;
+	unsigned long long alloc;
+	unsigned int gfp_flags = 0xd0;
+	char *ptr_data;
+
+	call_site = gen_syms[GEN_FIRST_KMEM_SYM +
+			     gen_rand() % GEN_NR_KMEM_SYMS].addr + 0x40;
+	req = 1 + gen_rand() % 1024;
+	/* Round up to the next power of two, like the kmalloc caches */
+	for (alloc = 8; alloc < req; alloc <<= 1)
+		;
+
+	ptr_data = reserve_event(cpu_data, 48);
+	write_common(ptr_data, GEN_KMALLOC, curr_pid(cpu_data));
+	memcpy(ptr_data + 8, &call_site, 8);
+	memcpy(ptr_data + 16, &ptr, 8);
+	memcpy(ptr_data + 24, &req, 8);
+	memcpy(ptr_data + 32, &alloc, 8);
+	memcpy(ptr_data + 40, &gfp_flags, 4);
+}
+
+static void gen_kfree(struct gen_cpu *cpu_data)
+{
+	unsigned long long call_site = gen_syms[GEN_FIRST_KMEM_SYM].addr + 0x80;
+	unsigned long long ptr = gen_kmem_ptr();
+	char *ptr_data;
+
+	ptr_data = reserve_event(cpu_data, 24);
+	write_common(ptr_data, GEN_KFREE, curr_pid(cpu_data));
+	memcpy(ptr_data + 8, &call_site, 8);
+	memcpy(ptr_data + 16, &ptr, 8);
+}
+
+static unsigned long long gen_func_addr(int func)
+{
+	return GEN_FUNC_ADDR + func * GEN_FUNC_SIZE + 0x10;
+}
+
+/*
+ * Walk a made up call graph. Each function calls one of a few others,
+ * so that the same call chains keep coming back.
+ */
+static void gen_function(struct gen_cpu *cpu_data)
+{
+	unsigned long long parent_ip;
+	unsigned long long ip;
+	int parent;
+	int func;
+	char *ptr;
+
+	if (cpu_data->depth && (cpu_data->depth == GEN_MAX_DEPTH ||
+				gen_rand() % 3 == 0))
+		cpu_data->depth = gen_rand() % cpu_data->depth;
+
+	if (cpu_data->depth)
+		parent = cpu_data->stack[cpu_data->depth - 1];
+	else
+		parent = gen_rand() % 8;
+
+	func = (parent * 7 + 1 + gen_rand() % 4) % GEN_NR_FUNCS;
+	if (!cpu_data->depth)
+		cpu_data->stack[cpu_data->depth++] = parent;
+	cpu_data->stack[cpu_data->depth++] = func;
+
+	parent_ip = gen_func_addr(parent);
+	ip = gen_func_addr(func);
+
+	ptr = reserve_event(cpu_data, 24);
+	write_common(ptr, GEN_FUNCTION, curr_pid(cpu_data));
+	memcpy(ptr + 8, &ip, 8);
+	memcpy(ptr + 16, &parent_ip, 8);
+}
+
+static void generate_cpu(struct gen_cpu *cpu_data, int cpus,
+			 unsigned long events, unsigned long long size,
+			 unsigned long long period, int max_payload)
+{
+	int type;
+
+	cpu_data->page = calloc(1, page_size);
+	if (!cpu_data->page)
+		die("Failed to allocate page");
+
+	cpu_data->ts = START_TS;
+
+	for (;;) {
+		if (events && cpu_data->events >= events)
+			break;
+		if (size && cpu_data->size >= size)
+			break;
+
+		/* Uniform between 1 and twice the period */
+		cpu_data->ts += 1 + gen_rand() % (2 * period);
+
+		type = pick_event();
+		switch (type) {
+		case GEN_SCHED_SWITCH:
+			gen_sched_switch(cpu_data);
+			break;
+		case GEN_SCHED_WAKEUP:
+			gen_sched_wakeup(cpu_data, cpus);
+			break;
+		case GEN_IRQ_ENTRY:
+			gen_irq_entry(cpu_data);
+			break;
+		case GEN_IRQ_EXIT:
+			gen_irq_exit(cpu_data);
+			break;
+		case GEN_HRTIMER_START:
+			gen_hrtimer_start(cpu_data);
+			break;
+		case GEN_PRINT:
+			gen_print(cpu_data, max_payload);
+			break;
+		case GEN_KMALLOC:
+			gen_kmalloc(cpu_data);
+			break;
+		case GEN_KFREE:
+			gen_kfree(cpu_data);
+			break;
+		case GEN_FUNCTION:
+			gen_function(cpu_data);
+			break;
+		}
+	}
+
+	if (cpu_data->index)
+		flush_page(cpu_data);
+
+	free(cpu_data->page);
+}
+
+static void gen_usage(char **argv)
+{
+	char *p = argv[0];
+	int i;
+
+	printf("\n"
+	       "usage: %s [-o file][-c cpus][-n events | -s size][-r rate]\n"
+	       "          [-e mix][-t tasks][-p max][-S seed][-v]\n"
+	       "\n"
+	       "  -o output file (default trace.dat)\n"
+	       "  -c number of CPUs (default 4)\n"
+	       "  -n number of events per CPU (default 100000)\n"
+	       "  -s size in megabytes of data per CPU (instead of -n)\n"
+	       "  -r events per second on each CPU (default 100000)\n"
+	       "  -e event mix, as a comma separated list of event[=weight]\n"
+	       "     (kmalloc, kfree and function are only made when listed)\n"
+	       "  -t number of tasks (default 64)\n"
+	       "  -p max size of the print event strings (default 64)\n"
+	       "  -S seed for the random numbers (default 1)\n"
+	       "  -v show the CPU data as it is written\n"
+	       "\n"
+	       "  events:", p);
+	for (i = 0; i < GEN_NR_EVENTS; i++)
+		printf(" %s", gen_events[i].name);
+	printf("\n\n");
+	exit(-1);
+}
+
+int main(int argc, char **argv)
+{
+	struct tracecmd_output *handle;
+	struct gen_cpu *cpu_data;
+	char tracing_dir[] = "/tmp/trace-gen.XXXXXX";
+	const char *output = "trace.dat";
+	unsigned long long size = 0;
+	unsigned long long period;
+	unsigned long events = 0;
+	unsigned long rate = 100000;
+	char **cpu_files;
+	char *kallsyms;
+	char *mix = NULL;
+	int max_payload = 64;
+	int cpus = 4;
+	int cpu;
+	int c;
+	int i;
+
+	quiet = 1;
+
+	while ((c = getopt(argc, argv, "ho:c:n:s:r:e:t:p:S:v")) >= 0) {
+		switch (c) {
+		case 'o':
+			output = optarg;
+			break;
+		case 'c':
+			cpus = atoi(optarg);
+			break;
+		case 'n':
+			events = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			size = strtoull(optarg, NULL, 0) << 20;
+			break;
+		case 'r':
+			rate = strtoul(optarg, NULL, 0);
+			break;
+		case 'e':
+			mix = optarg;
+			break;
+		case 't':
+			nr_tasks = atoi(optarg);
+			break;
+		case 'p':
+			max_payload = atoi(optarg);
+			break;
+		case 'S':
+			rand_state = strtoull(optarg, NULL, 0);
+			break;
+		case 'v':
+			quiet = 0;
+			break;
+		case 'h':
+		default:
+			gen_usage(argv);
+		}
+	}
+
+	if (cpus <= 0 || nr_tasks <= 0 || !rate)
+		gen_usage(argv);
+	if (max_payload < 8 || max_payload > MAX_PAYLOAD)
+		die("print size must be between 8 and %d", MAX_PAYLOAD);
+	if (!rand_state)
+		rand_state = 1;
+	if (!events && !size)
+		events = 100000;
+
+	if (mix)
+		parse_mix(mix);
+	else
+		for (i = 0; i < GEN_KMALLOC; i++)
+			weights[i] = 1;
+
+	for (i = 0; i < GEN_NR_EVENTS; i++)
+		total_weight += weights[i];
+	if (!total_weight)
+		die("No events to generate");
+
+	period = 1000000000ULL / rate;
+	if (!period)
+		period = 1;
+
+	page_size = getpagesize();
+
+	init_tasks();
+
+	if (!mkdtemp(tracing_dir))
+		die("Can not create temp directory");
+
+	create_tracing_dir(tracing_dir);
+
+	if (asprintf(&kallsyms, "%s/kallsyms", tracing_dir) < 0)
+		die("Failed to allocate kallsyms path");
+
+	handle = tracecmd_create_init_file_override(output, tracing_dir,
+						    kallsyms);
+	if (!handle)
+		die("Failed to create %s", output);
+
+	cpu_data = calloc(cpus, sizeof(*cpu_data));
+	cpu_files = calloc(cpus, sizeof(*cpu_files));
+	if (!cpu_data || !cpu_files)
+		die("Failed to allocate cpu data");
+
+	for (cpu = 0; cpu < cpus; cpu++) {
+		if (asprintf(&cpu_data[cpu].file, "%s/cpu%d",
+			     tracing_dir, cpu) < 0)
+			die("Failed to allocate cpu file name");
+		cpu_data[cpu].fd = open(cpu_data[cpu].file,
+					O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE,
+					0644);
+		if (cpu_data[cpu].fd < 0)
+			die("Can not create %s", cpu_data[cpu].file);
+		cpu_data[cpu].curr = -1;
+
+		generate_cpu(&cpu_data[cpu], cpus, events, size,
+			     period, max_payload);
+
+		close(cpu_data[cpu].fd);
+		cpu_files[cpu] = cpu_data[cpu].file;
+	}
+
+	tracecmd_add_option(handle, TRACECMD_OPTION_TRACECLOCK, 0, NULL);
+
+	if (tracecmd_append_cpu_data(handle, cpus, cpu_files) < 0)
+		die("Failed to write CPU data to %s", output);
+
+	tracecmd_output_close(handle);
+
+	for (cpu = 0; cpu < cpus; cpu++) {
+		printf("CPU%d: %lu events, %llu bytes\n", cpu,
+		       cpu_data[cpu].events, cpu_data[cpu].size);
+		free(cpu_data[cpu].file);
+	}
+
+	remove_tracing_dir(tracing_dir);
+
+	free(cpu_files);
+	free(cpu_data);
+	free(kallsyms);
+	free(tasks);
+
+	return 0;
+}
@@ -52,3 +52,31 @@ int main (void)
 	return ret;
 }
 endef
+
+define SOURCE_ZLIB
+#include <zlib.h>
+
+int main (void)
+{
+	z_stream z = { 0 };
+
+	if (deflateInit(&z, Z_BEST_SPEED) != Z_OK)
+		return -1;
+	return deflateEnd(&z);
+}
+endef
+
+define SOURCE_IO_URING
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+int main (void)
+{
+	struct io_uring_params p = { 0 };
+
+	if (IORING_OP_SPLICE == IORING_OP_READ)
+		return -1;
+	return syscall(__NR_io_uring_setup, 1, &p) < 0;
+}
+endef
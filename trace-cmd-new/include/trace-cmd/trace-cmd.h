@@ -68,6 +68,9 @@ const char *tracecmd_get_tracing_dir(void);
 /* tracecmd_find_tracing_dir must be freed */
 char *tracecmd_find_tracing_dir(void);
 
+long long tracecmd_copy_file_range(int in_fd, unsigned long long *in_offset,
+				   int out_fd, unsigned long long len);
+
 /* --- Opening and Reading the trace.dat file --- */
 
 enum {
@@ -104,6 +107,7 @@ struct tracecmd_input *tracecmd_alloc(const char *file);
 struct tracecmd_input *tracecmd_alloc_fd(int fd);
 struct tracecmd_input *tracecmd_open(const char *file);
 struct tracecmd_input *tracecmd_open_fd(int fd);
+struct tracecmd_input *tracecmd_open_again(struct tracecmd_input *handle);
 void tracecmd_ref(struct tracecmd_input *handle);
 void tracecmd_close(struct tracecmd_input *handle);
 int tracecmd_read_headers(struct tracecmd_input *handle);
@@ -126,6 +130,7 @@ void tracecmd_remove_instances(void);
 
 void tracecmd_set_ts_offset(struct tracecmd_input *handle, unsigned long long offset);
 void tracecmd_set_ts2secs(struct tracecmd_input *handle, unsigned long long hz);
+int tracecmd_ts_adjusted(struct tracecmd_input *handle);
 
 void tracecmd_print_events(struct tracecmd_input *handle, const char *regex);
 
@@ -187,6 +192,44 @@ int tracecmd_set_cursor(struct tracecmd_input *handle,
 unsigned long long
 tracecmd_get_cursor(struct tracecmd_input *handle, int cpu);
 
+struct tracecmd_page_index {
+	unsigned long long	offset;		/* file offset of the page */
+	unsigned long long	ts;		/* time stamp of its first record */
+	unsigned int		nr_records;	/* records on the page */
+};
+
+int tracecmd_read_page_index(struct tracecmd_input *handle,
+			     struct tracecmd_page_index **index,
+			     int *nr_pages);
+
+struct tracecmd_page_map_stats {
+	unsigned long long	hits;
+	unsigned long long	misses;
+	unsigned long long	evictions;
+	unsigned long long	mapped;
+};
+
+void tracecmd_set_page_map_budget(struct tracecmd_input *handle,
+				  unsigned long long budget);
+unsigned long long
+tracecmd_get_page_map_budget(struct tracecmd_input *handle);
+void tracecmd_get_page_map_stats(struct tracecmd_input *handle,
+				 struct tracecmd_page_map_stats *stats);
+
+/* Work done reading a file, see also pevent_get_stats() */
+struct tracecmd_input_stats {
+	unsigned long long	pages_mapped;
+	unsigned long long	pages_unmapped;
+	unsigned long long	pages_read;
+	unsigned long long	bytes_read;
+	unsigned long long	records;
+	unsigned long long	open_ns;
+	unsigned long long	page_ns;
+};
+
+int tracecmd_get_stats(struct tracecmd_input *handle,
+		       struct tracecmd_input_stats *stats);
+
 int tracecmd_ftrace_overrides(struct tracecmd_input *handle, struct tracecmd_ftrace *finfo);
 struct pevent *tracecmd_get_pevent(struct tracecmd_input *handle);
 bool tracecmd_get_use_trace_clock(struct tracecmd_input *handle);
@@ -266,6 +309,7 @@ enum {
 	TRACECMD_RECORD_NOSPLICE	= (1 << 0),	/* Use read instead of splice */
 	TRACECMD_RECORD_SNAPSHOT	= (1 << 1),	/* extract from snapshot */
 	TRACECMD_RECORD_BLOCK		= (1 << 2),	/* Block on splice write */
+	TRACECMD_RECORD_URING		= (1 << 3),	/* Batch the I/O with io_uring */
 };
 
 void tracecmd_free_recorder(struct tracecmd_recorder *recorder);
@@ -275,6 +319,39 @@ struct tracecmd_recorder *tracecmd_create_recorder_maxkb(const char *file, int c
 struct tracecmd_recorder *tracecmd_create_buffer_recorder_fd(int fd, int cpu, unsigned flags, const char *buffer);
 struct tracecmd_recorder *tracecmd_create_buffer_recorder(const char *file, int cpu, unsigned flags, const char *buffer);
 struct tracecmd_recorder *tracecmd_create_buffer_recorder_maxkb(const char *file, int cpu, unsigned flags, const char *buffer, int maxkb);
+struct tracecmd_recorder *tracecmd_create_recorder_segs(const char *file, int cpu, unsigned flags, int maxkb, int segs);
+struct tracecmd_recorder *tracecmd_create_buffer_recorder_segs(const char *file, int cpu, unsigned flags, const char *buffer, int maxkb, int segs);
+
+/*
+ * A recorder with segments writes its CPU file as a ring of segments of
+ * a fixed size, and keeps a manifest of the segments next to the file.
+ */
+struct tracecmd_segment {
+	unsigned long long	seq;		/* order of the segment, 0 if unused */
+	unsigned long long	offset;		/* where it is in the CPU file */
+	unsigned long long	size;		/* bytes of data in the segment */
+	unsigned long long	first_ts;	/* time stamp of its first page */
+	unsigned long long	last_ts;	/* time stamp of its last page */
+};
+
+int tracecmd_read_segments(const char *file, struct tracecmd_segment **segments);
+void tracecmd_delete_segments(const char *file);
+
+/*
+ * What a recorder moved, kept up to date as it records. Another process
+ * may read it when it is in shared memory, there is only one writer.
+ */
+struct tracecmd_recorder_stats {
+	unsigned long long	bytes;		/* moved out of the ring buffer */
+	unsigned long long	pages;		/* the pages of them */
+	unsigned long long	rounds;		/* splices (or reads) that moved data */
+	unsigned long long	busy_ns;	/* time spent in those rounds */
+	unsigned long long	max_ns;		/* the longest round */
+	unsigned long long	last_ns;	/* CLOCK_MONOTONIC at the last round */
+};
+
+void tracecmd_recorder_set_stats(struct tracecmd_recorder *recorder,
+				 struct tracecmd_recorder_stats *stats);
 
 int tracecmd_start_recording(struct tracecmd_recorder *recorder, unsigned long sleep);
 void tracecmd_stop_recording(struct tracecmd_recorder *recorder);
@@ -291,12 +368,14 @@ enum tracecmd_msg_bits {
 	TRACECMD_MSG_BIT_CLIENT		= 0,
 	TRACECMD_MSG_BIT_SERVER		= 1,
 	TRACECMD_MSG_BIT_USE_TCP	= 2,
+	TRACECMD_MSG_BIT_COMPRESS	= 3,
 };
 
 enum tracecmd_msg_flags {
 	TRACECMD_MSG_FL_CLIENT		= (1 << TRACECMD_MSG_BIT_CLIENT),
 	TRACECMD_MSG_FL_SERVER		= (1 << TRACECMD_MSG_BIT_SERVER),
 	TRACECMD_MSG_FL_USE_TCP		= (1 << TRACECMD_MSG_BIT_USE_TCP),
+	TRACECMD_MSG_FL_COMPRESS	= (1 << TRACECMD_MSG_BIT_COMPRESS),
 };
 
 /* for both client and server */
@@ -320,15 +399,30 @@ int tracecmd_msg_metadata_send(struct tracecmd_msg_handle *msg_handle,
 			       const char *buf, int size);
 int tracecmd_msg_finish_sending_metadata(struct tracecmd_msg_handle *msg_handle);
 void tracecmd_msg_send_close_msg(struct tracecmd_msg_handle *msg_handle);
+int tracecmd_msg_send_data(struct tracecmd_msg_handle *msg_handle,
+			   int *fds, int cpus);
 
 /* for server */
 int tracecmd_msg_initial_setting(struct tracecmd_msg_handle *msg_handle);
 int tracecmd_msg_send_port_array(struct tracecmd_msg_handle *msg_handle,
 				 int *ports);
 int tracecmd_msg_collect_metadata(struct tracecmd_msg_handle *msg_handle, int ofd);
+int tracecmd_msg_collect_data(struct tracecmd_msg_handle *msg_handle,
+			      int *cpu_fds);
 bool tracecmd_msg_done(struct tracecmd_msg_handle *msg_handle);
 void tracecmd_msg_set_done(struct tracecmd_msg_handle *msg_handle);
 
+/* for a server that reads the messages on its own */
+int tracecmd_msg_buf_len(const void *buf, int len);
+int tracecmd_msg_initial_setting_buf(struct tracecmd_msg_handle *msg_handle,
+				     void *buf, int len);
+int tracecmd_msg_port_array_buf(struct tracecmd_msg_handle *msg_handle,
+				int *ports, char **buf);
+int tracecmd_msg_collect_metadata_buf(struct tracecmd_msg_handle *msg_handle,
+				      void *buf, int len, int ofd);
+int tracecmd_msg_data_buf(struct tracecmd_msg_handle *msg_handle,
+			  void *buf, int len, int *cpu, void **data);
+
 /* --- Plugin handling --- */
 extern struct pevent_plugin_option trace_ftrace_options[];
 
@@ -52,4 +52,44 @@ struct trace_hash_item *
 trace_hash_find(struct trace_hash *hash, unsigned long long key,
 		trace_hash_func match, void *data);
 
+/*
+ * An open addressing hash that keeps the keys next to the items and
+ * grows as items are added. It holds pointers to the items, which do
+ * not need to embed anything. Items with the same key are told apart
+ * by the match function, but finding one of them does not return
+ * them in any order.
+ */
+struct trace_ohash_slot {
+	unsigned long long	key;
+	void			*item;		/* NULL if free */
+};
+
+struct trace_ohash {
+	struct trace_ohash_slot	*slots;
+	unsigned int		nr_slots;	/* always a power of two */
+	unsigned int		nr_items;
+};
+
+typedef int (*trace_ohash_func)(void *item, void *data);
+
+int trace_ohash_init(struct trace_ohash *hash, int size);
+void trace_ohash_free(struct trace_ohash *hash);
+int trace_ohash_add(struct trace_ohash *hash, unsigned long long key,
+		    void *item);
+int trace_ohash_del(struct trace_ohash *hash, unsigned long long key,
+		    void *item);
+void *trace_ohash_find(struct trace_ohash *hash, unsigned long long key,
+		       trace_ohash_func match, void *data);
+
+static inline int trace_ohash_empty(struct trace_ohash *hash)
+{
+	return !hash->nr_items;
+}
+
+/* Items may not be added or deleted while walking the hash */
+#define trace_ohash_for_each_item(obj, slot, hash)			\
+	for (slot = (hash)->slots;					\
+	     slot < (hash)->slots + (hash)->nr_slots; slot++)		\
+		if (!((obj) = (slot)->item)) {} else
+
 #endif /* _TRACE_HASH_H */
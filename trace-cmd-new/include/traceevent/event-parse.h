@@ -315,6 +315,9 @@ struct event_format {
 	char			*system;
 	pevent_event_handler_func handler;
 	void			*context;
+	/* format not parsed yet, see pevent_parse_event_lazy() */
+	char			*lazy_format;
+	unsigned long		lazy_size;
 };
 
 enum {
@@ -363,6 +366,7 @@ enum pevent_flag {
 	PEVENT_NSEC_OUTPUT		= 1,	/* output in NSECS */
 	PEVENT_DISABLE_SYS_PLUGINS	= 1 << 1,
 	PEVENT_DISABLE_PLUGINS		= 1 << 2,
+	PEVENT_PROFILE_SELF		= 1 << 3,	/* time filters and formatting */
 };
 
 #define PEVENT_ERRORS 							      \
@@ -443,6 +447,19 @@ struct func_resolver;
 typedef char *(pevent_func_resolver_t)(void *priv,
 				       unsigned long long *addrp, char **modp);
 
+/*
+ * Counts of the work done by the library. The times of filtering and
+ * formatting are only taken when PEVENT_PROFILE_SELF is set.
+ */
+struct pevent_stats {
+	unsigned long long	formats_parsed;
+	unsigned long long	parse_ns;
+	unsigned long long	filter_evals;
+	unsigned long long	filter_ns;
+	unsigned long long	format_calls;
+	unsigned long long	format_ns;
+};
+
 struct pevent {
 	int ref_count;
 
@@ -518,6 +535,8 @@ struct pevent {
 	struct event_format *last_event;
 
 	char *trace_clock;
+
+	struct pevent_stats stats;
 };
 
 static inline void pevent_set_flag(struct pevent *pevent, int flag)
@@ -632,6 +651,10 @@ int pevent_parse_header_page(struct pevent *pevent, char *buf, unsigned long siz
 
 enum pevent_errno pevent_parse_event(struct pevent *pevent, const char *buf,
 				     unsigned long size, const char *sys);
+enum pevent_errno pevent_parse_event_lazy(struct pevent *pevent,
+					  const char *buf,
+					  unsigned long size, const char *sys);
+void pevent_parse_lazy_events(struct pevent *pevent);
 enum pevent_errno pevent_parse_format(struct pevent *pevent,
 				      struct event_format **eventp,
 				      const char *buf,
@@ -784,6 +807,9 @@ void pevent_free(struct pevent *pevent);
 void pevent_ref(struct pevent *pevent);
 void pevent_unref(struct pevent *pevent);
 
+int pevent_get_stats(struct pevent *pevent, struct pevent_stats *stats);
+void pevent_reset_stats(struct pevent *pevent);
+
 /* access to the internal parser */
 void pevent_buffer_init(const char *buf, unsigned long long size);
 enum event_type pevent_read_token(char **tok);
@@ -0,0 +1,94 @@
+// SPDX-License-Identifier: GPL-2.0
+
+/*
+ * Copyright (C) 2018 VMware Inc, Yordan Karadzhov <y.karadz@gmail.com>
+ */
+
+// C
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// KernelShark
+#include "libkshark.h"
+
+const char *default_file = "trace.dat";
+
+/* Stop after this many seconds without new data. */
+#define IDLE_SECS	3
+
+int main(int argc, char **argv)
+{
+	struct kshark_context *kshark_ctx;
+	struct kshark_entry **data = NULL;
+	size_t r, n_rows = 0, n_tasks;
+	ssize_t ret;
+	bool status;
+	int idle = 0;
+	int *pids;
+
+	/* Create a new kshark session. */
+	kshark_ctx = NULL;
+	if (!kshark_instance(&kshark_ctx))
+		return 1;
+
+	/*
+	 * Open a recording in progress, given the file with the headers
+	 * and the data files of the CPUs, or a trace data file.
+	 */
+	if (argc > 2)
+		status = kshark_open_live(kshark_ctx, argv[1],
+					  argc - 2, argv + 2);
+	else if (argc > 1)
+		status = kshark_open(kshark_ctx, argv[1]);
+	else
+		status = kshark_open(kshark_ctx, default_file);
+
+	if (!status) {
+		kshark_free(kshark_ctx);
+		return 1;
+	}
+
+	/* Load the new data, until nothing comes for a while. */
+	while (idle < IDLE_SECS) {
+		ret = kshark_load_more_entries(kshark_ctx, &data, n_rows);
+		if (ret < 0)
+			break;
+
+		if (ret == n_rows) {
+			++idle;
+			sleep(1);
+			continue;
+		}
+
+		printf("entries: %zi (+%zi)\n", ret, ret - n_rows);
+		n_rows = ret;
+		idle = 0;
+	}
+
+	/* Print to the screen the list of all tasks. */
+	n_tasks = kshark_get_task_pids(kshark_ctx, &pids);
+	for (r = 0; r < n_tasks; ++r) {
+		const char *task_str =
+			pevent_data_comm_from_pid(kshark_ctx->pevent,
+						  pids[r]);
+
+		printf("task: %s-%i\n", task_str, pids[r]);
+	}
+
+	free(pids);
+
+	/* Free the memory. */
+	for (r = 0; r < n_rows; ++r)
+		free(data[r]);
+
+	free(data);
+
+	/* Close the file. */
+	kshark_close(kshark_ctx);
+
+	/* Close the session. */
+	kshark_free(kshark_ctx);
+
+	return 0;
+}
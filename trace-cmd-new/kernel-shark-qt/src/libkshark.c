@@ -15,8 +15,11 @@
 // C
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 // KernelShark
 #include "libkshark.h"
@@ -117,6 +120,78 @@ static void kshark_free_task_list(struct kshark_context *kshark_ctx)
 	}
 }
 
+static void kshark_free_index(struct kshark_entry_index **index)
+{
+	struct kshark_entry_index *list;
+	int i;
+
+	for (i = 0; i < KS_TASK_HASH_SIZE; ++i) {
+		while (index[i]) {
+			list = index[i];
+			index[i] = list->next;
+			free(list->entries);
+			free(list);
+		}
+	}
+}
+
+static void kshark_free_entry_index(struct kshark_context *kshark_ctx)
+{
+	if (!kshark_ctx)
+		return;
+
+	kshark_free_index(kshark_ctx->task_index);
+	kshark_free_index(kshark_ctx->event_index);
+	kshark_ctx->n_index_entries = 0;
+}
+
+static void kshark_close_live_fds(struct kshark_context *kshark_ctx)
+{
+	int cpu;
+
+	if (!kshark_ctx->live_fds)
+		return;
+
+	for (cpu = 0; cpu < kshark_ctx->n_cpus; ++cpu) {
+		if (kshark_ctx->live_fds[cpu] >= 0)
+			close(kshark_ctx->live_fds[cpu]);
+	}
+
+	free(kshark_ctx->live_fds);
+	kshark_ctx->live_fds = NULL;
+}
+
+static bool kshark_open_handle(struct kshark_context *kshark_ctx,
+			       struct tracecmd_input *handle)
+{
+	kshark_ctx->n_cpus = tracecmd_cpus(handle);
+	kshark_ctx->cpu_cursors = calloc(kshark_ctx->n_cpus,
+					 sizeof(*kshark_ctx->cpu_cursors));
+	if (!kshark_ctx->cpu_cursors)
+		return false;
+
+	if (pthread_mutex_init(&kshark_ctx->input_mutex, NULL) != 0) {
+		free(kshark_ctx->cpu_cursors);
+		kshark_ctx->cpu_cursors = NULL;
+		return false;
+	}
+
+	kshark_ctx->handle = handle;
+	kshark_ctx->pevent = tracecmd_get_pevent(handle);
+
+	kshark_ctx->advanced_event_filter =
+		pevent_filter_alloc(kshark_ctx->pevent);
+
+	/*
+	 * Turn off function trace indent and turn on show parent
+	 * if possible.
+	 */
+	trace_util_add_option("ftrace:parent", "1");
+	trace_util_add_option("ftrace:indent", "0");
+
+	return true;
+}
+
 /**
  * @brief Open and prepare for reading a trace data file specified by "file".
  *	  If the specified file does not exist, or contains no trace data,
@@ -130,30 +205,80 @@ bool kshark_open(struct kshark_context *kshark_ctx, const char *file)
 	struct tracecmd_input *handle;
 
 	kshark_free_task_list(kshark_ctx);
+	kshark_free_entry_index(kshark_ctx);
 
 	handle = tracecmd_open(file);
 	if (!handle)
 		return false;
 
-	if (pthread_mutex_init(&kshark_ctx->input_mutex, NULL) != 0) {
+	if (!kshark_open_handle(kshark_ctx, handle)) {
 		tracecmd_close(handle);
 		return false;
 	}
 
-	kshark_ctx->handle = handle;
-	kshark_ctx->pevent = tracecmd_get_pevent(handle);
+	return true;
+}
 
-	kshark_ctx->advanced_event_filter =
-		pevent_filter_alloc(kshark_ctx->pevent);
+/**
+ * @brief Open a recording which is still in progress. The headers of the
+ *	  trace are read from "file", and the data of each CPU is read from
+ *	  the matching file of "cpu_files", while these files are growing.
+ *	  For the trace-cmd listener, "file" is the output file and the
+ *	  CPU files are its "<output>.<host>:<port>.cpu<N>" files. The data
+ *	  can only be loaded with kshark_load_more_entries(), and the
+ *	  latency and info fields of its entries are not available.
+ * @param kshark_ctx: Input location for context pointer.
+ * @param file: The file holding the headers of the trace.
+ * @param n_cpus: The number of CPU data files.
+ * @param cpu_files: The CPU data files, one per CPU.
+ * @returns True on success, or false on failure.
+ */
+bool kshark_open_live(struct kshark_context *kshark_ctx, const char *file,
+		      int n_cpus, char * const *cpu_files)
+{
+	struct tracecmd_input *handle;
+	int *fds;
+	int cpu;
 
-	/*
-	 * Turn off function trace indent and turn on show parent
-	 * if possible.
-	 */
-	trace_util_add_option("ftrace:parent", "1");
-	trace_util_add_option("ftrace:indent", "0");
+	kshark_free_task_list(kshark_ctx);
+	kshark_free_entry_index(kshark_ctx);
+
+	handle = tracecmd_alloc(file);
+	if (!handle)
+		return false;
+
+	if (tracecmd_read_headers(handle) < 0)
+		goto fail;
+
+	fds = malloc(n_cpus * sizeof(*fds));
+	if (!fds)
+		goto fail;
+
+	for (cpu = 0; cpu < n_cpus; ++cpu)
+		fds[cpu] = -1;
+
+	kshark_ctx->live_fds = fds;
+	kshark_ctx->n_cpus = n_cpus;
+
+	for (cpu = 0; cpu < n_cpus; ++cpu) {
+		fds[cpu] = open(cpu_files[cpu], O_RDONLY);
+		if (fds[cpu] < 0)
+			goto fail_close;
+
+		if (tracecmd_make_pipe(handle, cpu, fds[cpu], n_cpus) < 0)
+			goto fail_close;
+	}
+
+	if (!kshark_open_handle(kshark_ctx, handle))
+		goto fail_close;
 
 	return true;
+
+ fail_close:
+	kshark_close_live_fds(kshark_ctx);
+ fail:
+	tracecmd_close(handle);
+	return false;
 }
 
 /**
@@ -174,6 +299,8 @@ void kshark_close(struct kshark_context *kshark_ctx)
 	tracecmd_filter_id_clear(kshark_ctx->show_event_filter);
 	tracecmd_filter_id_clear(kshark_ctx->hide_event_filter);
 
+	kshark_free_entry_index(kshark_ctx);
+
 	if (kshark_ctx->advanced_event_filter) {
 		pevent_filter_reset(kshark_ctx->advanced_event_filter);
 		pevent_filter_free(kshark_ctx->advanced_event_filter);
@@ -184,6 +311,11 @@ void kshark_close(struct kshark_context *kshark_ctx)
 	kshark_ctx->handle = NULL;
 	kshark_ctx->pevent = NULL;
 
+	kshark_close_live_fds(kshark_ctx);
+	free(kshark_ctx->cpu_cursors);
+	kshark_ctx->cpu_cursors = NULL;
+	kshark_ctx->n_cpus = 0;
+
 	pthread_mutex_destroy(&kshark_ctx->input_mutex);
 }
 
@@ -212,6 +344,7 @@ void kshark_free(struct kshark_context *kshark_ctx)
 	tracecmd_filter_id_hash_free(kshark_ctx->hide_event_filter);
 
 	kshark_free_task_list(kshark_ctx);
+	kshark_free_entry_index(kshark_ctx);
 
 	if (seq.buffer)
 		trace_seq_destroy(&seq);
@@ -268,6 +401,101 @@ kshark_add_task(struct kshark_context *kshark_ctx, int pid)
 	return list;
 }
 
+/*
+ * The order of the loaded entries. Entries having the same time stamp are
+ * ordered by CPU, the way kshark_load_data_entries() merges the CPUs.
+ */
+static inline bool kshark_entry_before(struct kshark_entry *a,
+				       struct kshark_entry *b)
+{
+	return a->ts < b->ts || (a->ts == b->ts && a->cpu < b->cpu);
+}
+
+static struct kshark_entry_index *
+kshark_find_index(struct kshark_entry_index **index, int id)
+{
+	struct kshark_entry_index *list;
+
+	for (list = index[knuth_hash8(id)]; list; list = list->next) {
+		if (list->id == id)
+			return list;
+	}
+
+	return NULL;
+}
+
+static bool kshark_index_entry(struct kshark_entry_index **index, int id,
+			       struct kshark_entry *entry)
+{
+	struct kshark_entry_index *list;
+	struct kshark_entry **temp_entries;
+	size_t i;
+	uint8_t key;
+
+	list = kshark_find_index(index, id);
+	if (!list) {
+		list = calloc(1, sizeof(*list));
+		if (!list)
+			return false;
+
+		key = knuth_hash8(id);
+		list->id = id;
+		list->next = index[key];
+		index[key] = list;
+	}
+
+	if (list->count == list->size) {
+		list->size = list->size ? list->size * 2 : 64;
+		temp_entries = realloc(list->entries,
+				       list->size * sizeof(*temp_entries));
+		if (!temp_entries)
+			return false;
+
+		list->entries = temp_entries;
+	}
+
+	/*
+	 * The entries come in time order when all data is loaded. The new
+	 * entries of a live trace may be older than the last entries of
+	 * the other CPUs, these are moved back into place.
+	 */
+	for (i = list->count++; i && kshark_entry_before(entry,
+							  list->entries[i - 1]); --i)
+		list->entries[i] = list->entries[i - 1];
+
+	list->entries[i] = entry;
+
+	return true;
+}
+
+/*
+ * Build the posting lists of the entries, per Pid and per Event Id, so that
+ * adding or removing a single Id to a filter only visits the entries having
+ * this Id.
+ */
+static bool kshark_build_entry_index(struct kshark_context *kshark_ctx,
+				     struct kshark_entry **data,
+				     size_t n_entries)
+{
+	size_t i;
+
+	kshark_free_entry_index(kshark_ctx);
+
+	for (i = 0; i < n_entries; ++i) {
+		if (!kshark_index_entry(kshark_ctx->task_index,
+					data[i]->pid, data[i]) ||
+		    !kshark_index_entry(kshark_ctx->event_index,
+					data[i]->event_id, data[i])) {
+			kshark_free_entry_index(kshark_ctx);
+			return false;
+		}
+	}
+
+	kshark_ctx->n_index_entries = n_entries;
+
+	return true;
+}
+
 /**
  * @brief Get an array containing the Process Ids of all tasks presented in
  *	  the loaded trace data file.
@@ -338,6 +566,23 @@ static bool kshark_show_event(struct kshark_context *kshark_ctx, int pid)
 	       filter_find(kshark_ctx->hide_event_filter, pid, false);
 }
 
+static struct tracecmd_filter_id *
+kshark_get_filter(struct kshark_context *kshark_ctx, int filter_id)
+{
+	switch (filter_id) {
+		case KS_SHOW_EVENT_FILTER:
+			return kshark_ctx->show_event_filter;
+		case KS_HIDE_EVENT_FILTER:
+			return kshark_ctx->hide_event_filter;
+		case KS_SHOW_TASK_FILTER:
+			return kshark_ctx->show_task_filter;
+		case KS_HIDE_TASK_FILTER:
+			return kshark_ctx->hide_task_filter;
+		default:
+			return NULL;
+	}
+}
+
 /**
  * @brief Add an Id value to the filster specified by "filter_id".
  * @param kshark_ctx: Input location for the session context pointer.
@@ -349,26 +594,31 @@ void kshark_filter_add_id(struct kshark_context *kshark_ctx,
 {
 	struct tracecmd_filter_id *filter;
 
-	switch (filter_id) {
-		case KS_SHOW_EVENT_FILTER:
-			filter = kshark_ctx->show_event_filter;
-			break;
-		case KS_HIDE_EVENT_FILTER:
-			filter = kshark_ctx->hide_event_filter;
-			break;
-		case KS_SHOW_TASK_FILTER:
-			filter = kshark_ctx->show_task_filter;
-			break;
-		case KS_HIDE_TASK_FILTER:
-			filter = kshark_ctx->hide_task_filter;
-			break;
-		default:
-			return;
-	}
+	filter = kshark_get_filter(kshark_ctx, filter_id);
+	if (!filter)
+		return;
 
 	tracecmd_filter_id_add(filter, id);
 }
 
+/**
+ * @brief Remove an Id value from the filter specified by "filter_id".
+ * @param kshark_ctx: Input location for the session context pointer.
+ * @param filter_id: Identifier of the filter.
+ * @param id: Id value to be removed from the filter.
+ */
+void kshark_filter_remove_id(struct kshark_context *kshark_ctx,
+			     int filter_id, int id)
+{
+	struct tracecmd_filter_id *filter;
+
+	filter = kshark_get_filter(kshark_ctx, filter_id);
+	if (!filter)
+		return;
+
+	tracecmd_filter_id_remove(filter, id);
+}
+
 /**
  * @brief Clear (reset) the filster specified by "filter_id".
  * @param kshark_ctx: Input location for the session context pointer.
@@ -378,22 +628,9 @@ void kshark_filter_clear(struct kshark_context *kshark_ctx, int filter_id)
 {
 	struct tracecmd_filter_id *filter;
 
-	switch (filter_id) {
-		case KS_SHOW_EVENT_FILTER:
-			filter = kshark_ctx->show_event_filter;
-			break;
-		case KS_HIDE_EVENT_FILTER:
-			filter = kshark_ctx->hide_event_filter;
-			break;
-		case KS_SHOW_TASK_FILTER:
-			filter = kshark_ctx->show_task_filter;
-			break;
-		case KS_HIDE_TASK_FILTER:
-			filter = kshark_ctx->hide_task_filter;
-			break;
-		default:
-			return;
-	}
+	filter = kshark_get_filter(kshark_ctx, filter_id);
+	if (!filter)
+		return;
 
 	tracecmd_filter_id_clear(filter);
 }
@@ -427,6 +664,34 @@ static void unset_event_filter_flag(struct kshark_context *kshark_ctx,
 	e->visible &= ~event_mask;
 }
 
+static void kshark_filter_entry(struct kshark_context *kshark_ctx,
+				struct kshark_entry *e)
+{
+	/* Start with and entry which is visible everywhere. */
+	e->visible = 0xFF;
+
+	/* Apply event filtering. */
+	if (!kshark_show_event(kshark_ctx, e->event_id))
+		unset_event_filter_flag(kshark_ctx, e);
+
+	/* Apply task filtering. */
+	if (!kshark_show_task(kshark_ctx, e->pid))
+		e->visible &= ~kshark_ctx->filter_mask;
+}
+
+static bool kshark_advanced_filter_is_set(struct kshark_context *kshark_ctx)
+{
+	if (!kshark_ctx->advanced_event_filter->filters)
+		return false;
+
+	/* The advanced filter is set. */
+	fprintf(stderr,
+		"Failed to filter!\n");
+	fprintf(stderr,
+		"Reset the Advanced filter or reload the data.\n");
+	return true;
+}
+
 /**
  * @brief This function loops over the array of entries specified by "data"
  *	  and "n_entries" and sets the "visible" fields of each entry
@@ -447,31 +712,67 @@ void kshark_filter_entries(struct kshark_context *kshark_ctx,
 {
 	int i;
 
-	if (kshark_ctx->advanced_event_filter->filters) {
-		/* The advanced filter is set. */
-		fprintf(stderr,
-			"Failed to filter!\n");
-		fprintf(stderr,
-			"Reset the Advanced filter or reload the data.\n");
+	if (kshark_advanced_filter_is_set(kshark_ctx))
 		return;
-	}
 
 	if (!kshark_filter_is_set(kshark_ctx))
 		return;
 
 	/* Apply only the Id filters. */
-	for (i = 0; i < n_entries; ++i) {
-		/* Start with and entry which is visible everywhere. */
-		data[i]->visible = 0xFF;
+	for (i = 0; i < n_entries; ++i)
+		kshark_filter_entry(kshark_ctx, data[i]);
+}
+
+/**
+ * @brief Update the "visible" fields of the entries after a single Id has
+ *	  been added to, or removed from the filter specified by "filter_id".
+ *	  Only the entries having this Id are visited, using the posting
+ *	  lists built by kshark_load_data_entries(). All entries are visited
+ *	  when a Show filter becomes empty or gets its first Id, because
+ *	  this changes the visibility of every entry.
+ *	  WARNING: Do not use this function if the advanced filter is set.
+ * @param kshark_ctx: Input location for the session context pointer.
+ * @param filter_id: Identifier of the filter.
+ * @param id: Id value added to or removed from the filter.
+ * @param data: Input location for the trace data to be filtered.
+ * @param n_entries: The size of the inputted data.
+ */
+void kshark_filter_id_entries(struct kshark_context *kshark_ctx,
+			      int filter_id, int id,
+			      struct kshark_entry **data,
+			      size_t n_entries)
+{
+	struct tracecmd_filter_id *filter;
+	struct kshark_entry_index *list;
+	size_t i;
+
+	if (kshark_advanced_filter_is_set(kshark_ctx))
+		return;
 
-		/* Apply event filtering. */
-		if (!kshark_show_event(kshark_ctx, data[i]->event_id))
-			unset_event_filter_flag(kshark_ctx, data[i]);
+	filter = kshark_get_filter(kshark_ctx, filter_id);
+	if (!filter)
+		return;
 
-		/* Apply task filtering. */
-		if (!kshark_show_task(kshark_ctx, data[i]->pid))
-			data[i]->visible &= ~kshark_ctx->filter_mask;
+	/* The posting lists must be of this data */
+	if (n_entries != kshark_ctx->n_index_entries ||
+	    ((filter_id == KS_SHOW_TASK_FILTER ||
+	      filter_id == KS_SHOW_EVENT_FILTER) && filter->count <= 1)) {
+		for (i = 0; i < n_entries; ++i)
+			kshark_filter_entry(kshark_ctx, data[i]);
+		return;
 	}
+
+	if (filter_id == KS_SHOW_TASK_FILTER ||
+	    filter_id == KS_HIDE_TASK_FILTER)
+		list = kshark_find_index(kshark_ctx->task_index, id);
+	else
+		list = kshark_find_index(kshark_ctx->event_index, id);
+
+	if (!list)
+		return;
+
+	for (i = 0; i < list->count; ++i)
+		kshark_filter_entry(kshark_ctx, list->entries[i]);
 }
 
 static void kshark_set_entry_values(struct kshark_context *kshark_ctx,
@@ -527,6 +828,33 @@ enum rec_type {
 	REC_ENTRY,
 };
 
+/*
+ * Apply all filters, including the advanced filter, to a new entry,
+ * while its record is still at hand.
+ */
+static void kshark_filter_new_entry(struct kshark_context *kshark_ctx,
+				    struct pevent_record *rec,
+				    struct kshark_entry *entry)
+{
+	struct event_filter *adv_filter = kshark_ctx->advanced_event_filter;
+	int ret;
+
+	/* Apply event filtering. */
+	ret = FILTER_MATCH;
+	if (adv_filter->filters)
+		ret = pevent_filter_match(adv_filter, rec);
+
+	if (!kshark_show_event(kshark_ctx, entry->event_id) ||
+	    ret != FILTER_MATCH) {
+		unset_event_filter_flag(kshark_ctx, entry);
+	}
+
+	/* Apply task filtering. */
+	if (!kshark_show_task(kshark_ctx, entry->pid)) {
+		entry->visible &= ~kshark_ctx->filter_mask;
+	}
+}
+
 static void free_rec_list(struct rec_list **rec_list, int n_cpus,
 			  enum rec_type type)
 {
@@ -548,7 +876,6 @@ static void free_rec_list(struct rec_list **rec_list, int n_cpus,
 static size_t get_records(struct kshark_context *kshark_ctx,
 			  struct rec_list ***rec_list, enum rec_type type)
 {
-	struct event_filter *adv_filter;
 	struct kshark_task_list *task;
 	struct pevent_record *rec;
 	struct rec_list **temp_next;
@@ -564,10 +891,6 @@ static size_t get_records(struct kshark_context *kshark_ctx,
 	if (!cpu_list)
 		return -ENOMEM;
 
-	/* Just to shorten the name */
-	if (type == REC_ENTRY)
-		adv_filter = kshark_ctx->advanced_event_filter;
-
 	for (cpu = 0; cpu < n_cpus; ++cpu) {
 		count = 0;
 		cpu_list[cpu] = NULL;
@@ -588,25 +911,11 @@ static size_t get_records(struct kshark_context *kshark_ctx,
 				break;
 			case REC_ENTRY: {
 				struct kshark_entry *entry;
-				int ret;
 
 				entry = &temp_rec->entry;
 				kshark_set_entry_values(kshark_ctx, rec, entry);
 				pid = entry->pid;
-				/* Apply event filtering. */
-				ret = FILTER_NONE;
-				if (adv_filter->filters)
-					ret = pevent_filter_match(adv_filter, rec);
-
-				if (!kshark_show_event(kshark_ctx, entry->event_id) ||
-				    ret != FILTER_MATCH) {
-					unset_event_filter_flag(kshark_ctx, entry);
-				}
-
-				/* Apply task filtering. */
-				if (!kshark_show_task(kshark_ctx, entry->pid)) {
-					entry->visible &= ~kshark_ctx->filter_mask;
-				}
+				kshark_filter_new_entry(kshark_ctx, rec, entry);
 				free_record(rec);
 				break;
 			} /* REC_ENTRY */
@@ -675,6 +984,10 @@ static int pick_next_cpu(struct rec_list **rec_list, int n_cpus,
  *	  is updated according to the criteria provided by the filters. The
  *	  field "filter_mask" of the session's context is used to control the
  *	  level of visibility/invisibility of the filtered entries.
+ *	  The entries are also indexed per Pid and per Event Id, for use by
+ *	  kshark_filter_id_entries().
+ *	  This function can not be used with a session opened by
+ *	  kshark_open_live().
  * @param kshark_ctx: Input location for context pointer.
  * @param data_rows: Output location for the trace data. The user is
  *		     responsible for freeing the elements of the outputted
@@ -691,6 +1004,11 @@ ssize_t kshark_load_data_entries(struct kshark_context *kshark_ctx,
 	size_t count, total = 0;
 	int n_cpus;
 
+	if (kshark_ctx->live_fds) {
+		fprintf(stderr, "Use kshark_load_more_entries() with live data.\n");
+		return -EINVAL;
+	}
+
 	if (*data_rows)
 		free(*data_rows);
 
@@ -723,6 +1041,20 @@ ssize_t kshark_load_data_entries(struct kshark_context *kshark_ctx,
 	}
 
 	free_rec_list(rec_list, n_cpus, type);
+
+	/* Without the posting lists, filtering falls back to all entries */
+	kshark_build_entry_index(kshark_ctx, rows, total);
+
+	/* Let kshark_load_more_entries() continue after these entries */
+	memset(kshark_ctx->cpu_cursors, 0,
+	       kshark_ctx->n_cpus * sizeof(*kshark_ctx->cpu_cursors));
+
+	for (count = 0; count < total; count++) {
+		kshark_ctx->cpu_cursors[rows[count]->cpu].last = rows[count];
+		kshark_ctx->cpu_cursors[rows[count]->cpu].offset =
+			rows[count]->offset;
+	}
+
 	*data_rows = rows;
 	return total;
 
@@ -760,6 +1092,11 @@ ssize_t kshark_load_data_records(struct kshark_context *kshark_ctx,
 	size_t count, total = 0;
 	int n_cpus;
 
+	if (kshark_ctx->live_fds) {
+		fprintf(stderr, "Use kshark_load_more_entries() with live data.\n");
+		return -EINVAL;
+	}
+
 	total = get_records(kshark_ctx, &rec_list, REC_RECORD);
 	if (total < 0)
 		goto fail;
@@ -796,6 +1133,222 @@ ssize_t kshark_load_data_records(struct kshark_context *kshark_ctx,
 	return -ENOMEM;
 }
 
+/*
+ * Read the records of a CPU which come after its cursor, into a list of
+ * new entries. Returns the number of entries, or a negative error code.
+ */
+static ssize_t get_more_entries(struct kshark_context *kshark_ctx, int cpu,
+				struct rec_list **head, struct rec_list **tail)
+{
+	struct kshark_cpu_cursor *cursor = &kshark_ctx->cpu_cursors[cpu];
+	struct tracecmd_input *handle = kshark_ctx->handle;
+	struct pevent_record *rec;
+	struct rec_list **temp_next;
+	struct rec_list *temp_rec;
+	ssize_t count = 0;
+
+	*head = *tail = NULL;
+	temp_next = head;
+
+	if (kshark_ctx->live_fds) {
+		/* The position in the data file of the CPU is the cursor. */
+		rec = tracecmd_read_data(handle, cpu);
+	} else if (cursor->last) {
+		/*
+		 * kshark_read_at() moves the CPU iterator, go back to the
+		 * last entry.
+		 */
+		rec = tracecmd_read_at(handle, cursor->offset, NULL);
+		free_record(rec);
+		rec = tracecmd_read_data(handle, cpu);
+	} else {
+		rec = tracecmd_read_cpu_first(handle, cpu);
+	}
+
+	while (rec) {
+		*temp_next = temp_rec = calloc(1, sizeof(*temp_rec));
+		if (!temp_rec)
+			goto fail;
+
+		kshark_set_entry_values(kshark_ctx, rec, &temp_rec->entry);
+		kshark_filter_new_entry(kshark_ctx, rec, &temp_rec->entry);
+		free_record(rec);
+		rec = NULL;
+
+		if (!kshark_add_task(kshark_ctx, temp_rec->entry.pid))
+			goto fail;
+
+		*tail = temp_rec;
+		temp_next = &temp_rec->next;
+
+		++count;
+		rec = tracecmd_read_data(handle, cpu);
+	}
+
+	return count;
+
+ fail:
+	free_record(rec);
+	while (*head) {
+		temp_rec = *head;
+		*head = temp_rec->next;
+		free(temp_rec);
+	}
+
+	return -ENOMEM;
+}
+
+/**
+ * @brief Load the records added to the trace data since the last loading,
+ *	  and merge them into the array of entries loaded before. Each CPU is
+ *	  read from its last loaded record on, so only the new records are
+ *	  read. The new entries are filtered, and added to the task list and
+ *	  to the posting lists, without visiting the loaded entries.
+ *	  Use this function to follow a trace which is still being recorded
+ *	  (see kshark_open_live()). Starting with no entries, it loads all
+ *	  data, like kshark_load_data_entries().
+ * @param kshark_ctx: Input location for context pointer.
+ * @param data_rows: Input location for the entries loaded so far, and
+ *		     output location for all entries. The array is
+ *		     reallocated. The user is responsible for freeing the
+ *		     elements of the outputted array.
+ * @param n_rows: The number of entries loaded so far.
+ * @returns The size of the outputted data in the case of success, or a
+ *	    negative error code on failure.
+ */
+ssize_t kshark_load_more_entries(struct kshark_context *kshark_ctx,
+				 struct kshark_entry ***data_rows,
+				 size_t n_rows)
+{
+	struct kshark_cpu_cursor *cursor;
+	struct rec_list **rec_list;
+	struct rec_list **tails;
+	struct kshark_entry **new_rows = NULL;
+	struct kshark_entry **rows;
+	size_t count, total = 0;
+	size_t start, end, mid;
+	size_t i, j, k;
+	ssize_t ret;
+	int n_cpus = kshark_ctx->n_cpus;
+	int cpu;
+
+	rec_list = calloc(n_cpus, sizeof(*rec_list));
+	tails = calloc(n_cpus, sizeof(*tails));
+	if (!rec_list || !tails)
+		goto fail;
+
+	pthread_mutex_lock(&kshark_ctx->input_mutex);
+
+	for (cpu = 0; cpu < n_cpus; ++cpu) {
+		ret = get_more_entries(kshark_ctx, cpu,
+				       &rec_list[cpu], &tails[cpu]);
+		if (ret < 0)
+			break;
+
+		total += ret;
+	}
+
+	pthread_mutex_unlock(&kshark_ctx->input_mutex);
+
+	if (cpu < n_cpus)
+		goto fail;
+
+	if (!total) {
+		free(rec_list);
+		free(tails);
+		return n_rows;
+	}
+
+	rows = realloc(*data_rows, (n_rows + total) * sizeof(*rows));
+	if (!rows)
+		goto fail;
+
+	*data_rows = rows;
+
+	new_rows = malloc(total * sizeof(*new_rows));
+	if (!new_rows)
+		goto fail;
+
+	/* Continue the per CPU lists of entries and move the cursors. */
+	for (cpu = 0; cpu < n_cpus; ++cpu) {
+		if (!rec_list[cpu])
+			continue;
+
+		cursor = &kshark_ctx->cpu_cursors[cpu];
+		if (cursor->last)
+			cursor->last->next = &rec_list[cpu]->entry;
+
+		cursor->last = &tails[cpu]->entry;
+		cursor->offset = tails[cpu]->entry.offset;
+	}
+
+	for (count = 0; count < total; count++) {
+		int next_cpu;
+
+		next_cpu = pick_next_cpu(rec_list, n_cpus, REC_ENTRY);
+		new_rows[count] = &rec_list[next_cpu]->entry;
+		rec_list[next_cpu] = rec_list[next_cpu]->next;
+	}
+
+	/*
+	 * The new entries come after the loaded entries of their own CPU,
+	 * but they can be older than the last entries of the other CPUs.
+	 * Find where the oldest new entry goes, and merge from the end of
+	 * the array, so only the entries after this point are moved.
+	 */
+	start = 0;
+	end = n_rows;
+	while (start < end) {
+		mid = start + (end - start) / 2;
+		if (kshark_entry_before(new_rows[0], rows[mid]))
+			end = mid;
+		else
+			start = mid + 1;
+	}
+
+	i = n_rows;
+	j = total;
+	k = n_rows + total;
+	while (j) {
+		if (i > start && kshark_entry_before(new_rows[j - 1], rows[i - 1]))
+			rows[--k] = rows[--i];
+		else
+			rows[--k] = new_rows[--j];
+	}
+
+	/* Extend the posting lists, if they are of the loaded entries. */
+	if (kshark_ctx->n_index_entries == n_rows) {
+		for (count = 0; count < total; count++) {
+			if (!kshark_index_entry(kshark_ctx->task_index,
+						new_rows[count]->pid,
+						new_rows[count]) ||
+			    !kshark_index_entry(kshark_ctx->event_index,
+						new_rows[count]->event_id,
+						new_rows[count])) {
+				kshark_free_entry_index(kshark_ctx);
+				break;
+			}
+		}
+
+		if (count == total)
+			kshark_ctx->n_index_entries = n_rows + total;
+	}
+
+	free(new_rows);
+	free(rec_list);
+	free(tails);
+
+	return n_rows + total;
+
+ fail:
+	if (rec_list)
+		free_rec_list(rec_list, n_cpus, REC_ENTRY);
+	free(new_rows);
+	free(tails);
+	fprintf(stderr, "Failed to allocate memory during data loading.\n");
+	return -ENOMEM;
+}
+
 static struct pevent_record *kshark_read_at(struct kshark_context *kshark_ctx,
 					    uint64_t offset)
 {
@@ -853,7 +1406,8 @@ static const char *kshark_get_info(struct pevent *pe,
  *	  user has to free the returned string.
  * @param entry: A Kernel Shark entry to be printed.
  * @returns The returned string contains a semicolon-separated list of data
- *	    fields.
+ *	    fields. For a live trace the latency and the info fields are left
+ *	    out, because the record can not be read again.
  */
 char* kshark_dump_entry(struct kshark_entry *entry)
 {
@@ -868,13 +1422,33 @@ char* kshark_dump_entry(struct kshark_entry *entry)
 	if (!kshark_instance(&kshark_ctx) || !init_thread_seq())
 		return NULL;
 
-	data = kshark_read_at(kshark_ctx, entry->offset);
+	/* The records of a live trace can not be read again. */
+	data = NULL;
+	if (!kshark_ctx->live_fds)
+		data = kshark_read_at(kshark_ctx, entry->offset);
 
-	event_id = pevent_data_type(kshark_ctx->pevent, data);
+	event_id = entry->event_id;
 	event = pevent_data_event_from_type(kshark_ctx->pevent, event_id);
 
 	event_name = event? event->name : "[UNKNOWN EVENT]";
 	task = pevent_data_comm_from_pid(kshark_ctx->pevent, entry->pid);
+
+	if (!data) {
+		/* Only what the entry itself has. */
+		size = asprintf(&entry_str, "%li %s-%i; CPU %i; %s; 0x%x",
+				entry->ts,
+				task,
+				entry->pid,
+				entry->cpu,
+				event_name,
+				entry->visible);
+
+		if (size > 0)
+			return entry_str;
+
+		return NULL;
+	}
+
 	lat = kshark_get_latency(kshark_ctx->pevent, data);
 
 	size = asprintf(&temp_str, "%li %s-%i; CPU %i; %s;",
@@ -77,6 +77,33 @@ struct kshark_task_list {
 	int			 pid;
 };
 
+/** Posting list of the loaded entries having a given Id. */
+struct kshark_entry_index {
+	/** Pointer to the next list in the same hash bucket. */
+	struct kshark_entry_index	*next;
+
+	/** Pid or Event Id of the entries. */
+	int				id;
+
+	/** Number of entries in the list. */
+	size_t				count;
+
+	/** Allocated size of the array of entries. */
+	size_t				size;
+
+	/** The entries having this Id, in time order. */
+	struct kshark_entry		**entries;
+};
+
+/** Position of the loading of the entries of one CPU. */
+struct kshark_cpu_cursor {
+	/** The last entry loaded from this CPU, or NULL. */
+	struct kshark_entry	*last;
+
+	/** The offset into the trace file of the last entry. */
+	uint64_t		offset;
+};
+
 /** Structure representing a kshark session. */
 struct kshark_context {
 	/** Input handle for the trace data file. */
@@ -115,15 +142,49 @@ struct kshark_context {
 	 * the event.
 	 */
 	struct event_filter		*advanced_event_filter;
+
+	/**
+	 * Posting lists of the entries, loaded by the last call of
+	 * kshark_load_data_entries(), per task Pid.
+	 */
+	struct kshark_entry_index	*task_index[KS_TASK_HASH_SIZE];
+
+	/** Posting lists of the same entries, per Event Id. */
+	struct kshark_entry_index	*event_index[KS_TASK_HASH_SIZE];
+
+	/** The number of entries in the posting lists. */
+	size_t				n_index_entries;
+
+	/**
+	 * Per CPU position of the loaded entries, used by
+	 * kshark_load_more_entries() to read only the new records.
+	 */
+	struct kshark_cpu_cursor	*cpu_cursors;
+
+	/** The number of CPU cursors. */
+	int				n_cpus;
+
+	/**
+	 * File descriptors of the per CPU data files, if the session was
+	 * opened with kshark_open_live(). Otherwise NULL.
+	 */
+	int				*live_fds;
 };
 
 bool kshark_instance(struct kshark_context **kshark_ctx);
 
 bool kshark_open(struct kshark_context *kshark_ctx, const char *file);
 
+bool kshark_open_live(struct kshark_context *kshark_ctx, const char *file,
+		      int n_cpus, char * const *cpu_files);
+
 ssize_t kshark_load_data_entries(struct kshark_context *kshark_ctx,
 				 struct kshark_entry ***data_rows);
 
+ssize_t kshark_load_more_entries(struct kshark_context *kshark_ctx,
+				 struct kshark_entry ***data_rows,
+				 size_t n_rows);
+
 ssize_t kshark_load_data_records(struct kshark_context *kshark_ctx,
 				 struct pevent_record ***data_rows);
 
@@ -184,12 +245,20 @@ enum kshark_filter_type {
 void kshark_filter_add_id(struct kshark_context *kshark_ctx,
 			  int filter_id, int id);
 
+void kshark_filter_remove_id(struct kshark_context *kshark_ctx,
+			     int filter_id, int id);
+
 void kshark_filter_clear(struct kshark_context *kshark_ctx, int filter_id);
 
 void kshark_filter_entries(struct kshark_context *kshark_ctx,
 			   struct kshark_entry **data,
 			   size_t n_entries);
 
+void kshark_filter_id_entries(struct kshark_context *kshark_ctx,
+			      int filter_id, int id,
+			      struct kshark_entry **data,
+			      size_t n_entries);
+
 #ifdef __cplusplus
 }
 #endif
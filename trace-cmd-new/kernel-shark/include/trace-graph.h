@@ -34,6 +34,18 @@ enum graph_irq_type {
 };
 
 struct graph_plot;
+struct graph_summary;
+struct graph_render;
+struct graph_tiles;
+
+/* Summary of the events of a CPU or a task over a range of time */
+struct graph_bucket {
+	guint64			busy;		/* time something was running */
+	guint64			dominant_time;	/* time dominant was running */
+	guint64			types;		/* mask of the event types seen */
+	guint			count;		/* number of events */
+	gint			dominant;	/* pid (CPU for tasks) that ran longest */
+};
 
 struct plot_info {
 	gboolean		line;
@@ -71,6 +83,13 @@ struct plot_info {
  *    bfill whether or not to fill the box (default TRUE)
  *   time is the time of the current event
  *
+ * plot_summary:
+ *   Used instead of plot_event when the graph is zoomed out far
+ *   enough to draw from the summary of the trace. It is called for
+ *   each pixel with the time from start to end that it covers, and
+ *   fills in the same info as plot_event. It is called with an end
+ *   of zero after the last pixel, to finish a box that was started.
+ *
  * end:
  *   called at the end of the plotting in case the plotter needs to
  *   release any resourses.
@@ -98,6 +117,10 @@ struct plot_callbacks {
 	int (*plot_event)(struct graph_info *ginfo,
 			  struct graph_plot *plot,
 			  struct pevent_record *record);
+	int (*plot_summary)(struct graph_info *ginfo,
+			    struct graph_plot *plot,
+			    unsigned long long start,
+			    unsigned long long end);
 	void (*end)(struct graph_info *, struct graph_plot *);
 	int (*display_last_event)(struct graph_info *ginfo, struct graph_plot *plot,
 				  struct trace_seq *s, unsigned long long time);
@@ -142,6 +165,8 @@ struct plot_hash {
 #define PLOT_HASH_SIZE 1024
 #define TASK_HASH_SIZE 1024
 struct task_list;
+struct task_index;
+struct graph_summary_build;
 
 struct graph_info {
 	struct tracecmd_input	*handle;
@@ -154,11 +179,18 @@ struct graph_info {
 
 	gint			nr_task_hash;
 	struct plot_hash	*task_hash[PLOT_HASH_SIZE];
+	struct task_index	*task_index[TASK_HASH_SIZE]; /* records of each task */
+	gboolean		task_index_loaded;
 	struct plot_hash	*cpu_hash[PLOT_HASH_SIZE];
 	struct plot_list	*all_recs;
 
 	struct task_list	 *tasks[TASK_HASH_SIZE];
 
+	struct graph_summary	*summary;	/* level of detail summary */
+	struct graph_summary_build *summary_build; /* summary being built */
+	struct graph_render	*render;	/* background drawing of the plots */
+	struct graph_tiles	*tiles;		/* cache of drawn plots */
+
 	GtkWidget		*widget;	/* Box to hold graph */
 	GtkWidget		*status_hbox;	/* hbox holding status info */
 	GtkWidget		*pointer_time;	/* time that pointer is at */
@@ -281,6 +313,7 @@ static inline GtkWidget *trace_graph_get_window(struct graph_info *ginfo)
 }
 
 void trace_graph_refresh(struct graph_info *ginfo);
+void trace_graph_render_stop(struct graph_info *ginfo);
 
 struct tracecmd_filter_id_item *
 trace_graph_filter_task_find_pid(struct graph_info *ginfo, gint pid);
@@ -311,6 +344,7 @@ void trace_graph_copy_filter(struct graph_info *ginfo,
 			     gboolean all_events,
 			     struct event_filter *event_filter);
 gint *trace_graph_task_list(struct graph_info *ginfo);
+void trace_graph_add_task(struct graph_info *ginfo, gint pid);
 
 int trace_graph_load_filters(struct graph_info *ginfo,
 			     struct tracecmd_xml_handle *handle);
@@ -370,6 +404,11 @@ int trace_graph_plot_event(struct graph_info *ginfo,
 			   struct graph_plot *plot,
 			   struct pevent_record *record);
 
+int trace_graph_plot_summary(struct graph_info *ginfo,
+			     struct graph_plot *plot,
+			     unsigned long long start,
+			     unsigned long long end);
+
 void trace_graph_plot_end(struct graph_info *ginfo,
 			  struct graph_plot *plot);
 
@@ -383,6 +422,20 @@ int trace_graph_plot_display_info(struct graph_info *ginfo,
 				  struct trace_seq *s,
 				  unsigned long long time);
 
+/* summary */
+void trace_graph_summary_free(struct graph_info *ginfo);
+gboolean trace_graph_summary_needed(struct graph_info *ginfo, gint width);
+gboolean trace_graph_summary_build(struct graph_info *ginfo, gint records);
+gboolean trace_graph_summary_usable(struct graph_info *ginfo, gint width);
+void trace_graph_summary_cpu(struct graph_info *ginfo, gint cpu,
+			     guint64 start, guint64 end,
+			     struct graph_bucket *bucket);
+void trace_graph_summary_task(struct graph_info *ginfo, gint pid,
+			      guint64 start, guint64 end,
+			      struct graph_bucket *bucket);
+gboolean trace_graph_summary_shown(struct graph_info *ginfo,
+				   struct graph_bucket *bucket);
+
 /* cpu plot */
 void graph_plot_init_cpus(struct graph_info *ginfo, int cpus);
 void graph_plot_cpus_plotted(struct graph_info *ginfo,
@@ -400,5 +453,6 @@ void graph_plot_task_update_callback(gboolean accept,
 				     gpointer data);
 void graph_plot_task_plotted(struct graph_info *ginfo,
 			     gint **plotted);
+void graph_plot_task_free_index(struct graph_info *ginfo);
 
 #endif /* _TRACE_GRAPH_H */
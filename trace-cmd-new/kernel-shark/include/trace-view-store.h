@@ -51,6 +51,11 @@ struct trace_view_record
 	guint64		offset;
 	gint		cpu;
 
+	/* Kept to filter tasks without reading the record again */
+	gint		pid;
+	gint		sched_pid;	/* task switched to or woken up, or -1 */
+	gint		event_visible;
+
 	/* admin stuff used by the trace view store model */
 	gint		visible;
 	guint		pos;	/* pos within the array */
@@ -58,6 +63,9 @@ struct trace_view_record
 
 
 
+#define TRACE_VIEW_TASK_HASH_SIZE 256
+struct trace_view_task_rows;
+
 /* TraceViewStore: this structure contains everything we need for our
  *             model implementation. You can add extra fields to
  *             this structure, e.g. hashtables to quickly lookup
@@ -71,10 +79,11 @@ struct trace_view_store
 
 	guint			start_row; /* row to start at */
 	guint			num_rows; /* number of rows that we have showing   */
-	guint			visible_rows; /* number of rows defined */
-	guint			actual_rows; /* size of rows array */
+	guint			visible_rows; /* number of rows of the page */
+	guint			actual_rows; /* number of records in the trace */
 	TraceViewRecord		**rows;	/* a dynamically allocated array of pointers to
-					 *   the TraceViewRecord structure for each row    */
+					 *   the TraceViewRecord structure for each row
+					 *   of the page */
 
 	guint			visible_column_mask;
 	gint			n_columns;		/* number of columns visible */
@@ -91,11 +100,23 @@ struct trace_view_store
 	struct format_field	*sched_wakeup_new_pid_field;
 	int			cpus;
 
+	/* The records of the page, per CPU */
 	TraceViewRecord		**cpu_list;
 	gint			*cpu_items;
+	gint			*cpu_alloced;
+	guint			*cpu_before;	/* records of the CPU before the page */
+
+	/* Index of the trace pages, to find the records of a page */
+	struct tracecmd_page_index **cpu_index;
+	gint			*cpu_index_pages;
+	guint			**cpu_index_rows; /* records before each trace page */
+
+	/* The records of the page, per task they show */
+	struct trace_view_task_rows *task_rows[TRACE_VIEW_TASK_HASH_SIZE];
 
 	gint			page;
 	gint			pages;
+	guint64			*page_ts;	/* first time stamp of pages 2 and on */
 	gint			rows_per_page;
 	GtkWidget		*spin;
 
@@ -139,8 +160,6 @@ TraceViewRecord *trace_view_store_get_row(TraceViewStore *store, gint row);
 
 TraceViewRecord *trace_view_store_get_visible_row(TraceViewStore *store, gint row);
 
-TraceViewRecord *trace_view_store_get_actual_row(TraceViewStore *store, gint row);
-
 gint trace_view_store_get_num_actual_rows(TraceViewStore *store);
 
 gboolean trace_view_store_event_enabled(TraceViewStore *store, gint event_id);
@@ -211,6 +211,11 @@ void trace_graph(int argc, char **argv)
 	int c;
 	int ret;
 
+#if !GLIB_CHECK_VERSION(2, 32, 0)
+	g_thread_init(NULL);
+#endif
+	gdk_threads_init();
+
 	gtk_init(&argc, &argv);
 
 	while ((c = getopt(argc, argv, "hi:")) != -1) {
@@ -469,10 +474,13 @@ void trace_graph(int argc, char **argv)
 
 	gtk_widget_set_size_request(window, TRACE_WIDTH, TRACE_HEIGHT);
 
+	gdk_threads_enter();
+
 	ginfo->no_draw = TRUE;
 	gtk_widget_show (window);
 	ginfo->no_draw = FALSE;
 	gtk_main ();
+	gdk_threads_leave();
 }
 
 int main(int argc, char **argv)
@@ -0,0 +1,879 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Level of detail summary of a trace for the graph.
+ *
+ * When the graph is zoomed out, one pixel can cover thousands of
+ * events, and reading and decoding all of them on every redraw makes
+ * the graph crawl. Instead, the trace is read once into a summary per
+ * CPU and per task. Each summary is a pyramid of time buckets: level 0
+ * splits the trace into SUMMARY_BUCKETS buckets, and each level above
+ * it has buckets twice as wide as the level below. A redraw picks the
+ * level whose buckets fit in a pixel, and the records are only read
+ * again when zoomed in far enough.
+ *
+ * The drawing thread builds the summary a step at a time, without the
+ * GDK lock, from a handle of its own. Nothing of the graph info is
+ * changed until it is done and handed over, with the lock held.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace-graph.h"
+#include "trace-local.h"
+#include "trace-hash-local.h"
+
+#define SUMMARY_BUCKETS		(1 << 15)
+#define SUMMARY_LEVELS		16	/* the top level has one bucket */
+
+/* Reading the records is fast enough for fewer events per pixel */
+#define SUMMARY_MIN_EVENTS	16
+
+/* The first event types get their own bit, the rest share this one */
+#define SUMMARY_OTHER_TYPE	63
+
+struct summary_bucket {
+	guint			index;
+	struct graph_bucket	data;
+};
+
+/* Only the buckets that have something in them are kept */
+struct summary_level {
+	struct summary_bucket	*buckets;
+	gint			nr_buckets;
+	gint			alloced;
+};
+
+struct summary_pyramid {
+	struct summary_level	levels[SUMMARY_LEVELS];
+};
+
+struct summary_task {
+	struct summary_task	*next;
+	gint			pid;
+	struct summary_pyramid	pyramid;
+	gboolean		seen;		/* has records of its own */
+	char			*comm;		/* from a sched switch */
+};
+
+struct graph_summary {
+	guint64			start;
+	guint64			width;		/* width of a level 0 bucket */
+	gint			level;		/* level used for this draw */
+	guint64			shown_types;	/* types that pass the event filter */
+
+	gint			*type_bits;	/* event id to type bit */
+	gint			nr_ids;
+	gint			nr_types;
+	gboolean		unknown_types;	/* events with unknown ids seen */
+
+	struct summary_pyramid	*cpus;
+	struct summary_task	*tasks[TASK_HASH_SIZE];
+};
+
+/* A sched event, as found in the pevent of the build */
+struct summary_sched {
+	gint			id;
+	struct format_field	*pid;
+	struct format_field	*comm;		/* switches only */
+	struct format_field	*success;	/* wakeups only */
+};
+
+struct graph_summary_build {
+	struct graph_summary	*summary;
+	struct tracecmd_input	*handle;
+	struct pevent		*pevent;
+	gboolean		own_handle;
+	gboolean		done;		/* all the records are read */
+	gint			cpus;
+	guint64			end_time;
+	guint64			*last_time;
+	gint			*last_pid;
+
+	/* The pids of the records, in the order they were first seen */
+	gint			*pids;
+	gint			nr_pids;
+
+	struct summary_sched	sched_switch;
+	struct summary_sched	context_switch;
+	struct summary_sched	wakeup;
+	struct summary_sched	wakeup_new;
+};
+
+static guint bucket_index(struct graph_summary *summary, guint64 time)
+{
+	if (time < summary->start)
+		return 0;
+	return (time - summary->start) / summary->width;
+}
+
+/* Returns the index of the first bucket of the level that starts at or after @time */
+static guint first_bucket(struct graph_summary *summary, guint64 time)
+{
+	guint64 width = summary->width << summary->level;
+
+	if (time <= summary->start)
+		return 0;
+	return (time - summary->start + width - 1) / width;
+}
+
+/* Returns the position of the first bucket at or after @index */
+static gint find_bucket(struct summary_level *level, guint index)
+{
+	gint lo = 0;
+	gint hi = level->nr_buckets;
+	gint mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (level->buckets[mid].index < index)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static struct graph_bucket *get_bucket(struct summary_level *level, guint index)
+{
+	struct summary_bucket *bucket;
+	gint nr = level->nr_buckets;
+	gint pos;
+
+	/* The summary is built in time order, this is almost always the last */
+	if (nr && level->buckets[nr - 1].index == index)
+		return &level->buckets[nr - 1].data;
+
+	if (!nr || level->buckets[nr - 1].index < index)
+		pos = nr;
+	else {
+		pos = find_bucket(level, index);
+		if (level->buckets[pos].index == index)
+			return &level->buckets[pos].data;
+	}
+
+	if (nr == level->alloced) {
+		level->alloced = level->alloced ? level->alloced * 2 : 16;
+		level->buckets = realloc(level->buckets,
+					 sizeof(*level->buckets) * level->alloced);
+		if (!level->buckets)
+			die("unable to grow graph summary");
+	}
+
+	bucket = &level->buckets[pos];
+	if (pos < nr)
+		memmove(bucket + 1, bucket, sizeof(*bucket) * (nr - pos));
+	level->nr_buckets++;
+
+	memset(bucket, 0, sizeof(*bucket));
+	bucket->index = index;
+
+	return &bucket->data;
+}
+
+/*
+ * The dominant one is only approximate: it is the one that ran
+ * the longest in one go, not necessarily the longest in total.
+ */
+static void add_dominant(struct graph_bucket *bucket, gint who, guint64 time)
+{
+	if (bucket->dominant == who && bucket->dominant_time)
+		bucket->dominant_time += time;
+	else if (time > bucket->dominant_time) {
+		bucket->dominant = who;
+		bucket->dominant_time = time;
+	}
+}
+
+static void merge_bucket(struct graph_bucket *dst, struct graph_bucket *src)
+{
+	dst->count += src->count;
+	dst->types |= src->types;
+	dst->busy += src->busy;
+	if (src->dominant_time)
+		add_dominant(dst, src->dominant, src->dominant_time);
+}
+
+static void add_event(struct graph_summary *summary,
+		      struct summary_pyramid *pyramid,
+		      guint64 ts, gint type)
+{
+	struct graph_bucket *bucket;
+
+	bucket = get_bucket(&pyramid->levels[0], bucket_index(summary, ts));
+	bucket->count++;
+	bucket->types |= 1ULL << type;
+}
+
+/* @who ran from @start to @end, spread it over the buckets it covers */
+static void add_run(struct graph_summary *summary,
+		    struct summary_pyramid *pyramid,
+		    gint who, guint64 start, guint64 end)
+{
+	struct graph_bucket *bucket;
+	guint64 next;
+	guint index;
+
+	while (start < end) {
+		index = bucket_index(summary, start);
+		next = summary->start + (index + 1) * summary->width;
+		if (next > end)
+			next = end;
+
+		bucket = get_bucket(&pyramid->levels[0], index);
+		bucket->busy += next - start;
+		add_dominant(bucket, who, next - start);
+
+		start = next;
+	}
+}
+
+static void build_levels(struct summary_pyramid *pyramid)
+{
+	struct summary_level *level;
+	struct summary_level *below;
+	struct summary_bucket *bucket;
+	gint l, i;
+
+	for (l = 1; l < SUMMARY_LEVELS; l++) {
+		level = &pyramid->levels[l];
+		below = &pyramid->levels[l - 1];
+
+		for (i = 0; i < below->nr_buckets; i++) {
+			bucket = &below->buckets[i];
+			merge_bucket(get_bucket(level, bucket->index >> 1),
+				     &bucket->data);
+		}
+	}
+}
+
+static void free_pyramid(struct summary_pyramid *pyramid)
+{
+	gint l;
+
+	for (l = 0; l < SUMMARY_LEVELS; l++)
+		free(pyramid->levels[l].buckets);
+}
+
+static struct summary_task *
+find_task(struct graph_summary *summary, gint pid, gboolean create)
+{
+	struct summary_task *task;
+	guint key;
+
+	key = trace_hash(pid) % TASK_HASH_SIZE;
+
+	for (task = summary->tasks[key]; task; task = task->next) {
+		if (task->pid == pid)
+			return task;
+	}
+
+	if (!create)
+		return NULL;
+
+	task = malloc_or_die(sizeof(*task));
+	memset(task, 0, sizeof(*task));
+	task->pid = pid;
+	task->next = summary->tasks[key];
+	summary->tasks[key] = task;
+
+	return task;
+}
+
+static gint type_bit(struct graph_summary *summary, gint id)
+{
+	if (id < 0 || id >= summary->nr_ids) {
+		summary->unknown_types = TRUE;
+		return SUMMARY_OTHER_TYPE;
+	}
+
+	if (summary->type_bits[id] < 0) {
+		if (summary->nr_types < SUMMARY_OTHER_TYPE)
+			summary->type_bits[id] = summary->nr_types++;
+		else
+			summary->type_bits[id] = SUMMARY_OTHER_TYPE;
+	}
+
+	return summary->type_bits[id];
+}
+
+static void init_type_bits(struct pevent *pevent,
+			   struct graph_summary *summary)
+{
+	gint i;
+
+	/* The events are sorted by id */
+	if (pevent->nr_events)
+		summary->nr_ids = pevent->events[pevent->nr_events - 1]->id + 1;
+
+	summary->type_bits = malloc_or_die(sizeof(gint) * (summary->nr_ids + 1));
+	for (i = 0; i < summary->nr_ids; i++)
+		summary->type_bits[i] = -1;
+}
+
+static void find_sched(struct pevent *pevent, struct summary_sched *sched,
+		       const char *sys, const char *name, const char *pid,
+		       const char *comm, const char *success)
+{
+	struct event_format *event;
+
+	memset(sched, 0, sizeof(*sched));
+	sched->id = -1;
+
+	event = pevent_find_event_by_name(pevent, sys, name);
+	if (!event)
+		return;
+
+	sched->id = event->id;
+	sched->pid = pevent_find_field(event, pid);
+	if (comm)
+		sched->comm = pevent_find_field(event, comm);
+	if (success)
+		sched->success = pevent_find_field(event, success);
+}
+
+/*
+ * The sched switch that @id is, as trace_graph_check_sched_switch()
+ * finds them, or NULL if it is not one.
+ */
+static struct summary_sched *
+find_sched_switch(struct graph_summary_build *build, gint id)
+{
+	/* Without sched_switch, the context switches are not looked for */
+	if (build->sched_switch.id < 0)
+		return NULL;
+
+	if (id == build->sched_switch.id)
+		return &build->sched_switch;
+	if (id == build->context_switch.id)
+		return &build->context_switch;
+
+	return NULL;
+}
+
+/* The same as trace_graph_check_sched_wakeup(), on the pevent of the build */
+static gboolean check_sched_wakeup(struct graph_summary_build *build,
+				   struct pevent_record *record, gint id,
+				   gint *pid)
+{
+	struct summary_sched *sched;
+	unsigned long long val;
+
+	if (id == build->wakeup.id)
+		sched = &build->wakeup;
+	else if (id == build->wakeup_new.id)
+		sched = &build->wakeup_new;
+	else
+		return FALSE;
+
+	/* We only want those that actually woke up the task */
+	if (sched->success) {
+		pevent_read_number_field(sched->success, record->data, &val);
+		if (!val)
+			return FALSE;
+	}
+
+	pevent_read_number_field(sched->pid, record->data, &val);
+	*pid = val;
+
+	return TRUE;
+}
+
+static struct graph_summary_build *
+start_build(struct graph_info *ginfo, struct tracecmd_input *handle,
+	    gboolean own_handle)
+{
+	struct graph_summary_build *build;
+	struct graph_summary *summary;
+	gint cpu;
+
+	build = malloc_or_die(sizeof(*build));
+	memset(build, 0, sizeof(*build));
+
+	build->handle = handle;
+	build->own_handle = own_handle;
+	build->pevent = tracecmd_get_pevent(handle);
+	build->cpus = ginfo->cpus;
+	build->end_time = ginfo->end_time;
+
+	summary = malloc_or_die(sizeof(*summary));
+	memset(summary, 0, sizeof(*summary));
+	build->summary = summary;
+
+	summary->start = ginfo->start_time;
+	summary->width = (ginfo->end_time - ginfo->start_time) / SUMMARY_BUCKETS + 1;
+
+	init_type_bits(build->pevent, summary);
+
+	summary->cpus = malloc_or_die(sizeof(*summary->cpus) * build->cpus);
+	memset(summary->cpus, 0, sizeof(*summary->cpus) * build->cpus);
+
+	build->last_time = malloc_or_die(sizeof(*build->last_time) * build->cpus);
+	build->last_pid = malloc_or_die(sizeof(*build->last_pid) * build->cpus);
+	for (cpu = 0; cpu < build->cpus; cpu++)
+		build->last_pid[cpu] = -1;
+
+	find_sched(build->pevent, &build->sched_switch, NULL, "sched_switch",
+		   "next_pid", "next_comm", NULL);
+	find_sched(build->pevent, &build->context_switch, "ftrace",
+		   "context_switch", "next_pid", "next_comm", NULL);
+	find_sched(build->pevent, &build->wakeup, NULL, "sched_wakeup",
+		   "pid", NULL, "success");
+	find_sched(build->pevent, &build->wakeup_new, NULL, "sched_wakeup_new",
+		   "pid", NULL, "success");
+
+	tracecmd_set_all_cpus_to_timestamp(handle, ginfo->start_time);
+
+	return build;
+}
+
+static void see_task(struct graph_summary_build *build,
+		     struct summary_task *task)
+{
+	if (task->seen)
+		return;
+
+	task->seen = TRUE;
+	build->pids = realloc(build->pids,
+			      sizeof(*build->pids) * (build->nr_pids + 1));
+	if (!build->pids)
+		die("unable to grow graph summary");
+	build->pids[build->nr_pids++] = task->pid;
+}
+
+static void add_record(struct graph_summary_build *build,
+		       struct pevent_record *record, gint cpu)
+{
+	struct graph_summary *summary = build->summary;
+	struct summary_sched *sched;
+	struct summary_task *task;
+	unsigned long long val;
+	gint wake_pid;
+	gint type;
+	gint pid;
+	gint id;
+
+	id = pevent_data_type(build->pevent, record);
+	type = type_bit(summary, id);
+	pid = pevent_data_pid(build->pevent, record);
+
+	if (build->last_pid[cpu] > 0) {
+		add_run(summary, &summary->cpus[cpu], build->last_pid[cpu],
+			build->last_time[cpu], record->ts);
+		task = find_task(summary, build->last_pid[cpu], TRUE);
+		add_run(summary, &task->pyramid, cpu,
+			build->last_time[cpu], record->ts);
+	}
+
+	add_event(summary, &summary->cpus[cpu], record->ts, type);
+
+	/* Same events as the task plot shows for a task */
+	task = find_task(summary, pid, TRUE);
+	add_event(summary, &task->pyramid, record->ts, type);
+	see_task(build, task);
+
+	sched = find_sched_switch(build, id);
+	if (sched) {
+		pevent_read_number_field(sched->pid, record->data, &val);
+		if (val != pid) {
+			task = find_task(summary, val, TRUE);
+			add_event(summary, &task->pyramid, record->ts, type);
+		}
+		/* The first comm of a task, for trace_graph_summary_finish() */
+		if (sched->comm && !task->comm) {
+			task->comm = strndup(record->data + sched->comm->offset,
+					     sched->comm->size);
+			if (!task->comm)
+				die("unable to grow graph summary");
+		}
+		pid = val;
+	} else if (check_sched_wakeup(build, record, id, &wake_pid) &&
+		   wake_pid != pid) {
+		task = find_task(summary, wake_pid, TRUE);
+		add_event(summary, &task->pyramid, record->ts, type);
+	}
+
+	build->last_pid[cpu] = pid;
+	build->last_time[cpu] = record->ts;
+}
+
+/*
+ * Reads up to @records records of the trace in time order. The time
+ * between two records of a CPU is given to the task that was running
+ * after the first one, the same way the CPU plot draws its boxes.
+ *
+ * Returns TRUE once all the records are read.
+ */
+static gboolean build_step(struct graph_summary_build *build, gint records)
+{
+	struct graph_summary *summary = build->summary;
+	struct pevent_record *record;
+	struct summary_task *task;
+	gint count;
+	gint cpu;
+	gint i;
+
+	if (build->done)
+		return TRUE;
+
+	for (count = 0; count < records; count++) {
+		record = tracecmd_read_next_data(build->handle, &cpu);
+		if (!record)
+			break;
+		add_record(build, record, cpu);
+		free_record(record);
+	}
+
+	if (count == records)
+		return FALSE;
+
+	/* Whatever runs at the end runs until the end of the trace */
+	for (cpu = 0; cpu < build->cpus; cpu++) {
+		if (build->last_pid[cpu] <= 0)
+			continue;
+		add_run(summary, &summary->cpus[cpu], build->last_pid[cpu],
+			build->last_time[cpu], build->end_time);
+		task = find_task(summary, build->last_pid[cpu], TRUE);
+		add_run(summary, &task->pyramid, cpu,
+			build->last_time[cpu], build->end_time);
+	}
+
+	for (cpu = 0; cpu < build->cpus; cpu++)
+		build_levels(&summary->cpus[cpu]);
+
+	for (i = 0; i < TASK_HASH_SIZE; i++) {
+		for (task = summary->tasks[i]; task; task = task->next)
+			build_levels(&task->pyramid);
+	}
+
+	build->done = TRUE;
+
+	return TRUE;
+}
+
+static void free_build(struct graph_summary_build *build)
+{
+	if (build->own_handle)
+		tracecmd_close(build->handle);
+	free(build->last_time);
+	free(build->last_pid);
+	free(build->pids);
+	free(build);
+}
+
+static void free_summary(struct graph_summary *summary, gint cpus)
+{
+	struct summary_task *task;
+	gint cpu;
+	gint i;
+
+	for (cpu = 0; cpu < cpus; cpu++)
+		free_pyramid(&summary->cpus[cpu]);
+	free(summary->cpus);
+
+	for (i = 0; i < TASK_HASH_SIZE; i++) {
+		while ((task = summary->tasks[i])) {
+			summary->tasks[i] = task->next;
+			free_pyramid(&task->pyramid);
+			free(task->comm);
+			free(task);
+		}
+	}
+
+	free(summary->type_bits);
+	free(summary);
+}
+
+/*
+ * Hand the summary of a finished build over to @ginfo. On the first
+ * read of the trace, the tasks and comms it found are added, as
+ * trace_graph_check_sched_switch() does for the records it is given.
+ */
+static void finish_build(struct graph_info *ginfo)
+{
+	struct graph_summary_build *build = ginfo->summary_build;
+	struct graph_summary *summary = build->summary;
+	struct summary_task *task;
+	gint i;
+
+	if (ginfo->read_comms) {
+		for (i = 0; i < build->nr_pids; i++)
+			trace_graph_add_task(ginfo, build->pids[i]);
+	}
+
+	for (i = 0; i < TASK_HASH_SIZE; i++) {
+		for (task = summary->tasks[i]; task; task = task->next) {
+			if (ginfo->read_comms && task->comm &&
+			    !pevent_pid_is_registered(ginfo->pevent, task->pid))
+				pevent_register_comm(ginfo->pevent, task->comm,
+						     task->pid);
+			free(task->comm);
+			task->comm = NULL;
+		}
+	}
+
+	ginfo->summary = summary;
+	ginfo->summary_build = NULL;
+	free_build(build);
+}
+
+/**
+ * trace_graph_summary_free - free the summary of the trace
+ * @ginfo: the graph info structure
+ *
+ * Also drops a summary that is still being built.
+ */
+void trace_graph_summary_free(struct graph_info *ginfo)
+{
+	if (ginfo->summary_build) {
+		free_summary(ginfo->summary_build->summary, ginfo->cpus);
+		free_build(ginfo->summary_build);
+		ginfo->summary_build = NULL;
+	}
+
+	if (!ginfo->summary)
+		return;
+
+	free_summary(ginfo->summary, ginfo->cpus);
+	ginfo->summary = NULL;
+}
+
+static void summarize(struct graph_summary *summary,
+		      struct summary_pyramid *pyramid,
+		      guint64 start, guint64 end,
+		      struct graph_bucket *bucket)
+{
+	struct summary_level *level;
+	guint first;
+	guint last;
+	gint i;
+
+	memset(bucket, 0, sizeof(*bucket));
+
+	if (!pyramid)
+		return;
+
+	/* A bucket belongs to the range its start time is in */
+	level = &pyramid->levels[summary->level];
+	first = first_bucket(summary, start);
+	last = first_bucket(summary, end);
+
+	for (i = find_bucket(level, first);
+	     i < level->nr_buckets && level->buckets[i].index < last; i++)
+		merge_bucket(bucket, &level->buckets[i].data);
+}
+
+/* Find the event types that pass the event filter */
+static gboolean update_shown_types(struct graph_info *ginfo,
+				   struct graph_summary *summary)
+{
+	guint64 hidden = 0;
+	guint64 shown = 0;
+	guint64 bit;
+	gint id;
+
+	if (ginfo->all_events) {
+		summary->shown_types = -1ULL;
+		return TRUE;
+	}
+
+	if (summary->unknown_types)
+		hidden |= 1ULL << SUMMARY_OTHER_TYPE;
+
+	for (id = 0; id < summary->nr_ids; id++) {
+		if (summary->type_bits[id] < 0)
+			continue;
+
+		bit = 1ULL << summary->type_bits[id];
+
+		if (!pevent_event_filtered(ginfo->event_filter, id))
+			hidden |= bit;
+		else if (pevent_filter_event_has_trivial(ginfo->event_filter, id,
+							 FILTER_TRIVIAL_TRUE))
+			shown |= bit;
+		else
+			/* Filters on the content need the records */
+			return FALSE;
+	}
+
+	/* Types that share a bit can not be told apart */
+	if (shown & hidden)
+		return FALSE;
+
+	summary->shown_types = shown;
+	return TRUE;
+}
+
+/* If the view is zoomed out enough to be drawn from the summary */
+static gboolean summary_fits(struct graph_info *ginfo, gint width,
+			     gdouble *pixel)
+{
+	guint64 bucket_width;
+	gint i;
+
+	if (!ginfo->handle || width <= 0)
+		return FALSE;
+
+	/* This includes the plots that see all records (tasks) */
+	for (i = 0; i < ginfo->plots; i++) {
+		if (!ginfo->plot_array[i]->cb->plot_summary)
+			return FALSE;
+	}
+
+	/* Task filters work on each record */
+	if (ginfo->filter_enabled &&
+	    (tracecmd_filter_task_count(ginfo->task_filter) ||
+	     tracecmd_filter_task_count(ginfo->hide_tasks)))
+		return FALSE;
+
+	*pixel = (gdouble)(ginfo->view_end_time - ginfo->view_start_time) / width;
+	bucket_width = (ginfo->end_time - ginfo->start_time) / SUMMARY_BUCKETS + 1;
+
+	return *pixel >= bucket_width;
+}
+
+/**
+ * trace_graph_summary_needed - see if the summary is to be built
+ * @ginfo: the graph info structure
+ * @width: the width in pixels of the visible part of the graph
+ *
+ * Returns TRUE if the summary is not built yet, and the current view
+ * may be drawn from it.
+ */
+gboolean trace_graph_summary_needed(struct graph_info *ginfo, gint width)
+{
+	gdouble pixel;
+
+	return !ginfo->summary && summary_fits(ginfo, width, &pixel);
+}
+
+/**
+ * trace_graph_summary_build - build the summary a step at a time
+ * @ginfo: the graph info structure
+ * @records: the number of records to read
+ *
+ * Reads the trace with a handle of its own, and touches nothing that
+ * the main thread uses. The drawing thread calls it without the GDK
+ * lock, and the next trace_graph_summary_usable() hands the summary
+ * over. What is built is kept if the drawing is stopped in between.
+ *
+ * Returns TRUE when all the records are read, or if the trace could not
+ * be opened again, in which case trace_graph_summary_usable() reads it
+ * with the handle of @ginfo.
+ */
+gboolean trace_graph_summary_build(struct graph_info *ginfo, gint records)
+{
+	struct tracecmd_input *handle;
+
+	if (!ginfo->summary_build) {
+		handle = tracecmd_open_again(ginfo->handle);
+		if (!handle)
+			return TRUE;
+		ginfo->summary_build = start_build(ginfo, handle, TRUE);
+	}
+
+	return build_step(ginfo->summary_build, records);
+}
+
+/**
+ * trace_graph_summary_usable - see if the summary can be used to draw
+ * @ginfo: the graph info structure
+ * @width: the width in pixels of the visible part of the graph
+ *
+ * Returns TRUE if the pixels of the current view cover enough
+ * events that drawing from the summary is worth it, and nothing
+ * is plotted that needs the records themselves. A summary that
+ * trace_graph_summary_build() did not finish is finished here.
+ */
+gboolean trace_graph_summary_usable(struct graph_info *ginfo, gint width)
+{
+	struct graph_summary *summary;
+	struct graph_bucket bucket;
+	guint64 events = 0;
+	gdouble pixel;
+	gint cpu;
+
+	if (!summary_fits(ginfo, width, &pixel))
+		return FALSE;
+
+	if (!ginfo->summary) {
+		if (!ginfo->summary_build)
+			ginfo->summary_build = start_build(ginfo, ginfo->handle,
+							   FALSE);
+		while (!build_step(ginfo->summary_build, G_MAXINT))
+			;
+		finish_build(ginfo);
+	}
+	summary = ginfo->summary;
+
+	if (!update_shown_types(ginfo, summary))
+		return FALSE;
+
+	for (summary->level = 0; summary->level < SUMMARY_LEVELS - 1;
+	     summary->level++) {
+		if ((summary->width << (summary->level + 1)) > pixel)
+			break;
+	}
+
+	for (cpu = 0; cpu < ginfo->cpus; cpu++) {
+		summarize(summary, &summary->cpus[cpu], ginfo->view_start_time,
+			  ginfo->view_end_time + 1, &bucket);
+		events += bucket.count;
+	}
+
+	return events >= (guint64)width * SUMMARY_MIN_EVENTS;
+}
+
+/**
+ * trace_graph_summary_cpu - summarize a CPU over a range of time
+ * @ginfo: the graph info structure
+ * @cpu: the CPU to summarize
+ * @start: the start of the range
+ * @end: the end of the range (not included)
+ * @bucket: returns the summary
+ *
+ * The dominant of @bucket is the pid that ran the longest.
+ * Only valid after trace_graph_summary_usable() returned TRUE.
+ */
+void trace_graph_summary_cpu(struct graph_info *ginfo, gint cpu,
+			     guint64 start, guint64 end,
+			     struct graph_bucket *bucket)
+{
+	struct graph_summary *summary = ginfo->summary;
+
+	summarize(summary, &summary->cpus[cpu], start, end, bucket);
+}
+
+/**
+ * trace_graph_summary_task - summarize a task over a range of time
+ * @ginfo: the graph info structure
+ * @pid: the task to summarize
+ * @start: the start of the range
+ * @end: the end of the range (not included)
+ * @bucket: returns the summary
+ *
+ * The dominant of @bucket is the CPU the task ran the longest on.
+ * Only valid after trace_graph_summary_usable() returned TRUE.
+ */
+void trace_graph_summary_task(struct graph_info *ginfo, gint pid,
+			      guint64 start, guint64 end,
+			      struct graph_bucket *bucket)
+{
+	struct graph_summary *summary = ginfo->summary;
+	struct summary_task *task;
+
+	task = find_task(summary, pid, FALSE);
+	summarize(summary, task ? &task->pyramid : NULL, start, end, bucket);
+}
+
+/**
+ * trace_graph_summary_shown - test if a summary has events to show
+ * @ginfo: the graph info structure
+ * @bucket: the summary from trace_graph_summary_cpu/task()
+ *
+ * Returns TRUE if any of the events in @bucket pass the event filter.
+ */
+gboolean trace_graph_summary_shown(struct graph_info *ginfo,
+				   struct graph_bucket *bucket)
+{
+	return bucket->count && (bucket->types & ginfo->summary->shown_types);
+}
@@ -9,6 +9,7 @@
 #include <stdarg.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <gtk/gtk.h>
 
 #include <sys/time.h>
@@ -59,6 +60,7 @@ static GdkGC *green;
 static GdkGC *red;
 
 static void redraw_pixmap_backend(struct graph_info *ginfo);
+static void tiles_flush(struct graph_info *ginfo);
 static void update_label_window(struct graph_info *ginfo);
 
 struct task_list {
@@ -116,6 +118,16 @@ static void free_task_hash(struct graph_info *ginfo)
 	}
 }
 
+/**
+ * trace_graph_add_task - add a task to the list of found tasks
+ * @ginfo: the graph info structure
+ * @pid: the pid of the task
+ */
+void trace_graph_add_task(struct graph_info *ginfo, gint pid)
+{
+	add_task_hash(ginfo, pid);
+}
+
 /**
  * trace_graph_task_list - return an allocated list of all found tasks
  * @ginfo: The graph info structure
@@ -457,6 +469,10 @@ static void redraw_graph(struct graph_info *ginfo)
 	gdouble height;
 	gdouble width;
 
+	/* The plots or the filters changed, the tiles are stale */
+	trace_graph_render_stop(ginfo);
+	tiles_flush(ginfo);
+
 	redraw_pixmap_backend(ginfo);
 	width = ginfo->draw->allocation.width;
 	height = ginfo->draw->allocation.height;
@@ -1921,77 +1937,359 @@ static void draw_plot(struct graph_info *ginfo, struct graph_plot *plot,
 				 plot->p1, plot->p2, ginfo->draw_width, width_16, font);
 }
 
-static void draw_plots(struct graph_info *ginfo, gint new_width)
+static void draw_plot_summary(struct graph_info *ginfo, struct graph_plot *plot,
+			      guint64 start, guint64 end)
+{
+	struct plot_info *info;
+	gint x1, x2;
+
+	trace_graph_plot_summary(ginfo, plot, start, end);
+	info = &plot->info;
+
+	if (info->box) {
+		if (info->bcolor != plot->last_color) {
+			plot->last_color = info->bcolor;
+			set_color(ginfo->draw, plot->gc, plot->last_color);
+		}
+
+		x1 = convert_time_to_x(ginfo, info->bstart);
+		x2 = convert_time_to_x(ginfo, info->bend);
+		draw_plot_box(ginfo, plot->pos, x1, x2, info->bfill, plot->gc);
+	}
+
+	if (info->line) {
+		if (info->lcolor != plot->last_color) {
+			plot->last_color = info->lcolor;
+			set_color(ginfo->draw, plot->gc, plot->last_color);
+		}
+
+		draw_plot_line(ginfo, plot->pos, info->ltime, plot->gc);
+	}
+}
+
+/*
+ * The plots are drawn by a thread, so that the UI stays usable while
+ * the records of a large trace are read. The thread draws into its
+ * own pixmap, a batch of records at a time, and only while it holds
+ * the GDK lock. All the GTK callbacks run with that lock held, thus
+ * between batches the main thread may use the handle and the plots as
+ * it always did, and the thread saves and restores its CPU cursors
+ * around each batch. A timeout copies what is drawn so far into the
+ * backstore. A redraw (zoom, scroll, filter or plot change) stops the
+ * thread before it touches anything, which is quick as the thread is
+ * at most waiting for the lock. The summary of a zoomed out view is
+ * built before the first batch, by the thread without the lock, from
+ * a handle of its own.
+ *
+ * The plots are kept in a cache of tiles, TILE_WIDTH pixels wide, that
+ * are numbered from the start of the trace. Scrolling at the same zoom
+ * copies the tiles it already has, and only the span of the missing
+ * ones is drawn. The thread draws that span in its own pixmap as if it
+ * was the whole view, by switching the view to the span for each batch.
+ * The tiles are dropped when the zoom, the size or the plots change,
+ * and by redraw_graph(), which all filter changes go through.
+ */
+#define RENDER_RECORDS	4096	/* records drawn per batch */
+#define RENDER_COLUMNS	64	/* summary pixels drawn per batch */
+#define RENDER_BLIT_MS	100	/* how often to show the partial graph */
+
+#define TILE_WIDTH	512
+#define TILE_MAX	32	/* more than a MAX_WIDTH view */
+#define TILE_TOP	(PLOT_TOP(0) - PLOT_SIZE * 2)	/* below the time line */
+
+struct graph_tile {
+	struct graph_tile	*next;
+	gint			index;		/* TILE_WIDTH pixels from the start */
+	GdkPixmap		*pixmap;
+};
+
+struct graph_tiles {
+	struct graph_tile	*list;		/* most recently used first */
+	gint			nr_tiles;
+	/* what the tiles were drawn with */
+	gdouble			resolution;
+	gint			height;
+	gint			plots;
+};
+
+struct graph_render {
+	pthread_t		thread;
+	gboolean		running;	/* thread started, not joined yet */
+	gboolean		cancel;		/* tells the thread to stop */
+	gboolean		done;		/* all the plots are drawn */
+	gboolean		started;	/* first batch was run */
+	gboolean		summary;	/* drawing from the summary */
+	gint			width;		/* width to draw */
+	gint			x;		/* next summary pixel to draw */
+	gint			cpu;		/* next CPU to read, CPU plots only */
+	guint64			time;		/* start of the next summary pixel */
+	guint			blit;		/* timeout showing the progress */
+	guint64			*offsets;	/* CPU cursors between batches */
+	struct timeval		tv_start;
+
+	GdkPixmap		*pixmap;	/* span of tiles being drawn */
+	gint			span_x;		/* where the span is in the view */
+	gint			first_tile;
+	gint			nr_tiles;
+	guint64			span_start;	/* view_start_time of the span */
+	guint64			span_end;	/* view_end_time of the span */
+
+	/* the view, while the span replaces it */
+	guint64			save_start;
+	guint64			save_end;
+	GdkPixmap		*save_pixmap;
+};
+
+static void tiles_flush(struct graph_info *ginfo)
+{
+	struct graph_tiles *tiles = ginfo->tiles;
+	struct graph_tile *tile;
+
+	if (!tiles)
+		return;
+
+	while ((tile = tiles->list)) {
+		tiles->list = tile->next;
+		g_object_unref(tile->pixmap);
+		free(tile);
+	}
+	tiles->nr_tiles = 0;
+}
+
+static void tiles_free(struct graph_info *ginfo)
+{
+	tiles_flush(ginfo);
+	free(ginfo->tiles);
+	ginfo->tiles = NULL;
+}
+
+/* Drop the tiles if they were not drawn for this zoom, size and plots */
+static void tiles_check(struct graph_info *ginfo, gint height)
+{
+	struct graph_tiles *tiles = ginfo->tiles;
+
+	if (!tiles) {
+		tiles = malloc_or_die(sizeof(*tiles));
+		memset(tiles, 0, sizeof(*tiles));
+		ginfo->tiles = tiles;
+	}
+
+	if (tiles->resolution == ginfo->resolution &&
+	    tiles->height == height &&
+	    tiles->plots == ginfo->plots)
+		return;
+
+	tiles_flush(ginfo);
+	tiles->resolution = ginfo->resolution;
+	tiles->height = height;
+	tiles->plots = ginfo->plots;
+}
+
+static struct graph_tile *tiles_find(struct graph_info *ginfo, gint index)
+{
+	struct graph_tiles *tiles = ginfo->tiles;
+	struct graph_tile **last;
+	struct graph_tile *tile;
+
+	for (last = &tiles->list; (tile = *last); last = &tile->next) {
+		if (tile->index != index)
+			continue;
+		/* move it to the front */
+		*last = tile->next;
+		tile->next = tiles->list;
+		tiles->list = tile;
+		return tile;
+	}
+
+	return NULL;
+}
+
+static void tiles_add(struct graph_info *ginfo, gint index,
+		      GdkPixmap *pixmap, gint x)
+{
+	struct graph_tiles *tiles = ginfo->tiles;
+	struct graph_tile **last;
+	struct graph_tile *tile;
+
+	tile = tiles_find(ginfo, index);
+	if (!tile) {
+		if (tiles->nr_tiles == TILE_MAX) {
+			/* reuse the least recently used tile */
+			for (last = &tiles->list; (*last)->next; last = &(*last)->next)
+				;
+			tile = *last;
+			*last = NULL;
+		} else {
+			tile = malloc_or_die(sizeof(*tile));
+			tile->pixmap = gdk_pixmap_new(ginfo->draw->window,
+						      TILE_WIDTH,
+						      tiles->height - TILE_TOP,
+						      -1);
+			tiles->nr_tiles++;
+		}
+		tile->index = index;
+		tile->next = tiles->list;
+		tiles->list = tile;
+	}
+
+	gdk_draw_drawable(tile->pixmap, ginfo->draw->style->black_gc, pixmap,
+			  x, TILE_TOP, 0, 0,
+			  TILE_WIDTH, tiles->height - TILE_TOP);
+}
+
+/* Switch the view to the span, only while holding the GDK lock */
+static void render_enter(struct graph_info *ginfo, struct graph_render *render)
+{
+	render->save_start = ginfo->view_start_time;
+	render->save_end = ginfo->view_end_time;
+	render->save_pixmap = ginfo->curr_pixmap;
+
+	ginfo->view_start_time = render->span_start;
+	ginfo->view_end_time = render->span_end;
+	ginfo->curr_pixmap = render->pixmap;
+}
+
+static void render_leave(struct graph_info *ginfo, struct graph_render *render)
+{
+	ginfo->view_start_time = render->save_start;
+	ginfo->view_end_time = render->save_end;
+	ginfo->curr_pixmap = render->save_pixmap;
+}
+
+/* Copy what is drawn of the span to the view */
+static void render_show(struct graph_info *ginfo, struct graph_render *render)
+{
+	gdk_draw_drawable(ginfo->curr_pixmap, ginfo->draw->style->black_gc,
+			  render->pixmap, 0, TILE_TOP, render->span_x, TILE_TOP,
+			  render->width, ginfo->tiles->height - TILE_TOP);
+}
+
+static void render_store(struct graph_info *ginfo, struct graph_render *render)
+{
+	gint i;
+
+	render_show(ginfo, render);
+
+	for (i = 0; i < render->nr_tiles; i++)
+		tiles_add(ginfo, render->first_tile + i,
+			  render->pixmap, i * TILE_WIDTH);
+}
+
+static void save_cursors(struct graph_info *ginfo, struct graph_render *render)
 {
-	struct timeval tv_start, tv_stop;
-	struct plot_list *list;
-	struct graph_plot *plot;
 	struct pevent_record *record;
-	struct plot_hash *hash;
-	gint pid;
 	gint cpu;
-	gint i;
 
-	/* Initialize plots */
-	for (i = 0; i < ginfo->plots; i++) {
-		plot = ginfo->plot_array[i];
+	for (cpu = 0; cpu < ginfo->cpus; cpu++) {
+		record = tracecmd_peek_data(ginfo->handle, cpu);
+		render->offsets[cpu] = record ? record->offset : 0;
+	}
+}
 
-		if (!plot->gc)
-			plot->gc = gdk_gc_new(ginfo->draw->window);
-		plot->p1 = 0;
-		plot->p2 = 0;
-		plot->p3 = 0;
-		plot->last_color = -1;
-		plot->info.last_line_x = -1;
-		plot->info.last_box_x = -1;
+static void restore_cursors(struct graph_info *ginfo, struct graph_render *render)
+{
+	struct pevent_record *record;
+	gint cpu;
 
-		gdk_draw_line(ginfo->curr_pixmap, ginfo->draw->style->black_gc,
-			      0, PLOT_LINE(i), new_width, PLOT_LINE(i));
+	for (cpu = 0; cpu < ginfo->cpus; cpu++) {
+		if (render->offsets[cpu])
+			tracecmd_set_cursor(ginfo->handle, cpu, render->offsets[cpu]);
+		else {
+			/* end of cpu, make sure it stays the end */
+			record = tracecmd_read_cpu_last(ginfo->handle, cpu);
+			free_record(record);
+		}
+	}
+}
 
-		trace_graph_plot_start(ginfo, plot, ginfo->view_start_time);
+/*
+ * Zoomed out, draw each pixel from the summary of the events it
+ * covers instead of reading them all. There is no room for event
+ * labels at this zoom, so they are not drawn.
+ *
+ * Returns TRUE when all the pixels are drawn.
+ */
+static gboolean draw_summary(struct graph_info *ginfo,
+			     struct graph_render *render)
+{
+	guint64 start, end;
+	gint last;
+	gint i;
 
-		set_color(ginfo->draw, plot->gc, plot->last_color);
+	last = render->x + RENDER_COLUMNS;
+	if (last > render->width)
+		last = render->width;
+
+	end = render->time;
+
+	for (; render->x < last; render->x++) {
+		start = end;
+		end = convert_x_to_time(ginfo, render->x + 1);
+		for (i = 0; i < ginfo->plots; i++)
+			draw_plot_summary(ginfo, ginfo->plot_array[i], start, end);
 	}
 
-	tracecmd_set_all_cpus_to_timestamp(ginfo->handle,
-					   ginfo->view_start_time);
+	render->time = end;
 
-	gettimeofday(&tv_start, NULL);
-	trace_set_cursor(GDK_WATCH);
+	if (render->x < render->width)
+		return FALSE;
 
-	/* Shortcut if we don't have any task plots */
-	if (!ginfo->nr_task_hash && !ginfo->all_recs) {
-		for (cpu = 0; cpu < ginfo->cpus; cpu++) {
-			hash = trace_graph_plot_find_cpu(ginfo, cpu);
-			if (!hash)
-				continue;
-
-			while ((record = tracecmd_read_data(ginfo->handle, cpu))) {
-				if (record->ts < ginfo->view_start_time) {
-					free_record(record);
-					continue;
-				}
-				if (record->ts > ginfo->view_end_time) {
-					free_record(record);
-					break;
-				}
+	for (i = 0; i < ginfo->plots; i++)
+		draw_plot_summary(ginfo, ginfo->plot_array[i], end, 0);
+
+	return TRUE;
+}
+
+/* Shortcut if we don't have any task plots, read one CPU at a time */
+static gboolean draw_cpu_records(struct graph_info *ginfo,
+				 struct graph_render *render)
+{
+	struct pevent_record *record;
+	struct plot_list *list;
+	struct plot_hash *hash;
+	gint count = 0;
+
+	for (; render->cpu < ginfo->cpus; render->cpu++) {
+		hash = trace_graph_plot_find_cpu(ginfo, render->cpu);
+		if (!hash)
+			continue;
+
+		while ((record = tracecmd_read_data(ginfo->handle, render->cpu))) {
+			if (record->ts > ginfo->view_end_time) {
+				free_record(record);
+				break;
+			}
+			if (record->ts >= ginfo->view_start_time) {
 				for (list = hash->plots; list; list = list->next)
 					draw_plot(ginfo, list->plot, record);
-				free_record(record);
 			}
+			free_record(record);
+			if (++count == RENDER_RECORDS)
+				return FALSE;
 		}
-		goto out;
 	}
 
+	return TRUE;
+}
+
+static gboolean draw_all_records(struct graph_info *ginfo,
+				 struct graph_render *render)
+{
+	struct pevent_record *record;
+	struct plot_list *list;
+	struct plot_hash *hash;
+	gint count = 0;
+	gint pid;
+	gint cpu;
+
 	while ((record = tracecmd_read_next_data(ginfo->handle, &cpu))) {
-		if (record->ts < ginfo->view_start_time) {
-			free_record(record);
-			continue;
-		}
 		if (record->ts > ginfo->view_end_time) {
 			free_record(record);
-			break;
+			return TRUE;
 		}
+		if (record->ts < ginfo->view_start_time)
+			goto next;
+
 		hash = trace_graph_plot_find_cpu(ginfo, cpu);
 		if (hash) {
 			for (list = hash->plots; list; list = list->next)
@@ -2005,27 +2303,314 @@ static void draw_plots(struct graph_info *ginfo, gint new_width)
 		}
 		for (list = ginfo->all_recs; list; list = list->next)
 			draw_plot(ginfo, list->plot, record);
+ next:
 		free_record(record);
+		if (++count == RENDER_RECORDS)
+			return FALSE;
 	}
 
-out:
+	return TRUE;
+}
+
+/* Draw the next batch, returns TRUE when the plots are all drawn */
+static gboolean render_batch(struct graph_info *ginfo,
+			     struct graph_render *render)
+{
+	gboolean done;
+	gint i;
+
+	if (!render->started) {
+		render->started = TRUE;
+		for (i = 0; i < ginfo->plots; i++)
+			trace_graph_plot_start(ginfo, ginfo->plot_array[i],
+					       ginfo->view_start_time);
+		/* Reads the rest of the trace if the summary is not built */
+		render->summary = trace_graph_summary_usable(ginfo, render->width);
+		if (!render->summary)
+			tracecmd_set_all_cpus_to_timestamp(ginfo->handle,
+							   ginfo->view_start_time);
+	} else if (!render->summary)
+		restore_cursors(ginfo, render);
+
+	if (render->summary)
+		return draw_summary(ginfo, render);
+
+	if (!ginfo->nr_task_hash && !ginfo->all_recs)
+		done = draw_cpu_records(ginfo, render);
+	else
+		done = draw_all_records(ginfo, render);
+
+	if (!done)
+		save_cursors(ginfo, render);
+
+	return done;
+}
+
+static void render_finish(struct graph_info *ginfo,
+			  struct graph_render *render)
+{
+	struct timeval tv_stop;
+	struct graph_plot *plot;
+	gint i;
+
 	for (i = 0; i < ginfo->plots; i++) {
 		plot = ginfo->plot_array[i];
-		draw_plot(ginfo, plot, NULL);
+		if (render->done && !render->summary)
+			draw_plot(ginfo, plot, NULL);
 		trace_graph_plot_end(ginfo, plot);
 		if (plot->gc)
 			gdk_gc_unref(plot->gc);
 		plot->gc = NULL;
 	}
-	trace_put_cursor();
+
+	if (!render->done)
+		return;
+
+	ginfo->read_comms = FALSE;
+
 	gettimeofday(&tv_stop, NULL);
-	if (tv_start.tv_usec > tv_stop.tv_usec) {
+	if (render->tv_start.tv_usec > tv_stop.tv_usec) {
 		tv_stop.tv_usec += 1000000;
 		tv_stop.tv_sec--;
 	}
 	if (TIME_DRAW)
-		printf("Time to draw: %ld.%06ld\n", tv_stop.tv_sec - tv_start.tv_sec,
-		       tv_stop.tv_usec - tv_start.tv_usec);
+		printf("Time to draw%s: %ld.%06ld\n",
+		       render->summary ? " (summary)" : "",
+		       tv_stop.tv_sec - render->tv_start.tv_sec,
+		       tv_stop.tv_usec - render->tv_start.tv_usec);
+}
+
+static void *render_thread(void *data)
+{
+	struct graph_info *ginfo = data;
+	struct graph_render *render = ginfo->render;
+	gboolean done = FALSE;
+	gboolean build;
+
+	/*
+	 * Zoomed out, the summary is built first. That reads the whole
+	 * trace, so it is done without the lock, a batch at a time, and
+	 * the first batch of the plots hands it over.
+	 */
+	gdk_threads_enter();
+	render_enter(ginfo, render);
+	build = trace_graph_summary_needed(ginfo, render->width);
+	render_leave(ginfo, render);
+	gdk_threads_leave();
+
+	while (build && !g_atomic_int_get(&render->cancel)) {
+		if (trace_graph_summary_build(ginfo, RENDER_RECORDS))
+			break;
+	}
+
+	while (!done) {
+		gdk_threads_enter();
+		if (render->cancel) {
+			gdk_threads_leave();
+			break;
+		}
+		render_enter(ginfo, render);
+		done = render_batch(ginfo, render);
+		if (done) {
+			render->done = TRUE;
+			render_finish(ginfo, render);
+		}
+		render_leave(ginfo, render);
+		if (done) {
+			render_store(ginfo, render);
+			gtk_widget_queue_draw(ginfo->draw);
+		}
+		gdk_threads_leave();
+	}
+
+	return NULL;
+}
+
+static gboolean render_blit(gpointer data)
+{
+	struct graph_info *ginfo = data;
+	struct graph_render *render = ginfo->render;
+
+	if (!render->done) {
+		render_show(ginfo, render);
+		gtk_widget_queue_draw(ginfo->draw);
+		return TRUE;
+	}
+
+	/* The thread has finished, reap it */
+	render->blit = 0;
+	trace_graph_render_stop(ginfo);
+
+	return FALSE;
+}
+
+/**
+ * trace_graph_render_stop - stop the drawing of the plots
+ * @ginfo: the graph info
+ *
+ * Must be called with the GDK lock held, before anything the drawing
+ * thread uses (the handle, the plots or the pixmap) is changed outside
+ * of the callback that starts the next draw. If the plots were not
+ * all drawn, they are left partially drawn.
+ */
+void trace_graph_render_stop(struct graph_info *ginfo)
+{
+	struct graph_render *render = ginfo->render;
+
+	if (!render || !render->running)
+		return;
+
+	/* The thread may be building the summary, without the lock */
+	g_atomic_int_set(&render->cancel, TRUE);
+
+	/* The thread needs the lock to see that it was cancelled */
+	gdk_threads_leave();
+	pthread_join(render->thread, NULL);
+	gdk_threads_enter();
+
+	if (!render->done) {
+		render_enter(ginfo, render);
+		render_finish(ginfo, render);
+		render_leave(ginfo, render);
+	}
+
+	g_object_unref(render->pixmap);
+	render->pixmap = NULL;
+
+	if (render->blit)
+		g_source_remove(render->blit);
+	render->blit = 0;
+	render->running = FALSE;
+
+	trace_put_cursor();
+}
+
+static void render_free(struct graph_info *ginfo)
+{
+	struct graph_render *render = ginfo->render;
+
+	if (!render)
+		return;
+
+	trace_graph_render_stop(ginfo);
+	free(render->offsets);
+	free(render);
+	ginfo->render = NULL;
+}
+
+static void draw_plots(struct graph_info *ginfo, gint new_width)
+{
+	struct graph_render *render;
+	struct graph_plot *plot;
+	struct graph_tile *tile;
+	gint height = ginfo->draw->allocation.height;
+	gint first, last;
+	gint start, end;
+	gint x0;
+	gint i;
+
+	if (height <= TILE_TOP || new_width <= 0)
+		return;
+
+	tiles_check(ginfo, height);
+
+	/* The pixel of the view start, counted from the start of the trace */
+	x0 = (ginfo->view_start_time - ginfo->start_time) * ginfo->resolution;
+	first = x0 / TILE_WIDTH;
+	last = (x0 + new_width - 1) / TILE_WIDTH;
+
+	/* Copy the tiles that are cached, and find the span to draw */
+	start = -1;
+	end = -1;
+	for (i = first; i <= last; i++) {
+		tile = tiles_find(ginfo, i);
+		if (!tile) {
+			if (start < 0)
+				start = i;
+			end = i;
+			continue;
+		}
+		gdk_draw_drawable(ginfo->curr_pixmap, ginfo->draw->style->black_gc,
+				  tile->pixmap, 0, 0, i * TILE_WIDTH - x0, TILE_TOP,
+				  TILE_WIDTH, height - TILE_TOP);
+	}
+
+	if (start < 0)
+		return;
+
+	render = ginfo->render;
+	if (!render) {
+		render = malloc_or_die(sizeof(*render));
+		memset(render, 0, sizeof(*render));
+		render->offsets = malloc_or_die(sizeof(*render->offsets) *
+						ginfo->cpus);
+		ginfo->render = render;
+	}
+
+	render->first_tile = start;
+	render->nr_tiles = end - start + 1;
+	render->width = render->nr_tiles * TILE_WIDTH;
+	render->span_x = start * TILE_WIDTH - x0;
+	render->span_start = ginfo->start_time +
+		(gdouble)start * TILE_WIDTH / ginfo->resolution;
+	render->span_end = ginfo->start_time +
+		(gdouble)(end + 1) * TILE_WIDTH / ginfo->resolution;
+
+	render->pixmap = gdk_pixmap_new(ginfo->draw->window,
+					render->width, height, -1);
+	gdk_draw_rectangle(render->pixmap, ginfo->draw->style->white_gc,
+			   TRUE, 0, 0, render->width, height);
+
+	/* Initialize plots */
+	for (i = 0; i < ginfo->plots; i++) {
+		plot = ginfo->plot_array[i];
+
+		if (!plot->gc)
+			plot->gc = gdk_gc_new(ginfo->draw->window);
+		plot->p1 = 0;
+		plot->p2 = 0;
+		plot->p3 = 0;
+		plot->last_color = -1;
+		plot->info.last_line_x = -1;
+		plot->info.last_box_x = -1;
+
+		gdk_draw_line(render->pixmap, ginfo->draw->style->black_gc,
+			      0, PLOT_LINE(i), render->width, PLOT_LINE(i));
+
+		set_color(ginfo->draw, plot->gc, plot->last_color);
+	}
+
+	render->running = TRUE;
+	render->cancel = FALSE;
+	render->done = FALSE;
+	render->started = FALSE;
+	render->summary = FALSE;
+	render->x = 0;
+	render->cpu = 0;
+	render->time = render->span_start;
+
+	gettimeofday(&render->tv_start, NULL);
+	trace_set_cursor(GDK_WATCH);
+
+	if (!pthread_create(&render->thread, NULL, render_thread, ginfo)) {
+		render->blit = gdk_threads_add_timeout(RENDER_BLIT_MS,
+						       render_blit, ginfo);
+		return;
+	}
+
+	/* No thread, draw it all now */
+	render_enter(ginfo, render);
+	while (!render_batch(ginfo, render))
+		;
+	render->done = TRUE;
+	render_finish(ginfo, render);
+	render_leave(ginfo, render);
+	render_store(ginfo, render);
+
+	g_object_unref(render->pixmap);
+	render->pixmap = NULL;
+	render->running = FALSE;
+	trace_put_cursor();
 }
 
 
@@ -2131,8 +2716,6 @@ static void draw_info(struct graph_info *ginfo,
 	draw_timeline(ginfo, new_width);
 
 	draw_plots(ginfo, new_width);
-
-	ginfo->read_comms = FALSE;
 }
 
 void trace_graph_select_by_time(struct graph_info *ginfo, guint64 time)
@@ -2317,6 +2900,9 @@ static void redraw_pixmap_backend(struct graph_info *ginfo)
 	GdkPixmap *old_pix;
 	static gboolean init;
 
+	/* The drawing thread uses the current pixmap */
+	trace_graph_render_stop(ginfo);
+
 	old_pix = ginfo->curr_pixmap;
 
 	/* initialize full width if needed */
@@ -2514,8 +3100,13 @@ static void free_int_array(int **array)
 
 void trace_graph_free_info(struct graph_info *ginfo)
 {
+	render_free(ginfo);
+	tiles_free(ginfo);
+
 	if (ginfo->handle) {
 		pevent_filter_free(ginfo->event_filter);
+		trace_graph_summary_free(ginfo);
+		graph_plot_task_free_index(ginfo);
 		trace_graph_plot_free(ginfo);
 		tracecmd_close(ginfo->handle);
 		free_task_hash(ginfo);
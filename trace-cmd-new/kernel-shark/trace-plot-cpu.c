@@ -310,6 +310,52 @@ static int cpu_plot_event(struct graph_info *ginfo,
 	return ret;
 }
 
+static int cpu_plot_summary(struct graph_info *ginfo,
+			    struct graph_plot *plot,
+			    unsigned long long start,
+			    unsigned long long end)
+{
+	struct cpu_plot_info *cpu_info = plot->private;
+	struct plot_info *info = &plot->info;
+	struct graph_bucket bucket;
+	int pid;
+
+	if (!end) {
+		/* Finish a box if the last pixel was not idle */
+		if (cpu_info->last_pid > 0) {
+			info->box = TRUE;
+			info->bstart = cpu_info->last_time;
+			info->bend = ginfo->view_end_time;
+			info->bcolor = hash_pid(cpu_info->last_pid);
+		}
+		return 0;
+	}
+
+	trace_graph_summary_cpu(ginfo, cpu_info->cpu, start, end, &bucket);
+
+	/* The pixel shows the task that ran the longest in it */
+	pid = bucket.busy ? bucket.dominant : 0;
+
+	if (cpu_info->last_pid != pid) {
+		if (cpu_info->last_pid > 0) {
+			info->box = TRUE;
+			info->bstart = cpu_info->last_time;
+			info->bend = start;
+			info->bcolor = hash_pid(cpu_info->last_pid);
+		}
+		cpu_info->last_pid = pid;
+		cpu_info->last_time = start;
+	}
+
+	if (trace_graph_summary_shown(ginfo, &bucket)) {
+		info->line = TRUE;
+		info->ltime = start;
+		info->lcolor = hash_pid(pid);
+	}
+
+	return 1;
+}
+
 static struct pevent_record *
 find_record_on_cpu(struct graph_info *ginfo, gint cpu, guint64 time)
 {
@@ -446,6 +492,7 @@ static void cpu_plot_destroy(struct graph_info *ginfo, struct graph_plot *plot)
 static const struct plot_callbacks cpu_plot_cb = {
 	.match_time		= cpu_plot_match_time,
 	.plot_event		= cpu_plot_event,
+	.plot_summary		= cpu_plot_summary,
 	.start			= cpu_plot_start,
 	.display_last_event	= cpu_plot_display_last_event,
 	.find_record		= cpu_plot_find_record,
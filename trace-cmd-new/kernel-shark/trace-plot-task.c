@@ -96,72 +96,6 @@ static gboolean record_matches_pid(struct graph_info *ginfo,
 	return FALSE;
 }
 
-static void set_cpu_to_time(int cpu, struct graph_info *ginfo, unsigned long long time)
-{
-	struct pevent_record *record;
-
-	tracecmd_set_cpu_to_timestamp(ginfo->handle, cpu, time);
-
-	while ((record = tracecmd_read_data(ginfo->handle, cpu))) {
-		if (record->ts >= time)
-			break;
-
-		free_record(record);
-	}
-	if (record) {
-		tracecmd_set_cursor(ginfo->handle, cpu, record->offset);
-		free_record(record);
-	} else
-		tracecmd_set_cpu_to_timestamp(ginfo->handle, cpu, time);
-}
-
-static void set_cpus_to_time(struct graph_info *ginfo, unsigned long long time)
-{
-	int cpu;
-
-	for (cpu = 0; cpu < ginfo->cpus; cpu++)
-		set_cpu_to_time(cpu, ginfo, time);
-}
-
-static int task_plot_match_time(struct graph_info *ginfo, struct graph_plot *plot,
-			       unsigned long long time)
-{
-	struct task_plot_info *task_info = plot->private;
-	struct pevent_record *record = NULL;
-	gboolean is_wakeup;
-	gboolean is_sched;
-	gboolean match;
-	int rec_pid;
-	int sched_pid;
-	int next_cpu;
-	int pid;
-	int ret = 0;
-
-	pid = task_info->pid;
-
-	set_cpus_to_time(ginfo, time);
-
-	do {
-		free_record(record);
-
-		record = tracecmd_read_next_data(ginfo->handle, &next_cpu);
-		if (!record)
-			return 0;
-
-		match = record_matches_pid(ginfo, record, pid, &rec_pid,
-					   &sched_pid, &is_sched, &is_wakeup);
-
-		/* Use +1 to make sure we have a match first */
-	} while ((!match && record->ts < time + 1) ||
-		 (match && record->ts < time));
-
-	if (record && record->ts == time)
-		ret = 1;
-	free_record(record);
-
-	return ret;
-}
-
 struct offset_cache {
 	guint64 *offsets;
 };
@@ -204,34 +138,243 @@ static void restore_offsets(struct graph_info *ginfo, struct offset_cache *offse
 	free(offsets);
 }
 
-static struct pevent_record *
-find_record(struct graph_info *ginfo, gint pid, guint64 time)
+/*
+ * The records that match each task (see record_matches_pid()) are
+ * indexed per CPU in time order the first time they are needed, so
+ * that finding the records of a task around a given time is a binary
+ * search instead of walking the trace.
+ */
+struct task_index_entry {
+	unsigned long long	ts;
+	unsigned long long	offset;
+};
+
+struct task_cpu_index {
+	struct task_index_entry	*entries;
+	int			nr_entries;
+	int			alloced;
+};
+
+struct task_index {
+	struct task_index	*next;
+	int			pid;
+	struct task_cpu_index	*cpus;
+};
+
+static struct task_index *
+find_task_index(struct graph_info *ginfo, int pid, gboolean create)
 {
-	struct pevent_record *record = NULL;
-	gboolean is_wakeup;
-	gboolean is_sched;
-	gboolean match;
+	struct task_index *index;
+	guint key;
+
+	key = trace_hash(pid) % TASK_HASH_SIZE;
+
+	for (index = ginfo->task_index[key]; index; index = index->next) {
+		if (index->pid == pid)
+			return index;
+	}
+
+	if (!create)
+		return NULL;
+
+	index = malloc_or_die(sizeof(*index));
+	index->pid = pid;
+	index->cpus = malloc_or_die(sizeof(*index->cpus) * ginfo->cpus);
+	memset(index->cpus, 0, sizeof(*index->cpus) * ginfo->cpus);
+	index->next = ginfo->task_index[key];
+	ginfo->task_index[key] = index;
+
+	return index;
+}
+
+static void add_index_entry(struct graph_info *ginfo, int pid,
+			    struct pevent_record *record)
+{
+	struct task_cpu_index *cpu_index;
+	struct task_index_entry *entry;
+
+	cpu_index = &find_task_index(ginfo, pid, TRUE)->cpus[record->cpu];
+
+	if (cpu_index->nr_entries == cpu_index->alloced) {
+		cpu_index->alloced = cpu_index->alloced ? cpu_index->alloced * 2 : 16;
+		cpu_index->entries = realloc(cpu_index->entries,
+					     sizeof(*cpu_index->entries) *
+					     cpu_index->alloced);
+		if (!cpu_index->entries)
+			die("unable to grow task index");
+	}
+
+	entry = &cpu_index->entries[cpu_index->nr_entries++];
+	entry->ts = record->ts;
+	entry->offset = record->offset;
+}
+
+static void load_task_index(struct graph_info *ginfo)
+{
+	struct pevent_record *record;
+	struct offset_cache *offsets;
+	const char *comm;
 	int sched_pid;
-	int rec_pid;
-	int next_cpu;
+	int pid;
+	int cpu;
+
+	if (ginfo->task_index_loaded)
+		return;
 
-	set_cpus_to_time(ginfo, time);
+	/* This may be called while plotting, keep the CPU cursors */
+	offsets = save_offsets(ginfo);
+
+	tracecmd_set_all_cpus_to_timestamp(ginfo->handle, ginfo->start_time);
+
+	while ((record = tracecmd_read_next_data(ginfo->handle, &cpu))) {
+		pid = pevent_data_pid(ginfo->pevent, record);
+		add_index_entry(ginfo, pid, record);
+
+		if (trace_graph_check_sched_switch(ginfo, record, &sched_pid, &comm)) {
+			if (sched_pid != pid)
+				add_index_entry(ginfo, sched_pid, record);
+		} else if (trace_graph_check_sched_wakeup(ginfo, record, &sched_pid) &&
+			   sched_pid != pid)
+			add_index_entry(ginfo, sched_pid, record);
 
-	do {
 		free_record(record);
+	}
+
+	restore_offsets(ginfo, offsets);
+
+	ginfo->task_index_loaded = TRUE;
+}
+
+/**
+ * graph_plot_task_free_index - free the index of the task records
+ * @ginfo: the graph info structure
+ */
+void graph_plot_task_free_index(struct graph_info *ginfo)
+{
+	struct task_index *index;
+	int cpu;
+	int i;
+
+	for (i = 0; i < TASK_HASH_SIZE; i++) {
+		while ((index = ginfo->task_index[i])) {
+			ginfo->task_index[i] = index->next;
+			for (cpu = 0; cpu < ginfo->cpus; cpu++)
+				free(index->cpus[cpu].entries);
+			free(index->cpus);
+			free(index);
+		}
+	}
+
+	ginfo->task_index_loaded = FALSE;
+}
+
+static struct task_cpu_index *
+get_task_cpu_index(struct graph_info *ginfo, int pid, int cpu)
+{
+	struct task_index *index;
+
+	load_task_index(ginfo);
+
+	index = find_task_index(ginfo, pid, FALSE);
+	if (!index || !index->cpus[cpu].nr_entries)
+		return NULL;
+
+	return &index->cpus[cpu];
+}
+
+/* Returns the position of the first entry at or after @ts */
+static int find_index_entry(struct task_cpu_index *cpu_index,
+			    unsigned long long ts)
+{
+	int lo = 0;
+	int hi = cpu_index->nr_entries;
+	int mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (cpu_index->entries[mid].ts < ts)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* Returns the first entry of @pid at or after @ts on any CPU */
+static struct task_index_entry *
+next_task_entry(struct graph_info *ginfo, int pid, unsigned long long ts)
+{
+	struct task_index_entry *next = NULL;
+	struct task_cpu_index *cpu_index;
+	int pos;
+	int cpu;
+
+	for (cpu = 0; cpu < ginfo->cpus; cpu++) {
+		cpu_index = get_task_cpu_index(ginfo, pid, cpu);
+		if (!cpu_index)
+			continue;
+
+		pos = find_index_entry(cpu_index, ts);
+		if (pos < cpu_index->nr_entries &&
+		    (!next || cpu_index->entries[pos].ts < next->ts))
+			next = &cpu_index->entries[pos];
+	}
+
+	return next;
+}
+
+/*
+ * Returns the last entry of @pid before @ts on any CPU, skipping
+ * the CPUs that have a record in @skip_cpus.
+ */
+static struct task_index_entry *
+prev_task_entry(struct graph_info *ginfo, int pid, unsigned long long ts,
+		struct pevent_record **skip_cpus)
+{
+	struct task_index_entry *prev = NULL;
+	struct task_cpu_index *cpu_index;
+	int pos;
+	int cpu;
+
+	for (cpu = 0; cpu < ginfo->cpus; cpu++) {
+		if (skip_cpus && skip_cpus[cpu])
+			continue;
+
+		cpu_index = get_task_cpu_index(ginfo, pid, cpu);
+		if (!cpu_index)
+			continue;
+
+		pos = find_index_entry(cpu_index, ts) - 1;
+		if (pos >= 0 &&
+		    (!prev || cpu_index->entries[pos].ts > prev->ts))
+			prev = &cpu_index->entries[pos];
+	}
+
+	return prev;
+}
+
+static int task_plot_match_time(struct graph_info *ginfo, struct graph_plot *plot,
+			       unsigned long long time)
+{
+	struct task_plot_info *task_info = plot->private;
+	struct task_index_entry *entry;
 
-		record = tracecmd_read_next_data(ginfo->handle, &next_cpu);
-		if (!record)
-			return NULL;
+	entry = next_task_entry(ginfo, task_info->pid, time);
 
-		match = record_matches_pid(ginfo, record, pid, &rec_pid,
-					   &sched_pid,  &is_sched, &is_wakeup);
+	return entry && entry->ts == time;
+}
 
-		/* Use +1 to make sure we have a match first */
-	} while (!(record->ts > time && match));
+/* Returns the first record of @pid after @time */
+static struct pevent_record *
+find_record(struct graph_info *ginfo, gint pid, guint64 time)
+{
+	struct task_index_entry *entry;
 
+	entry = next_task_entry(ginfo, pid, time + 1);
+	if (!entry)
+		return NULL;
 
-	return record;
+	return tracecmd_read_at(ginfo->handle, entry->offset, NULL);
 }
 
 static int task_plot_display_last_event(struct graph_info *ginfo,
@@ -355,82 +498,51 @@ static void update_last_record(struct graph_info *ginfo,
 			       struct task_plot_info *task_info,
 			       struct pevent_record *record)
 {
-	struct tracecmd_input *handle = ginfo->handle;
-	struct pevent_record *trecord, *t2record;
-	struct pevent_record *saved;
+	struct task_index_entry *entry;
+	struct offset_cache *offsets;
+	struct pevent_record *trecord;
 	unsigned long long ts;
 	int sched_pid;
 	int pid;
 	int rec_pid;
 	int is_wakeup;
 	int is_sched;
-	int this_cpu;
-	int cpu;
 
 	pid = task_info->pid;
 
-	if (record) {
+	if (record)
 		ts = record->ts;
-		this_cpu = record->cpu;
-	} else {
+	else
 		ts = ginfo->view_end_time;
-		this_cpu = -1;
-	}
-
-	for (cpu = 0; cpu < ginfo->cpus; cpu++) {
-
-		if (task_info->last_records[cpu])
-			continue;
 
-		if (cpu == this_cpu) {
-			static int once;
+	/*
+	 * The last record of the task before this one tells if it
+	 * was running, on the CPUs that have not been seen yet.
+	 */
+	entry = prev_task_entry(ginfo, pid, ts, task_info->last_records);
+	if (!entry)
+		return;
 
-			trecord = tracecmd_read_prev(handle, record);
-			/* Set cpu cursor back to what it was  */
-			saved = tracecmd_read_data(handle, cpu);
-			if (!once && saved->offset != record->offset) {
-				once++;
-				warning("failed to reset cursor!");
-			}
-			free_record(saved);
-		} else {
-			static int once;
-
-			saved = tracecmd_read_data(handle, cpu);
-			set_cpu_to_time(cpu, ginfo, ts);
-			t2record = tracecmd_read_data(handle, cpu);
-			trecord = tracecmd_read_prev(handle, t2record);
-			free_record(t2record);
-			/* reset cursor back to what it was */
-			if (saved) {
-				tracecmd_set_cursor(handle, cpu, saved->offset);
-				free_record(saved);
-			} else {
-				saved = tracecmd_read_data(handle, cpu);
-				if (!once && saved) {
-					once++;
-					warning("failed to reset cursor to end!");
-				}
-				/* saved should always be NULL */
-				free_record(saved);
-			}
-		}
-		if (!trecord)
-			continue;
+	/* Reading the record moves its CPU cursor, which the plotter uses */
+	offsets = save_offsets(ginfo);
+	trecord = tracecmd_read_at(ginfo->handle, entry->offset, NULL);
+	restore_offsets(ginfo, offsets);
 
-		if (record_matches_pid(ginfo, trecord, pid, &rec_pid,
-				       &sched_pid, &is_sched, &is_wakeup) &&
-		    !is_wakeup &&
-		    (!is_sched || (is_sched && sched_pid == pid))) {
-			task_info->last_records[cpu] = trecord;
-			task_info->last_cpu = trecord->cpu;
-			task_info->last_time = trecord->ts;
-			task_info->in_irq = record_is_interrupt(ginfo, trecord, TRUE);
-			break;
-		}
+	if (!trecord)
+		return;
 
-		free_record(trecord);
+	if (record_matches_pid(ginfo, trecord, pid, &rec_pid,
+			       &sched_pid, &is_sched, &is_wakeup) &&
+	    !is_wakeup &&
+	    (!is_sched || (is_sched && sched_pid == pid))) {
+		task_info->last_records[trecord->cpu] = trecord;
+		task_info->last_cpu = trecord->cpu;
+		task_info->last_time = trecord->ts;
+		task_info->in_irq = record_is_interrupt(ginfo, trecord, TRUE);
+		return;
 	}
+
+	free_record(trecord);
 }
 
 static int task_plot_event(struct graph_info *ginfo,
@@ -604,69 +716,69 @@ static int task_plot_event(struct graph_info *ginfo,
 	return 1;
 }
 
-
-static struct pevent_record *
-task_plot_find_record(struct graph_info *ginfo, struct graph_plot *plot,
-		      unsigned long long time)
+static int task_plot_summary(struct graph_info *ginfo,
+			     struct graph_plot *plot,
+			     unsigned long long start,
+			     unsigned long long end)
 {
 	struct task_plot_info *task_info = plot->private;
-	int pid;
-
-	pid = task_info->pid;
-
-	return find_record(ginfo, pid, time);
-}
+	struct plot_info *info = &plot->info;
+	struct graph_bucket bucket;
+	int cpu;
 
-#define MAX_SEARCH 20
+	if (!end) {
+		/* Finish a box if the task was running at the end */
+		if (task_info->last_cpu >= 0) {
+			info->box = TRUE;
+			info->bstart = task_info->last_time;
+			info->bend = ginfo->view_end_time;
+			info->bcolor = hash_cpu(task_info->last_cpu);
+		}
+		return 0;
+	}
 
-static struct pevent_record *
-find_previous_record(struct graph_info *ginfo, struct pevent_record *start_record,
-		     int pid, int cpu)
-{
-	struct pevent_record *last_record = start_record;
-	struct pevent_record *record;
-	gboolean match;
-	gboolean is_sched;
-	gboolean is_wakeup;
-	gint rec_pid;
-	gint sched_pid;
-	int count = 0;
+	trace_graph_summary_task(ginfo, task_info->pid, start, end, &bucket);
 
-	if (last_record)
-		last_record->ref_count++;
-	else
-		last_record = tracecmd_read_cpu_last(ginfo->handle, cpu);
+	/* The pixel shows the CPU the task ran the longest on */
+	cpu = bucket.busy ? bucket.dominant : -1;
 
-	while ((record = tracecmd_read_prev(ginfo->handle, last_record))) {
-		count++;
+	if (task_info->last_cpu != cpu) {
+		if (task_info->last_cpu >= 0) {
+			info->box = TRUE;
+			info->bstart = task_info->last_time;
+			info->bend = start;
+			info->bcolor = hash_cpu(task_info->last_cpu);
+		}
+		task_info->last_cpu = cpu;
+		task_info->last_time = start;
+	}
 
-		match = record_matches_pid(ginfo, record, pid, &rec_pid,
-					   &sched_pid, &is_sched, &is_wakeup);
-		if (match)
-			break;
+	if (bucket.count) {
+		info->line = TRUE;
+		info->ltime = start;
+		info->lcolor = hash_pid(task_info->pid);
+	}
 
-		free_record(last_record);
+	return 1;
+}
 
-		if (count > MAX_SEARCH) {
-			free_record(record);
-			return NULL;
-		}
-		last_record = record;
-	}
+static struct pevent_record *
+task_plot_find_record(struct graph_info *ginfo, struct graph_plot *plot,
+		      unsigned long long time)
+{
+	struct task_plot_info *task_info = plot->private;
+	int pid;
 
-	free_record(last_record);
+	pid = task_info->pid;
 
-	return record;
+	return find_record(ginfo, pid, time);
 }
 
 static struct pevent_record *
 get_display_record(struct graph_info *ginfo, int pid, unsigned long long time)
 {
+	struct task_index_entry *entry;
 	struct pevent_record *record;
-	struct pevent_record **records;
-	unsigned long long ts;
-	int next_cpu;
-	int cpu;
 
 	record = find_record(ginfo, pid, time);
 
@@ -674,58 +786,14 @@ get_display_record(struct graph_info *ginfo, int pid, unsigned long long time)
 	if (record && record->ts < time + (1 / ginfo->resolution))
 		return record;
 
-	if (record) {
-		tracecmd_set_cursor(ginfo->handle, record->cpu,
-				    record->offset);
-		free_record(record);
-	}
-
-	/* find a previous record */
-	records = malloc_or_die(sizeof(*records) * ginfo->cpus);
-	for (cpu = 0; cpu < ginfo->cpus; cpu++) {
-		record = tracecmd_read_data(ginfo->handle, cpu);
-		records[cpu] = find_previous_record(ginfo, record,
-						    pid, cpu);
-		free_record(record);
-	}
-
-	record = NULL;
-	for (;;) {
-		ts = 0;
-		next_cpu = -1;
-
-		for (cpu = 0; cpu < ginfo->cpus; cpu++) {
-			if (!records[cpu])
-				continue;
-			if (records[cpu]->ts > ts) {
-				ts = records[cpu]->ts;
-				next_cpu = cpu;
-			}
-		}
-
-		if (next_cpu < 0)
-			break;
-
-		if (records[next_cpu]->ts < time + (2 / ginfo->resolution)) {
-			record = records[next_cpu];
-			break;
-		}
-
-		record = find_previous_record(ginfo, records[next_cpu],
-					      pid, next_cpu);
-		free_record(records[next_cpu]);
-		records[next_cpu] = record;
-		record = NULL;
-	}
+	free_record(record);
 
-	for (cpu = 0; cpu < ginfo->cpus; cpu++) {
-		if (records[cpu] == record)
-			continue;
-		free_record(records[cpu]);
-	}
-	free(records);
+	/* Otherwise use the last record before it */
+	entry = prev_task_entry(ginfo, pid, time + (2 / ginfo->resolution), NULL);
+	if (!entry)
+		return NULL;
 
-	return record;
+	return tracecmd_read_at(ginfo->handle, entry->offset, NULL);
 }
 
 int task_plot_display_info(struct graph_info *ginfo,
@@ -803,6 +871,7 @@ void task_plot_destroy(struct graph_info *ginfo, struct graph_plot *plot)
 static const struct plot_callbacks task_plot_cb = {
 	.match_time		= task_plot_match_time,
 	.plot_event		= task_plot_event,
+	.plot_summary		= task_plot_summary,
 	.start			= task_plot_start,
 	.display_last_event	= task_plot_display_last_event,
 	.find_record		= task_plot_find_record,
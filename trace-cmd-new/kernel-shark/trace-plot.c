@@ -47,6 +47,9 @@ allocate_plot(struct graph_info *ginfo,
 	struct graph_plot *plot;
 	char *name;
 
+	/* The plots can not change under the drawing thread */
+	trace_graph_render_stop(ginfo);
+
 	name = strdup(label);
 	if (!name)
 		die("Unable to allocate label");
@@ -135,6 +138,8 @@ void trace_graph_plot_remove(struct graph_info *ginfo, struct graph_plot *plot)
 	int pos = plot->pos;
 	int i;
 
+	trace_graph_render_stop(ginfo);
+
 	if (plot->cb->destroy)
 		plot->cb->destroy(ginfo, plot);
 
@@ -340,6 +345,23 @@ int trace_graph_plot_event(struct graph_info *ginfo,
 	return plot->cb->plot_event(ginfo, plot, record);
 }
 
+int trace_graph_plot_summary(struct graph_info *ginfo,
+			     struct graph_plot *plot,
+			     unsigned long long start,
+			     unsigned long long end)
+{
+	struct plot_info *info = &plot->info;
+
+	info->line = FALSE;
+	info->box = FALSE;
+	info->bfill = TRUE;
+
+	if (!plot->cb->plot_summary)
+		return 0;
+
+	return plot->cb->plot_summary(ginfo, plot, start, end);
+}
+
 void trace_graph_plot_end(struct graph_info *ginfo,
 			  struct graph_plot *plot)
 {
@@ -12,6 +12,18 @@
 
 #include "cpu.h"
 #include "trace-filter.h"
+#include "trace-hash-local.h"
+
+/* The records of the page that show a task, to only refilter those */
+struct trace_view_task_rows {
+	struct trace_view_task_rows	*next;
+	gint				pid;
+	gint				nr_rows;
+	gint				alloced;
+	TraceViewRecord			**rows;
+};
+
+static void free_task_rows(TraceViewStore *store);
 
 /* boring declarations of local functions */
 
@@ -209,13 +221,24 @@ trace_view_store_finalize (GObject *object)
 
 	/* free all records and free all memory used by the list */
 
-	for (cpu = 0; cpu < store->cpus; cpu++)
+	for (cpu = 0; cpu < store->cpus; cpu++) {
 		g_free(store->cpu_list[cpu]);
+		g_free(store->cpu_index_rows[cpu]);
+		free(store->cpu_index[cpu]);
+	}
 
 	g_free(store->cpu_list);
 	g_free(store->cpu_mask);
 	g_free(store->rows);
 	g_free(store->cpu_items);
+	g_free(store->cpu_alloced);
+	g_free(store->cpu_before);
+	g_free(store->cpu_index);
+	g_free(store->cpu_index_pages);
+	g_free(store->cpu_index_rows);
+	g_free(store->page_ts);
+
+	free_task_rows(store);
 
 	tracecmd_filter_id_hash_free(store->task_filter);
 
@@ -563,7 +586,7 @@ trace_view_store_iter_next (GtkTreeModel	*tree_model,
 	if ((pos + 1) >= trace_view_store->num_rows)
 		return FALSE;
 
-	nextrecord = trace_view_store->rows[(record->pos + 1)];
+	nextrecord = trace_view_store->rows[pos + 1];
 
 	g_assert ( nextrecord != NULL );
 	g_assert ( nextrecord->pos == (record->pos + 1) );
@@ -697,7 +720,7 @@ trace_view_store_iter_nth_child (GtkTreeModel *tree_model,
 	if( n >= trace_view_store->num_rows )
 		return FALSE;
 
-	record = trace_view_store->rows[trace_view_store->start_row + n];
+	record = trace_view_store->rows[n];
 
 	g_assert( record != NULL );
 	g_assert( record->pos - trace_view_store->start_row == n );
@@ -756,7 +779,7 @@ static void update_page(TraceViewStore *store)
 
 /*****************************************************************************
  *
- *	merge_sort_rows_ts: Merge sort the data by time stamp.
+ *	merge_sort_rows_ts: Merge sort the data of the page by time stamp.
  *	
  *
  *****************************************************************************/
@@ -773,6 +796,13 @@ static void merge_sort_rows_ts(TraceViewStore *store)
 
 	indexes = g_new0(guint, store->cpus);
 
+	/* The rows before the page are counted from the index */
+	store->start_row = 0;
+	for (cpu = 0; cpu < store->cpus; cpu++) {
+		if (store->all_cpus || mask_cpu_isset(store, cpu))
+			store->start_row += store->cpu_before[cpu];
+	}
+
 	/* Now sort these by timestamp */
 	do {
 		next = -1;
@@ -800,33 +830,296 @@ static void merge_sort_rows_ts(TraceViewStore *store)
 		if (next >= 0) {
 			i = indexes[next]++;
 			store->rows[count] = &store->cpu_list[next][i];
-			store->cpu_list[next][i].pos = count++;
+			store->cpu_list[next][i].pos = store->start_row + count++;
 		}
 	} while (next >= 0);
 
 	store->visible_rows = count;
-	store->start_row = 0;
-	store->pages = (count / store->rows_per_page) + 1;
+	store->num_rows = count;
+
+	update_page(store);
+
+	g_free(indexes);
+}
+
+static void init_sched_events(TraceViewStore *store)
+{
+	struct pevent *pevent;
+
+	if (store->sched_switch_event)
+		return;
+
+	pevent = tracecmd_get_pevent(store->handle);
+
+	store->sched_switch_event =
+		pevent_find_event_by_name(pevent, "sched", "sched_switch");
+	if (store->sched_switch_event)
+		store->sched_switch_next_field =
+			pevent_find_any_field(store->sched_switch_event,
+					      "next_pid");
+	store->sched_wakeup_event =
+		pevent_find_event_by_name(pevent, "sched", "sched_wakeup");
+	if (store->sched_wakeup_event)
+		store->sched_wakeup_pid_field =
+			pevent_find_any_field(store->sched_wakeup_event,
+					      "pid");
+
+	store->sched_wakeup_new_event =
+		pevent_find_event_by_name(pevent, "sched", "sched_wakeup_new");
+	if (store->sched_wakeup_new_event)
+		store->sched_wakeup_new_pid_field =
+			pevent_find_any_field(store->sched_wakeup_new_event,
+					      "pid");
+}
+
+/*****************************************************************************
+ *
+ *	load_index: Read the index of the trace pages, and split the trace
+ *	into pages of about rows_per_page rows, at the start of a trace page.
+ *	Page p holds the records from page_ts[p - 2] up to page_ts[p - 1].
+ *
+ *****************************************************************************/
+
+struct index_page {
+	guint64		ts;
+	guint		nr_records;
+};
+
+static int index_page_cmp(const void *a, const void *b)
+{
+	const struct index_page *pa = a;
+	const struct index_page *pb = b;
+
+	if (pa->ts < pb->ts)
+		return -1;
+	return pa->ts > pb->ts;
+}
+
+static void load_index(TraceViewStore *store)
+{
+	struct tracecmd_page_index *index;
+	struct index_page *pages;
+	guint rows = 0;
+	gint nr_pages = 0;
+	gint cpu;
+	gint i;
 
-	if (store->page > 1) {
-		if (count < store->page * store->rows_per_page)
-			store->page = store->pages;
+	store->pages = 1;
 
-		/* still greater? */
-		if (store->page > 1) {
-			store->start_row =
-				(store->page - 1) * store->rows_per_page;
-			g_assert(store->start_row < count);
+	/* Without an index, the only page holds all the records */
+	if (tracecmd_read_page_index(store->handle, store->cpu_index,
+				     store->cpu_index_pages) < 0)
+		return;
+
+	store->actual_rows = 0;
+	for (cpu = 0; cpu < store->cpus; cpu++) {
+		store->cpu_index_rows[cpu] = g_new(guint, store->cpu_index_pages[cpu]);
+		rows = 0;
+		for (i = 0; i < store->cpu_index_pages[cpu]; i++) {
+			store->cpu_index_rows[cpu][i] = rows;
+			rows += store->cpu_index[cpu][i].nr_records;
 		}
+		store->actual_rows += rows;
+		nr_pages += store->cpu_index_pages[cpu];
 	}
 
-	store->num_rows = count > (store->start_row + store->rows_per_page) ?
-		store->rows_per_page :
-		count - store->start_row;
+	pages = g_new(struct index_page, nr_pages);
+	nr_pages = 0;
+	for (cpu = 0; cpu < store->cpus; cpu++) {
+		index = store->cpu_index[cpu];
+		for (i = 0; i < store->cpu_index_pages[cpu]; i++) {
+			if (!index[i].nr_records)
+				continue;
+			pages[nr_pages].ts = index[i].ts;
+			pages[nr_pages++].nr_records = index[i].nr_records;
+		}
+	}
 
-	update_page(store);
+	qsort(pages, nr_pages, sizeof(*pages), index_page_cmp);
+
+	rows = 0;
+	for (i = 0; i < nr_pages; i++) {
+		if (rows && rows + pages[i].nr_records > store->rows_per_page &&
+		    (store->pages == 1 ||
+		     store->page_ts[store->pages - 2] != pages[i].ts)) {
+			store->page_ts = g_renew(guint64, store->page_ts,
+						 store->pages);
+			store->page_ts[store->pages - 1] = pages[i].ts;
+			store->pages++;
+			rows = 0;
+		}
+		rows += pages[i].nr_records;
+	}
 
-	g_free(indexes);
+	g_free(pages);
+}
+
+/* Returns the trace page of @cpu with the last record before @ts */
+static gint find_index_page(TraceViewStore *store, gint cpu, guint64 ts)
+{
+	struct tracecmd_page_index *index = store->cpu_index[cpu];
+	gint start = 0;
+	gint end = store->cpu_index_pages[cpu];
+	gint mid;
+
+	/* find the first page that starts at or after ts */
+	while (start < end) {
+		mid = (start + end) / 2;
+		if (index[mid].ts < ts)
+			start = mid + 1;
+		else
+			end = mid;
+	}
+
+	return start - 1;
+}
+
+static void set_record_visible(TraceViewStore *store, struct pevent *pevent,
+			       struct pevent_record *record,
+			       TraceViewRecord *trec);
+
+static void add_cpu_record(TraceViewStore *store, struct pevent *pevent,
+			   struct pevent_record *record, gint cpu)
+{
+	TraceViewRecord *trec;
+	gint i = store->cpu_items[cpu];
+
+	if (i == store->cpu_alloced[cpu]) {
+		store->cpu_alloced[cpu] = i ? i * 2 : 1024;
+		store->cpu_list[cpu] = g_renew(TraceViewRecord, store->cpu_list[cpu],
+					       store->cpu_alloced[cpu]);
+	}
+
+	trec = &store->cpu_list[cpu][i];
+	trec->cpu = cpu;
+	trec->timestamp = record->ts;
+	trec->offset = record->offset;
+	trec->pos = i;
+	set_record_visible(store, pevent, record, trec);
+
+	store->cpu_items[cpu]++;
+}
+
+static void add_task_row(TraceViewStore *store, gint pid,
+			 TraceViewRecord *trec)
+{
+	struct trace_view_task_rows *task;
+	guint key = trace_hash(pid) % TRACE_VIEW_TASK_HASH_SIZE;
+
+	for (task = store->task_rows[key]; task; task = task->next) {
+		if (task->pid == pid)
+			break;
+	}
+
+	if (!task) {
+		task = g_new0(struct trace_view_task_rows, 1);
+		task->pid = pid;
+		task->next = store->task_rows[key];
+		store->task_rows[key] = task;
+	}
+
+	if (task->nr_rows == task->alloced) {
+		task->alloced = task->alloced ? task->alloced * 2 : 16;
+		task->rows = g_renew(TraceViewRecord *, task->rows,
+				     task->alloced);
+	}
+	task->rows[task->nr_rows++] = trec;
+}
+
+static void free_task_rows(TraceViewStore *store)
+{
+	struct trace_view_task_rows *task;
+	gint i;
+
+	for (i = 0; i < TRACE_VIEW_TASK_HASH_SIZE; i++) {
+		while (store->task_rows[i]) {
+			task = store->task_rows[i];
+			store->task_rows[i] = task->next;
+			g_free(task->rows);
+			g_free(task);
+		}
+	}
+}
+
+/* Map each task to the records of the page it shows */
+static void load_task_rows(TraceViewStore *store)
+{
+	TraceViewRecord *trec;
+	gint cpu;
+	gint i;
+
+	free_task_rows(store);
+
+	for (cpu = 0; cpu < store->cpus; cpu++) {
+		for (i = 0; i < store->cpu_items[cpu]; i++) {
+			trec = &store->cpu_list[cpu][i];
+			add_task_row(store, trec->pid, trec);
+			if (trec->sched_pid >= 0 && trec->sched_pid != trec->pid)
+				add_task_row(store, trec->sched_pid, trec);
+		}
+	}
+}
+
+/*****************************************************************************
+ *
+ *	load_page: Read the records of the current page, and only those.
+ *	The index gives the trace page to start reading each CPU from, and
+ *	the number of records before it.
+ *
+ *****************************************************************************/
+
+static void load_page(TraceViewStore *store)
+{
+	struct tracecmd_input *handle = store->handle;
+	struct pevent *pevent = tracecmd_get_pevent(handle);
+	struct pevent_record *record;
+	guint64 start = 0;
+	guint64 end = 0;
+	guint total = 0;
+	gint cpu;
+	gint i;
+
+	if (store->page > 1)
+		start = store->page_ts[store->page - 2];
+	if (store->page < store->pages)
+		end = store->page_ts[store->page - 1];
+
+	for (cpu = 0; cpu < store->cpus; cpu++) {
+		store->cpu_items[cpu] = 0;
+		store->cpu_before[cpu] = 0;
+
+		i = start ? find_index_page(store, cpu, start) : -1;
+		if (i >= 0) {
+			store->cpu_before[cpu] = store->cpu_index_rows[cpu][i];
+			tracecmd_set_cursor(handle, cpu,
+					    store->cpu_index[cpu][i].offset);
+			record = tracecmd_read_data(handle, cpu);
+		} else
+			record = tracecmd_read_cpu_first(handle, cpu);
+
+		while (record) {
+			if (end && record->ts >= end) {
+				free_record(record);
+				break;
+			}
+			if (record->ts < start)
+				store->cpu_before[cpu]++;
+			else
+				add_cpu_record(store, pevent, record, cpu);
+			free_record(record);
+			record = tracecmd_read_data(handle, cpu);
+		}
+
+		total += store->cpu_items[cpu];
+	}
+
+	store->rows = g_renew(TraceViewRecord *, store->rows, total + 1);
+
+	load_task_rows(store);
+
+	/* No index, count what was read */
+	if (store->pages == 1)
+		store->actual_rows = total;
 }
 
 /*****************************************************************************
@@ -834,19 +1127,16 @@ static void merge_sort_rows_ts(TraceViewStore *store)
  *	trace_view_store_new:	This is what you use in your own code to create a
  *	new trace view store tree model for you to use.
  *
+ *	Only the index of the trace pages is read here, and the records of
+ *	the first page. The records of another page are read when the page
+ *	is selected.
+ *
  *****************************************************************************/
 
 TraceViewStore *
 trace_view_store_new (struct tracecmd_input *handle)
 {
 	TraceViewStore *newstore;
-	struct pevent_record *data;
-	gint cpu, count, total=0;
-	struct temp {
-		guint64		offset;
-		guint64		ts;
-		struct temp	*next;
-	} *list, **next, *rec;
 
 	newstore = (TraceViewStore*) g_object_new (TRACE_VIEW_STORE_TYPE, NULL);
 
@@ -857,12 +1147,18 @@ trace_view_store_new (struct tracecmd_input *handle)
 	tracecmd_ref(handle);
 	newstore->event_filter = pevent_filter_alloc(tracecmd_get_pevent(handle));
 
-	newstore->cpu_list = g_new(TraceViewRecord *, newstore->cpus);
+	newstore->cpu_list = g_new0(TraceViewRecord *, newstore->cpus);
 	g_assert(newstore->cpu_list != NULL);
 
-	newstore->cpu_items = g_new(gint, newstore->cpus);
+	newstore->cpu_items = g_new0(gint, newstore->cpus);
 	g_assert(newstore->cpu_items != NULL);
 
+	newstore->cpu_alloced = g_new0(gint, newstore->cpus);
+	newstore->cpu_before = g_new0(guint, newstore->cpus);
+	newstore->cpu_index = g_new0(struct tracecmd_page_index *, newstore->cpus);
+	newstore->cpu_index_pages = g_new0(gint, newstore->cpus);
+	newstore->cpu_index_rows = g_new0(guint *, newstore->cpus);
+
 	newstore->all_cpus = 1;
 	newstore->all_events = 1;
 
@@ -871,59 +1167,10 @@ trace_view_store_new (struct tracecmd_input *handle)
 
 	mask_set_cpus(newstore, newstore->cpus);
 
-	for (cpu = 0; cpu < newstore->cpus; cpu++) {
-
-		count = 0;
-		list = NULL;
-		next = &list;
-
-		data = tracecmd_read_cpu_first(handle, cpu);
-		while (data) {
-			*next = rec = g_malloc(sizeof(*rec));
-			g_assert(rec != NULL);
-			rec->offset = data->offset;
-			rec->ts = data->ts;
-			rec->next = NULL;
-			next = &rec->next;
-			free_record(data);
-			count++;
-			data = tracecmd_read_data(handle, cpu);
-		}
-
-		if (count) {
-			TraceViewRecord *trec;
-			struct temp *t;
-			gint i;
-
-			rec = list;
-
-			trec = g_new(TraceViewRecord, count);
-			g_assert(trec != NULL);
-
-			for (i = 0; i < count; i++) {
-				g_assert(rec != NULL);
-				trec[i].cpu = cpu;
-				trec[i].timestamp = rec->ts;
-				trec[i].offset = rec->offset;
-				trec[i].visible = 1;
-				trec[i].pos = i;
-				t = rec;
-				rec = rec->next;
-				g_free(t);
-			}
-			g_assert(rec == NULL);
-
-			newstore->cpu_list[cpu] = trec;
-		} else
-			newstore->cpu_list[cpu] = NULL;
-
-		newstore->cpu_items[cpu] = count;
-
-		total += count;
-	}
+	init_sched_events(newstore);
 
-	newstore->actual_rows = total;
-	newstore->rows = g_malloc(sizeof(*newstore->rows) * total + 1);
+	load_index(newstore);
+	load_page(newstore);
 
 	merge_sort_rows_ts(newstore);
 
@@ -1001,14 +1248,14 @@ void trace_view_store_clear_cpu(TraceViewStore *store, gint cpu)
 void trace_view_store_set_page(TraceViewStore *store, gint page)
 {
 	g_return_if_fail (TRACE_VIEW_IS_LIST (store));
-	g_return_if_fail (page >= 0 || page < store->pages);
+	g_return_if_fail (page >= 1 && page <= store->pages);
+
+	if (page == store->page)
+		return;
 
 	store->page = page;
-	store->start_row = (page - 1) * store->rows_per_page;
-	g_assert(store->start_row < store->visible_rows);
-	store->num_rows = store->start_row + store->rows_per_page <
-		store->visible_rows ? store->rows_per_page :
-		store->visible_rows - store->start_row;
+	load_page(store);
+	merge_sort_rows_ts(store);
 }
 
 static int rows_ts_cmp(const void *a, const void *b)
@@ -1067,20 +1314,27 @@ gint trace_view_store_get_timestamp_visible_row(TraceViewStore *store, guint64 t
 	if (!rec)
 		return 0;
 
-	return rec->pos - (store->page - 1) * store->rows_per_page;
+	return rec->pos - store->start_row;
 }
 
 gint trace_view_store_get_timestamp_page(TraceViewStore *store, guint64 ts)
 {
-	TraceViewRecord *rec;
+	gint start = 0;
+	gint end = store->pages - 1;
+	gint mid;
 
 	g_return_val_if_fail (TRACE_VIEW_IS_LIST (store), 0);
 
-	rec = search_for_record_by_timestamp(store, ts);
-	if (!rec)
-		return 1;
+	/* Count the pages that start at or before ts */
+	while (start < end) {
+		mid = (start + end) / 2;
+		if (store->page_ts[mid] <= ts)
+			start = mid + 1;
+		else
+			end = mid;
+	}
 
-	return rec->pos / store->rows_per_page + 1;
+	return start + 1;
 }
 
 static TraceViewRecord *get_row(TraceViewStore *store, gint row)
@@ -1090,7 +1344,7 @@ static TraceViewRecord *get_row(TraceViewStore *store, gint row)
 
 	g_return_val_if_fail(index >= 0 && index < store->visible_rows, NULL);
 
-	record = store->rows[row];
+	record = store->rows[index];
 	g_assert(record != NULL);
 	g_assert(record->pos == row);
 	return record;
@@ -1120,19 +1374,6 @@ trace_view_store_get_visible_row(TraceViewStore *store, gint row)
 	return get_row(store, row);
 }
 
-TraceViewRecord *
-trace_view_store_get_actual_row(TraceViewStore *store, gint row)
-{
-	g_return_val_if_fail (TRACE_VIEW_IS_LIST (store), NULL);
-	g_return_val_if_fail (row >= 0, NULL);
-	g_return_val_if_fail (row < store->actual_rows, NULL);
-
-	if (!store->rows)
-		return NULL;
-
-	return store->rows[row];
-}
-
 gint trace_view_store_get_num_actual_rows(TraceViewStore *store)
 {
 	g_return_val_if_fail (TRACE_VIEW_IS_LIST (store), -1);
@@ -1166,117 +1407,128 @@ gint get_wakeup_new_pid(TraceViewStore *store, struct pevent *pevent, struct pev
 	return val;
 }
 
+static gboolean view_task_filters(struct tracecmd_filter_id *task_filter,
+				  struct tracecmd_filter_id *hide_tasks,
+				  gint pid)
+{
+	return (!task_filter ||
+		!tracecmd_filter_task_count(task_filter) ||
+		tracecmd_filter_id_find(task_filter, pid)) &&
+		(!hide_tasks ||
+		 !tracecmd_filter_task_count(hide_tasks) ||
+		 !tracecmd_filter_id_find(hide_tasks, pid));
+}
+
 static gboolean view_task(TraceViewStore *store, gint pid)
 {
-	return (!store->task_filter ||
-		!tracecmd_filter_task_count(store->task_filter) ||
-		tracecmd_filter_id_find(store->task_filter, pid)) &&
-		(!store->hide_tasks ||
-		 !tracecmd_filter_task_count(store->hide_tasks) ||
-		 !tracecmd_filter_id_find(store->hide_tasks, pid));
+	return view_task_filters(store->task_filter, store->hide_tasks, pid);
 }
 
-static gboolean show_task(TraceViewStore *store, struct pevent *pevent,
-			  struct pevent_record *record, gint pid)
+/* Returns the task a sched event switches to or wakes up, or -1 */
+static gint get_sched_pid(TraceViewStore *store, struct pevent *pevent,
+			  struct pevent_record *record)
 {
 	gint event_id;
 
-	if (view_task(store, pid))
-		return TRUE;
-
 	event_id = pevent_data_type(pevent, record);
 
 	if (store->sched_switch_next_field &&
-	    event_id == store->sched_switch_event->id) {
-		/* show sched switch to task */
-		pid = get_next_pid(store, pevent, record);
-		if (view_task(store, pid))
-			return TRUE;
-	}
+	    event_id == store->sched_switch_event->id)
+		return get_next_pid(store, pevent, record);
 
 	if (store->sched_wakeup_pid_field &&
-	    event_id == store->sched_wakeup_event->id) {
-		/* show sched switch to task */
-		pid = get_wakeup_pid(store, pevent, record);
-		if (view_task(store, pid))
-			return TRUE;
-	}
+	    event_id == store->sched_wakeup_event->id)
+		return get_wakeup_pid(store, pevent, record);
 
 	if (store->sched_wakeup_new_pid_field &&
-	    event_id == store->sched_wakeup_new_event->id) {
-		/* show sched switch to task */
-		pid = get_wakeup_new_pid(store, pevent, record);
-		if (view_task(store, pid))
-			return TRUE;
-	}
+	    event_id == store->sched_wakeup_new_event->id)
+		return get_wakeup_new_pid(store, pevent, record);
 
-	return FALSE;
+	return -1;
 }
 
-static void update_filter_tasks(TraceViewStore *store)
+/* Sched events are also shown for the task they switch to or wake up */
+static gboolean show_task(TraceViewStore *store, TraceViewRecord *trec)
 {
-	struct tracecmd_input *handle;
-	struct pevent *pevent;
-	struct pevent_record *record;
-	gint pid;
-	gint cpu;
-	gint i;
+	return view_task(store, trec->pid) ||
+		(trec->sched_pid >= 0 && view_task(store, trec->sched_pid));
+}
 
-	handle = store->handle;
-	pevent = tracecmd_get_pevent(store->handle);
+static void set_record_visible(TraceViewStore *store, struct pevent *pevent,
+			       struct pevent_record *record,
+			       TraceViewRecord *trec)
+{
+	trec->pid = pevent_data_pid(pevent, record);
+	trec->sched_pid = get_sched_pid(store, pevent, record);
 
-	if (!store->sched_switch_event) {
-		store->sched_switch_event =
-			pevent_find_event_by_name(pevent, "sched", "sched_switch");
-		if (store->sched_switch_event)
-			store->sched_switch_next_field =
-				pevent_find_any_field(store->sched_switch_event,
-						      "next_pid");
-		store->sched_wakeup_event =
-			pevent_find_event_by_name(pevent, "sched", "sched_wakeup");
-		if (store->sched_wakeup_event)
-			store->sched_wakeup_pid_field =
-				pevent_find_any_field(store->sched_wakeup_event,
-						      "pid");
-
-		store->sched_wakeup_new_event =
-			pevent_find_event_by_name(pevent, "sched", "sched_wakeup_new");
-		if (store->sched_wakeup_new_event)
-			store->sched_wakeup_new_pid_field =
-				pevent_find_any_field(store->sched_wakeup_new_event,
-						      "pid");
-	}
+	/* The record may be filtered by the events */
+	trec->event_visible = store->all_events ||
+		pevent_filter_match(store->event_filter, record) == FILTER_MATCH;
 
-	for (cpu = 0; cpu < store->cpus; cpu++) {
-		record = tracecmd_read_cpu_first(handle, cpu);
+	trec->visible = trec->event_visible && show_task(store, trec);
+}
 
-		for (i = 0; i < store->cpu_items[cpu]; i++) {
+/*
+ * The task filters changed from @task_filter and @hide_tasks. Only the
+ * records of the tasks whose visibility changed are filtered again,
+ * unless @all is set.
+ */
+static void refilter_tasks(TraceViewStore *store,
+			   struct tracecmd_filter_id *task_filter,
+			   struct tracecmd_filter_id *hide_tasks,
+			   gboolean all)
+{
+	struct trace_view_task_rows *task;
+	TraceViewRecord *trec;
+	gint i, r;
+
+	for (i = 0; i < TRACE_VIEW_TASK_HASH_SIZE; i++) {
+		for (task = store->task_rows[i]; task; task = task->next) {
+			if (!all &&
+			    view_task_filters(task_filter, hide_tasks, task->pid) ==
+			    view_task(store, task->pid))
+				continue;
 
-			g_assert(record->offset == store->cpu_list[cpu][i].offset);
-
-			/* The record may be filtered by the events */
-			if (!store->all_events) {
-				int ret;
-				ret = pevent_filter_match(store->event_filter,
-							  record);
-				if (ret != FILTER_MATCH) {
-					store->cpu_list[cpu][i].visible = 0;
-					goto skip;
-				}
+			for (r = 0; r < task->nr_rows; r++) {
+				trec = task->rows[r];
+				trec->visible = trec->event_visible &&
+					show_task(store, trec);
 			}
-
-			pid = pevent_data_pid(pevent, record);
-			if (show_task(store, pevent, record, pid))
-				store->cpu_list[cpu][i].visible = 1;
-			else
-				store->cpu_list[cpu][i].visible = 0;
-
- skip:
-			free_record(record);
-			record = tracecmd_read_data(handle, cpu);
 		}
-		g_assert(record == NULL);
 	}
+}
+
+/* The event filters need the records, only read those of the page */
+static void update_filter_tasks(TraceViewStore *store)
+{
+	init_sched_events(store);
+	load_page(store);
+	merge_sort_rows_ts(store);
+}
+
+static void set_task_filters(TraceViewStore *store,
+			     struct tracecmd_filter_id *task_filter,
+			     struct tracecmd_filter_id *hide_tasks,
+			     gboolean all)
+{
+	struct tracecmd_filter_id *old_task_filter = store->task_filter;
+	struct tracecmd_filter_id *old_hide_tasks = store->hide_tasks;
+
+	/* We may pass in the store->task_filter. Don't copy it if we do */
+	if (store->hide_tasks != hide_tasks)
+		store->hide_tasks = tracecmd_filter_id_hash_copy(hide_tasks);
+
+	if (store->task_filter != task_filter)
+		store->task_filter = tracecmd_filter_id_hash_copy(task_filter);
+
+	refilter_tasks(store, old_task_filter, old_hide_tasks, all);
+
+	/* The old filters were needed to find what changed */
+	if (old_task_filter && old_task_filter != store->task_filter)
+		tracecmd_filter_id_hash_free(old_task_filter);
+
+	if (old_hide_tasks && old_hide_tasks != store->hide_tasks)
+		tracecmd_filter_id_hash_free(old_hide_tasks);
 
 	merge_sort_rows_ts(store);
 }
@@ -1286,14 +1538,9 @@ void trace_view_store_filter_tasks(TraceViewStore *store,
 {
 	g_return_if_fail (TRACE_VIEW_IS_LIST (store));
 
-	/* We may pass in the store->task_filter. Don't free it if we do */
-	if (store->task_filter && store->task_filter != filter)
-		tracecmd_filter_id_hash_free(store->task_filter);
-
-	if (store->task_filter != filter)
-		store->task_filter = tracecmd_filter_id_hash_copy(filter);
-
-	update_filter_tasks(store);
+	/* A filter changed in place can not be compared with the old one */
+	set_task_filters(store, filter, store->hide_tasks,
+			 filter && filter == store->task_filter);
 }
 
 void trace_view_store_hide_tasks(TraceViewStore *store,
@@ -1301,14 +1548,8 @@ void trace_view_store_hide_tasks(TraceViewStore *store,
 {
 	g_return_if_fail (TRACE_VIEW_IS_LIST (store));
 
-	/* We may pass in the store->task_filter. Don't free it if we do */
-	if (store->hide_tasks && store->hide_tasks != filter)
-		tracecmd_filter_id_hash_free(store->hide_tasks);
-
-	if (store->hide_tasks != filter)
-		store->hide_tasks = tracecmd_filter_id_hash_copy(filter);
-
-	update_filter_tasks(store);
+	set_task_filters(store, store->task_filter, filter,
+			 filter && filter == store->hide_tasks);
 }
 
 void trace_view_store_update_filter(TraceViewStore *store)
@@ -1324,18 +1565,9 @@ void trace_view_store_assign_filters(TraceViewStore *store,
 {
 	g_return_if_fail (TRACE_VIEW_IS_LIST (store));
 
-	/* We may pass in the store->task_filter. Don't free it if we do */
-	if (store->task_filter && store->task_filter != task_filter)
-		tracecmd_filter_id_hash_free(store->task_filter);
-
-	if (store->hide_tasks && store->hide_tasks != hide_tasks)
-		tracecmd_filter_id_hash_free(store->hide_tasks);
-
-	if (store->hide_tasks != hide_tasks)
-		store->hide_tasks = tracecmd_filter_id_hash_copy(hide_tasks);
-
-	if (store->task_filter != task_filter)
-		store->task_filter = tracecmd_filter_id_hash_copy(task_filter);
+	set_task_filters(store, task_filter, hide_tasks,
+			 (task_filter && task_filter == store->task_filter) ||
+			 (hide_tasks && hide_tasks == store->hide_tasks));
 }
 
 /*****************************************************************************
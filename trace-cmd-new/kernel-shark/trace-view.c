@@ -310,8 +310,8 @@ void trace_view_update_filters(GtkWidget *treeview,
 	g_object_ref(model);
 	gtk_tree_view_set_model(tree, NULL);
 
+	/* Only the rows of the tasks that changed are filtered again */
 	trace_view_store_assign_filters(TRACE_VIEW_STORE(model), task_filter, hide_tasks);
-	trace_view_store_update_filter(TRACE_VIEW_STORE(model));
 
 	gtk_tree_view_set_model(tree, model);
 	g_object_unref(model);
@@ -724,30 +724,53 @@ static void search_next_pages(GtkTreeView *tree,
 	GtkTreeModel *model;
 	TraceViewRecord *rec;
 	GtkTreeIter iter;
+	guint64 ts = 0;
+	gint start_page;
+	gint page;
+	gint pages;
 	gint row;
-	gint total_rows;
+	gint rows;
 	gboolean found = FALSE;
 
 	model = (GtkTreeModel *)store;
 
-	row = store->start_row + store->num_rows;
-	total_rows = trace_view_store_get_num_actual_rows(store);
+	start_page = trace_view_store_get_page(store);
+	pages = trace_view_store_get_pages(store);
+	page = start_page;
 
 	trace_set_cursor(GDK_WATCH);
 	trace_freeze_all();
 
-	for (; row < total_rows; row++) {
+	/* Only the rows of a page are loaded, walk the pages after this one */
+	g_object_ref(model);
+	gtk_tree_view_set_model(tree, NULL);
 
-		/* Needed to process the cursor change */
-		if (!(row & ((1 << 5)-1)))
-			gtk_main_iteration_do(FALSE);
+	while (!found && ++page <= pages) {
+		trace_view_store_set_page(store, page);
+		rows = trace_view_store_visible_rows(store);
 
-		rec = trace_view_store_get_actual_row(store, row);
-		iter.user_data = rec;
-		found = test_row(model, &iter, sel, col_num, search_val, search_text);
-		if (found)
-			break;
+		for (row = 0; row < rows; row++) {
+
+			/* Needed to process the cursor change */
+			if (!(row & ((1 << 5)-1)))
+				gtk_main_iteration_do(FALSE);
+
+			rec = trace_view_store_get_visible_row(store, row);
+			iter.user_data = rec;
+			found = test_row(model, &iter, sel, col_num, search_val, search_text);
+			if (found) {
+				ts = rec->timestamp;
+				break;
+			}
+		}
 	}
+
+	/* trace_view_select() moves to the page of the found record */
+	trace_view_store_set_page(store, start_page);
+
+	gtk_tree_view_set_model(tree, model);
+	g_object_unref(model);
+
 	trace_unfreeze_all();
 	trace_put_cursor();
 
@@ -756,7 +779,7 @@ static void search_next_pages(GtkTreeView *tree,
 		return;
 	}
 
-	trace_view_select(GTK_WIDGET(tree), rec->timestamp);
+	trace_view_select(GTK_WIDGET(tree), ts);
 }
 
 static void search_tree(gpointer data)
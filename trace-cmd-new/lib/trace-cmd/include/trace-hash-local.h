@@ -34,6 +34,21 @@ static inline unsigned int trace_hash(unsigned int val)
 	return hash;
 }
 
+/*
+ * The finalizer of MurmurHash3. All the bits of @val affect all the
+ * bits of the hash, and no two values have the same hash.
+ */
+static inline unsigned long long trace_hash64(unsigned long long val)
+{
+	val ^= val >> 33;
+	val *= 0xff51afd7ed558ccdULL;
+	val ^= val >> 33;
+	val *= 0xc4ceb9fe1a85ec53ULL;
+	val ^= val >> 33;
+
+	return val;
+}
+
 static inline unsigned int trace_hash_str(char *str)
 {
 	int val = 0;
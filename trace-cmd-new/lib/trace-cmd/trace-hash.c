@@ -81,3 +81,188 @@ trace_hash_find(struct trace_hash *hash, unsigned long long key,
 
 	return NULL;
 }
+
+#define OHASH_MIN_SLOTS		8
+
+/* Spread the bits of the key, as not all keys are hashes already */
+static inline unsigned int ohash_slot(struct trace_ohash *hash,
+				      unsigned long long key)
+{
+	return ((key * 0x9e3779b97f4a7c15ULL) >> 32) & (hash->nr_slots - 1);
+}
+
+static int ohash_alloc(struct trace_ohash *hash, unsigned int nr_slots)
+{
+	hash->slots = calloc(nr_slots, sizeof(*hash->slots));
+	if (!hash->slots)
+		return -ENOMEM;
+	hash->nr_slots = nr_slots;
+	return 0;
+}
+
+/**
+ * trace_ohash_init - initialize an open addressing hash
+ * @hash: the hash to initialize
+ * @size: the number of items expected, it grows past this as needed
+ *
+ * Returns 0 on success and -ENOMEM if the slots could not be allocated.
+ */
+int trace_ohash_init(struct trace_ohash *hash, int size)
+{
+	unsigned int nr_slots = OHASH_MIN_SLOTS;
+
+	memset(hash, 0, sizeof(*hash));
+
+	/* Keep it at most three quarters full */
+	while (size > 0 && nr_slots / 4 * 3 < (unsigned int)size)
+		nr_slots <<= 1;
+
+	return ohash_alloc(hash, nr_slots);
+}
+
+/**
+ * trace_ohash_free - free the slots of a hash
+ * @hash: the hash to free
+ *
+ * The items are not freed, that is up to the user of the hash.
+ */
+void trace_ohash_free(struct trace_ohash *hash)
+{
+	free(hash->slots);
+	memset(hash, 0, sizeof(*hash));
+}
+
+static void ohash_insert(struct trace_ohash *hash, unsigned long long key,
+			 void *item)
+{
+	unsigned int mask = hash->nr_slots - 1;
+	unsigned int i;
+
+	for (i = ohash_slot(hash, key); hash->slots[i].item; i = (i + 1) & mask)
+		;
+
+	hash->slots[i].key = key;
+	hash->slots[i].item = item;
+}
+
+static int ohash_grow(struct trace_ohash *hash)
+{
+	struct trace_ohash_slot *slots = hash->slots;
+	unsigned int nr_slots = hash->nr_slots;
+	unsigned int i;
+
+	if (ohash_alloc(hash, nr_slots << 1) < 0) {
+		hash->slots = slots;
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < nr_slots; i++) {
+		if (slots[i].item)
+			ohash_insert(hash, slots[i].key, slots[i].item);
+	}
+	free(slots);
+
+	return 0;
+}
+
+/**
+ * trace_ohash_add - add an item to a hash
+ * @hash: the hash to add to
+ * @key: the key to find @item by
+ * @item: the item to add, must not be NULL
+ *
+ * The hash doubles its slots when it gets three quarters full.
+ *
+ * Returns 1 on success and -ENOMEM if the hash needed to grow and
+ * could not, in which case @item is not added.
+ */
+int trace_ohash_add(struct trace_ohash *hash, unsigned long long key,
+		    void *item)
+{
+	if (!hash->nr_slots && ohash_alloc(hash, OHASH_MIN_SLOTS) < 0)
+		return -ENOMEM;
+
+	if ((hash->nr_items + 1) * 4 > hash->nr_slots * 3 &&
+	    ohash_grow(hash) < 0)
+		return -ENOMEM;
+
+	ohash_insert(hash, key, item);
+	hash->nr_items++;
+
+	return 1;
+}
+
+/**
+ * trace_ohash_find - find an item in a hash
+ * @hash: the hash to search
+ * @key: the key of the item
+ * @match: function to tell the items with the same key apart, may be NULL
+ * @data: passed to @match
+ *
+ * Returns the first item with @key that @match returns true for, or
+ * any item with @key if @match is NULL. Returns NULL if none is found.
+ */
+void *trace_ohash_find(struct trace_ohash *hash, unsigned long long key,
+		       trace_ohash_func match, void *data)
+{
+	struct trace_ohash_slot *slot;
+	unsigned int mask = hash->nr_slots - 1;
+	unsigned int i;
+
+	if (!hash->nr_items)
+		return NULL;
+
+	for (i = ohash_slot(hash, key); (slot = &hash->slots[i])->item;
+	     i = (i + 1) & mask) {
+		if (slot->key != key)
+			continue;
+		if (!match || match(slot->item, data))
+			return slot->item;
+	}
+
+	return NULL;
+}
+
+/**
+ * trace_ohash_del - remove an item from a hash
+ * @hash: the hash to remove from
+ * @key: the key @item was added with
+ * @item: the item to remove
+ *
+ * Returns 1 if @item was removed and 0 if it was not in @hash.
+ */
+int trace_ohash_del(struct trace_ohash *hash, unsigned long long key,
+		    void *item)
+{
+	unsigned int mask = hash->nr_slots - 1;
+	unsigned int home;
+	unsigned int i;
+	unsigned int j;
+
+	if (!hash->nr_items)
+		return 0;
+
+	for (i = ohash_slot(hash, key); hash->slots[i].item != item;
+	     i = (i + 1) & mask) {
+		if (!hash->slots[i].item)
+			return 0;
+	}
+
+	/*
+	 * Move back the items after it that can not be found past the
+	 * free slot anymore, instead of leaving a marker in it.
+	 */
+	for (j = (i + 1) & mask; hash->slots[j].item; j = (j + 1) & mask) {
+		home = ohash_slot(hash, hash->slots[j].key);
+		/* Leave it if its home is cyclically in (i, j] */
+		if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+			continue;
+		hash->slots[i] = hash->slots[j];
+		i = j;
+	}
+
+	hash->slots[i].item = NULL;
+	hash->nr_items--;
+
+	return 1;
+}
@@ -26,8 +26,11 @@
 
 #include "trace-cmd-local.h"
 #include "trace-local.h"
+#include "trace-hash.h"
+#include "trace-hash-local.h"
 #include "kbuffer.h"
 #include "list.h"
+#include "event-utils.h"
 
 #define MISSING_EVENTS (1 << 31)
 #define MISSING_STORED (1 << 30)
@@ -39,12 +42,26 @@ static int force_read = 0;
 
 #define PAGE_STOPPER		((struct page *)-1L)
 
+#define PAGE_MAP_HASH_SIZE	256
+
+/* Unused page maps are kept until this much of the file is mapped */
+#define DEFAULT_PAGE_MAP_BUDGET	(64ULL << 20)
+
+/*
+ * Page maps that are no longer referenced by any page are not
+ * unmapped right away, but kept on the handle's LRU list so that
+ * going back and forth over the same area of the file does not
+ * need to mmap it again. They are only unmapped when the total
+ * amount of mapped memory goes over the handle's budget.
+ */
 struct page_map {
-	struct list_head	list;
+	struct trace_hash_item	hash;
+	struct list_head	lru;
 	off64_t			offset;
 	off64_t			size;
 	void			*map;
 	int			ref_count;
+	int			cpu;
 };
 
 struct page {
@@ -68,7 +85,6 @@ struct cpu_data {
 	unsigned long long	offset;
 	unsigned long long	size;
 	unsigned long long	timestamp;
-	struct list_head	page_maps;
 	struct page_map		*page_map;
 	struct page		**pages;
 	struct pevent_record	*next;
@@ -109,6 +125,16 @@ struct tracecmd_input {
 	struct tracecmd_ftrace	finfo;
 
 	struct hook_list	*hooks;
+
+	/* page map cache */
+	struct trace_hash	page_map_hash;
+	struct list_head	page_map_lru;
+	unsigned long long	page_map_mapped;
+	unsigned long long	page_map_budget;
+	struct tracecmd_page_map_stats	page_map_stats;
+
+	struct tracecmd_input_stats	stats;
+
 	/* file information */
 	size_t			header_files_start;
 	size_t			ftrace_files_start;
@@ -203,6 +229,8 @@ static ssize_t do_read(struct tracecmd_input *handle, void *data, size_t size)
 			return r;
 	} while (tot != size);
 
+	stats_add(&handle->stats, bytes_read, tot);
+
 	return tot;
 }
 
@@ -421,7 +449,7 @@ static int read_ftrace_file(struct tracecmd_input *handle,
 		if (print || regex_event_buf(buf, size, epreg))
 			printf("%.*s\n", (int)size, buf);
 	} else {
-		if (pevent_parse_event(pevent, buf, size, "ftrace"))
+		if (pevent_parse_event_lazy(pevent, buf, size, "ftrace"))
 			pevent->parsing_failures = 1;
 	}
 	free(buf);
@@ -455,7 +483,7 @@ static int read_event_file(struct tracecmd_input *handle,
 			printf("%.*s\n", (int)size, buf);
 		}
 	} else {
-		if (pevent_parse_event(pevent, buf, size, system))
+		if (pevent_parse_event_lazy(pevent, buf, size, system))
 			pevent->parsing_failures = 1;
 	}
 	free(buf);
@@ -723,34 +751,33 @@ static int read_and_parse_cmdlines(struct tracecmd_input *handle);
  */
 int tracecmd_read_headers(struct tracecmd_input *handle)
 {
-	int ret;
+	unsigned long long start = stats_start();
+	int ret = -1;
 
-	ret = read_header_files(handle);
-	if (ret < 0)
-		return -1;
+	if (read_header_files(handle) < 0)
+		goto out;
 
-	ret = read_ftrace_files(handle, NULL);
-	if (ret < 0)
-		return -1;
+	if (read_ftrace_files(handle, NULL) < 0)
+		goto out;
 
-	ret = read_event_files(handle, NULL);
-	if (ret < 0)
-		return -1;
+	if (read_event_files(handle, NULL) < 0)
+		goto out;
 
-	ret = read_proc_kallsyms(handle);
-	if (ret < 0)
-		return -1;
+	if (read_proc_kallsyms(handle) < 0)
+		goto out;
 
-	ret = read_ftrace_printk(handle);
-	if (ret < 0)
-		return -1;
+	if (read_ftrace_printk(handle) < 0)
+		goto out;
 
 	if (read_and_parse_cmdlines(handle) < 0)
-		return -1;
+		goto out;
 
 	pevent_set_long_size(handle->pevent, handle->long_size);
 
-	return 0;
+	ret = 0;
+ out:
+	stats_end(&handle->stats, open_ns, start);
+	return ret;
 }
 
 static unsigned long long calc_page_offset(struct tracecmd_input *handle,
@@ -776,7 +803,19 @@ static int read_page(struct tracecmd_input *handle, off64_t offset,
 			/* Set EINVAL when the pipe has closed */
 			errno = EINVAL;
 			return -1;
+		} else if (ret < handle->page_size &&
+			   lseek64(handle->cpu_data[cpu].pipe_fd,
+				   -ret, SEEK_CUR) >= 0) {
+			/*
+			 * A file that is still being written may end in
+			 * the middle of a page, give the page back and
+			 * read it again once it is complete.
+			 */
+			errno = EAGAIN;
+			return -1;
 		}
+		stats_inc(&handle->stats, pages_read);
+		stats_add(&handle->stats, bytes_read, ret);
 		return 0;
 	}
 
@@ -790,6 +829,9 @@ static int read_page(struct tracecmd_input *handle, off64_t offset,
 	if (ret < 0)
 		return -1;
 
+	stats_inc(&handle->stats, pages_read);
+	stats_add(&handle->stats, bytes_read, ret);
+
 	/* reset the file pointer back */
 	lseek64(handle->fd, save_seek, SEEK_SET);
 
@@ -811,15 +853,83 @@ static unsigned long long normalize_size(unsigned long long size)
 	return size - (size >> 1);
 }
 
-static void free_page_map(struct page_map *page_map)
+static void unmap_page_map(struct tracecmd_input *handle,
+			   struct page_map *page_map)
+{
+	munmap(page_map->map, page_map->size);
+	trace_hash_del(&page_map->hash);
+	handle->page_map_mapped -= page_map->size;
+	stats_add(&handle->stats, pages_unmapped,
+		  page_map->size / handle->page_size);
+	free(page_map);
+}
+
+/* Unmap unused page maps, oldest first, until the budget is met */
+static void trim_page_maps(struct tracecmd_input *handle,
+			   unsigned long long budget)
+{
+	struct page_map *page_map;
+
+	while (handle->page_map_mapped > budget &&
+	       !list_empty(&handle->page_map_lru)) {
+		page_map = container_of(handle->page_map_lru.prev,
+					struct page_map, lru);
+		list_del(&page_map->lru);
+		unmap_page_map(handle, page_map);
+		handle->page_map_stats.evictions++;
+	}
+}
+
+static void free_page_map(struct tracecmd_input *handle,
+			  struct page_map *page_map)
 {
 	page_map->ref_count--;
 	if (page_map->ref_count)
 		return;
 
-	munmap(page_map->map, page_map->size);
-	list_del(&page_map->list);
-	free(page_map);
+	/* Keep it cached in case it is needed again */
+	list_add(&page_map->lru, &handle->page_map_lru);
+	trim_page_maps(handle, handle->page_map_budget);
+}
+
+struct page_map_key {
+	off64_t			offset;
+	int			cpu;
+};
+
+static unsigned long long page_map_hash_key(struct tracecmd_input *handle,
+					    off64_t map_offset)
+{
+	return trace_hash(map_offset / handle->page_size);
+}
+
+static int match_page_map(struct trace_hash_item *item, void *data)
+{
+	struct page_map *page_map = container_of(item, struct page_map, hash);
+	struct page_map_key *key = data;
+
+	return page_map->cpu == key->cpu &&
+		key->offset >= page_map->offset &&
+		key->offset < page_map->offset + page_map->size;
+}
+
+static struct page_map *
+find_page_map(struct tracecmd_input *handle, int cpu,
+	      off64_t map_offset, off64_t offset)
+{
+	struct trace_hash_item *item;
+	struct page_map_key key;
+
+	key.offset = offset;
+	key.cpu = cpu;
+
+	item = trace_hash_find(&handle->page_map_hash,
+			       page_map_hash_key(handle, map_offset),
+			       match_page_map, &key);
+	if (!item)
+		return NULL;
+
+	return container_of(item, struct page_map, hash);
 }
 
 static void *allocate_page_map(struct tracecmd_input *handle,
@@ -855,13 +965,18 @@ static void *allocate_page_map(struct tracecmd_input *handle,
 	page_map = cpu_data->page_map;
 
 	if (page_map && page_map->offset == map_offset)
-		goto out;
+		goto hit;
 
-	list_for_each_entry(page_map, &cpu_data->page_maps, list) {
-		if (page_map->offset == map_offset)
-			goto out;
+	page_map = find_page_map(handle, cpu, map_offset, offset);
+	if (page_map) {
+		/* Unused maps sit on the LRU list */
+		if (!page_map->ref_count)
+			list_del(&page_map->lru);
+		goto hit;
 	}
 
+	handle->page_map_stats.misses++;
+
 	page_map = calloc(1, sizeof(*page_map));
 	if (!page_map)
 		return NULL;
@@ -877,7 +992,12 @@ static void *allocate_page_map(struct tracecmd_input *handle,
 	page_map->map = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE,
 			 handle->fd, map_offset);
 
-	if (page->map == MAP_FAILED) {
+	if (page_map->map == MAP_FAILED) {
+		/* Drop the cached maps before settling for a smaller one */
+		if (!list_empty(&handle->page_map_lru)) {
+			trim_page_maps(handle, 0);
+			goto again;
+		}
 		/* Try a smaller map */
 		map_size >>= 1;
 		if (map_size < handle->page_size) {
@@ -894,17 +1014,29 @@ static void *allocate_page_map(struct tracecmd_input *handle,
 		goto again;
 	}
 
-	list_add(&page_map->list, &cpu_data->page_maps);
+	page_map->cpu = cpu;
+	page_map->hash.key = page_map_hash_key(handle, map_offset);
+	trace_hash_add(&handle->page_map_hash, &page_map->hash);
+	handle->page_map_mapped += map_size;
+	stats_add(&handle->stats, pages_mapped, map_size / handle->page_size);
+	goto out;
+
+ hit:
+	handle->page_map_stats.hits++;
  out:
 	if (cpu_data->page_map != page_map) {
 		struct page_map *old_map = cpu_data->page_map;
 		cpu_data->page_map = page_map;
 		page_map->ref_count++;
 		if (old_map)
-			free_page_map(old_map);
+			free_page_map(handle, old_map);
 	}
 	page->page_map = page_map;
 	page_map->ref_count++;
+
+	/* A new map may have pushed us over the budget */
+	trim_page_maps(handle, handle->page_map_budget);
+
 	return page_map->map + offset - page_map->offset;
 }
 
@@ -915,8 +1047,12 @@ static struct page *allocate_page(struct tracecmd_input *handle,
 	struct page *page;
 	int index;
 
+	/*
+	 * The pages of a pipe are read once and have no index, each one
+	 * is a page of its own while records hold it.
+	 */
 	index = (offset - cpu_data->file_offset) / handle->page_size;
-	if (cpu_data->pages[index]) {
+	if (!handle->use_pipe && cpu_data->pages[index]) {
 		cpu_data->pages[index]->ref_count++;
 		return cpu_data->pages[index];
 	}
@@ -937,7 +1073,8 @@ static struct page *allocate_page(struct tracecmd_input *handle,
 		return NULL;
 	}
 
-	cpu_data->pages[index] = page;
+	if (!handle->use_pipe)
+		cpu_data->pages[index] = page;
 	cpu_data->page_cnt++;
 	page->ref_count = 1;
 
@@ -959,10 +1096,12 @@ static void __free_page(struct tracecmd_input *handle, struct page *page)
 	if (handle->read_page)
 		free(page->map);
 	else
-		free_page_map(page->page_map);
+		free_page_map(handle, page->page_map);
 
-	index = (page->offset - cpu_data->file_offset) / handle->page_size;
-	cpu_data->pages[index] = NULL;
+	if (!handle->use_pipe) {
+		index = (page->offset - cpu_data->file_offset) / handle->page_size;
+		cpu_data->pages[index] = NULL;
+	}
 	cpu_data->page_cnt--;
 
 	free(page);
@@ -1076,6 +1215,10 @@ static int update_page_info(struct tracecmd_input *handle, int cpu)
 static int get_page(struct tracecmd_input *handle, int cpu,
 		    off64_t offset)
 {
+	unsigned long long start;
+	unsigned long long prev;
+	int ret = 0;
+
 	/* Don't map if the page is already where we want */
 	if (handle->cpu_data[cpu].offset == offset &&
 	    handle->cpu_data[cpu].page)
@@ -1099,6 +1242,7 @@ static int get_page(struct tracecmd_input *handle, int cpu,
 		return -1;
 	}
 
+	prev = handle->cpu_data[cpu].offset;
 	handle->cpu_data[cpu].offset = offset;
 	handle->cpu_data[cpu].size = (handle->cpu_data[cpu].file_offset +
 				      handle->cpu_data[cpu].file_size) -
@@ -1106,14 +1250,22 @@ static int get_page(struct tracecmd_input *handle, int cpu,
 
 	free_page(handle, cpu);
 
+	start = stats_start();
+
 	handle->cpu_data[cpu].page = allocate_page(handle, cpu, offset);
-	if (!handle->cpu_data[cpu].page)
-		return -1;
+	if (!handle->cpu_data[cpu].page) {
+		/* The page of a pipe is read again on the next try */
+		if (handle->use_pipe) {
+			handle->cpu_data[cpu].offset = prev;
+			handle->cpu_data[cpu].size += offset - prev;
+		}
+		ret = -1;
+	} else if (update_page_info(handle, cpu))
+		ret = -1;
 
-	if (update_page_info(handle, cpu))
-		return -1;
+	stats_end(&handle->stats, page_ns, start);
 
-	return 0;
+	return ret;
 }
 
 static int get_next_page(struct tracecmd_input *handle, int cpu)
@@ -1584,6 +1736,207 @@ tracecmd_get_cursor(struct tracecmd_input *handle, int cpu)
 	return cpu_data->offset + kbuffer_curr_offset(kbuf);
 }
 
+/* Do not bother starting a thread for less than this many pages */
+#define INDEX_PAGES_PER_THREAD	256
+
+struct page_index_work {
+	struct tracecmd_input		*handle;
+	struct tracecmd_page_index	**index;
+	int				*nr_pages;
+	int				total;	/* pages of all the CPUs */
+	int				next;
+};
+
+struct page_index_thread {
+	struct page_index_work	*work;
+	pthread_t		thread;
+	int			failed;
+};
+
+static int index_page(struct tracecmd_input *handle, struct kbuffer *kbuf,
+		      void *buf, struct tracecmd_page_index *page)
+{
+	unsigned long long ts;
+	ssize_t r;
+	void *data;
+
+	r = pread(handle->fd, buf, handle->page_size, page->offset);
+	if (r < 0)
+		return -1;
+	/* the last page of a CPU may be short */
+	if (r < handle->page_size)
+		memset(buf + r, 0, handle->page_size - r);
+
+	kbuffer_load_subbuffer(kbuf, buf);
+	if (kbuffer_subbuffer_size(kbuf) > handle->page_size)
+		return -1;
+
+	data = kbuffer_read_event(kbuf, &ts);
+	if (!data)
+		ts = kbuffer_timestamp(kbuf);
+
+	ts += handle->ts_offset;
+	if (handle->ts2secs)
+		ts *= handle->ts2secs;
+	page->ts = ts;
+
+	page->nr_records = 0;
+	while (data) {
+		page->nr_records++;
+		data = kbuffer_next_event(kbuf, NULL);
+	}
+
+	return 0;
+}
+
+static void *page_index_thread(void *data)
+{
+	struct page_index_thread *thread = data;
+	struct page_index_work *work = thread->work;
+	struct tracecmd_input *handle = work->handle;
+	struct kbuffer *kbuf;
+	void *buf;
+	int cpu;
+	int i;
+
+	buf = malloc(handle->page_size);
+	kbuf = kbuffer_alloc(handle->long_size == 8 ?
+			     KBUFFER_LSIZE_8 : KBUFFER_LSIZE_4,
+			     handle->pevent->file_bigendian ?
+			     KBUFFER_ENDIAN_BIG : KBUFFER_ENDIAN_LITTLE);
+	if (!buf || !kbuf) {
+		thread->failed = 1;
+		goto out;
+	}
+	if (handle->pevent->old_format)
+		kbuffer_set_old_format(kbuf);
+
+	/* The pages are numbered across the CPUs, in CPU order */
+	while ((i = __sync_fetch_and_add(&work->next, 1)) < work->total) {
+		for (cpu = 0; i >= work->nr_pages[cpu]; cpu++)
+			i -= work->nr_pages[cpu];
+		if (index_page(handle, kbuf, buf, &work->index[cpu][i]))
+			thread->failed = 1;
+	}
+ out:
+	kbuffer_free(kbuf);
+	free(buf);
+
+	return NULL;
+}
+
+/**
+ * tracecmd_read_page_index - read the index of the pages of all CPUs
+ * @handle: input handle for the trace.dat file
+ * @index: array of a page index per CPU to fill in
+ * @nr_pages: array of the number of pages per CPU to fill in
+ *
+ * For each page of the trace data, saves its file offset, the time
+ * stamp of its first record and how many records it holds, without
+ * reading any records. This is enough to find where a record is, or
+ * to count records, and read only the pages that are needed.
+ *
+ * The pages are read directly from the file, by a thread per CPU
+ * when there are many of them, and none of the read cursors of the
+ * handle are changed.
+ *
+ * @index and @nr_pages must have tracecmd_cpus() entries. Each
+ * index[cpu] is allocated and must be freed with free().
+ *
+ * Returns 0 on success and -1 on error, in which case nothing is
+ * allocated.
+ */
+int tracecmd_read_page_index(struct tracecmd_input *handle,
+			     struct tracecmd_page_index **index,
+			     int *nr_pages)
+{
+	struct page_index_thread *threads;
+	struct page_index_work work;
+	struct cpu_data *cpu_data;
+	long nr_threads;
+	int failed = 0;
+	int started;
+	int cpu;
+	int i;
+
+	if (handle->use_pipe || !handle->cpu_data)
+		return -1;
+
+	if (handle->pevent->header_page_ts_size != 8) {
+		warning("expected a long long type for timestamp");
+		return -1;
+	}
+
+	memset(&work, 0, sizeof(work));
+	work.handle = handle;
+	work.index = index;
+	work.nr_pages = nr_pages;
+
+	memset(index, 0, sizeof(*index) * handle->cpus);
+
+	for (cpu = 0; cpu < handle->cpus; cpu++) {
+		cpu_data = &handle->cpu_data[cpu];
+		nr_pages[cpu] = (cpu_data->file_size + handle->page_size - 1) /
+			handle->page_size;
+		if (!nr_pages[cpu])
+			continue;
+
+		index[cpu] = malloc(sizeof(*index[cpu]) * nr_pages[cpu]);
+		if (!index[cpu])
+			goto fail;
+
+		for (i = 0; i < nr_pages[cpu]; i++)
+			index[cpu][i].offset = cpu_data->file_offset +
+				(unsigned long long)i * handle->page_size;
+
+		work.total += nr_pages[cpu];
+	}
+
+	nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nr_threads > work.total / INDEX_PAGES_PER_THREAD)
+		nr_threads = work.total / INDEX_PAGES_PER_THREAD;
+	if (nr_threads < 1)
+		nr_threads = 1;
+
+	threads = calloc(nr_threads, sizeof(*threads));
+	if (!threads)
+		goto fail;
+
+	/* The first one is this thread */
+	for (started = 1; started < nr_threads; started++) {
+		threads[started].work = &work;
+		if (pthread_create(&threads[started].thread, NULL,
+				   page_index_thread, &threads[started]))
+			break;
+	}
+
+	threads[0].work = &work;
+	page_index_thread(&threads[0]);
+
+	for (i = 0; i < started; i++) {
+		if (i)
+			pthread_join(threads[i].thread, NULL);
+		if (threads[i].failed)
+			failed = 1;
+	}
+	free(threads);
+
+	if (failed) {
+		warning("bad page read while indexing");
+		goto fail;
+	}
+
+	return 0;
+
+ fail:
+	for (cpu = 0; cpu < handle->cpus; cpu++) {
+		free(index[cpu]);
+		index[cpu] = NULL;
+		nr_pages[cpu] = 0;
+	}
+	return -1;
+}
+
 /**
  * tracecmd_translate_data - create a record from raw data
  * @handle: input handle for the trace.dat file
@@ -1617,6 +1970,7 @@ tracecmd_translate_data(struct tracecmd_input *handle,
 	if (!record)
 		return NULL;
 	memset(record, 0, sizeof(*record));
+	stats_inc(&handle->stats, records);
 
 	record->ref_count = 1;
 	if (pevent->host_bigendian == pevent->file_bigendian)
@@ -1794,6 +2148,7 @@ read_again:
 	if (!record)
 		return NULL;
 	memset(record, 0, sizeof(*record));
+	stats_inc(&handle->stats, records);
 
 	record->ts = handle->cpu_data[cpu].timestamp;
 	record->size = kbuffer_event_size(kbuf);
@@ -2026,8 +2381,6 @@ static int init_cpu(struct tracecmd_input *handle, int cpu)
 	cpu_data->size = cpu_data->file_size;
 	cpu_data->timestamp = 0;
 
-	list_head_init(&cpu_data->page_maps);
-
 	if (!cpu_data->size) {
 		printf("CPU %d is empty\n", cpu);
 		return 0;
@@ -2106,6 +2459,20 @@ void tracecmd_set_ts2secs(struct tracecmd_input *handle,
 	handle->use_trace_clock = false;
 }
 
+/**
+ * tracecmd_ts_adjusted - test if the time stamps are not the ones in the file
+ * @handle: input handle for the trace.dat file
+ *
+ * Returns true if the time stamps of the records are offset or
+ * converted from the ones in the pages of the file. The pages can
+ * then not be copied as they are into another file that is read
+ * without the same adjustments.
+ */
+int tracecmd_ts_adjusted(struct tracecmd_input *handle)
+{
+	return handle->ts_offset || handle->ts2secs;
+}
+
 static int handle_options(struct tracecmd_input *handle)
 {
 	unsigned long long offset;
@@ -2399,18 +2766,21 @@ static int read_and_parse_trace_clock(struct tracecmd_input *handle,
 int tracecmd_init_data(struct tracecmd_input *handle)
 {
 	struct pevent *pevent = handle->pevent;
+	unsigned long long start = stats_start();
     unsigned int cpus;
 	int ret;
 
-	if (read4(handle, &cpus) < 0)
-		return -1;
+	if (read4(handle, &cpus) < 0) {
+		ret = -1;
+		goto out;
+	}
 	handle->cpus = cpus;
 
 	pevent_set_cpus(pevent, handle->cpus);
 
 	ret = read_cpu_data(handle);
 	if (ret < 0)
-		return ret;
+		goto out;
 
 	if (handle->use_trace_clock) {
 		/*
@@ -2428,6 +2798,8 @@ int tracecmd_init_data(struct tracecmd_input *handle)
 
 	tracecmd_blk_hack(handle);
 
+ out:
+	stats_end(&handle->stats, open_ns, start);
 	return ret;
 }
 
@@ -2585,6 +2957,15 @@ struct hook_list *tracecmd_hooks(struct tracecmd_input *handle)
 	return handle->hooks;
 }
 
+static int init_page_map_cache(struct tracecmd_input *handle)
+{
+	memset(&handle->page_map_stats, 0, sizeof(handle->page_map_stats));
+	handle->page_map_mapped = 0;
+	list_head_init(&handle->page_map_lru);
+
+	return trace_hash_init(&handle->page_map_hash, PAGE_MAP_HASH_SIZE);
+}
+
 /**
  * tracecmd_alloc_fd - create a tracecmd_input handle from a file descriptor
  * @fd: the file descriptor for the trace.dat file
@@ -2602,6 +2983,7 @@ struct hook_list *tracecmd_hooks(struct tracecmd_input *handle)
 struct tracecmd_input *tracecmd_alloc_fd(int fd)
 {
 	struct tracecmd_input *handle;
+	unsigned long long start = stats_start();
 	char test[] = { 23, 8, 68 };
     unsigned int page_size;
 	char *version;
@@ -2615,6 +2997,10 @@ struct tracecmd_input *tracecmd_alloc_fd(int fd)
 	handle->fd = fd;
 	handle->ref = 1;
 
+	if (init_page_map_cache(handle) < 0)
+		goto failed_read;
+	handle->page_map_budget = DEFAULT_PAGE_MAP_BUDGET;
+
 	if (do_read_check(handle, buf, 3))
 		goto failed_read;
 
@@ -2662,9 +3048,12 @@ struct tracecmd_input *tracecmd_alloc_fd(int fd)
 	handle->header_files_start =
 		lseek64(handle->fd, handle->header_files_start, SEEK_SET);
 
+	stats_end(&handle->stats, open_ns, start);
+
 	return handle;
 
  failed_read:
+	trace_hash_free(&handle->page_map_hash);
 	free(handle);
 
 	return NULL;
@@ -2736,6 +3125,42 @@ struct tracecmd_input *tracecmd_open(const char *file)
 	return tracecmd_open_fd(fd);
 }
 
+/**
+ * tracecmd_open_again - open the file of a handle again
+ * @handle: input handle for the trace.dat file
+ *
+ * Returns a new handle of the same file, with its own file descriptor
+ * and cursors, that can be read from another thread than @handle. The
+ * timestamps are adjusted as they are by @handle.
+ *
+ * Returns NULL on error, or if @handle does not read a whole file.
+ */
+struct tracecmd_input *tracecmd_open_again(struct tracecmd_input *handle)
+{
+	struct tracecmd_input *new_handle;
+	char path[64];
+	int fd;
+
+	if (handle->use_pipe || handle->flags & TRACECMD_FL_BUFFER_INSTANCE)
+		return NULL;
+
+	/* Not dup(), the new handle must not share the file offset */
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", handle->fd);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	new_handle = tracecmd_open_fd(fd);
+	if (!new_handle)
+		return NULL;
+
+	new_handle->ts_offset = handle->ts_offset;
+	new_handle->ts2secs = handle->ts2secs;
+	new_handle->use_trace_clock = handle->use_trace_clock;
+
+	return new_handle;
+}
+
 /**
  * tracecmd_ref - add a reference to the handle
  * @handle: input handle for the trace.dat file
@@ -2781,7 +3206,7 @@ void tracecmd_close(struct tracecmd_input *handle)
 		if (handle->cpu_data && handle->cpu_data[cpu].kbuf) {
 			kbuffer_free(handle->cpu_data[cpu].kbuf);
 			if (handle->cpu_data[cpu].page_map)
-				free_page_map(handle->cpu_data[cpu].page_map);
+				free_page_map(handle, handle->cpu_data[cpu].page_map);
 
 			if (handle->cpu_data[cpu].page_cnt)
 				warning("%d pages still allocated on cpu %d%s",
@@ -2791,6 +3216,10 @@ void tracecmd_close(struct tracecmd_input *handle)
 		}
 	}
 
+	/* Unmap what is left in the page map cache */
+	trim_page_maps(handle, 0);
+	trace_hash_free(&handle->page_map_hash);
+
 	free(handle->cpustats);
 	free(handle->cpu_data);
 	free(handle->uname);
@@ -3136,6 +3565,11 @@ tracecmd_buffer_instance_handle(struct tracecmd_input *handle, int indx)
 	new_handle->parent = handle;
 	new_handle->cpustats = NULL;
 	new_handle->hooks = NULL;
+	memset(&new_handle->stats, 0, sizeof(new_handle->stats));
+	if (init_page_map_cache(new_handle) < 0) {
+		free(new_handle);
+		return NULL;
+	}
 	if (handle->uname)
 		/* Ignore if fails to malloc, no biggy */
 		new_handle->uname = strdup(handle->uname);
@@ -3242,3 +3676,75 @@ void tracecmd_set_show_data_func(struct tracecmd_input *handle,
 {
 	handle->show_data_func = func;
 }
+
+/**
+ * tracecmd_set_page_map_budget - limit the memory cached by page maps
+ * @handle: input handle for the trace.dat file
+ * @budget: the number of bytes of the file that may be mapped
+ *
+ * Parts of the file that are no longer referenced by any record stay
+ * mapped so that reading them again is cheap. Once more than @budget
+ * bytes are mapped, the least recently used of them are unmapped.
+ * Maps still referenced by records are never unmapped, and count
+ * against the budget. A budget of zero unmaps them as soon as
+ * they are no longer used.
+ */
+void tracecmd_set_page_map_budget(struct tracecmd_input *handle,
+				  unsigned long long budget)
+{
+	handle->page_map_budget = budget;
+	trim_page_maps(handle, budget);
+}
+
+/**
+ * tracecmd_get_page_map_budget - return the page map memory budget
+ * @handle: input handle for the trace.dat file
+ */
+unsigned long long
+tracecmd_get_page_map_budget(struct tracecmd_input *handle)
+{
+	return handle->page_map_budget;
+}
+
+/**
+ * tracecmd_get_page_map_stats - read the page map cache counters
+ * @handle: input handle for the trace.dat file
+ * @stats: where to store the counters
+ *
+ * Fills @stats with the number of times a page was found in an
+ * existing map (hits), needed a new map (misses), and the number
+ * of unused maps that were unmapped to stay within the budget
+ * (evictions), as well as the number of bytes currently mapped.
+ */
+void tracecmd_get_page_map_stats(struct tracecmd_input *handle,
+				 struct tracecmd_page_map_stats *stats)
+{
+	*stats = handle->page_map_stats;
+	stats->mapped = handle->page_map_mapped;
+}
+
+/**
+ * tracecmd_get_stats - read the counters of the work done on a handle
+ * @handle: input handle for the trace.dat file
+ * @stats: where to store the counters
+ *
+ * Fills @stats with the number of pages mapped, unmapped and read,
+ * the bytes read from the file, the records decoded, and the time
+ * spent opening the file and loading pages. The work of parsing,
+ * filtering and printing events is kept by the pevent of the handle,
+ * see pevent_get_stats().
+ *
+ * Returns 0 on success, or -1 if the library was built with
+ * NO_SELF_STATS and does not keep any counters.
+ */
+int tracecmd_get_stats(struct tracecmd_input *handle,
+		       struct tracecmd_input_stats *stats)
+{
+#ifdef NO_SELF_STATS
+	memset(stats, 0, sizeof(*stats));
+	return -1;
+#else
+	*stats = handle->stats;
+	return 0;
+#endif
+}
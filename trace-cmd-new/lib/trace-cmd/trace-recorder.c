@@ -18,6 +18,12 @@
 #include <ctype.h>
 #include <errno.h>
 
+#ifndef NO_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
 #include "trace-cmd.h"
 #include "event-utils.h"
 
@@ -41,6 +47,32 @@ struct tracecmd_recorder {
 	int		count;
 	unsigned	fd_flags;
 	unsigned	flags;
+	/* For recording into a ring of segments */
+	int		segs_fd;
+	int		nr_segs;
+	int		seg;
+	int		segs_failed;
+	unsigned long long	seg_size;
+	struct tracecmd_segment	segment;
+	/* For TRACECMD_RECORD_URING */
+	struct recorder_uring	*uring;
+	struct tracecmd_recorder_stats	*stats;
+	unsigned long long	round_start;
+};
+
+/*
+ * The manifest of the segments is a header followed by one
+ * struct tracecmd_segment for each segment of the CPU file.
+ * It is in the endian of the machine that recorded it.
+ */
+#define SEGS_MAGIC	"tcmdsegs"
+#define SEGS_EXT	".segs"
+
+struct segs_header {
+	char			magic[8];
+	unsigned int		nr_segs;
+	unsigned int		page_size;
+	unsigned long long	seg_size;
 };
 
 static int append_file(int size, int dst, int src)
@@ -62,11 +94,533 @@ static int append_file(int size, int dst, int src)
 	return 0;
 }
 
+static unsigned long long page_ts(struct tracecmd_recorder *recorder,
+				  unsigned long long offset)
+{
+	unsigned long long ts;
+
+	/* The time stamp of the page is the start of its header */
+	if (pread64(recorder->fd, &ts, sizeof(ts), offset) != sizeof(ts))
+		return 0;
+
+	return ts;
+}
+
+static int write_segment(struct tracecmd_recorder *recorder)
+{
+	off64_t offset;
+
+	offset = sizeof(struct segs_header) +
+		recorder->seg * sizeof(recorder->segment);
+	if (pwrite64(recorder->segs_fd, &recorder->segment,
+		     sizeof(recorder->segment), offset) != sizeof(recorder->segment)) {
+		warning("recorder error writing the manifest of the segments");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int close_segment(struct tracecmd_recorder *recorder)
+{
+	struct tracecmd_segment *segment = &recorder->segment;
+	unsigned long long last;
+
+	if (!segment->size)
+		return 0;
+
+	last = (segment->size - 1) & ~((unsigned long long)recorder->page_size - 1);
+	segment->last_ts = page_ts(recorder, segment->offset + last);
+
+	return write_segment(recorder);
+}
+
+/*
+ * The segment written to is full: record it in the manifest, and
+ * start to write over the oldest segment. Its entry is cleared before
+ * its data is overwritten, to never list data that is not there.
+ * If that can not be done, nothing more may be written.
+ */
+static int next_segment(struct tracecmd_recorder *recorder)
+{
+	struct tracecmd_segment *segment = &recorder->segment;
+
+	if (close_segment(recorder) < 0)
+		return -1;
+
+	recorder->seg = (recorder->seg + 1) % recorder->nr_segs;
+
+	segment->seq++;
+	segment->offset = recorder->seg * recorder->seg_size;
+	segment->size = 0;
+	segment->first_ts = 0;
+	segment->last_ts = 0;
+	if (write_segment(recorder) < 0)
+		return -1;
+
+	if (lseek64(recorder->fd, segment->offset, SEEK_SET) == (off64_t)-1) {
+		warning("recorder error seeking to segment %d", recorder->seg);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * How much of @size can be written before the segment is full,
+ * or -1 once the segments can no longer be kept.
+ */
+static long segment_room(struct tracecmd_recorder *recorder, long size)
+{
+	unsigned long long room;
+
+	if (!recorder->nr_segs)
+		return size;
+
+	if (recorder->segs_failed)
+		return -1;
+
+	if (recorder->segment.size >= recorder->seg_size &&
+	    next_segment(recorder) < 0) {
+		recorder->segs_failed = 1;
+		return -1;
+	}
+
+	room = recorder->seg_size - recorder->segment.size;
+
+	return size > room ? room : size;
+}
+
+#ifndef NO_IO_URING
+/*
+ * With TRACECMD_RECORD_URING, the splices (or the reads and writes) of
+ * up to URING_BATCH chunks of data are handed to the kernel in one
+ * io_uring_enter() call, instead of a system call for each. The ring is
+ * driven with the system calls directly, to not depend on liburing.
+ */
+#define URING_BATCH	8
+#define URING_ENTRIES	(URING_BATCH * 2)
+
+struct recorder_uring {
+	int			fd;
+	unsigned		*sq_tail;
+	unsigned		*sq_mask;
+	unsigned		*sq_array;
+	unsigned		*cq_head;
+	unsigned		*cq_tail;
+	unsigned		*cq_mask;
+	struct io_uring_sqe	*sqes;
+	struct io_uring_cqe	*cqes;
+	void			*sq_ring;
+	size_t			sq_ring_size;
+	void			*cq_ring;
+	size_t			cq_ring_size;
+	size_t			sqes_size;
+	unsigned		tail;
+	unsigned		queued;
+	int			res[URING_ENTRIES];
+	char			*bufs;
+};
+
+static void free_uring(struct recorder_uring *uring)
+{
+	if (!uring)
+		return;
+
+	if (uring->sqes)
+		munmap(uring->sqes, uring->sqes_size);
+	if (uring->cq_ring && uring->cq_ring != uring->sq_ring)
+		munmap(uring->cq_ring, uring->cq_ring_size);
+	if (uring->sq_ring)
+		munmap(uring->sq_ring, uring->sq_ring_size);
+	if (uring->fd >= 0)
+		close(uring->fd);
+	free(uring->bufs);
+	free(uring);
+}
+
+/* The kernel must be able to do all the operations the recorder needs */
+static int uring_probe(int fd)
+{
+	struct io_uring_probe *probe;
+	size_t size;
+	int ret;
+
+	size = sizeof(*probe) + IORING_OP_LAST * sizeof(probe->ops[0]);
+	probe = calloc(1, size);
+	if (!probe)
+		return -1;
+
+	ret = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE,
+		      probe, IORING_OP_LAST);
+	if (ret >= 0 &&
+	    (probe->last_op < IORING_OP_SPLICE ||
+	     !(probe->ops[IORING_OP_SPLICE].flags & IO_URING_OP_SUPPORTED) ||
+	     !(probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) ||
+	     !(probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED)))
+		ret = -1;
+
+	free(probe);
+	return ret < 0 ? -1 : 0;
+}
+
+static struct recorder_uring *alloc_uring(struct tracecmd_recorder *recorder)
+{
+	struct recorder_uring *uring;
+	struct io_uring_params p;
+
+	uring = calloc(1, sizeof(*uring));
+	if (!uring)
+		return NULL;
+
+	memset(&p, 0, sizeof(p));
+	uring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if (uring->fd < 0)
+		goto fail;
+
+	/* Writes go to the position of the file, like write() */
+	if (!(p.features & IORING_FEAT_RW_CUR_POS) || uring_probe(uring->fd) < 0)
+		goto fail;
+
+	uring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	uring->cq_ring_size = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (uring->cq_ring_size > uring->sq_ring_size)
+			uring->sq_ring_size = uring->cq_ring_size;
+		uring->cq_ring_size = uring->sq_ring_size;
+	}
+
+	uring->sq_ring = mmap(NULL, uring->sq_ring_size, PROT_READ | PROT_WRITE,
+			      MAP_SHARED | MAP_POPULATE, uring->fd,
+			      IORING_OFF_SQ_RING);
+	if (uring->sq_ring == MAP_FAILED) {
+		uring->sq_ring = NULL;
+		goto fail;
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		uring->cq_ring = uring->sq_ring;
+	} else {
+		uring->cq_ring = mmap(NULL, uring->cq_ring_size,
+				      PROT_READ | PROT_WRITE,
+				      MAP_SHARED | MAP_POPULATE, uring->fd,
+				      IORING_OFF_CQ_RING);
+		if (uring->cq_ring == MAP_FAILED) {
+			uring->cq_ring = NULL;
+			goto fail;
+		}
+	}
+
+	uring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	uring->sqes = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, uring->fd,
+			   IORING_OFF_SQES);
+	if (uring->sqes == MAP_FAILED) {
+		uring->sqes = NULL;
+		goto fail;
+	}
+
+	uring->sq_tail = uring->sq_ring + p.sq_off.tail;
+	uring->sq_mask = uring->sq_ring + p.sq_off.ring_mask;
+	uring->sq_array = uring->sq_ring + p.sq_off.array;
+	uring->cq_head = uring->cq_ring + p.cq_off.head;
+	uring->cq_tail = uring->cq_ring + p.cq_off.tail;
+	uring->cq_mask = uring->cq_ring + p.cq_off.ring_mask;
+	uring->cqes = uring->cq_ring + p.cq_off.cqes;
+	uring->tail = *uring->sq_tail;
+
+	if (recorder->flags & TRACECMD_RECORD_NOSPLICE) {
+		uring->bufs = malloc(URING_BATCH * recorder->page_size);
+		if (!uring->bufs)
+			goto fail;
+	}
+
+	return uring;
+
+ fail:
+	free_uring(uring);
+	return NULL;
+}
+
+static struct io_uring_sqe *uring_sqe(struct recorder_uring *uring,
+				      int op, int fd, int index)
+{
+	struct io_uring_sqe *sqe;
+	unsigned idx;
+
+	idx = uring->tail++ & *uring->sq_mask;
+	uring->sq_array[idx] = idx;
+	uring->queued++;
+
+	sqe = &uring->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = op;
+	sqe->fd = fd;
+	/* -1 is the file position, for the offsets of all operations */
+	sqe->off = -1;
+	sqe->user_data = index;
+
+	return sqe;
+}
+
+/* Submit what is queued and wait for all of it to complete */
+static int uring_run(struct recorder_uring *uring)
+{
+	struct io_uring_cqe *cqe;
+	unsigned head;
+	int submit = uring->queued;
+	int wait = uring->queued;
+	int ret;
+
+	__atomic_store_n(uring->sq_tail, uring->tail, __ATOMIC_RELEASE);
+
+	while (wait) {
+		ret = syscall(__NR_io_uring_enter, uring->fd, submit, wait,
+			      IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret < 0 && errno != EINTR)
+			return -1;
+		if (ret > 0)
+			submit -= ret;
+
+		head = *uring->cq_head;
+		while (head != __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE)) {
+			cqe = &uring->cqes[head & *uring->cq_mask];
+			uring->res[cqe->user_data] = cqe->res;
+			head++;
+			wait--;
+		}
+		__atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	uring->queued = 0;
+
+	return 0;
+}
+
+/*
+ * Each chunk is a splice into the pipe, and one out of it. The splices
+ * are hard linked to run in order, even when one moves nothing. All are
+ * non blocking, an empty buffer fails them with EAGAIN.
+ */
+static long uring_splice_data(struct tracecmd_recorder *recorder)
+{
+	struct recorder_uring *uring = recorder->uring;
+	struct io_uring_sqe *sqe;
+	long total_in = 0;
+	long total_out = 0;
+	long ret;
+	int i;
+
+	for (i = 0; i < URING_BATCH; i++) {
+		sqe = uring_sqe(uring, IORING_OP_SPLICE, recorder->brass[1], i * 2);
+		sqe->splice_fd_in = recorder->trace_fd;
+		sqe->splice_off_in = -1;
+		sqe->len = recorder->pipe_size;
+		sqe->splice_flags = SPLICE_F_MOVE | SPLICE_F_NONBLOCK;
+		sqe->flags = IOSQE_IO_HARDLINK;
+
+		sqe = uring_sqe(uring, IORING_OP_SPLICE, recorder->fd, i * 2 + 1);
+		sqe->splice_fd_in = recorder->brass[0];
+		sqe->splice_off_in = -1;
+		sqe->len = recorder->pipe_size;
+		sqe->splice_flags = SPLICE_F_MOVE | SPLICE_F_NONBLOCK;
+		if (i < URING_BATCH - 1)
+			sqe->flags = IOSQE_IO_HARDLINK;
+	}
+
+	if (uring_run(uring) < 0) {
+		warning("recorder error in io_uring");
+		return -1;
+	}
+
+	for (i = 0; i < URING_BATCH; i++) {
+		ret = uring->res[i * 2];
+		if (ret > 0)
+			total_in += ret;
+		else if (ret < 0 && ret != -EAGAIN && ret != -EINTR) {
+			errno = -ret;
+			warning("recorder error in splice input");
+			return -1;
+		}
+
+		ret = uring->res[i * 2 + 1];
+		if (ret > 0)
+			total_out += ret;
+		else if (ret < 0 && ret != -EAGAIN && ret != -EINTR) {
+			errno = -ret;
+			warning("recorder error in splice output");
+			return -1;
+		}
+	}
+
+	/* Move out what is left in the pipe, like splice_data() does */
+	while (total_out < total_in) {
+		ret = splice(recorder->brass[0], NULL, recorder->fd, NULL,
+			     total_in - total_out, recorder->fd_flags);
+		if (ret < 0) {
+			if (errno != EAGAIN && errno != EINTR) {
+				warning("recorder error in splice output");
+				return -1;
+			}
+			break;
+		}
+		total_out += ret;
+	}
+
+	return total_in;
+}
+
+static long write_data(struct tracecmd_recorder *recorder, char *buf, long size);
+
+/*
+ * The reads of the pages are linked, a short or failed read cancels the
+ * ones after it. The writes of what was read are linked as well, to
+ * keep the order of the pages in the file.
+ */
+static long uring_read_data(struct tracecmd_recorder *recorder)
+{
+	struct recorder_uring *uring = recorder->uring;
+	struct io_uring_sqe *sqe;
+	long total = 0;
+	long ret;
+	int nr;
+	int i;
+
+	for (i = 0; i < URING_BATCH; i++) {
+		sqe = uring_sqe(uring, IORING_OP_READ, recorder->trace_fd, i);
+		sqe->addr = (unsigned long)(uring->bufs + i * recorder->page_size);
+		sqe->len = recorder->page_size;
+		if (i < URING_BATCH - 1)
+			sqe->flags = IOSQE_IO_LINK;
+	}
+
+	if (uring_run(uring) < 0) {
+		warning("recorder error in io_uring");
+		return -1;
+	}
+
+	for (nr = 0; nr < URING_BATCH; nr++) {
+		ret = uring->res[nr];
+		if (ret <= 0)
+			break;
+		total += ret;
+	}
+
+	if (ret < 0 && ret != -EAGAIN && ret != -EINTR && ret != -ECANCELED) {
+		errno = -ret;
+		warning("recorder error in read output");
+		return -1;
+	}
+
+	if (!nr)
+		return 0;
+
+	for (i = 0; i < nr; i++) {
+		sqe = uring_sqe(uring, IORING_OP_WRITE, recorder->fd, i);
+		sqe->addr = (unsigned long)(uring->bufs + i * recorder->page_size);
+		sqe->len = uring->res[i];
+		if (i < nr - 1)
+			sqe->flags = IOSQE_IO_LINK;
+	}
+
+	/* Keep the sizes read, the writes return theirs in res */
+	for (i = 0; i < nr; i++)
+		uring->res[URING_BATCH + i] = uring->res[i];
+
+	if (uring_run(uring) < 0) {
+		warning("recorder error in io_uring");
+		return -1;
+	}
+
+	/* Write what a short write or a cancelled one left over */
+	for (i = 0; i < nr; i++) {
+		long size = uring->res[URING_BATCH + i];
+		long done = uring->res[i];
+
+		if (done == size)
+			continue;
+		if (done < 0 && done != -ECANCELED && done != -EAGAIN &&
+		    done != -EINTR) {
+			errno = -done;
+			warning("recorder error in write output");
+			return -1;
+		}
+		if (done < 0)
+			done = 0;
+
+		ret = write_data(recorder, uring->bufs + i * recorder->page_size + done,
+				 size - done);
+		if (ret < 0)
+			return ret;
+	}
+
+	return total;
+}
+
+/*
+ * Fall back to the system calls when the kernel has no io_uring, or
+ * -m is used, which switches the file between the writes.
+ */
+static bool use_uring(struct tracecmd_recorder *recorder)
+{
+	long flags;
+
+	if (!(recorder->flags & TRACECMD_RECORD_URING))
+		return false;
+
+	if (recorder->uring)
+		return true;
+
+	if (!recorder->max && !recorder->nr_segs)
+		recorder->uring = alloc_uring(recorder);
+
+	if (!recorder->uring) {
+		recorder->flags &= ~TRACECMD_RECORD_URING;
+		return false;
+	}
+
+	/* Poll the buffer, the linked operations must not wait for data */
+	flags = fcntl(recorder->trace_fd, F_GETFL);
+	fcntl(recorder->trace_fd, F_SETFL, flags | O_NONBLOCK);
+
+	return true;
+}
+#else
+struct recorder_uring;
+
+static void free_uring(struct recorder_uring *uring) { }
+
+static bool use_uring(struct tracecmd_recorder *recorder)
+{
+	return false;
+}
+
+static long uring_splice_data(struct tracecmd_recorder *recorder)
+{
+	return -1;
+}
+
+static long uring_read_data(struct tracecmd_recorder *recorder)
+{
+	return -1;
+}
+#endif /* NO_IO_URING */
+
 void tracecmd_free_recorder(struct tracecmd_recorder *recorder)
 {
 	if (!recorder)
 		return;
 
+	if (recorder->segs_fd >= 0) {
+		/* After a failure, the manifest is left as it was */
+		if (!recorder->segs_failed)
+			close_segment(recorder);
+		close(recorder->segs_fd);
+	}
+
+	free_uring(recorder->uring);
+
 	if (recorder->max) {
 		/* Need to put everything into fd1 */
 		if (recorder->fd == recorder->fd1) {
@@ -125,6 +679,11 @@ tracecmd_create_buffer_recorder_fd2(int fd, int fd2, int cpu, unsigned flags,
 	recorder->trace_fd = -1;
 	recorder->brass[0] = -1;
 	recorder->brass[1] = -1;
+	recorder->segs_fd = -1;
+	recorder->nr_segs = 0;
+	recorder->segs_failed = 0;
+	recorder->uring = NULL;
+	recorder->stats = NULL;
 
 	recorder->page_size = getpagesize();
 	if (maxkb) {
@@ -204,6 +763,9 @@ tracecmd_create_buffer_recorder(const char *file, int cpu, unsigned flags, const
 	if (fd < 0)
 		return NULL;
 
+	/* A manifest of what was in the file before is no longer valid */
+	tracecmd_delete_segments(file);
+
 	recorder = tracecmd_create_buffer_recorder_fd(fd, cpu, flags, buffer);
 	if (!recorder) {
 		close(fd);
@@ -233,6 +795,8 @@ tracecmd_create_buffer_recorder_maxkb(const char *file, int cpu, unsigned flags,
 
 	sprintf(file2, "%s.1", file);
 
+	tracecmd_delete_segments(file);
+
 	fd = open(file, O_RDWR | O_CREAT | O_TRUNC | O_LARGEFILE, 0644);
 	if (fd < 0)
 		goto out;
@@ -258,6 +822,210 @@ tracecmd_create_buffer_recorder_maxkb(const char *file, int cpu, unsigned flags,
 	goto out;
 }
 
+static char *segs_file(const char *file)
+{
+	char *path;
+
+	if (asprintf(&path, "%s" SEGS_EXT, file) < 0)
+		return NULL;
+
+	return path;
+}
+
+/**
+ * tracecmd_create_buffer_recorder_segs - record into a ring of segments
+ * @file: the file to record into
+ * @cpu: the CPU to record
+ * @flags: the TRACECMD_RECORD_* flags
+ * @buffer: the tracing directory of the buffer to record
+ * @maxkb: the size of the file, in kilobytes
+ * @segs: the number of segments to split the file into
+ *
+ * Like tracecmd_create_buffer_recorder_maxkb(), but the file is split
+ * into @segs segments of the same size. When all segments are full, the
+ * oldest one is written over, so only one segment of the history is
+ * lost at a time. The order and the time stamps of the segments are kept
+ * in a manifest next to the file, see tracecmd_read_segments().
+ *
+ * With less than two segments, or no @maxkb, this is the same as
+ * tracecmd_create_buffer_recorder_maxkb().
+ */
+struct tracecmd_recorder *
+tracecmd_create_buffer_recorder_segs(const char *file, int cpu, unsigned flags,
+				     const char *buffer, int maxkb, int segs)
+{
+	struct tracecmd_recorder *recorder;
+	struct segs_header header;
+	unsigned long long size;
+	char *path;
+	int segs_fd;
+	int fd;
+
+	if (!maxkb || segs < 2)
+		return tracecmd_create_buffer_recorder_maxkb(file, cpu, flags,
+							     buffer, maxkb);
+
+	path = segs_file(file);
+	if (!path)
+		return NULL;
+
+	fd = open(file, O_RDWR | O_CREAT | O_TRUNC | O_LARGEFILE, 0644);
+	if (fd < 0)
+		goto out_free;
+
+	segs_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (segs_fd < 0)
+		goto out_close;
+
+	recorder = tracecmd_create_buffer_recorder_fd2(fd, -1, cpu, flags,
+						       buffer, 0);
+	if (!recorder)
+		goto out_close_segs;
+
+	recorder->segs_fd = segs_fd;
+	recorder->nr_segs = segs;
+
+	/* Each segment holds whole pages */
+	size = (unsigned long long)maxkb * 1024 / segs;
+	size &= ~((unsigned long long)recorder->page_size - 1);
+	if (!size)
+		size = recorder->page_size;
+	recorder->seg_size = size;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SEGS_MAGIC, sizeof(header.magic));
+	header.nr_segs = segs;
+	header.page_size = recorder->page_size;
+	header.seg_size = size;
+
+	/* All segments start out unused */
+	if (write(segs_fd, &header, sizeof(header)) != sizeof(header) ||
+	    ftruncate(segs_fd, sizeof(header) +
+		      segs * sizeof(struct tracecmd_segment)) < 0) {
+		tracecmd_free_recorder(recorder);
+		unlink(file);
+		unlink(path);
+		free(path);
+		return NULL;
+	}
+
+	memset(&recorder->segment, 0, sizeof(recorder->segment));
+	recorder->segment.seq = 1;
+	recorder->seg = 0;
+	if (write_segment(recorder) < 0) {
+		tracecmd_free_recorder(recorder);
+		unlink(file);
+		unlink(path);
+		free(path);
+		return NULL;
+	}
+
+	free(path);
+	return recorder;
+
+ out_close_segs:
+	close(segs_fd);
+	unlink(path);
+ out_close:
+	close(fd);
+	unlink(file);
+ out_free:
+	free(path);
+	return NULL;
+}
+
+static int cmp_segments(const void *a, const void *b)
+{
+	const struct tracecmd_segment *sa = a;
+	const struct tracecmd_segment *sb = b;
+
+	if (sa->seq < sb->seq)
+		return -1;
+
+	return sa->seq > sb->seq;
+}
+
+/**
+ * tracecmd_read_segments - read the manifest of the segments of a file
+ * @file: the CPU file recorded by tracecmd_create_buffer_recorder_segs()
+ * @segments: returns an allocated array of the segments with data
+ *
+ * The segments are returned oldest first, the data of the CPU is their
+ * data in this order.
+ *
+ * Returns the number of segments, or -1 if @file has no manifest
+ * (with errno set to ENOENT) or it could not be read.
+ */
+int tracecmd_read_segments(const char *file, struct tracecmd_segment **segments)
+{
+	struct tracecmd_segment *segs;
+	struct segs_header header;
+	char *path;
+	ssize_t size;
+	int fd;
+	int nr;
+	int i;
+
+	path = segs_file(file);
+	if (!path)
+		return -1;
+
+	fd = open(path, O_RDONLY);
+	free(path);
+	if (fd < 0)
+		return -1;
+
+	if (read(fd, &header, sizeof(header)) != sizeof(header) ||
+	    memcmp(header.magic, SEGS_MAGIC, sizeof(header.magic)) != 0) {
+		warning("bad manifest of segments for %s", file);
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+
+	size = header.nr_segs * sizeof(*segs);
+	segs = malloc(size);
+	if (!segs) {
+		close(fd);
+		return -1;
+	}
+
+	if (read(fd, segs, size) != size) {
+		warning("truncated manifest of segments for %s", file);
+		free(segs);
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+	close(fd);
+
+	for (i = 0, nr = 0; i < header.nr_segs; i++) {
+		if (segs[i].seq && segs[i].size)
+			segs[nr++] = segs[i];
+	}
+
+	qsort(segs, nr, sizeof(*segs), cmp_segments);
+
+	*segments = segs;
+	return nr;
+}
+
+/**
+ * tracecmd_delete_segments - remove the manifest of the segments of a file
+ * @file: the CPU file that may have been recorded in segments
+ */
+void tracecmd_delete_segments(const char *file)
+{
+	char *path;
+
+	path = segs_file(file);
+	if (!path)
+		return;
+
+	unlink(path);
+	free(path);
+}
+
 struct tracecmd_recorder *tracecmd_create_recorder_fd(int fd, int cpu, unsigned flags)
 {
 	const char *tracing;
@@ -298,10 +1066,34 @@ tracecmd_create_recorder_maxkb(const char *file, int cpu, unsigned flags, int ma
 	return tracecmd_create_buffer_recorder_maxkb(file, cpu, flags, tracing, maxkb);
 }
 
+struct tracecmd_recorder *
+tracecmd_create_recorder_segs(const char *file, int cpu, unsigned flags,
+			      int maxkb, int segs)
+{
+	const char *tracing;
+
+	tracing = tracecmd_get_tracing_dir();
+	if (!tracing) {
+		errno = ENODEV;
+		return NULL;
+	}
+
+	return tracecmd_create_buffer_recorder_segs(file, cpu, flags, tracing,
+						    maxkb, segs);
+}
+
 static inline void update_fd(struct tracecmd_recorder *recorder, int size)
 {
 	int fd;
 
+	if (recorder->nr_segs) {
+		if (!recorder->segment.size)
+			recorder->segment.first_ts =
+				page_ts(recorder, recorder->segment.offset);
+		recorder->segment.size += size;
+		return;
+	}
+
 	if (!recorder->max)
 		return;
 
@@ -332,6 +1124,24 @@ static inline void update_fd(struct tracecmd_recorder *recorder, int size)
 	recorder->fd = fd;
 }
 
+static unsigned long long stats_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * A round of the stats starts when there is data to move, the wait
+ * of a blocking splice (or read) for a page is not part of it.
+ */
+static void start_round(struct tracecmd_recorder *recorder)
+{
+	if (recorder->stats)
+		recorder->round_start = stats_time();
+}
+
 /*
  * Returns -1 on error.
  *          or bytes of data read.
@@ -339,9 +1149,13 @@ static inline void update_fd(struct tracecmd_recorder *recorder, int size)
 static long splice_data(struct tracecmd_recorder *recorder)
 {
 	long total_read = 0;
+	long room;
 	long read;
 	long ret;
 
+	if (use_uring(recorder))
+		return uring_splice_data(recorder);
+
 	read = splice(recorder->trace_fd, NULL, recorder->brass[1], NULL,
 		      recorder->pipe_size, 1 /* SPLICE_F_MOVE */);
 	if (read < 0) {
@@ -353,9 +1167,15 @@ static long splice_data(struct tracecmd_recorder *recorder)
 	} else if (read == 0)
 		return 0;
 
+	start_round(recorder);
+
  again:
+	room = segment_room(recorder, read);
+	if (room < 0)
+		return -1;
+
 	ret = splice(recorder->brass[0], NULL, recorder->fd, NULL,
-		     read, recorder->fd_flags);
+		     room, recorder->fd_flags);
 	if (ret < 0) {
 		if (errno != EAGAIN && errno != EINTR) {
 			warning("recorder error in splice output");
@@ -364,7 +1184,7 @@ static long splice_data(struct tracecmd_recorder *recorder)
 		return total_read;
 	} else
 		update_fd(recorder, ret);
-	total_read = ret;
+	total_read += ret;
 	read -= ret;
 	if (read)
 		goto again;
@@ -372,6 +1192,33 @@ static long splice_data(struct tracecmd_recorder *recorder)
 	return total_read;
 }
 
+/*
+ * Returns -1 on error.
+ *          or bytes of data written.
+ */
+static long write_data(struct tracecmd_recorder *recorder, char *buf, long size)
+{
+	long left = size;
+	long room;
+	long w;
+
+	do {
+		room = segment_room(recorder, left);
+		if (room < 0)
+			return -1;
+		w = write(recorder->fd, buf + (size - left), room);
+		if (w > 0) {
+			left -= w;
+			update_fd(recorder, w);
+		}
+	} while (w >= 0 && left);
+
+	if (w < 0)
+		return w;
+
+	return size;
+}
+
 /*
  * Returns -1 on error.
  *          or bytes of data read.
@@ -379,8 +1226,10 @@ static long splice_data(struct tracecmd_recorder *recorder)
 static long read_data(struct tracecmd_recorder *recorder)
 {
 	char buf[recorder->page_size];
-	long left;
-	long r, w;
+	long r;
+
+	if (use_uring(recorder))
+		return uring_read_data(recorder);
 
 	r = read(recorder->trace_fd, buf, recorder->page_size);
 	if (r < 0) {
@@ -391,17 +1240,10 @@ static long read_data(struct tracecmd_recorder *recorder)
 		return 0;
 	}
 
-	left = r;
-	do {
-		w = write(recorder->fd, buf + (r - left), left);
-		if (w > 0) {
-			left -= w;
-			update_fd(recorder, w);
-		}
-	} while (w >= 0 && left);
-
-	if (w < 0)
-		r = w;
+	if (r) {
+		start_round(recorder);
+		r = write_data(recorder, buf, r);
+	}
 
 	return r;
 }
@@ -418,6 +1260,58 @@ static void set_nonblock(struct tracecmd_recorder *recorder)
 	recorder->fd_flags |= 2; /* NON_BLOCK */
 }
 
+/**
+ * tracecmd_recorder_set_stats - have a recorder keep stats of its work
+ * @recorder: the recorder
+ * @stats: where to keep them, or NULL to stop
+ *
+ * From now on, each splice (or read) of @recorder that moves data adds
+ * to @stats, with the time it took. The counters are only added to,
+ * a reader takes the difference between two reads for the rates.
+ */
+void tracecmd_recorder_set_stats(struct tracecmd_recorder *recorder,
+				 struct tracecmd_recorder_stats *stats)
+{
+	recorder->stats = stats;
+}
+
+/* Each counter is stored whole, a reader never sees half of one */
+#define stats_set(field, val) __atomic_store_n(&(field), val, __ATOMIC_RELAXED)
+
+static void update_stats(struct tracecmd_recorder *recorder, long ret)
+{
+	struct tracecmd_recorder_stats *stats = recorder->stats;
+	unsigned long long now = stats_time();
+	unsigned long long delta = now - recorder->round_start;
+
+	stats_set(stats->bytes, stats->bytes + ret);
+	stats_set(stats->pages, stats->pages +
+		  (ret + recorder->page_size - 1) / recorder->page_size);
+	stats_set(stats->rounds, stats->rounds + 1);
+	stats_set(stats->busy_ns, stats->busy_ns + delta);
+	if (delta > stats->max_ns)
+		stats_set(stats->max_ns, delta);
+	stats_set(stats->last_ns, now);
+}
+
+static long record_data(struct tracecmd_recorder *recorder)
+{
+	long ret;
+
+	/* The io_uring recorder does not wait, its rounds start here */
+	start_round(recorder);
+
+	if (recorder->flags & TRACECMD_RECORD_NOSPLICE)
+		ret = read_data(recorder);
+	else
+		ret = splice_data(recorder);
+
+	if (ret > 0 && recorder->stats)
+		update_stats(recorder, ret);
+
+	return ret;
+}
+
 long tracecmd_flush_recording(struct tracecmd_recorder *recorder)
 {
 	char buf[recorder->page_size];
@@ -428,10 +1322,7 @@ long tracecmd_flush_recording(struct tracecmd_recorder *recorder)
 	set_nonblock(recorder);
 
 	do {
-		if (recorder->flags & TRACECMD_RECORD_NOSPLICE)
-			ret = read_data(recorder);
-		else
-			ret = splice_data(recorder);
+		ret = record_data(recorder);
 		if (ret < 0)
 			return ret;
 		total += ret;
@@ -441,7 +1332,7 @@ long tracecmd_flush_recording(struct tracecmd_recorder *recorder)
 	do {
 		ret = read(recorder->trace_fd, buf, recorder->page_size);
 		if (ret > 0) {
-			write(recorder->fd, buf, ret);
+			write_data(recorder, buf, ret);
 			wrote += ret;
 		}
 
@@ -451,7 +1342,7 @@ long tracecmd_flush_recording(struct tracecmd_recorder *recorder)
 	wrote &= recorder->page_size - 1;
 	if (wrote) {
 		memset(buf, 0, recorder->page_size);
-		write(recorder->fd, buf, recorder->page_size - wrote);
+		write_data(recorder, buf, recorder->page_size - wrote);
 		total += recorder->page_size;
 	}
 
@@ -475,10 +1366,7 @@ int tracecmd_start_recording(struct tracecmd_recorder *recorder, unsigned long s
 		}
 		read = 0;
 		do {
-			if (recorder->flags & TRACECMD_RECORD_NOSPLICE)
-				ret = read_data(recorder);
-			else
-				ret = splice_data(recorder);
+			ret = record_data(recorder);
 			if (ret < 0)
 				return ret;
 			read += ret;
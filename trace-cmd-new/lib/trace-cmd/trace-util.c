@@ -17,6 +17,7 @@
 #include <sys/mount.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 
 #include "trace-cmd.h"
 #include "event-utils.h"
@@ -757,6 +758,45 @@ const char *tracecmd_get_tracing_dir(void)
 	return tracing_dir;
 }
 
+/**
+ * tracecmd_copy_file_range - copy data from one file to another in the kernel
+ * @in_fd: the file to copy from
+ * @in_offset: where to copy from, or NULL to use the file position of @in_fd
+ * @out_fd: the file to copy to, at its file position
+ * @len: the number of bytes to copy
+ *
+ * Like copy_file_range(2), the data does not go through user space,
+ * and file systems that can share the blocks do not copy them at all.
+ * @in_offset is moved forward by what was copied.
+ *
+ * Returns the number of bytes copied, which may be less than @len,
+ * zero at the end of @in_fd, or -1 with errno set when the files
+ * can not be copied this way (ENOSYS, EXDEV, EINVAL). The caller is
+ * expected to fall back to reading and writing the data then.
+ */
+long long tracecmd_copy_file_range(int in_fd, unsigned long long *in_offset,
+				   int out_fd, unsigned long long len)
+{
+#ifdef __NR_copy_file_range
+	loff_t off;
+	long long r;
+
+	if (!in_offset)
+		return syscall(__NR_copy_file_range, in_fd, NULL,
+			       out_fd, NULL, (size_t)len, 0);
+
+	off = *in_offset;
+	r = syscall(__NR_copy_file_range, in_fd, &off,
+		    out_fd, NULL, (size_t)len, 0);
+	if (r > 0)
+		*in_offset = off;
+	return r;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
 /* FIXME: append_file() is duplicated and could be consolidated */
 static char *append_file(const char *dir, const char *name)
 {
@@ -1077,7 +1117,7 @@ static int load_events(struct pevent *pevent, const char *system,
 		if (len < 0)
 			goto free_format;
 
-		ret = pevent_parse_event(pevent, buf, len, system);
+		ret = pevent_parse_event_lazy(pevent, buf, len, system);
 		free(buf);
  free_format:
 		free(format);
@@ -1206,6 +1246,13 @@ int tracecmd_fill_local_events(const char *tracing_dir, struct pevent *pevent)
 	}
 
 	closedir(dir);
+
+	/* load_events() only read the formats, parse them all at once */
+	pevent->parsing_failures = 0;
+	pevent_parse_lazy_events(pevent);
+	if (pevent->parsing_failures)
+		failure = 1;
+
 	/* always succeed because parsing failures are not critical */
 	ret = 0;
 
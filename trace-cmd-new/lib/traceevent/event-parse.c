@@ -18,6 +18,8 @@
 #include <errno.h>
 #include <stdint.h>
 #include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <linux/string.h>
 #include <linux/time64.h>
 
@@ -25,14 +27,18 @@
 #include "event-parse.h"
 #include "event-utils.h"
 
-static const char *input_buf;
-static unsigned long long input_buf_ptr;
-static unsigned long long input_buf_siz;
+/*
+ * The parser state is per thread, so that formats can be parsed
+ * by several threads at once (see pevent_parse_lazy_events()).
+ */
+static __thread const char *input_buf;
+static __thread unsigned long long input_buf_ptr;
+static __thread unsigned long long input_buf_siz;
 
-static int is_flag_field;
-static int is_symbolic_field;
+static __thread int is_flag_field;
+static __thread int is_symbolic_field;
 
-static int show_warning = 1;
+static __thread int show_warning = 1;
 
 #define do_warning(fmt, ...)				\
 	do {						\
@@ -2416,7 +2422,7 @@ static int arg_num_eval(struct print_arg *arg, long long *val)
 static char *arg_eval (struct print_arg *arg)
 {
 	long long val;
-	static char buf[20];
+	static __thread char buf[20];
 
 	switch (arg->type) {
 	case PRINT_ATOM:
@@ -3370,6 +3376,16 @@ int pevent_read_number_field(struct format_field *field, const void *data,
 	}
 }
 
+static void parse_lazy_event(struct event_format *event);
+
+/* Parses the format of an event added by pevent_parse_event_lazy() */
+static inline struct event_format *event_parsed(struct event_format *event)
+{
+	if (event && event->lazy_format)
+		parse_lazy_event(event);
+	return event;
+}
+
 static int get_common_info(struct pevent *pevent,
 			   const char *type, int *offset, int *size)
 {
@@ -3385,7 +3401,7 @@ static int get_common_info(struct pevent *pevent,
 		return -1;
 	}
 
-	event = pevent->events[0];
+	event = event_parsed(pevent->events[0]);
 	field = pevent_find_common_field(event, type);
 	if (!field)
 		return -1;
@@ -3476,7 +3492,7 @@ struct event_format *pevent_find_event(struct pevent *pevent, int id)
 			   sizeof(*pevent->events), events_id_cmp);
 
 	if (eventptr) {
-		pevent->last_event = *eventptr;
+		pevent->last_event = event_parsed(*eventptr);
 		return *eventptr;
 	}
 
@@ -3516,7 +3532,7 @@ pevent_find_event_by_name(struct pevent *pevent,
 	if (i == pevent->nr_events)
 		event = NULL;
 
-	pevent->last_event = event;
+	pevent->last_event = event_parsed(event);
 	return event;
 }
 
@@ -5388,9 +5404,15 @@ int pevent_cmdline_pid(struct pevent *pevent, struct cmdline *cmdline)
 void pevent_event_info(struct trace_seq *s, struct event_format *event,
 		       struct pevent_record *record)
 {
+	struct pevent *pevent = event->pevent;
+	unsigned long long start = 0;
 	int print_pretty = 1;
 
-	if (event->pevent->print_raw || (event->flags & EVENT_FL_PRINTRAW))
+	stats_inc(&pevent->stats, format_calls);
+	if (pevent->flags & PEVENT_PROFILE_SELF)
+		start = stats_start();
+
+	if (pevent->print_raw || (event->flags & EVENT_FL_PRINTRAW))
 		pevent_print_fields(s, record->data, record->size, event);
 	else {
 
@@ -5403,6 +5425,9 @@ void pevent_event_info(struct trace_seq *s, struct event_format *event,
 	}
 
 	trace_seq_terminate(s);
+
+	if (start)
+		stats_end(&pevent->stats, format_ns, start);
 }
 
 static bool is_timestamp_in_us(char *trace_clock, bool use_trace_clock)
@@ -5626,6 +5651,9 @@ struct event_format **pevent_list_events(struct pevent *pevent, enum event_sort_
 	if (events && pevent->last_type == sort_type)
 		return events;
 
+	/* The callers may look at the fields of any of them */
+	pevent_parse_lazy_events(pevent);
+
 	if (!events) {
 		events = malloc(sizeof(*events) * (pevent->nr_events + 1));
 		if (!events)
@@ -6008,22 +6036,13 @@ static int find_event_handle(struct pevent *pevent, struct event_format *event)
 	return 1;
 }
 
-/**
- * __pevent_parse_format - parse the event format
- * @buf: the buffer storing the event format string
- * @size: the size of @buf
- * @sys: the system the event belongs to
- *
- * This parses the event format and creates an event structure
- * to quickly parse raw data for a given event.
- *
- * These files currently come from:
- *
- * /sys/kernel/debug/tracing/events/.../.../format
+/*
+ * Reads the name and ID at the start of a format, and creates the
+ * event for it. The rest of the format is left in the input buffer.
  */
-enum pevent_errno __pevent_parse_format(struct event_format **eventp,
-					struct pevent *pevent, const char *buf,
-					unsigned long size, const char *sys)
+static enum pevent_errno
+event_read_header(struct event_format **eventp, const char *buf,
+		  unsigned long size, const char *sys)
 {
 	struct event_format *event;
 	int ret;
@@ -6064,8 +6083,24 @@ enum pevent_errno __pevent_parse_format(struct event_format **eventp,
 		goto event_alloc_failed;
 	}
 
-	/* Add pevent to event so that it can be referenced */
-	event->pevent = pevent;
+	return 0;
+
+ event_alloc_failed:
+	free(event->system);
+	free(event->name);
+	free(event);
+	*eventp = NULL;
+	return ret;
+}
+
+/*
+ * Parses the fields and print format of an event, after its
+ * header was read by event_read_header().
+ */
+static enum pevent_errno
+event_read_body(struct pevent *pevent, struct event_format *event)
+{
+	int ret;
 
 	ret = event_read_format(event);
 	if (ret < 0) {
@@ -6077,7 +6112,7 @@ enum pevent_errno __pevent_parse_format(struct event_format **eventp,
 	 * If the event has an override, don't print warnings if the event
 	 * print format fails to parse.
 	 */
-	if (pevent && find_event_handle(pevent, event))
+	if (event->handler)
 		show_warning = 0;
 
 	ret = event_read_print(event);
@@ -6119,13 +6154,38 @@ enum pevent_errno __pevent_parse_format(struct event_format **eventp,
  event_parse_failed:
 	event->flags |= EVENT_FL_FAILED;
 	return ret;
+}
 
- event_alloc_failed:
-	free(event->system);
-	free(event->name);
-	free(event);
-	*eventp = NULL;
-	return ret;
+/**
+ * __pevent_parse_format - parse the event format
+ * @buf: the buffer storing the event format string
+ * @size: the size of @buf
+ * @sys: the system the event belongs to
+ *
+ * This parses the event format and creates an event structure
+ * to quickly parse raw data for a given event.
+ *
+ * These files currently come from:
+ *
+ * /sys/kernel/debug/tracing/events/.../.../format
+ */
+enum pevent_errno __pevent_parse_format(struct event_format **eventp,
+					struct pevent *pevent, const char *buf,
+					unsigned long size, const char *sys)
+{
+	int ret;
+
+	ret = event_read_header(eventp, buf, size, sys);
+	if (ret < 0)
+		return ret;
+
+	/* Add pevent to event so that it can be referenced */
+	(*eventp)->pevent = pevent;
+
+	if (pevent)
+		find_event_handle(pevent, *eventp);
+
+	return event_read_body(pevent, *eventp);
 }
 
 static enum pevent_errno
@@ -6134,9 +6194,15 @@ __pevent_parse_event(struct pevent *pevent,
 		     const char *buf, unsigned long size,
 		     const char *sys)
 {
+	unsigned long long start = stats_start();
 	int ret = __pevent_parse_format(eventp, pevent, buf, size, sys);
 	struct event_format *event = *eventp;
 
+	if (pevent) {
+		stats_inc(&pevent->stats, formats_parsed);
+		stats_end(&pevent->stats, parse_ns, start);
+	}
+
 	if (event == NULL)
 		return ret;
 
@@ -6200,6 +6266,196 @@ enum pevent_errno pevent_parse_event(struct pevent *pevent, const char *buf,
 	return __pevent_parse_event(pevent, &event, buf, size, sys);
 }
 
+/**
+ * pevent_parse_event_lazy - add an event, and parse its format later
+ * @pevent: the handle to the pevent
+ * @buf: the buffer storing the event format string
+ * @size: the size of @buf
+ * @sys: the system the event belongs to
+ *
+ * Like pevent_parse_event(), but only the name and ID of the event
+ * are read now. A copy of @buf is kept, and the fields and print
+ * format are parsed the first time the event is looked up. Most
+ * traces only use a few of the events they carry the formats of.
+ */
+enum pevent_errno pevent_parse_event_lazy(struct pevent *pevent,
+					  const char *buf,
+					  unsigned long size, const char *sys)
+{
+	struct event_format *event;
+	int ret;
+
+	ret = event_read_header(&event, buf, size, sys);
+	if (ret < 0)
+		return ret;
+
+	event->lazy_format = malloc(size);
+	if (!event->lazy_format) {
+		ret = PEVENT_ERRNO__MEM_ALLOC_FAILED;
+		goto failed;
+	}
+	memcpy(event->lazy_format, buf, size);
+	event->lazy_size = size;
+
+	if (add_event(pevent, event)) {
+		ret = PEVENT_ERRNO__MEM_ALLOC_FAILED;
+		goto failed;
+	}
+
+	/* Pick up a handler registered before the event was added */
+	find_event_handle(pevent, event);
+
+	return 0;
+
+ failed:
+	pevent_free_format(event);
+	return ret;
+}
+
+/*
+ * Only touches @event and @stats, so different events can be
+ * parsed at the same time.
+ */
+static int __parse_lazy_event(struct event_format *event,
+			      struct pevent_stats *stats)
+{
+	unsigned long long start = stats_start();
+	char *buf = event->lazy_format;
+	int ret;
+
+	/* Only try once, even if it fails */
+	event->lazy_format = NULL;
+
+	init_input_buf(buf, event->lazy_size);
+
+	/* The name and ID were read when the event was added */
+	free_token(event_read_name());
+	event_read_id();
+
+	ret = event_read_body(event->pevent, event);
+
+	stats_inc(stats, formats_parsed);
+	stats_end(stats, parse_ns, start);
+
+	free(buf);
+
+	return ret;
+}
+
+static void parse_lazy_event(struct event_format *event)
+{
+	struct pevent *pevent = event->pevent;
+
+	if (__parse_lazy_event(event, &pevent->stats))
+		pevent->parsing_failures = 1;
+}
+
+/* Do not bother starting a thread for less than this many formats */
+#define LAZY_EVENTS_PER_THREAD	64
+
+struct lazy_parse_work {
+	struct event_format	**events;
+	int			nr_events;
+	int			next;
+};
+
+struct lazy_parse_thread {
+	struct lazy_parse_work	*work;
+	struct pevent_stats	stats;
+	pthread_t		thread;
+	int			failed;
+};
+
+static void *lazy_parse_thread(void *data)
+{
+	struct lazy_parse_thread *thread = data;
+	struct lazy_parse_work *work = thread->work;
+	int i;
+
+	while ((i = __sync_fetch_and_add(&work->next, 1)) < work->nr_events) {
+		if (__parse_lazy_event(work->events[i], &thread->stats))
+			thread->failed = 1;
+	}
+
+	return NULL;
+}
+
+/**
+ * pevent_parse_lazy_events - parse the formats of all events now
+ * @pevent: the handle to the pevent
+ *
+ * Parses the formats of the events added by pevent_parse_event_lazy()
+ * that have not been used yet. pevent->parsing_failures is set if
+ * any of them fails to parse.
+ *
+ * When there are many of them, they are parsed by a thread per CPU.
+ * The events are already in place in the sorted events array, each
+ * thread only fills in the events it takes.
+ */
+void pevent_parse_lazy_events(struct pevent *pevent)
+{
+	struct lazy_parse_thread *threads;
+	struct lazy_parse_work work;
+	struct pevent_stats *stats;
+	long nr_threads;
+	int started;
+	int i;
+
+	memset(&work, 0, sizeof(work));
+
+	work.events = malloc(sizeof(*work.events) * pevent->nr_events);
+	if (!work.events)
+		goto serial;
+
+	for (i = 0; i < pevent->nr_events; i++) {
+		if (pevent->events[i]->lazy_format)
+			work.events[work.nr_events++] = pevent->events[i];
+	}
+
+	nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nr_threads > work.nr_events / LAZY_EVENTS_PER_THREAD)
+		nr_threads = work.nr_events / LAZY_EVENTS_PER_THREAD;
+	if (nr_threads < 2) {
+		free(work.events);
+		goto serial;
+	}
+
+	threads = calloc(nr_threads, sizeof(*threads));
+	if (!threads) {
+		free(work.events);
+		goto serial;
+	}
+
+	/* The first one is this thread */
+	for (started = 1; started < nr_threads; started++) {
+		threads[started].work = &work;
+		if (pthread_create(&threads[started].thread, NULL,
+				   lazy_parse_thread, &threads[started]))
+			break;
+	}
+
+	threads[0].work = &work;
+	lazy_parse_thread(&threads[0]);
+
+	for (i = 0; i < started; i++) {
+		if (i)
+			pthread_join(threads[i].thread, NULL);
+		stats = &threads[i].stats;
+		stats_add(&pevent->stats, formats_parsed, stats->formats_parsed);
+		stats_add(&pevent->stats, parse_ns, stats->parse_ns);
+		if (threads[i].failed)
+			pevent->parsing_failures = 1;
+	}
+
+	free(threads);
+	free(work.events);
+	return;
+
+ serial:
+	for (i = 0; i < pevent->nr_events; i++)
+		event_parsed(pevent->events[i]);
+}
+
 #undef _PE
 #define _PE(code, str) str
 static const char * const pevent_error_str[] = {
@@ -6787,6 +7043,7 @@ void pevent_free_format(struct event_format *event)
 {
 	free(event->name);
 	free(event->system);
+	free(event->lazy_format);
 
 	free_formats(&event->format);
 
@@ -6889,3 +7146,31 @@ void pevent_unref(struct pevent *pevent)
 {
 	pevent_free(pevent);
 }
+
+/**
+ * pevent_get_stats - read the counters of the work done by the library
+ * @pevent: the handle to the pevent
+ * @stats: where to copy the counters to
+ *
+ * Returns 0 on success, or -1 if the library was built with
+ * NO_SELF_STATS and does not keep any counters.
+ */
+int pevent_get_stats(struct pevent *pevent, struct pevent_stats *stats)
+{
+#ifdef NO_SELF_STATS
+	memset(stats, 0, sizeof(*stats));
+	return -1;
+#else
+	*stats = pevent->stats;
+	return 0;
+#endif
+}
+
+/**
+ * pevent_reset_stats - zero the counters of the work done by the library
+ * @pevent: the handle to the pevent
+ */
+void pevent_reset_stats(struct pevent *pevent)
+{
+	memset(&pevent->stats, 0, sizeof(pevent->stats));
+}
@@ -7,6 +7,7 @@
 #define __UTIL_H
 
 #include <ctype.h>
+#include <time.h>
 
 /* Can be overridden */
 void warning(const char *fmt, ...);
@@ -64,4 +65,29 @@ static inline int has_text(const char *text)
 	return 0;
 }
 
+/*
+ * Self profiling of the libraries. The counters cost an increment,
+ * and can be compiled out by building with NO_SELF_STATS.
+ */
+#ifndef NO_SELF_STATS
+static inline unsigned long long stats_time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+# define stats_inc(stats, field)	((stats)->field++)
+# define stats_add(stats, field, val)	((stats)->field += (val))
+# define stats_start()			stats_time_ns()
+# define stats_end(stats, field, start)				\
+	((stats)->field += stats_time_ns() - (start))
+#else
+# define stats_inc(stats, field)	do { } while (0)
+# define stats_add(stats, field, val)	do { } while (0)
+# define stats_start()			0ULL
+# define stats_end(stats, field, start)	do { (void)(start); } while (0)
+#endif
+
 #endif
@@ -302,6 +302,8 @@ find_event(struct pevent *pevent, struct event_list **events,
 		event = pevent->events[i];
 		if (event_match(event, sys_name ? &sreg : NULL, &ereg)) {
 			match = 1;
+			/* Looking it up parses the format if it is lazy */
+			event = pevent_find_event(pevent, event->id);
 			if (add_event(events, event) < 0) {
 				fail = 1;
 				break;
@@ -2037,6 +2039,7 @@ enum pevent_errno pevent_filter_match(struct event_filter *filter,
 {
 	struct pevent *pevent = filter->pevent;
 	struct filter_type *filter_type;
+	unsigned long long start = 0;
 	int event_id;
 	int ret;
 	enum pevent_errno err = 0;
@@ -2052,7 +2055,15 @@ enum pevent_errno pevent_filter_match(struct event_filter *filter,
 	if (!filter_type)
 		return PEVENT_ERRNO__FILTER_NOT_FOUND;
 
+	stats_inc(&pevent->stats, filter_evals);
+	if (pevent->flags & PEVENT_PROFILE_SELF)
+		start = stats_start();
+
 	ret = test_filter(filter_type->event, filter_type->filter, record, &err);
+
+	if (start)
+		stats_end(&pevent->stats, filter_ns, start);
+
 	if (err)
 		return err;
 
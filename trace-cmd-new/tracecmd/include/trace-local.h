@@ -93,6 +93,8 @@ struct hook_list;
 void trace_init_profile(struct tracecmd_input *handle, struct hook_list *hooks,
 			int global);
 int do_trace_profile(void);
+void trace_profile_parallel(struct tracecmd_input *handle, const char *file,
+			    int threads);
 void trace_profile_set_merge_like_comms(void);
 
 struct tracecmd_input *
@@ -100,6 +102,14 @@ trace_stream_init(struct buffer_instance *instance, int cpu, int fd, int cpus,
 		  struct hook_list *hooks,
 		  tracecmd_handle_init_func handle_init, int global);
 int trace_stream_read(struct pid_record_data *pids, int nr_pids, struct timeval *tv);
+void trace_stream_config(unsigned long long window_usecs, int stats_secs);
+void trace_stream_finish(void);
+
+struct tracecmd_recorder_stats *
+trace_telemetry_init(const char *file, int secs, int nr_recorders);
+int trace_telemetry_start(struct pid_record_data *pids, int nr_pids);
+void trace_telemetry_stop(void);
+void trace_telemetry_kill(void);
 
 void trace_show_data(struct tracecmd_input *handle, struct pevent_record *record);
 
@@ -182,6 +192,7 @@ struct buffer_instance {
 
 	struct tracecmd_msg_handle *msg_handle;
 	struct tracecmd_output *network_handle;
+	int			mux_pid;	/* sends the data of the CPUs (v3) */
 
 	int			flags;
 	int			tracing_on_init_val;
@@ -4,11 +4,21 @@
 #include <stdbool.h>
 
 #define UDP_MAX_PACKET	(65536 - 20)
+
+/* Two (4k) pages is the max transfer, unless the server takes more */
+#define MSG_MAX_LEN	8192
+
+/* What the server says it takes */
+#define MSG_LARGE_MAX_LEN	(256 * 1024)
+
 #define V2_MAGIC	"677768\0"
 #define V2_CPU		"-1V2"
+#define V3_CPU		"-1V3"
 
 #define V1_PROTOCOL	1
 #define V2_PROTOCOL	2
+/* v2, with the data of all CPUs sent over the one connection */
+#define V3_PROTOCOL	3
 
 extern unsigned int page_size;
 
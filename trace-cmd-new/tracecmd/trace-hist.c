@@ -12,9 +12,12 @@
 #include <string.h>
 #include <getopt.h>
 #include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include "trace-hash-local.h"
 #include "trace-local.h"
+#include "trace-hash.h"
 #include "list.h"
 
 static int sched_wakeup_type;
@@ -55,11 +58,6 @@ static void *zalloc(size_t size)
 	return calloc(1, size);
 }
 
-static const char **ips;
-static int ips_idx;
-static int func_depth;
-static int current_pid = -1;
-
 struct stack_save {
 	struct stack_save	*next;
 	const char		**ips;
@@ -68,18 +66,178 @@ struct stack_save {
 	int			pid;
 };
 
-struct stack_save *saved_stacks;
+struct pid_list;
+
+struct chain {
+	struct chain		*next;
+	struct chain		*sibling;
+	const char		*func;
+	struct chain		*parents;
+	struct trace_ohash	parent_hash;	/* once it has many parents */
+	struct pid_list		*pid_list;
+	unsigned long long	seq;		/* the call chain that added it */
+	int			nr_parents;
+	int			count;
+	int			total;
+	int			event;
+	int			merged;
+};
+
+struct pid_list {
+	struct pid_list		*next;
+	struct chain		chain;
+	int			pid;
+};
+
+struct hist_comm {
+	int			pid;
+	char			comm[];
+};
+
+/*
+ * What is needed to build the call chains out of the records given
+ * to it. With -j there is one for each thread. They all follow the
+ * stacks of every task, but only keep the call chains of their part
+ * of the pids, and are merged at the end.
+ */
+struct hist_data {
+	struct pevent		*pevent;
+
+	/* The stack of the current task */
+	const char		**ips;
+	int			ips_idx;
+	int			func_depth;
+	int			current_pid;
+	struct stack_save	*saved_stacks;
+
+	/* The stack of an event, waiting for its kernel stack trace */
+	int			pending_pid;
+	const char		**pending_ips;
+	int			pending_ips_idx;
+
+	struct chain		*chains;
+	int			nr_chains;
+	int			total_counts;
+	unsigned long long	nr_calls;
+
+	/* The pids whose hash modulo @nr_parts is @part are ours */
+	int			part;
+	int			nr_parts;
+
+	struct pid_list		*list_pids;
+	struct pid_list		*last_pid_list;
+	struct trace_ohash	pid_hash;
+	struct pid_list		all_pid_list;
+
+	/* The first comm of each pid */
+	struct trace_ohash	comms;
+
+	/* Set when the names of the pevent have to be interned */
+	int			intern;
+	struct trace_ohash	func_names;
+};
+
+/* Hash the parents of a chain once walking them gets slow */
+#define CHAIN_HASH_MIN	8
+
+static struct trace_ohash func_names;
+static pthread_mutex_t func_names_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void init_hist_data(struct hist_data *hd, int part, int nr_parts)
+{
+	memset(hd, 0, sizeof(*hd));
+	hd->current_pid = -1;
+	hd->pending_pid = -1;
+	hd->part = part;
+	hd->nr_parts = nr_parts;
+	hd->intern = nr_parts > 1;
+}
+
+static int match_name(void *item, void *data)
+{
+	return strcmp(item, data) == 0;
+}
+
+/*
+ * With -j each thread has its own handle, with its own copy of the
+ * function and event names. Give them all the same copy of a name,
+ * so that names can still be compared by their pointers.
+ */
+static const char *intern_func(struct hist_data *hd, const char *func)
+{
+	unsigned long long key;
+	char *name;
+
+	if (!hd->intern || !func)
+		return func;
+
+	/* The hash of the pointer is unique, no need to match */
+	key = trace_hash64((unsigned long)func);
+	name = trace_ohash_find(&hd->func_names, key, NULL, NULL);
+	if (name)
+		return name;
+
+	pthread_mutex_lock(&func_names_lock);
+	name = trace_ohash_find(&func_names, trace_hash_str((char *)func),
+				match_name, (void *)func);
+	if (!name) {
+		name = strdup(func);
+		if (!name ||
+		    trace_ohash_add(&func_names, trace_hash_str(name), name) < 0)
+			die("malloc");
+	}
+	pthread_mutex_unlock(&func_names_lock);
+
+	if (trace_ohash_add(&hd->func_names, key, name) < 0)
+		die("malloc");
+
+	return name;
+}
+
+static void register_comm(struct pevent *pevent, struct hist_comm *comm)
+{
+	pevent_register_comm(pevent, comm->comm, comm->pid);
+}
+
+/*
+ * Only the first comm of a pid is kept, instead of registering it
+ * again for every sched event. With -j they are registered when the
+ * CPUs are merged.
+ */
+static void save_comm(struct hist_data *hd, const char *comm, int pid)
+{
+	unsigned long long key = trace_hash64((unsigned int)pid);
+	struct hist_comm *hc;
+	int len;
+
+	if (trace_ohash_find(&hd->comms, key, NULL, NULL))
+		return;
+
+	len = strnlen(comm, 16);
+	hc = malloc(sizeof(*hc) + len + 1);
+	if (!hc)
+		die("malloc");
+	hc->pid = pid;
+	memcpy(hc->comm, comm, len);
+	hc->comm[len] = '\0';
+
+	if (trace_ohash_add(&hd->comms, key, hc) < 0)
+		die("malloc");
+
+	if (!hd->intern)
+		register_comm(hd->pevent, hc);
+}
 
-static void reset_stack(void)
+static void reset_stack(struct hist_data *hd)
 {
-	current_pid = -1;
-	ips_idx = 0;
-	func_depth = 0;
+	hd->current_pid = -1;
+	hd->ips_idx = 0;
+	hd->func_depth = 0;
 	/* Don't free here, it may be saved */
-	ips = NULL;
+	hd->ips = NULL;
 }
 
-static void save_stack(void)
+static void save_stack(struct hist_data *hd)
 {
 	struct stack_save *stack;
 
@@ -87,22 +245,22 @@ static void save_stack(void)
 	if (!stack)
 		die("malloc");
 
-	stack->pid = current_pid;
-	stack->ips_idx = ips_idx;
-	stack->func_depth = func_depth;
-	stack->ips = ips;
+	stack->pid = hd->current_pid;
+	stack->ips_idx = hd->ips_idx;
+	stack->func_depth = hd->func_depth;
+	stack->ips = hd->ips;
 
-	stack->next = saved_stacks;
-	saved_stacks = stack;
+	stack->next = hd->saved_stacks;
+	hd->saved_stacks = stack;
 
-	reset_stack();
+	reset_stack(hd);
 }
 
-static void restore_stack(int pid)
+static void restore_stack(struct hist_data *hd, int pid)
 {
 	struct stack_save *last = NULL, *stack;
 
-	for (stack = saved_stacks; stack; last = stack, stack = stack->next) {
+	for (stack = hd->saved_stacks; stack; last = stack, stack = stack->next) {
 		if (stack->pid == pid)
 			break;
 	}
@@ -113,147 +271,191 @@ static void restore_stack(int pid)
 	if (last)
 		last->next = stack->next;
 	else
-		saved_stacks = stack->next;
+		hd->saved_stacks = stack->next;
 
-	current_pid = stack->pid;
-	ips_idx = stack->ips_idx;
-	func_depth = stack->func_depth;
-	free(ips);
-	ips = stack->ips;
+	hd->current_pid = stack->pid;
+	hd->ips_idx = stack->ips_idx;
+	hd->func_depth = stack->func_depth;
+	free(hd->ips);
+	hd->ips = stack->ips;
 	free(stack);
 }
 
-struct pid_list;
+static void add_chain(struct hist_data *hd, struct chain *chain)
+{
+	if (chain->next)
+		die("chain not null?");
+	chain->next = hd->chains;
+	hd->chains = chain;
+	hd->nr_chains++;
+}
 
-struct chain {
-	struct chain		*next;
-	struct chain		*sibling;
-	const char		*func;
-	struct chain		*parents;
-	struct pid_list		*pid_list;
-	int			nr_parents;
-	int			count;
-	int			total;
-	int			event;
-};
-static struct chain *chains;
-static int nr_chains;
-static int total_counts;
+static void hash_parent(struct chain *chain, struct chain *parent)
+{
+	unsigned long long key = trace_hash64((unsigned long)parent->func);
 
-struct pid_list {
-	struct pid_list		*next;
-	struct chain		chain;
-	int			pid;
-};
-static struct pid_list *list_pids;
-static struct pid_list all_pid_list;
+	if (trace_ohash_add(&chain->parent_hash, key, parent) < 0)
+		die("malloc");
+}
 
-static void add_chain(struct chain *chain)
+static struct chain *find_parent(struct chain *chain, const char *func)
 {
-	if (chain->next)
-		die("chain not null?");
-	chain->next = chains;
-	chains = chain;
-	nr_chains++;
+	struct chain *parent;
+
+	/* A func is only once in the parents, its key is enough */
+	if (chain->nr_parents >= CHAIN_HASH_MIN)
+		return trace_ohash_find(&chain->parent_hash,
+					trace_hash64((unsigned long)func),
+					NULL, NULL);
+
+	for (parent = chain->parents; parent; parent = parent->sibling) {
+		if (parent->func == func)
+			return parent;
+	}
+
+	return NULL;
+}
+
+static void add_parent(struct chain *chain, struct chain *parent)
+{
+	struct chain *p;
+
+	parent->sibling = chain->parents;
+	chain->parents = parent;
+	chain->nr_parents++;
+
+	if (chain->nr_parents > CHAIN_HASH_MIN)
+		hash_parent(chain, parent);
+	else if (chain->nr_parents == CHAIN_HASH_MIN) {
+		for (p = chain->parents; p; p = p->sibling)
+			hash_parent(chain, p);
+	}
 }
 
 static void
-insert_chain(struct pid_list *pid_list, struct chain *chain_list,
-	     const char **chain_str, int size, int event)
+insert_chain(struct hist_data *hd, struct pid_list *pid_list,
+	     struct chain *chain_list, const char **chain_str, int size,
+	     int event, unsigned long long seq)
 {
 	struct chain *chain;
 
-	/* Record all counts */
-	if (!chain_list->func)
-		total_counts++;
+	for (;;) {
+		/* Record all counts */
+		if (!chain_list->func)
+			hd->total_counts++;
 
-	chain_list->count++;
+		chain_list->count++;
 
-	if (!size--)
-		return;
-
-	for (chain = chain_list->parents; chain; chain = chain->sibling) {
-		if (chain->func == chain_str[size]) {
-			insert_chain(pid_list, chain, chain_str, size, 0);
+		if (!size--)
 			return;
+
+		chain = find_parent(chain_list, chain_str[size]);
+		if (!chain) {
+			chain = zalloc(sizeof(struct chain));
+			if (!chain)
+				die("malloc");
+			chain->func = chain_str[size];
+			chain->pid_list = pid_list;
+			chain->event = event;
+			chain->seq = seq;
+			add_parent(chain_list, chain);
+
+			/*
+			 * NULL func means this is the top level of the chain.
+			 * Store it.
+			 */
+			if (!chain_list->func)
+				add_chain(hd, chain);
 		}
+
+		/* Only the top level is marked as an event */
+		chain_list = chain;
+		event = 0;
 	}
+}
+
+static struct pid_list *
+find_pid_list(struct hist_data *hd, int pid, int create)
+{
+	unsigned long long key = trace_hash64((unsigned int)pid);
+	struct pid_list *pid_list;
+
+	pid_list = trace_ohash_find(&hd->pid_hash, key, NULL, NULL);
+	if (pid_list || !create)
+		return pid_list;
 
-	chain_list->nr_parents++;
-	chain = zalloc(sizeof(struct chain));
-	if (!chain)
+	pid_list = zalloc(sizeof(*pid_list));
+	if (!pid_list)
 		die("malloc");
-	chain->sibling = chain_list->parents;
-	chain_list->parents = chain;
-	chain->func = chain_str[size];
-	chain->pid_list = pid_list;
-	chain->event = event;
+	pid_list->pid = pid;
+	pid_list->next = hd->list_pids;
+	hd->list_pids = pid_list;
 
-	/* NULL func means this is the top level of the chain. Store it */
-	if (!chain_list->func)
-		add_chain(chain);
+	if (trace_ohash_add(&hd->pid_hash, key, pid_list) < 0)
+		die("malloc");
 
-	insert_chain(pid_list, chain, chain_str, size, 0);
+	return pid_list;
 }
 
-static void save_call_chain(int pid, const char **chain, int size, int event)
+static void save_call_chain(struct hist_data *hd, int pid,
+			    const char **chain, int size, int event)
 {
-	static struct pid_list *pid_list;
+	struct pid_list *pid_list = hd->last_pid_list;
+	unsigned long long seq = hd->nr_calls++;
+
+	/*
+	 * All the parts count the call chains, so that the new chains
+	 * are ordered the same way as without -j.
+	 */
+	if (hd->nr_parts > 1 &&
+	    trace_hash64((unsigned int)pid) % hd->nr_parts != hd->part)
+		return;
 
 	if (compact)
-		pid_list = &all_pid_list;
+		pid_list = &hd->all_pid_list;
 
-	else if (!pid_list || pid_list->pid != pid) {
-		for (pid_list = list_pids; pid_list; pid_list = pid_list->next) {
-			if (pid_list->pid == pid)
-				break;
-		}
-		if (!pid_list) {
-			pid_list = zalloc(sizeof(*pid_list));
-			if (!pid_list)
-				die("malloc");
-			pid_list->pid = pid;
-			pid_list->next = list_pids;
-			list_pids = pid_list;
-		}
-	}
-	insert_chain(pid_list, &pid_list->chain, chain, size, event);
+	else if (!pid_list || pid_list->pid != pid)
+		pid_list = find_pid_list(hd, pid, 1);
+
+	hd->last_pid_list = pid_list;
+	insert_chain(hd, pid_list, &pid_list->chain, chain, size, event, seq);
 }
 
-static void save_stored_stacks(void)
+static void save_stored_stacks(struct hist_data *hd)
 {
-	while (saved_stacks) {
-		restore_stack(saved_stacks->pid);
-		save_call_chain(current_pid, ips, ips_idx, 0);
+	while (hd->saved_stacks) {
+		restore_stack(hd, hd->saved_stacks->pid);
+		save_call_chain(hd, hd->current_pid, hd->ips, hd->ips_idx, 0);
 	}
 }
 
-static void flush_stack(void)
+static void flush_stack(struct hist_data *hd)
 {
-	if (current_pid < 0)
+	if (hd->current_pid < 0)
 		return;
 
-	save_call_chain(current_pid, ips, ips_idx, 0);
-	free(ips);
-	reset_stack();
+	save_call_chain(hd, hd->current_pid, hd->ips, hd->ips_idx, 0);
+	free(hd->ips);
+	reset_stack(hd);
 }
 
-static void push_stack_func(const char *func)
+static void push_stack_func(struct hist_data *hd, const char *func)
 {
-	ips_idx++;
-	ips = realloc(ips, ips_idx * sizeof(char *));
-	ips[ips_idx - 1] = func;
+	hd->ips_idx++;
+	hd->ips = realloc(hd->ips, hd->ips_idx * sizeof(char *));
+	hd->ips[hd->ips_idx - 1] = func;
 }
 
-static void pop_stack_func(void)
+static void pop_stack_func(struct hist_data *hd)
 {
-	ips_idx--;
-	ips[ips_idx] = NULL;
+	hd->ips_idx--;
+	hd->ips[hd->ips_idx] = NULL;
 }
 
 static void
-process_function(struct pevent *pevent, struct pevent_record *record)
+process_function(struct hist_data *hd, struct pevent_record *record)
 {
+	struct pevent *pevent = hd->pevent;
 	unsigned long long parent_ip;
 	unsigned long long ip;
 	unsigned long long val;
@@ -276,25 +478,26 @@ process_function(struct pevent *pevent, struct pevent_record *record)
 
 	pid = val;
 
-	func = pevent_find_function(pevent, ip);
-	parent = pevent_find_function(pevent, parent_ip);
+	func = intern_func(hd, pevent_find_function(pevent, ip));
+	parent = intern_func(hd, pevent_find_function(pevent, parent_ip));
 
-	if (current_pid >= 0 && pid != current_pid) {
-		save_stack();
-		restore_stack(pid);
+	if (hd->current_pid >= 0 && pid != hd->current_pid) {
+		save_stack(hd);
+		restore_stack(hd, pid);
 	}
 
-	current_pid = pid;
+	hd->current_pid = pid;
 
-	if (ips_idx) {
-		if (ips[ips_idx - 1] == parent)
-			push_stack_func(func);
+	if (hd->ips_idx) {
+		if (hd->ips[hd->ips_idx - 1] == parent)
+			push_stack_func(hd, func);
 		else {
-			save_call_chain(pid, ips, ips_idx, 0);
-			while (ips_idx) {
-				pop_stack_func();
-				if (ips[ips_idx - 1] == parent) {
-					push_stack_func(func);
+			save_call_chain(hd, pid, hd->ips, hd->ips_idx, 0);
+			while (hd->ips_idx) {
+				pop_stack_func(hd);
+				if (hd->ips_idx &&
+				    hd->ips[hd->ips_idx - 1] == parent) {
+					push_stack_func(hd, func);
 					break;
 				}
 			}
@@ -302,14 +505,14 @@ process_function(struct pevent *pevent, struct pevent_record *record)
 	}
 
 	/* The above check can set ips_idx to zero again */
-	if (!ips_idx) {
-		push_stack_func(parent);
-		push_stack_func(func);
+	if (!hd->ips_idx) {
+		push_stack_func(hd, parent);
+		push_stack_func(hd, func);
 	}
 }
 
 static void
-process_function_graph_entry(struct pevent *pevent, struct pevent_record *record)
+process_function_graph_entry(struct hist_data *hd, struct pevent_record *record)
 {
 	unsigned long long depth;
 	unsigned long long ip;
@@ -334,28 +537,28 @@ process_function_graph_entry(struct pevent *pevent, struct pevent_record *record
 
 	pid = val;
 
-	func = pevent_find_function(pevent, ip);
+	func = intern_func(hd, pevent_find_function(hd->pevent, ip));
 
-	if (current_pid >= 0 && pid != current_pid) {
-		save_stack();
-		restore_stack(pid);
+	if (hd->current_pid >= 0 && pid != hd->current_pid) {
+		save_stack(hd);
+		restore_stack(hd, pid);
 	}
 
-	current_pid = pid;
+	hd->current_pid = pid;
 
-	if (depth != ips_idx) {
-		save_call_chain(pid, ips, ips_idx, 0);
-		while (ips_idx > depth)
-			pop_stack_func();
+	if (depth != hd->ips_idx) {
+		save_call_chain(hd, pid, hd->ips, hd->ips_idx, 0);
+		while (hd->ips_idx > depth)
+			pop_stack_func(hd);
 	}
 
-	func_depth = depth;
+	hd->func_depth = depth;
 
-	push_stack_func(func);
+	push_stack_func(hd, func);
 }
 
 static void
-process_function_graph_exit(struct pevent *pevent, struct pevent_record *record)
+process_function_graph_exit(struct hist_data *hd, struct pevent_record *record)
 {
 	unsigned long long depth;
 	unsigned long long val;
@@ -373,46 +576,43 @@ process_function_graph_exit(struct pevent *pevent, struct pevent_record *record)
 
 	pid = val;
 
-	if (current_pid >= 0 && pid != current_pid) {
-		save_stack();
-		restore_stack(pid);
+	if (hd->current_pid >= 0 && pid != hd->current_pid) {
+		save_stack(hd);
+		restore_stack(hd, pid);
 	}
 
-	current_pid = pid;
+	hd->current_pid = pid;
 
-	if (ips_idx != depth) {
-		save_call_chain(pid, ips, ips_idx, 0);
-		while (ips_idx > depth)
-			pop_stack_func();
+	if (hd->ips_idx != depth) {
+		save_call_chain(hd, pid, hd->ips, hd->ips_idx, 0);
+		while (hd->ips_idx > depth)
+			pop_stack_func(hd);
 	}
 
-	func_depth = depth - 1;
+	hd->func_depth = depth - 1;
 }
 
-static int pending_pid = -1;
-static const char **pending_ips;
-static int pending_ips_idx;
-
-static void reset_pending_stack(void)
+static void reset_pending_stack(struct hist_data *hd)
 {
-	pending_pid = -1;
-	pending_ips_idx = 0;
-	free(pending_ips);
-	pending_ips = NULL;
+	hd->pending_pid = -1;
+	hd->pending_ips_idx = 0;
+	free(hd->pending_ips);
+	hd->pending_ips = NULL;
 }
 
-static void copy_stack_to_pending(int pid)
+static void copy_stack_to_pending(struct hist_data *hd, int pid)
 {
-	pending_pid = pid;
-	pending_ips = zalloc(sizeof(char *) * ips_idx);
-	memcpy(pending_ips, ips, sizeof(char *) * ips_idx);
-	pending_ips_idx = ips_idx;
+	hd->pending_pid = pid;
+	hd->pending_ips = zalloc(sizeof(char *) * hd->ips_idx);
+	memcpy(hd->pending_ips, hd->ips, sizeof(char *) * hd->ips_idx);
+	hd->pending_ips_idx = hd->ips_idx;
 }
 
 static void
-process_kernel_stack(struct pevent *pevent, struct pevent_record *record)
+process_kernel_stack(struct hist_data *hd, struct pevent_record *record)
 {
 	struct format_field *field = kernel_stack_caller_field;
+	struct pevent *pevent = hd->pevent;
 	unsigned long long val;
 	void *data = record->data;
 	int do_restore = 0;
@@ -424,29 +624,29 @@ process_kernel_stack(struct pevent *pevent, struct pevent_record *record)
 		die("no pid field for function?");
 	pid = val;
 
-	if (pending_pid >= 0 && pid != pending_pid) {
-		reset_pending_stack();
+	if (hd->pending_pid >= 0 && pid != hd->pending_pid) {
+		reset_pending_stack(hd);
 		return;
 	}
 
 	if (!field)
 		die("no caller field for kernel stack?");
 
-	if (pending_pid >= 0) {
-		if (current_pid >= 0) {
-			save_stack();
+	if (hd->pending_pid >= 0) {
+		if (hd->current_pid >= 0) {
+			save_stack(hd);
 			do_restore = 1;
 		}
 	} else {
 		/* function stack trace? */
-		if (current_pid >= 0) {
-			copy_stack_to_pending(current_pid);
-			free(ips);
-			reset_stack();
+		if (hd->current_pid >= 0) {
+			copy_stack_to_pending(hd, hd->current_pid);
+			free(hd->ips);
+			reset_stack(hd);
 		}
 	}
 
-	current_pid = pid;
+	hd->current_pid = pid;
 
 	/* Need to start at the end of the callers and work up */
 	for (data += field->offset; data < record->data + record->size;
@@ -465,22 +665,22 @@ process_kernel_stack(struct pevent *pevent, struct pevent_record *record)
 		const char *func;
 
 		addr = pevent_read_number(pevent, data, long_size);
-		func = pevent_find_function(pevent, addr);
+		func = intern_func(hd, pevent_find_function(pevent, addr));
 		if (func)
-			push_stack_func(func);
+			push_stack_func(hd, func);
 	}
 
-	if (pending_pid >= 0) {
-		push_stack_func(pending_ips[pending_ips_idx - 1]);
-		reset_pending_stack();
+	if (hd->pending_pid >= 0) {
+		push_stack_func(hd, hd->pending_ips[hd->pending_ips_idx - 1]);
+		reset_pending_stack(hd);
 	}
-	save_call_chain(current_pid, ips, ips_idx, 1);
+	save_call_chain(hd, hd->current_pid, hd->ips, hd->ips_idx, 1);
 	if (do_restore)
-		restore_stack(current_pid);
+		restore_stack(hd, hd->current_pid);
 }
 
 static void
-process_sched_wakeup(struct pevent *pevent, struct pevent_record *record, int type)
+process_sched_wakeup(struct hist_data *hd, struct pevent_record *record, int type)
 {
 	unsigned long long val;
 	const char *comm;
@@ -501,11 +701,11 @@ process_sched_wakeup(struct pevent *pevent, struct pevent_record *record, int ty
 
 	pid = val;
 
-	pevent_register_comm(pevent, comm, pid);
+	save_comm(hd, comm, pid);
 }
 
 static void
-process_sched_switch(struct pevent *pevent, struct pevent_record *record)
+process_sched_switch(struct hist_data *hd, struct pevent_record *record)
 {
 	unsigned long long val;
 	const char *comm;
@@ -517,18 +717,18 @@ process_sched_switch(struct pevent *pevent, struct pevent_record *record)
 	if (ret < 0)
 		die("no prev_pid field in sched_switch?");
 	pid = val;
-	pevent_register_comm(pevent, comm, pid);
+	save_comm(hd, comm, pid);
 
 	comm = (char *)(record->data + sched_switch_next_field->offset);
 	ret = pevent_read_number_field(sched_switch_next_pid_field, record->data, &val);
 	if (ret < 0)
 		die("no next_pid field in sched_switch?");
 	pid = val;
-	pevent_register_comm(pevent, comm, pid);
+	save_comm(hd, comm, pid);
 }
 
 static void
-process_event(struct pevent *pevent, struct pevent_record *record, int type)
+process_event(struct hist_data *hd, struct pevent_record *record, int type)
 {
 	struct event_format *event;
 	const char *event_name;
@@ -536,13 +736,14 @@ process_event(struct pevent *pevent, struct pevent_record *record, int type)
 	int pid;
 	int ret;
 
-	if (pending_pid >= 0) {
-		save_call_chain(pending_pid, pending_ips, pending_ips_idx, 1);
-		reset_pending_stack();
+	if (hd->pending_pid >= 0) {
+		save_call_chain(hd, hd->pending_pid, hd->pending_ips,
+				hd->pending_ips_idx, 1);
+		reset_pending_stack(hd);
 	}
 		
-	event = pevent_data_event_from_type(pevent, type);
-	event_name = event->name;
+	event = pevent_data_event_from_type(hd->pevent, type);
+	event_name = intern_func(hd, event->name);
 
 	ret = pevent_read_number_field(common_pid_field, record->data, &val);
 	if (ret < 0)
@@ -557,13 +758,13 @@ process_event(struct pevent *pevent, struct pevent_record *record, int type)
 	 * until after the event. Thus, we only add the event into
 	 * the pending stack.
 	 */
-	push_stack_func(event_name);
-	copy_stack_to_pending(pid);
-	pop_stack_func();
+	push_stack_func(hd, event_name);
+	copy_stack_to_pending(hd, pid);
+	pop_stack_func(hd);
 }
 
 static void
-process_record(struct pevent *pevent, struct pevent_record *record)
+process_record(struct hist_data *hd, struct pevent_record *record)
 {
 	unsigned long long val;
 	int type;
@@ -572,24 +773,24 @@ process_record(struct pevent *pevent, struct pevent_record *record)
 	type = val;
 
 	if (type == function_type)
-		return process_function(pevent, record);
+		return process_function(hd, record);
 
 	if (type == function_graph_entry_type)
-		return process_function_graph_entry(pevent, record);
+		return process_function_graph_entry(hd, record);
 
 	if (type == function_graph_exit_type)
-		return process_function_graph_exit(pevent, record);
+		return process_function_graph_exit(hd, record);
 
 	if (type == kernel_stack_type)
-		return process_kernel_stack(pevent, record);
+		return process_kernel_stack(hd, record);
 
 	if (type == sched_wakeup_type || type == sched_wakeup_new_type)
-		process_sched_wakeup(pevent, record, type);
+		process_sched_wakeup(hd, record, type);
 
 	else if (type == sched_switch_type)
-		process_sched_switch(pevent, record);
+		process_sched_switch(hd, record);
 
-	process_event(pevent, record, type);
+	process_event(hd, record, type);
 }
 
 static struct event_format *
@@ -704,102 +905,82 @@ static struct chain *next_ptr(struct chain *chain, enum field field)
 	return chain->sibling;
 }
 
-static struct chain *split_chain(struct chain *orig, int size, enum field field)
+static void set_next_ptr(struct chain *chain, struct chain *next,
+			 enum field field)
 {
-	struct chain *chain;
-	int i;
+	if (field == NEXT_PTR)
+		chain->next = next;
+	else
+		chain->sibling = next;
+}
 
-	if (size < 2)
-		return NULL;
+static int compare_chains(const void *a, const void *b)
+{
+	const struct chain *A = *(const struct chain **)a;
+	const struct chain *B = *(const struct chain **)b;
 
-	for (i = 1; i < (size + 1) / 2; i++, orig = next_ptr(orig, field))
-		;
+	if (A->count != B->count)
+		return A->count > B->count ? -1 : 1;
 
-	if (field == NEXT_PTR) {
-		chain = orig->next;
-		orig->next = NULL;
-	} else {
-		chain = orig->sibling;
-		orig->sibling = NULL;
-	}
+	/* On a tie, keep them in the order of the list, newest first */
+	if (A->seq != B->seq)
+		return A->seq > B->seq ? -1 : 1;
 
-	return chain;
+	return 0;
 }
 
 static struct chain *
-merge_chains(struct chain *a, int nr_a, struct chain *b, int nr_b, enum field field)
+sort_chain_list(struct chain *list, int nr, enum field field)
 {
+	struct chain **array;
 	struct chain *chain;
-	struct chain *final;
-	struct chain **next = &final;
 	int i;
 
-	if (!a)
-		return b;
-	if (!b)
-		return a;
-
-	for (i = 0, chain = a; chain; i++, chain = next_ptr(chain, field))
-		;
-	if (i != nr_a)
-		die("WTF %d %d", i, nr_a);
-
-	chain = split_chain(a, nr_a, field);
-	a = merge_chains(chain, nr_a / 2, a, (nr_a + 1) / 2, field);
-
-	chain = split_chain(b, nr_b, field);
-	b = merge_chains(chain, nr_b / 2, b, (nr_b + 1) / 2, field);
-
-	while (a && b) {
-		if (a->count > b->count) {
-			*next = a;
-			if (field == NEXT_PTR)
-				next = &a->next;
-			else
-				next = &a->sibling;
-			a = *next;
-			*next = NULL;
-		} else {
-			*next = b;
-			if (field == NEXT_PTR)
-				next = &b->next;
-			else
-				next = &b->sibling;
-			b = *next;
-			*next = NULL;
-		}
+	if (nr < 2)
+		return list;
+
+	array = malloc(sizeof(*array) * nr);
+	if (!array)
+		die("malloc");
+
+	for (i = 0, chain = list; chain; i++, chain = next_ptr(chain, field)) {
+		if (i == nr)
+			break;
+		array[i] = chain;
 	}
-	if (a)
-		*next = a;
-	else
-		*next = b;
+	if (i != nr || chain)
+		die("WTF %d %d", i, nr);
+
+	qsort(array, nr, sizeof(*array), compare_chains);
+
+	for (i = 0; i < nr - 1; i++)
+		set_next_ptr(array[i], array[i + 1], field);
+	set_next_ptr(array[nr - 1], NULL, field);
+
+	list = array[0];
+	free(array);
 
-	return final;
+	return list;
 }
 
 static void sort_chain_parents(struct chain *chain)
 {
 	struct chain *parent;
 
-	parent = split_chain(chain->parents, chain->nr_parents, SIB_PTR);
-	chain->parents = merge_chains(parent, chain->nr_parents / 2,
-				      chain->parents, (chain->nr_parents + 1) / 2,
-				      SIB_PTR);
+	chain->parents = sort_chain_list(chain->parents, chain->nr_parents,
+					 SIB_PTR);
 
-	for (chain = chain->parents; chain; chain = chain->sibling)
-		sort_chain_parents(chain);
+	for (parent = chain->parents; parent; parent = parent->sibling)
+		sort_chain_parents(parent);
 }
 
-static void sort_chains(void)
+static void sort_chains(struct hist_data *hd)
 {
 	struct chain *chain;
 
-	chain = split_chain(chains, nr_chains, NEXT_PTR);
-
-	/* The original always has more or equal to the split */
-	chains = merge_chains(chain, nr_chains / 2, chains, (nr_chains + 1) / 2, NEXT_PTR);
+	hd->chains = sort_chain_list(hd->chains, hd->nr_chains, NEXT_PTR);
 
-	for (chain = chains; chain; chain = chain->next)
+	for (chain = hd->chains; chain; chain = chain->next)
 		sort_chain_parents(chain);
 }
 
@@ -901,23 +1082,23 @@ static void print_parents(struct pevent *pevent, struct chain *chain, int indent
 	}
 }
 
-static void print_chains(struct pevent *pevent)
+static void print_chains(struct hist_data *hd, struct pevent *pevent)
 {
-	struct chain *chain = chains;
+	struct chain *chain = hd->chains;
 	int pid;
 
 	for (; chain; chain = chain->next) {
 		pid = chain->pid_list->pid;
-		if (chain != chains)
+		if (chain != hd->chains)
 			printf("\n");
 		if (compact)
 			printf("  %%%3.2f <all pids> %30s #%d\n",
-			       get_percent(total_counts, chain->count),
+			       get_percent(hd->total_counts, chain->count),
 			       chain->func,
 			       chain->count);
 		else
 			printf("  %%%3.2f  (%d) %s %30s #%d\n",
-			       get_percent(total_counts, chain->count),
+			       get_percent(hd->total_counts, chain->count),
 			       pid,
 			       pevent_data_comm_from_pid(pevent, pid),
 			       chain->func,
@@ -931,7 +1112,104 @@ static void print_chains(struct pevent *pevent)
 	}
 }
 
-static void do_trace_hist(struct tracecmd_input *handle)
+/*
+ * Add the counts of @other to @chain, and hand over the parents that
+ * @chain does not have yet. The nodes of @other that were merged are
+ * marked, as the top level ones are still on the chains of @other.
+ * A merged node is the one of the call chain that came first.
+ */
+static void merge_chain(struct chain *chain, struct chain *other)
+{
+	struct chain *parent;
+	struct chain *exist;
+	struct chain *next;
+
+	chain->count += other->count;
+	if (other->seq < chain->seq) {
+		chain->seq = other->seq;
+		chain->event = other->event;
+	}
+
+	for (parent = other->parents; parent; parent = next) {
+		next = parent->sibling;
+		exist = find_parent(chain, parent->func);
+		if (exist) {
+			merge_chain(exist, parent);
+			parent->merged = 1;
+		} else
+			add_parent(chain, parent);
+	}
+}
+
+static void merge_hist_data(struct hist_data *hd, struct hist_data *other)
+{
+	struct pid_list *pid_list;
+	struct pid_list *exist;
+	struct pid_list *next;
+	struct chain *chain;
+	struct chain *next_chain;
+
+	hd->total_counts += other->total_counts;
+
+	if (compact)
+		merge_chain(&hd->all_pid_list.chain, &other->all_pid_list.chain);
+
+	for (pid_list = other->list_pids; pid_list; pid_list = next) {
+		next = pid_list->next;
+		exist = find_pid_list(hd, pid_list->pid, 0);
+		if (exist) {
+			merge_chain(&exist->chain, &pid_list->chain);
+			continue;
+		}
+		pid_list->next = hd->list_pids;
+		hd->list_pids = pid_list;
+		if (trace_ohash_add(&hd->pid_hash,
+				    trace_hash64((unsigned int)pid_list->pid),
+				    pid_list) < 0)
+			die("malloc");
+	}
+
+	/* The top level chains that did not merge into one of @hd */
+	for (chain = other->chains; chain; chain = next_chain) {
+		next_chain = chain->next;
+		if (chain->merged)
+			continue;
+		chain->next = NULL;
+		add_chain(hd, chain);
+	}
+}
+
+static void hist_cpu(struct hist_data *hd, struct tracecmd_input *handle,
+		     int cpu)
+{
+	struct pevent_record *record;
+
+	for (;;) {
+		record = tracecmd_read_data(handle, cpu);
+		if (!record)
+			break;
+
+		/* If we missed events, just flush out the current stack */
+		if (record->missed_events)
+			flush_stack(hd);
+
+		process_record(hd, record);
+		free_record(record);
+	}
+}
+
+static void finish_hist_data(struct hist_data *hd)
+{
+	if (hd->current_pid >= 0)
+		save_call_chain(hd, hd->current_pid, hd->ips, hd->ips_idx, 0);
+	if (hd->pending_pid >= 0)
+		save_call_chain(hd, hd->pending_pid, hd->pending_ips,
+				hd->pending_ips_idx, 1);
+
+	save_stored_stacks(hd);
+}
+
+static void init_hist_fields(struct tracecmd_input *handle)
 {
 	struct pevent *pevent = tracecmd_get_pevent(handle);
 	struct event_format *event;
@@ -971,46 +1249,128 @@ static void do_trace_hist(struct tracecmd_input *handle)
 	update_function_graph_entry(pevent);
 	update_function_graph_exit(pevent);
 	update_kernel_stack(pevent);
+}
 
-	for (cpu = 0; cpu < cpus; cpu++) {
-		for (;;) {
-			struct pevent_record *record;
+/* Read the CPUs in sequence, the stacks of the tasks follow them across */
+static void hist_cpus(struct hist_data *hd, struct tracecmd_input *handle)
+{
+	int cpus;
+	int cpu;
 
-			record = tracecmd_read_data(handle, cpu);
-			if (!record)
-				break;
+	hd->pevent = tracecmd_get_pevent(handle);
+	cpus = tracecmd_cpus(handle);
 
-			/* If we missed events, just flush out the current stack */
-			if (record->missed_events)
-				flush_stack();
+	for (cpu = 0; cpu < cpus; cpu++)
+		hist_cpu(hd, handle, cpu);
 
-			process_record(pevent, record);
-			free_record(record);
-		}
+	finish_hist_data(hd);
+}
+
+static void do_trace_hist(struct tracecmd_input *handle, struct hist_data *hd)
+{
+	init_hist_fields(handle);
+
+	hist_cpus(hd, handle);
+
+	sort_chains(hd);
+	print_chains(hd, hd->pevent);
+}
+
+struct hist_thread {
+	struct tracecmd_input	*handle;
+	struct hist_data	hd;
+	pthread_t		thread;
+	int			started;
+};
+
+static void *hist_thread(void *data)
+{
+	struct hist_thread *ht = data;
+
+	hist_cpus(&ht->hd, ht->handle);
+
+	return NULL;
+}
+
+/*
+ * Spread the building of the call chains over @threads threads, each
+ * with its own handle of @file. Each reads all the records, to follow
+ * the stacks of the tasks as do_trace_hist() does, but only keeps the
+ * call chains of the pids of its part. Merged, they are the same as
+ * the ones of do_trace_hist().
+ */
+static void do_trace_hist_threads(struct tracecmd_input *handle,
+				  const char *file, int threads)
+{
+	struct pevent *pevent = tracecmd_get_pevent(handle);
+	struct hist_thread *hts;
+	struct hist_comm *hc;
+	struct trace_ohash_slot *slot;
+	int i;
+
+	init_hist_fields(handle);
+
+	hts = calloc(threads, sizeof(*hts));
+	if (!hts)
+		die("malloc");
+
+	/* Loading the plugins is not thread safe, open them all here */
+	hts[0].handle = handle;
+	for (i = 1; i < threads; i++) {
+		hts[i].handle = tracecmd_alloc(file);
+		if (!hts[i].handle)
+			die("can't open %s\n", file);
+		if (tracecmd_read_headers(hts[i].handle) ||
+		    tracecmd_init_data(hts[i].handle) < 0)
+			die("failed to init data");
 	}
 
-	if (current_pid >= 0)
-		save_call_chain(current_pid, ips, ips_idx, 0);
-	if (pending_pid >= 0)
-		save_call_chain(pending_pid, pending_ips, pending_ips_idx, 1);
+	for (i = 0; i < threads; i++)
+		init_hist_data(&hts[i].hd, i, threads);
 
-	save_stored_stacks();
+	for (i = 1; i < threads; i++) {
+		if (!pthread_create(&hts[i].thread, NULL, hist_thread, &hts[i]))
+			hts[i].started = 1;
+	}
 
-	sort_chains();
-	print_chains(pevent);
+	/* The first part is this thread's */
+	hist_thread(&hts[0]);
+
+	for (i = 1; i < threads; i++) {
+		if (hts[i].started)
+			pthread_join(hts[i].thread, NULL);
+		else
+			hist_thread(&hts[i]);
+	}
+
+	for (i = 1; i < threads; i++)
+		merge_hist_data(&hts[0].hd, &hts[i].hd);
+
+	/* All the parts saw the same comms */
+	trace_ohash_for_each_item(hc, slot, &hts[0].hd.comms)
+		register_comm(pevent, hc);
+
+	sort_chains(&hts[0].hd);
+	print_chains(&hts[0].hd, pevent);
+
+	for (i = 1; i < threads; i++)
+		tracecmd_close(hts[i].handle);
+	free(hts);
 }
 
 void trace_hist(int argc, char **argv)
 {
 	struct tracecmd_input *handle;
+	struct hist_data hd;
 	const char *input_file = NULL;
+	int threads = 1;
 	int instances;
 	int ret;
 
 	for (;;) {
 		int c;
 
-		c = getopt(argc-1, argv+1, "+hi:P");
+		c = getopt(argc-1, argv+1, "+hi:Pj:");
 		if (c == -1)
 			break;
 		switch (c) {
@@ -1025,6 +1385,11 @@ void trace_hist(int argc, char **argv)
 		case 'P':
 			compact = 1;
 			break;
+		case 'j':
+			threads = atoi(optarg);
+			if (threads <= 0)
+				threads = sysconf(_SC_NPROCESSORS_ONLN);
+			break;
 		default:
 			usage(argv);
 		}
@@ -1054,6 +1419,9 @@ void trace_hist(int argc, char **argv)
 	if (ret > 0)
 		die("trace-cmd hist does not work with latency traces\n");
 
+	init_hist_data(&hd, 0, 1);
+
+	/* The instances add to the same call chains, keep them in sequence */
 	instances = tracecmd_buffer_instances(handle);
 	if (instances) {
 		struct tracecmd_input *new_handle;
@@ -1065,11 +1433,13 @@ void trace_hist(int argc, char **argv)
 				warning("could not retrieve handle %d", i);
 				continue;
 			}
-			do_trace_hist(new_handle);
+			do_trace_hist(new_handle, &hd);
 			tracecmd_close(new_handle);
 		}
+	} else if (threads > 1) {
+		do_trace_hist_threads(handle, input_file, threads);
 	} else {
-		do_trace_hist(handle);
+		do_trace_hist(handle, &hd);
 	}
 
 	tracecmd_close(handle);
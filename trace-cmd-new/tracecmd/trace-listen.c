@@ -13,13 +13,17 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <signal.h>
 #include <errno.h>
+#include <time.h>
 
 #include "trace-local.h"
+#include "trace-cmd-local.h"
 #include "trace-msg.h"
 
 #define MAX_OPTION_SIZE 4096
@@ -40,6 +44,8 @@ static int backlog = 5;
 
 static int do_daemon;
 
+static int use_epoll;
+
 /* Used for signaling INT to finish */
 static struct tracecmd_msg_handle *stop_msg_handle;
 static bool done;
@@ -264,6 +270,7 @@ static int udp_bind_a_port(int start_port, int *sfd, int use_tcp)
 	char buf[BUFSIZ];
 	int s;
 	int num_port = start_port;
+	int tries = 0;
 
  again:
 	snprintf(buf, BUFSIZ, "%d", num_port);
@@ -274,8 +281,11 @@ static int udp_bind_a_port(int start_port, int *sfd, int use_tcp)
 	hints.ai_flags = AI_PASSIVE;
 
 	s = getaddrinfo(NULL, buf, &hints, &result);
-	if (s != 0)
-		pdie("getaddrinfo: error opening udp socket");
+	if (s != 0) {
+		plog("getaddrinfo: error opening udp socket: %s\n",
+		     gai_strerror(s));
+		return -1;
+	}
 
 	for (rp = result; rp != NULL; rp = rp->ai_next) {
 		*sfd = socket(rp->ai_family, rp->ai_socktype,
@@ -291,8 +301,13 @@ static int udp_bind_a_port(int start_port, int *sfd, int use_tcp)
 
 	if (rp == NULL) {
 		freeaddrinfo(result);
+		/* Wrap around, the search may not start at the first port */
 		if (++num_port > MAX_PORT_SEARCH)
-			pdie("No available ports to bind");
+			num_port = START_PORT_SEARCH;
+		if (++tries > MAX_PORT_SEARCH - START_PORT_SEARCH) {
+			plog("No available ports to bind\n");
+			return -1;
+		}
 		goto again;
 	}
 
@@ -326,10 +341,6 @@ static int open_udp(const char *node, const char *port, int *pid,
 	int sfd;
 	int num_port;
 
-	/*
-	 * udp_bind_a_port() currently does not return an error, but if that
-	 * changes in the future, we have a check for it now.
-	 */
 	num_port = udp_bind_a_port(start_port, &sfd, use_tcp);
 	if (num_port < 0)
 		return num_port;
@@ -344,6 +355,7 @@ static int communicate_with_client(struct tracecmd_msg_handle *msg_handle)
 	char *last_proto = NULL;
 	char buf[BUFSIZ];
 	char *option;
+	int version = V2_PROTOCOL;
 	int pagesize = 0;
 	int options;
 	int size;
@@ -366,7 +378,9 @@ static int communicate_with_client(struct tracecmd_msg_handle *msg_handle)
 
 	/* Is the client using the new protocol? */
 	if (cpus == -1) {
-		if (memcmp(buf, V2_CPU, n) != 0) {
+		if (memcmp(buf, V3_CPU, n) == 0)
+			version = V3_PROTOCOL;
+		else if (memcmp(buf, V2_CPU, n) != 0) {
 			/* If it did not send a version, then bail */
 			if (memcmp(buf, "-1V", 3)) {
 				plog("Unknown string %s\n", buf);
@@ -391,8 +405,8 @@ static int communicate_with_client(struct tracecmd_msg_handle *msg_handle)
 			goto try_again;
 		}
 
-		/* Let the client know we use v2 protocol */
-		write(fd, "V2", 3);
+		/* Let the client know the protocol we use */
+		write(fd, version == V3_PROTOCOL ? "V3" : "V2", 3);
 
 		/* read the rest of dummy data */
 		n = read(fd, buf, sizeof(V2_MAGIC));
@@ -402,7 +416,7 @@ static int communicate_with_client(struct tracecmd_msg_handle *msg_handle)
 		/* We're off! */
 		write(fd, "OK", 2);
 
-		msg_handle->version = V2_PROTOCOL;
+		msg_handle->version = version;
 
 		/* read the CPU count, the page size, and options */
 		if ((pagesize = tracecmd_msg_initial_setting(msg_handle)) < 0)
@@ -491,7 +505,7 @@ static int create_client_file(const char *node, const char *port)
 
 	ofd = open(buf, O_RDWR | O_CREAT | O_TRUNC, 0644);
 	if (ofd < 0)
-		pdie("Can not create file %s", buf);
+		plog("Can not create file %s: %s\n", buf, strerror(errno));
 	return ofd;
 }
 
@@ -626,12 +640,12 @@ static void stop_all_readers(int cpus, int *pid_array)
 static int put_together_file(int cpus, int ofd, const char *node,
 			      const char *port)
 {
-	char **temp_files;
+	char **temp_files = NULL;
 	int cpu;
 	int ret = -ENOMEM;
 
-	/* Now put together the file */
-	temp_files = malloc(sizeof(*temp_files) * cpus);
+	/* Now put together the file, the names start out NULL */
+	temp_files = calloc(cpus, sizeof(*temp_files));
 	if (!temp_files)
 		return -ENOMEM;
 
@@ -644,13 +658,100 @@ static int put_together_file(int cpus, int ofd, const char *node,
 	tracecmd_attach_cpu_data_fd(ofd, cpus, temp_files);
 	ret = 0;
  out:
-	for (cpu--; cpu >= 0; cpu--) {
+	for (cpu = 0; cpu < cpus; cpu++)
 		put_temp_file(temp_files[cpu]);
-	}
 	free(temp_files);
 	return ret;
 }
 
+static void destroy_all_cpu_files(int cpus, int *fd_array, const char *node,
+				  const char *port)
+{
+	int cpu;
+
+	for (cpu = 0; cpu < cpus; cpu++) {
+		if (fd_array[cpu] >= 0)
+			close(fd_array[cpu]);
+		delete_temp_file(node, port, cpu);
+	}
+
+	free(fd_array);
+}
+
+/* The v3 client sends the data of all its CPUs over its own connection */
+static int *create_all_cpu_files(const char *node, const char *port,
+				 struct tracecmd_msg_handle *msg_handle)
+{
+	int cpus = msg_handle->cpu_count;
+	char *tempfile;
+	int *fd_array;
+	int cpu;
+
+	fd_array = malloc(sizeof(int) * cpus);
+	if (!fd_array)
+		return NULL;
+
+	for (cpu = 0; cpu < cpus; cpu++) {
+		tempfile = get_temp_file(node, port, cpu);
+		if (!tempfile)
+			goto out_free;
+		fd_array[cpu] = open(tempfile, O_WRONLY | O_TRUNC | O_CREAT, 0644);
+		if (fd_array[cpu] < 0)
+			plog("creating %s: %s\n", tempfile, strerror(errno));
+		put_temp_file(tempfile);
+		if (fd_array[cpu] < 0) {
+			cpu++;
+			goto out_free;
+		}
+	}
+
+	/* No ports to send, the client keeps to this connection */
+	if (tracecmd_msg_send_port_array(msg_handle, NULL) < 0) {
+		plog("Failed sending port array\n");
+		goto out_free;
+	}
+
+	return fd_array;
+
+ out_free:
+	destroy_all_cpu_files(cpu, fd_array, node, port);
+	return NULL;
+}
+
+static int process_v3_client(struct tracecmd_msg_handle *msg_handle,
+			     const char *node, const char *port, int ofd)
+{
+	int cpus = msg_handle->cpu_count;
+	int *fd_array;
+	int ret;
+	int cpu;
+
+	fd_array = create_all_cpu_files(node, port, msg_handle);
+	if (!fd_array)
+		return -ENOMEM;
+
+	/* on signal stop this msg */
+	stop_msg_handle = msg_handle;
+
+	/* Now we are ready to start reading data from the client */
+	if (tracecmd_msg_collect_metadata(msg_handle, ofd) == 0)
+		tracecmd_msg_collect_data(msg_handle, fd_array);
+
+	stop_msg_handle = NULL;
+
+	/* There are no readers to wait for, the data is all in */
+	for (cpu = 0; cpu < cpus; cpu++) {
+		close(fd_array[cpu]);
+		fd_array[cpu] = -1;
+	}
+
+	ret = put_together_file(cpus, ofd, node, port);
+
+	destroy_all_cpu_files(cpus, fd_array, node, port);
+
+	return ret;
+}
+
 static int process_client(struct tracecmd_msg_handle *msg_handle,
 			  const char *node, const char *port)
 {
@@ -665,6 +766,11 @@ static int process_client(struct tracecmd_msg_handle *msg_handle,
 		return pagesize;
 
 	ofd = create_client_file(node, port);
+	if (ofd < 0)
+		pdie("creating the file of %s:%s", node, port);
+
+	if (msg_handle->version == V3_PROTOCOL)
+		return process_v3_client(msg_handle, node, port, ofd);
 
 	pid_array = create_all_readers(node, port, pagesize, msg_handle);
 	if (!pid_array)
@@ -864,6 +970,1056 @@ static void do_accept_loop(int sfd)
 	clean_up();
 }
 
+/*
+ * The event driven listener (--epoll) serves all the clients from a
+ * single process. The client connections and the sockets of their CPUs
+ * are non-blocking, and are all waited on with one epoll set. The input
+ * of each connection is parsed from a buffer as it comes in, and the
+ * data of each CPU is gathered in a buffer before it is written to the
+ * temp file.
+ */
+
+/* Pages of a CPU to gather before writing them to the temp file */
+#define CPU_BUF_PAGES		16
+
+/* Pages that the socket of a CPU can hold when UDP is used */
+#define UDP_RCVBUF_PAGES	256
+
+/*
+ * Enough for the largest message, and for the strings of the v1 protocol.
+ * It grows up to the messages that the server says it takes.
+ */
+#define CLIENT_BUF_SIZE		(MSG_MAX_LEN > BUFSIZ ? MSG_MAX_LEN : BUFSIZ)
+
+/* Time to keep reading the CPUs after the client is done */
+#define CLIENT_FINISH_MSEC	1000
+
+#define MAX_EPOLL_EVENTS	64
+
+enum listen_type {
+	LISTEN_ACCEPT,
+	LISTEN_CLIENT,
+	LISTEN_CPU_ACCEPT,
+	LISTEN_CPU,
+};
+
+/* What the epoll events point to, the first field of its owner */
+struct listen_event {
+	enum listen_type	type;
+	int			fd;
+};
+
+enum client_state {
+	CLIENT_VERSION,
+	CLIENT_V2_MAGIC,
+	CLIENT_V2_TINIT,
+	CLIENT_V1_PAGESIZE,
+	CLIENT_V1_OPTIONS,
+	CLIENT_V1_OPTION_SIZE,
+	CLIENT_V1_OPTION,
+	CLIENT_METADATA,
+	CLIENT_FINISH,
+	CLIENT_DONE,
+};
+
+struct listen_client;
+
+struct listen_cpu {
+	struct listen_event	event;
+	struct listen_client	*client;
+	int			cpu;
+	int			tfd;
+	char			*buf;
+	int			len;
+	bool			warned;
+};
+
+struct listen_client {
+	struct listen_event	event;
+	struct listen_client	*next;
+	struct tracecmd_msg_handle *msg_handle;
+	struct listen_cpu	*cpus;
+	int			nr_cpus;
+	int			cpus_open;
+	enum client_state	state;
+	int			use_tcp;
+	int			pagesize;
+	int			options;
+	int			option_size;
+	int			ofd;
+	char			*last_proto;
+	char			*out;
+	int			out_len;
+	int			in_len;
+	int			in_size;
+	char			*in;
+	unsigned long long	finish_time;
+	char			host[NI_MAXHOST];
+	char			port[NI_MAXSERV];
+};
+
+static int epoll_fd = -1;
+static struct listen_client *clients;
+/* Freed once the events that may point to them are handled */
+static struct listen_client *done_clients;
+static int next_port = START_PORT_SEARCH;
+
+static unsigned long long get_time_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static int set_nonblock(int fd)
+{
+	int flags;
+
+	flags = fcntl(fd, F_GETFL);
+	if (flags < 0)
+		return -1;
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static int event_add(struct listen_event *event, int fd,
+		     enum listen_type type, unsigned int events)
+{
+	struct epoll_event ev;
+
+	event->type = type;
+	event->fd = fd;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = event;
+	return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static void event_mod(struct listen_event *event, unsigned int events)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = event;
+	epoll_ctl(epoll_fd, EPOLL_CTL_MOD, event->fd, &ev);
+}
+
+/* Writes what it can, and keeps the rest until the socket is writable */
+static int client_write(struct listen_client *client, const void *data, int len)
+{
+	char *out;
+	int w = 0;
+
+	if (!client->out_len) {
+		w = write(client->event.fd, data, len);
+		if (w < 0) {
+			if (errno != EAGAIN && errno != EINTR)
+				return -1;
+			w = 0;
+		}
+		if (w == len)
+			return 0;
+	}
+
+	out = realloc(client->out, client->out_len + len - w);
+	if (!out)
+		return -1;
+	memcpy(out + client->out_len, data + w, len - w);
+	client->out = out;
+
+	if (!client->out_len)
+		event_mod(&client->event, EPOLLIN | EPOLLOUT);
+	client->out_len += len - w;
+
+	return 0;
+}
+
+static int client_flush(struct listen_client *client)
+{
+	int w;
+
+	w = write(client->event.fd, client->out, client->out_len);
+	if (w < 0)
+		return errno == EAGAIN || errno == EINTR ? 0 : -1;
+
+	client->out_len -= w;
+	memmove(client->out, client->out + w, client->out_len);
+	if (!client->out_len)
+		event_mod(&client->event, EPOLLIN);
+
+	return 0;
+}
+
+static int cpu_flush(struct listen_cpu *cpu)
+{
+	int ret;
+
+	if (!cpu->len)
+		return 0;
+
+	ret = __do_write_check(cpu->tfd, cpu->buf, cpu->len);
+	cpu->len = 0;
+	if (ret < 0) {
+		plog("writing cpu%d of %s:%s: %s\n", cpu->cpu,
+		     cpu->client->host, cpu->client->port, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/* The data of a v3 client comes over its connection */
+static int cpu_write(struct listen_cpu *cpu, const void *data, int len)
+{
+	struct listen_client *client = cpu->client;
+	int size = client->pagesize * CPU_BUF_PAGES;
+
+	if (!cpu->buf) {
+		cpu->buf = malloc(size);
+		if (!cpu->buf) {
+			plog("allocating the buffer of cpu%d of %s:%s\n",
+			     cpu->cpu, client->host, client->port);
+			return -1;
+		}
+	}
+
+	if (size - cpu->len < len && cpu_flush(cpu) < 0)
+		return -1;
+
+	if (len > size)
+		return __do_write_check(cpu->tfd, data, len) < 0 ? -1 : 0;
+
+	memcpy(cpu->buf + cpu->len, data, len);
+	cpu->len += len;
+
+	return 0;
+}
+
+static void close_cpu(struct listen_cpu *cpu)
+{
+	if (cpu->event.fd < 0)
+		return;
+
+	close(cpu->event.fd);
+	cpu->event.fd = -1;
+	cpu->client->cpus_open--;
+	cpu_flush(cpu);
+}
+
+static void free_client(struct listen_client *client)
+{
+	int cpu;
+
+	for (cpu = 0; cpu < client->nr_cpus; cpu++)
+		free(client->cpus[cpu].buf);
+	free(client->cpus);
+	free(client->last_proto);
+	free(client->out);
+	free(client->in);
+	tracecmd_msg_handle_close(client->msg_handle);
+	free(client);
+}
+
+/* In the child putting @client together, let go of all the other connections */
+static void close_other_clients(struct listen_client *client)
+{
+	struct listen_client *other;
+	struct listen_cpu *cpu;
+	int i;
+
+	close(epoll_fd);
+
+	/* The temp files and output of the done clients are already closed */
+	for (other = done_clients; other; other = other->next)
+		close(other->event.fd);
+
+	for (other = clients; other; other = other->next) {
+		close(other->event.fd);
+		if (other == client)
+			continue;
+		if (other->ofd >= 0)
+			close(other->ofd);
+		for (i = 0; i < other->nr_cpus; i++) {
+			cpu = &other->cpus[i];
+			if (cpu->event.fd >= 0)
+				close(cpu->event.fd);
+			if (cpu->tfd >= 0)
+				close(cpu->tfd);
+		}
+	}
+}
+
+static void remove_temp_files(struct listen_client *client)
+{
+	int i;
+
+	for (i = 0; i < client->nr_cpus; i++) {
+		if (client->cpus[i].tfd >= 0)
+			delete_temp_file(client->host, client->port, i);
+	}
+}
+
+/*
+ * Putting the file together reads all that the client sent, which
+ * would hold up every other connection. Do it in a child, that is
+ * reaped by the event loop. SIGINT and SIGTERM stay blocked in the
+ * child, and the loop waits for it before exiting, so the file is
+ * always finished.
+ */
+static void assemble_client(struct listen_client *client)
+{
+	int pid;
+
+	pid = fork();
+	if (pid > 0) {
+		add_process(pid);
+		close(client->ofd);
+		return;
+	}
+
+	if (pid < 0)
+		plog("Could not fork to put %s:%s together, doing it now\n",
+		     client->host, client->port);
+	else
+		close_other_clients(client);
+
+	/* This closes the file */
+	if (put_together_file(client->nr_cpus, client->ofd,
+			      client->host, client->port) < 0)
+		close(client->ofd);
+	remove_temp_files(client);
+	plog("Finished %s:%s\n", client->host, client->port);
+
+	if (!pid)
+		_exit(0);
+}
+
+/*
+ * Puts the file of the client together, or only removes what it left
+ * if it did not get that far, and stops handling its events.
+ */
+static void end_client(struct listen_client *client, bool assemble)
+{
+	struct listen_client **last;
+	struct listen_cpu *cpu;
+	int i;
+
+	for (i = 0; i < client->nr_cpus; i++) {
+		cpu = &client->cpus[i];
+		close_cpu(cpu);
+		cpu_flush(cpu);
+		if (cpu->tfd >= 0)
+			close(cpu->tfd);
+	}
+
+	if (client->ofd >= 0 && assemble) {
+		/* Also removes the temp files once it is done with them */
+		assemble_client(client);
+	} else {
+		if (client->ofd >= 0)
+			close(client->ofd);
+		remove_temp_files(client);
+	}
+
+	if (client->state < CLIENT_FINISH)
+		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->event.fd, NULL);
+	client->state = CLIENT_DONE;
+
+	for (last = &clients; *last; last = &(*last)->next) {
+		if (*last == client) {
+			*last = client->next;
+			break;
+		}
+	}
+	client->next = done_clients;
+	done_clients = client;
+}
+
+/* The client is done sending, give its CPUs some time to catch up */
+static void finish_client(struct listen_client *client)
+{
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->event.fd, NULL);
+	client->state = CLIENT_FINISH;
+	client->finish_time = get_time_ms() + CLIENT_FINISH_MSEC;
+}
+
+static void close_client(struct listen_client *client)
+{
+	if (client->state != CLIENT_METADATA)
+		end_client(client, false);
+	else if (client->cpus_open)
+		finish_client(client);
+	else
+		/* All the data came over the connection (v3) */
+		end_client(client, true);
+}
+
+static int start_client(struct listen_client *client)
+{
+	struct tracecmd_msg_handle *msg_handle = client->msg_handle;
+	struct listen_cpu *cpu;
+	char buf[BUFSIZ];
+	char *tempfile;
+	char *msg;
+	int *ports;
+	int rcvbuf;
+	int port;
+	int sfd;
+	int ret = -1;
+	int i;
+
+	client->use_tcp = msg_handle->flags & TRACECMD_MSG_FL_USE_TCP;
+	if (client->use_tcp)
+		plog("Using TCP for live connection\n");
+
+	client->ofd = create_client_file(client->host, client->port);
+	if (client->ofd < 0)
+		return -1;
+
+	client->cpus = calloc(msg_handle->cpu_count, sizeof(*client->cpus));
+	ports = malloc(sizeof(*ports) * msg_handle->cpu_count);
+	if (!client->cpus || !ports)
+		goto out;
+
+	client->nr_cpus = msg_handle->cpu_count;
+	rcvbuf = client->pagesize * UDP_RCVBUF_PAGES;
+	for (i = 0; i < client->nr_cpus; i++) {
+		client->cpus[i].event.fd = -1;
+		client->cpus[i].tfd = -1;
+	}
+
+	/* Now create a UDP port for each CPU */
+	for (i = 0; i < client->nr_cpus; i++) {
+		cpu = &client->cpus[i];
+		cpu->client = client;
+		cpu->cpu = i;
+
+		tempfile = get_temp_file(client->host, client->port, i);
+		if (!tempfile)
+			goto out;
+		cpu->tfd = open(tempfile, O_WRONLY | O_TRUNC | O_CREAT, 0644);
+		if (cpu->tfd < 0)
+			plog("creating %s: %s\n", tempfile, strerror(errno));
+		put_temp_file(tempfile);
+		if (cpu->tfd < 0)
+			goto out;
+
+		/* The v3 client sends the data over its connection */
+		if (msg_handle->version == V3_PROTOCOL)
+			continue;
+
+		port = udp_bind_a_port(next_port, &sfd, client->use_tcp);
+		if (port < 0)
+			goto out;
+		/* Keep the search going after the last port of any client */
+		next_port = port + 1;
+
+		/*
+		 * UDP has no flow control, give it room for the pages that
+		 * come in while the other sockets are served.
+		 */
+		if (!client->use_tcp)
+			setsockopt(sfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf,
+				   sizeof(rcvbuf));
+
+		if ((client->use_tcp && listen(sfd, backlog) < 0) ||
+		    set_nonblock(sfd) < 0 ||
+		    event_add(&cpu->event, sfd, client->use_tcp ?
+			      LISTEN_CPU_ACCEPT : LISTEN_CPU, EPOLLIN) < 0) {
+			plog("setting up cpu%d of %s:%s: %s\n", i,
+			     client->host, client->port, strerror(errno));
+			close(sfd);
+			cpu->event.fd = -1;
+			goto out;
+		}
+		client->cpus_open++;
+		ports[i] = port;
+	}
+
+	if (msg_handle->version >= V2_PROTOCOL) {
+		/* send set of port numbers to the client */
+		ret = tracecmd_msg_port_array_buf(msg_handle,
+						  msg_handle->version == V3_PROTOCOL ?
+						  NULL : ports, &msg);
+		if (ret < 0) {
+			plog("Failed sending port array\n");
+			goto out;
+		}
+		ret = client_write(client, msg, ret);
+		free(msg);
+	} else {
+		/* send the client a comma deliminated set of port numbers */
+		for (ret = 0, i = 0; !ret && i < client->nr_cpus; i++) {
+			snprintf(buf, BUFSIZ, "%s%d", i ? "," : "", ports[i]);
+			ret = client_write(client, buf, strlen(buf));
+		}
+		/* end with null terminator */
+		if (!ret)
+			ret = client_write(client, "\0", 1);
+	}
+ out:
+	free(ports);
+	return ret;
+}
+
+/*
+ * Returns the size of the nul terminated string at the start of @buf,
+ * 0 if it is not all there yet, or -1 if it is too big.
+ */
+static int client_string(char *buf, int len)
+{
+	char *end;
+
+	end = memchr(buf, 0, len);
+	if (end)
+		return end - buf + 1;
+
+	return len >= BUFSIZ ? -1 : 0;
+}
+
+/*
+ * Goes through the input of the client, the same way that
+ * communicate_with_client() and the metadata collection do.
+ *
+ * Returns 1 when the client closed the connection, 0 if it
+ * is expected to send more, or negative on error.
+ */
+static int process_client_input(struct listen_client *client)
+{
+	struct tracecmd_msg_handle *msg_handle = client->msg_handle;
+	char option[MAX_OPTION_SIZE + 1];
+	void *data;
+	char *buf;
+	int pos = 0;
+	int cpu;
+	int len;
+	int ret = 0;
+	int n;
+
+	while (!ret && pos < client->in_len) {
+		buf = client->in + pos;
+		len = client->in_len - pos;
+		n = 0;
+
+		switch (client->state) {
+		case CLIENT_VERSION:
+			n = client_string(buf, len);
+			if (n <= 0)
+				break;
+
+			/* Is the client using the new protocol? */
+			if (atoi(buf) != -1) {
+				/* The client is using the v1 protocol */
+				plog("cpus=%d\n", atoi(buf));
+				if (atoi(buf) < 0) {
+					ret = -EINVAL;
+					break;
+				}
+				msg_handle->cpu_count = atoi(buf);
+				client->state = CLIENT_V1_PAGESIZE;
+				break;
+			}
+
+			if (memcmp(buf, V3_CPU, n - 1) == 0) {
+				/* Let the client know we use v3 protocol */
+				ret = client_write(client, "V3", 3);
+				msg_handle->version = V3_PROTOCOL;
+				client->state = CLIENT_V2_MAGIC;
+				break;
+			}
+
+			if (memcmp(buf, V2_CPU, n - 1) == 0) {
+				/* Let the client know we use v2 protocol */
+				ret = client_write(client, "V2", 3);
+				msg_handle->version = V2_PROTOCOL;
+				client->state = CLIENT_V2_MAGIC;
+				break;
+			}
+
+			/* If it did not send a version, then bail */
+			if (memcmp(buf, "-1V", 3)) {
+				plog("Unknown string %s\n", buf);
+				ret = -EINVAL;
+				break;
+			}
+			/* Skip "-1" */
+			plog("Cannot handle the protocol %s\n", buf + 2);
+
+			/* If it returned the same command as last time, bail! */
+			if (client->last_proto &&
+			    strcmp(client->last_proto, buf) == 0) {
+				plog("Repeat of version %s sent\n", buf);
+				ret = -EINVAL;
+				break;
+			}
+			free(client->last_proto);
+			client->last_proto = strdup(buf);
+
+			/* Return the highest protocol we can use */
+			ret = client_write(client, "V2", 3);
+			break;
+
+		case CLIENT_V2_MAGIC:
+			if (len < sizeof(V2_MAGIC))
+				break;
+			n = sizeof(V2_MAGIC);
+			if (memcmp(buf, V2_MAGIC, n) != 0) {
+				ret = -EINVAL;
+				break;
+			}
+			/* We're off! */
+			ret = client_write(client, "OK", 2);
+			client->state = CLIENT_V2_TINIT;
+			break;
+
+		case CLIENT_V2_TINIT:
+			n = tracecmd_msg_buf_len(buf, len);
+			if (n <= 0 || n > len)
+				break;
+			/* read the CPU count, the page size, and options */
+			client->pagesize = tracecmd_msg_initial_setting_buf(msg_handle,
+									    buf, n);
+			if (client->pagesize < 0) {
+				ret = client->pagesize;
+				break;
+			}
+			ret = start_client(client);
+			if (!ret)
+				client->state = CLIENT_METADATA;
+			break;
+
+		case CLIENT_V1_PAGESIZE:
+			n = client_string(buf, len);
+			if (n <= 0)
+				break;
+			client->pagesize = atoi(buf);
+			plog("pagesize=%d\n", client->pagesize);
+			if (client->pagesize <= 0) {
+				ret = -EINVAL;
+				break;
+			}
+			client->state = CLIENT_V1_OPTIONS;
+			break;
+
+		case CLIENT_V1_OPTIONS:
+			n = client_string(buf, len);
+			if (n <= 0)
+				break;
+			client->options = atoi(buf);
+			if (client->options > 0) {
+				client->state = CLIENT_V1_OPTION_SIZE;
+				break;
+			}
+			ret = start_client(client);
+			if (!ret)
+				client->state = CLIENT_METADATA;
+			break;
+
+		case CLIENT_V1_OPTION_SIZE:
+			n = client_string(buf, len);
+			if (n <= 0)
+				break;
+			client->option_size = atoi(buf);
+			/* prevent a client from killing us */
+			if (client->option_size <= 0 ||
+			    client->option_size > MAX_OPTION_SIZE) {
+				ret = -EINVAL;
+				break;
+			}
+			client->state = CLIENT_V1_OPTION;
+			break;
+
+		case CLIENT_V1_OPTION:
+			if (len < client->option_size)
+				break;
+			n = client->option_size;
+			memcpy(option, buf, n);
+			option[n] = 0;
+			/* do we understand this option? */
+			if (!process_option(msg_handle, option)) {
+				ret = -EINVAL;
+				break;
+			}
+			if (--client->options) {
+				client->state = CLIENT_V1_OPTION_SIZE;
+				break;
+			}
+			ret = start_client(client);
+			if (!ret)
+				client->state = CLIENT_METADATA;
+			break;
+
+		case CLIENT_METADATA:
+			if (msg_handle->version < V2_PROTOCOL) {
+				/* All that the v1 client sends now is metadata */
+				n = len;
+				ret = __do_write_check(client->ofd, buf, n);
+				if (ret < 0)
+					plog("writing to file: %s\n",
+					     strerror(errno));
+				break;
+			}
+			n = tracecmd_msg_buf_len(buf, len);
+			if (n <= 0 || n > len)
+				break;
+			if (msg_handle->version == V3_PROTOCOL) {
+				ret = tracecmd_msg_data_buf(msg_handle, buf, n,
+							    &cpu, &data);
+				if (ret > 0)
+					ret = cpu_write(&client->cpus[cpu],
+							data, ret);
+				else if (!ret && !data)
+					ret = tracecmd_msg_collect_metadata_buf(msg_handle,
+										buf, n,
+										client->ofd);
+				break;
+			}
+			ret = tracecmd_msg_collect_metadata_buf(msg_handle, buf,
+								n, client->ofd);
+			break;
+
+		default:
+			return -EINVAL;
+		}
+
+		if (n < 0 && !ret)
+			ret = n;
+		if (n <= 0 || n > len)
+			break;
+		pos += n;
+	}
+
+	client->in_len -= pos;
+	memmove(client->in, client->in + pos, client->in_len);
+
+	return ret;
+}
+
+/* Make room for a message that does not fit yet */
+static int client_grow_in(struct listen_client *client)
+{
+	int size;
+	char *in;
+
+	if (client->in_len < client->in_size)
+		return 0;
+
+	size = client->in_size ? client->in_size * 2 : CLIENT_BUF_SIZE;
+	if (client->in_size >= MSG_LARGE_MAX_LEN) {
+		plog("message from %s:%s is too big\n",
+		     client->host, client->port);
+		return -EINVAL;
+	}
+
+	in = realloc(client->in, size);
+	if (!in) {
+		plog("allocating client buffer\n");
+		return -ENOMEM;
+	}
+	client->in = in;
+	client->in_size = size;
+	return 0;
+}
+
+static void handle_client(struct listen_client *client, unsigned int events)
+{
+	int r;
+
+	if (client->state >= CLIENT_FINISH)
+		return;
+
+	if (events & EPOLLOUT) {
+		if (client_flush(client) < 0)
+			goto out_close;
+	}
+
+	if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+		return;
+
+	if (client_grow_in(client) < 0)
+		goto out_close;
+
+	r = read(client->event.fd, client->in + client->in_len,
+		 client->in_size - client->in_len);
+	if (r < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return;
+		plog("reading %s:%s: %s\n", client->host, client->port,
+		     strerror(errno));
+		goto out_close;
+	}
+	/* The v1 client closes the connection after the metadata */
+	if (!r)
+		goto out_close;
+
+	client->in_len += r;
+	if (process_client_input(client))
+		goto out_close;
+
+	return;
+
+ out_close:
+	close_client(client);
+}
+
+static void handle_cpu_accept(struct listen_cpu *cpu)
+{
+	int cfd;
+
+	cfd = accept(cpu->event.fd, NULL, NULL);
+	if (cfd < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return;
+		plog("accept cpu%d of %s:%s: %s\n", cpu->cpu,
+		     cpu->client->host, cpu->client->port, strerror(errno));
+		close_cpu(cpu);
+		return;
+	}
+
+	/* Only one connection per CPU */
+	close(cpu->event.fd);
+	if (set_nonblock(cfd) < 0 ||
+	    event_add(&cpu->event, cfd, LISTEN_CPU, EPOLLIN) < 0) {
+		close(cfd);
+		cpu->event.fd = -1;
+		cpu->client->cpus_open--;
+	}
+}
+
+static void handle_cpu(struct listen_cpu *cpu)
+{
+	struct listen_client *client = cpu->client;
+	int size = client->pagesize * CPU_BUF_PAGES;
+	int r;
+
+	if (!cpu->buf) {
+		cpu->buf = malloc(size);
+		if (!cpu->buf) {
+			plog("allocating the buffer of cpu%d of %s:%s\n",
+			     cpu->cpu, client->host, client->port);
+			close_cpu(cpu);
+			return;
+		}
+	}
+
+	/* Read until the buffer is full, the next event gets the rest */
+	for (;;) {
+		/* UDP requires that we get the full size in one go */
+		if (size - cpu->len < (client->use_tcp ? 1 : client->pagesize)) {
+			if (cpu_flush(cpu) < 0)
+				close_cpu(cpu);
+			return;
+		}
+
+		r = read(cpu->event.fd, cpu->buf + cpu->len,
+			 client->use_tcp ? size - cpu->len : client->pagesize);
+		if (r < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				return;
+			plog("reading pages of cpu%d of %s:%s: %s\n", cpu->cpu,
+			     client->host, client->port, strerror(errno));
+			close_cpu(cpu);
+			return;
+		}
+		if (!r) {
+			close_cpu(cpu);
+			return;
+		}
+
+		if (!client->use_tcp && r < client->pagesize && !cpu->warned) {
+			cpu->warned = true;
+			warning("read %d bytes, expected %d", r, client->pagesize);
+		}
+		cpu->len += r;
+	}
+}
+
+static void new_client(int cfd, struct sockaddr_storage *peer_addr,
+		       socklen_t peer_addr_len)
+{
+	struct listen_client *client;
+	int s;
+
+	client = calloc(1, sizeof(*client));
+	if (!client) {
+		plog("allocating client\n");
+		close(cfd);
+		return;
+	}
+
+	s = getnameinfo((struct sockaddr *)peer_addr, peer_addr_len,
+			client->host, NI_MAXHOST,
+			client->port, NI_MAXSERV, NI_NUMERICSERV);
+	if (s != 0) {
+		plog("Error with getnameinfo: %s\n", gai_strerror(s));
+		close(cfd);
+		free(client);
+		return;
+	}
+
+	plog("Connected with %s:%s\n", client->host, client->port);
+
+	client->msg_handle = tracecmd_msg_handle_alloc(cfd, TRACECMD_MSG_FL_SERVER);
+	if (!client->msg_handle) {
+		close(cfd);
+		free(client);
+		return;
+	}
+	client->ofd = -1;
+
+	if (set_nonblock(cfd) < 0 ||
+	    event_add(&client->event, cfd, LISTEN_CLIENT, EPOLLIN) < 0) {
+		free_client(client);
+		return;
+	}
+
+	client->next = clients;
+	clients = client;
+
+	/* Let the client know what we are */
+	if (client_write(client, "tracecmd", 8) < 0)
+		end_client(client, false);
+}
+
+static void handle_accept(int sfd)
+{
+	struct sockaddr_storage peer_addr;
+	socklen_t peer_addr_len;
+	int cfd;
+
+	for (;;) {
+		peer_addr_len = sizeof(peer_addr);
+		cfd = accept(sfd, (struct sockaddr *)&peer_addr,
+			     &peer_addr_len);
+		if (cfd < 0) {
+			if (errno != EAGAIN && errno != EINTR &&
+			    errno != ECONNABORTED)
+				plog("connecting: %s\n", strerror(errno));
+			return;
+		}
+		new_client(cfd, &peer_addr, peer_addr_len);
+	}
+}
+
+/* Puts together the files of the clients that are done */
+static int check_finished_clients(void)
+{
+	struct listen_client *client, *next;
+	unsigned long long now = get_time_ms();
+	int timeout = -1;
+
+	for (client = clients; client; client = next) {
+		next = client->next;
+		if (client->state != CLIENT_FINISH)
+			continue;
+		/* With TCP, all is read once the client closed its CPUs */
+		if (now >= client->finish_time ||
+		    (client->use_tcp && !client->cpus_open)) {
+			end_client(client, true);
+			continue;
+		}
+		if (timeout < 0 || client->finish_time - now < timeout)
+			timeout = client->finish_time - now;
+	}
+
+	while (done_clients) {
+		client = done_clients;
+		done_clients = client->next;
+		free_client(client);
+	}
+
+	/* Reap the children that put files together */
+	clean_up();
+
+	return timeout;
+}
+
+static void raise_fd_limit(void)
+{
+	struct rlimit rlim;
+
+	/* Every CPU of every client needs a socket and a temp file */
+	if (getrlimit(RLIMIT_NOFILE, &rlim) < 0)
+		return;
+	rlim.rlim_cur = rlim.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rlim);
+}
+
+static void do_event_loop(int sfd)
+{
+	struct epoll_event events[MAX_EPOLL_EVENTS];
+	struct listen_event accept_event;
+	struct listen_event *event;
+	sigset_t orig_mask;
+	sigset_t mask;
+	int timeout = -1;
+	int nr;
+	int i;
+
+	raise_fd_limit();
+
+	/* Only let the signals in while waiting, so that none is missed */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, &orig_mask);
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0)
+		pdie("creating epoll");
+
+	if (set_nonblock(sfd) < 0 ||
+	    event_add(&accept_event, sfd, LISTEN_ACCEPT, EPOLLIN) < 0)
+		pdie("adding listening socket");
+
+	while (!done) {
+		nr = epoll_pwait(epoll_fd, events, MAX_EPOLL_EVENTS, timeout,
+				 &orig_mask);
+		if (nr < 0 && errno != EINTR)
+			pdie("epoll_wait");
+
+		for (i = 0; i < nr; i++) {
+			event = events[i].data.ptr;
+			/* Closed by an earlier event of this round */
+			if (event->fd < 0)
+				continue;
+
+			switch (event->type) {
+			case LISTEN_ACCEPT:
+				handle_accept(event->fd);
+				break;
+			case LISTEN_CLIENT:
+				handle_client((struct listen_client *)event,
+					      events[i].events);
+				break;
+			case LISTEN_CPU_ACCEPT:
+				handle_cpu_accept((struct listen_cpu *)event);
+				break;
+			case LISTEN_CPU:
+				handle_cpu((struct listen_cpu *)event);
+				break;
+			}
+		}
+
+		timeout = check_finished_clients();
+	}
+
+	/* Put together what the clients sent until now */
+	while (clients)
+		end_client(clients, clients->state >= CLIENT_METADATA);
+	check_finished_clients();
+
+	/* Let the files that are still being put together finish */
+	while (wait(NULL) > 0)
+		;
+
+	close(epoll_fd);
+	sigprocmask(SIG_SETMASK, &orig_mask, NULL);
+}
+
 static void make_pid_file(void)
 {
 	char buf[PATH_MAX];
@@ -895,8 +2051,10 @@ static void do_listen(char *port)
 	struct addrinfo hints;
 	struct addrinfo *result, *rp;
 	int sfd, s;
+	int on = 1;
 
-	if (!debug)
+	/* The event loop is woken up by its children putting files together */
+	if (!debug || use_epoll)
 		signal_setup(SIGCHLD, sigstub);
 
 	make_pid_file();
@@ -916,6 +2074,9 @@ static void do_listen(char *port)
 		if (sfd < 0)
 			continue;
 
+		/* Do not wait for the connections of a previous run to time out */
+		setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
 		if (bind(sfd, rp->ai_addr, rp->ai_addrlen) == 0)
 			break;
 
@@ -927,12 +2088,19 @@ static void do_listen(char *port)
 
 	freeaddrinfo(result);
 
+	/* One process takes all the connections, let them queue up */
+	if (use_epoll)
+		backlog = SOMAXCONN;
+
 	if (listen(sfd, backlog) < 0)
 		pdie("listen");
 
-	do_accept_loop(sfd);
-
-	kill_clients();
+	if (use_epoll) {
+		do_event_loop(sfd);
+	} else {
+		do_accept_loop(sfd);
+		kill_clients();
+	}
 
 	remove_pid_file();
 }
@@ -946,6 +2114,7 @@ static void start_daemon(void)
 }
 
 enum {
+	OPT_epoll	= 254,
 	OPT_debug	= 255,
 };
 
@@ -968,6 +2137,7 @@ void trace_listen(int argc, char **argv)
 			{"port", required_argument, NULL, 'p'},
 			{"help", no_argument, NULL, '?'},
 			{"debug", no_argument, NULL, OPT_debug},
+			{"epoll", no_argument, NULL, OPT_epoll},
 			{NULL, 0, NULL, 0}
 		};
 
@@ -997,6 +2167,9 @@ void trace_listen(int argc, char **argv)
 		case OPT_debug:
 			debug = 1;
 			break;
+		case OPT_epoll:
+			use_epoll = 1;
+			break;
 		default:
 			usage(argv);
 		}
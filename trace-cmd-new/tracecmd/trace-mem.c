@@ -18,8 +18,11 @@
 #include <string.h>
 #include <getopt.h>
 #include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include "trace-local.h"
+#include "trace-hash.h"
 #include "trace-hash-local.h"
 #include "list.h"
 
@@ -157,6 +160,7 @@ static void update_kmem_cache_free(struct pevent *pevent)
 
 struct func_descr {
 	struct func_descr	*next;
+	struct func_descr	*global;	/* what a part merges into */
 	const char		*func;
 	unsigned long		total_alloc;
 	unsigned long		total_req;
@@ -169,165 +173,282 @@ struct func_descr {
 };
 
 struct ptr_descr {
-	struct ptr_descr	*next;
+	struct ptr_descr	*next;		/* on the free list */
 	struct func_descr	*func;
 	unsigned long long	ptr;
 	unsigned long		alloc;
 	unsigned long		req;
 };
 
-#define HASH_BITS	12
-#define HASH_SIZE	(1 << HASH_BITS)
-#define HASH_MASK	(HASH_SIZE - 1);
+#define PTR_CHUNK_SIZE	4096
 
-static struct func_descr *func_hash[HASH_SIZE];
-static struct ptr_descr *ptr_hash[HASH_SIZE];
-static struct func_descr **func_list;
+struct ptr_chunk {
+	struct ptr_chunk	*next;
+	struct ptr_descr	ptrs[PTR_CHUNK_SIZE];
+};
+
+/*
+ * Millions of pointers can be live at once, hand them out of large
+ * chunks instead of allocating each one.
+ */
+struct ptr_pool {
+	struct ptr_chunk	*chunks;
+	struct ptr_descr	*free;
+	int			used;		/* of the first chunk */
+};
 
-static unsigned func_count;
+/* A change of the current allocations of a function, in record order */
+struct mem_delta {
+	unsigned long long	seq;
+	struct func_descr	*func;
+	long			alloc;
+	long			req;
+};
 
-static int make_key(const void *ptr, int size)
+/*
+ * With more than one part, each part only handles the pointers whose
+ * hash falls into it, and keeps the changes to the current allocations
+ * in @deltas. The max values depend on the order of all the changes,
+ * so they are found when the parts are merged.
+ */
+struct mem_data {
+	struct tracecmd_input	*handle;
+	struct pevent		*pevent;
+	struct func_descr	*funcs;
+	struct trace_ohash	func_hash;
+	struct trace_ohash	ptr_hash;
+	struct ptr_pool		pool;
+	unsigned		func_count;
+
+	int			part;
+	int			nr_parts;
+	unsigned long long	seq;
+	struct mem_delta	*deltas;
+	unsigned long		nr_deltas;
+	unsigned long		deltas_size;
+
+	pthread_t		thread;
+	int			started;
+};
+
+static struct func_descr **func_list;
+
+static void init_mem_data(struct mem_data *mem, struct tracecmd_input *handle,
+			  int part, int nr_parts)
 {
-	int key = 0;
-	int i;
-	char *kp = (char *)&key;
-	const char *indx = ptr;
+	memset(mem, 0, sizeof(*mem));
 
-	for (i = 0; i < size; i++)
-		kp[i & 3] ^= indx[i];
+	mem->handle = handle;
+	mem->pevent = tracecmd_get_pevent(handle);
+	mem->part = part;
+	mem->nr_parts = nr_parts;
 
-	return trace_hash(key);
+	trace_ohash_init(&mem->func_hash, 256);
+	trace_ohash_init(&mem->ptr_hash, 4096);
 }
 
-static struct func_descr *find_func(const char *func)
+static void free_mem_data(struct mem_data *mem)
 {
 	struct func_descr *funcd;
-	int key = make_key(func, strlen(func)) & HASH_MASK;
-
-	for (funcd = func_hash[key]; funcd; funcd = funcd->next) {
-		/*
-		 * As func is always a constant to one pointer,
-		 * we can use a direct compare instead of strcmp.
-		 */
-		if (funcd->func == func)
-			return funcd;
+	struct ptr_chunk *chunk;
+
+	while ((funcd = mem->funcs)) {
+		mem->funcs = funcd->next;
+		free(funcd);
 	}
 
-	return NULL;
+	while ((chunk = mem->pool.chunks)) {
+		mem->pool.chunks = chunk->next;
+		free(chunk);
+	}
+
+	trace_ohash_free(&mem->func_hash);
+	trace_ohash_free(&mem->ptr_hash);
+	free(mem->deltas);
 }
 
-static struct func_descr *create_func(const char *func)
+static struct ptr_descr *alloc_ptr(struct ptr_pool *pool)
+{
+	struct ptr_chunk *chunk;
+	struct ptr_descr *ptrd;
+
+	if (pool->free) {
+		ptrd = pool->free;
+		pool->free = ptrd->next;
+		return ptrd;
+	}
+
+	if (!pool->chunks || pool->used == PTR_CHUNK_SIZE) {
+		chunk = malloc(sizeof(*chunk));
+		if (!chunk)
+			die("malloc");
+		chunk->next = pool->chunks;
+		pool->chunks = chunk;
+		pool->used = 0;
+	}
+
+	return &pool->chunks->ptrs[pool->used++];
+}
+
+static void free_ptr(struct ptr_pool *pool, struct ptr_descr *ptrd)
+{
+	ptrd->next = pool->free;
+	pool->free = ptrd;
+}
+
+static int match_func(void *item, void *data)
+{
+	struct func_descr *funcd = item;
+
+	/*
+	 * As func is always a constant to one pointer,
+	 * we can use a direct compare instead of strcmp.
+	 */
+	return funcd->func == data;
+}
+
+static struct func_descr *find_func(struct mem_data *mem, const char *func)
+{
+	unsigned long long key = trace_hash64((unsigned long)func);
+
+	return trace_ohash_find(&mem->func_hash, key, match_func, (void *)func);
+}
+
+static struct func_descr *
+create_func(struct mem_data *mem, const char *func, unsigned long long key)
 {
 	struct func_descr *funcd;
-	int key = make_key(func, strlen(func)) & HASH_MASK;
 
 	funcd = zalloc(sizeof(*funcd));
 	if (!funcd)
 		die("malloc");
 
 	funcd->func = func;
-	funcd->next = func_hash[key];
-	func_hash[key] = funcd;
+	if (trace_ohash_add(&mem->func_hash, key, funcd) < 0)
+		die("malloc");
 
-	func_count++;
+	funcd->next = mem->funcs;
+	mem->funcs = funcd;
+	mem->func_count++;
 
 	return funcd;
 }
 
-static struct ptr_descr *find_ptr(unsigned long long ptr)
+/*
+ * The 64 bit hash of a pointer is unique, and is all that needs
+ * to be compared to find it.
+ */
+static struct ptr_descr *find_ptr(struct mem_data *mem, unsigned long long key)
 {
-	struct ptr_descr *ptrd;
-	int key = make_key(&ptr, sizeof(ptr)) & HASH_MASK;
-
-	for (ptrd = ptr_hash[key]; ptrd; ptrd = ptrd->next) {
-		if (ptrd->ptr == ptr)
-			return ptrd;
-	}
-
-	return NULL;
+	return trace_ohash_find(&mem->ptr_hash, key, NULL, NULL);
 }
 
-static struct ptr_descr *create_ptr(unsigned long long ptr)
+static struct ptr_descr *
+create_ptr(struct mem_data *mem, unsigned long long ptr, unsigned long long key)
 {
 	struct ptr_descr *ptrd;
-	int key = make_key(&ptr, sizeof(ptr)) & HASH_MASK;
-
-	ptrd = zalloc(sizeof(*ptrd));
-	if (!ptrd)
-		die("malloc");
 
+	ptrd = alloc_ptr(&mem->pool);
+	memset(ptrd, 0, sizeof(*ptrd));
 	ptrd->ptr = ptr;
-	ptrd->next = ptr_hash[key];
-	ptr_hash[key] = ptrd;
+
+	if (trace_ohash_add(&mem->ptr_hash, key, ptrd) < 0)
+		die("malloc");
 
 	return ptrd;
 }
 
-static void remove_ptr(unsigned long long ptr)
+static void remove_ptr(struct mem_data *mem, struct ptr_descr *ptrd,
+		       unsigned long long key)
 {
-	struct ptr_descr *ptrd, **last;
-	int key = make_key(&ptr, sizeof(ptr)) & HASH_MASK;
+	trace_ohash_del(&mem->ptr_hash, key, ptrd);
+	free_ptr(&mem->pool, ptrd);
+}
 
-	last = &ptr_hash[key];
-	for (ptrd = ptr_hash[key]; ptrd; ptrd = ptrd->next) {
-		if (ptrd->ptr == ptr)
-			break;
-		last = &ptrd->next;
-	}
+static void update_current(struct func_descr *funcd, long alloc, long req)
+{
+	funcd->current_alloc += alloc;
+	funcd->current_req += req;
+	if (funcd->current_alloc > funcd->max_alloc)
+		funcd->max_alloc = funcd->current_alloc;
+	if (funcd->current_req > funcd->max_req)
+		funcd->max_req = funcd->current_req;
+}
 
-	if (!ptrd)
+static void add_delta(struct mem_data *mem, struct func_descr *funcd,
+		      long alloc, long req)
+{
+	struct mem_delta *delta;
+
+	if (mem->nr_parts == 1) {
+		update_current(funcd, alloc, req);
 		return;
+	}
+
+	if (mem->nr_deltas == mem->deltas_size) {
+		mem->deltas_size = mem->deltas_size ? mem->deltas_size * 2 : 4096;
+		mem->deltas = realloc(mem->deltas,
+				      sizeof(*mem->deltas) * mem->deltas_size);
+		if (!mem->deltas)
+			die("malloc");
+	}
 
-	*last = ptrd->next;
-	free(ptrd);
+	delta = &mem->deltas[mem->nr_deltas++];
+	delta->seq = mem->seq;
+	delta->func = funcd;
+	delta->alloc = alloc;
+	delta->req = req;
 }
 
-static void add_kmalloc(const char *func, unsigned long long ptr,
+static void add_kmalloc(struct mem_data *mem, const char *func,
+			unsigned long long ptr, unsigned long long key,
 			unsigned int req, int alloc)
 {
 	struct func_descr *funcd;
 	struct ptr_descr *ptrd;
 
-	funcd = find_func(func);
+	funcd = find_func(mem, func);
 	if (!funcd)
-		funcd = create_func(func);
+		funcd = create_func(mem, func,
+				    trace_hash64((unsigned long)func));
 
 	funcd->total_alloc += alloc;
 	funcd->total_req += req;
-	funcd->current_alloc += alloc;
-	funcd->current_req += req;
-	if (funcd->current_alloc > funcd->max_alloc)
-		funcd->max_alloc = funcd->current_alloc;
-	if (funcd->current_req > funcd->max_req)
-		funcd->max_req = funcd->current_req;
+	add_delta(mem, funcd, alloc, req);
 
-	ptrd = find_ptr(ptr);
+	ptrd = find_ptr(mem, key);
 	if (!ptrd)
-		ptrd = create_ptr(ptr);
+		ptrd = create_ptr(mem, ptr, key);
 
 	ptrd->alloc = alloc;
 	ptrd->req = req;
 	ptrd->func = funcd;
 }
 
-static void remove_kmalloc(unsigned long long ptr)
+static void remove_kmalloc(struct mem_data *mem, unsigned long long key)
 {
-	struct func_descr *funcd;
 	struct ptr_descr *ptrd;
 
-	ptrd = find_ptr(ptr);
+	ptrd = find_ptr(mem, key);
 	if (!ptrd)
 		return;
 
-	funcd = ptrd->func;
-	funcd->current_alloc -= ptrd->alloc;
-	funcd->current_req -= ptrd->req;
+	add_delta(mem, ptrd->func, -(long)ptrd->alloc, -(long)ptrd->req);
+
+	remove_ptr(mem, ptrd, key);
+}
+
+/* Set @key to the hash of @ptr, and return if it is in the part of @mem */
+static int ptr_in_part(struct mem_data *mem, unsigned long long ptr,
+		       unsigned long long *key)
+{
+	*key = trace_hash64(ptr);
 
-	remove_ptr(ptr);
+	return mem->nr_parts == 1 || *key % mem->nr_parts == mem->part;
 }
 
 static void
-process_kmalloc(struct pevent *pevent, struct pevent_record *record,
+process_kmalloc(struct mem_data *mem, struct pevent_record *record,
 		struct format_field *callsite_field,
 		struct format_field *bytes_req_field,
 		struct format_field *bytes_alloc_field,
@@ -336,35 +457,42 @@ process_kmalloc(struct pevent *pevent, struct pevent_record *record,
 	unsigned long long callsite;
 	unsigned long long val;
 	unsigned long long ptr;
+	unsigned long long key;
 	unsigned int req;
 	int alloc;
 	const char *func;
 
+	pevent_read_number_field(ptr_field, record->data, &ptr);
+	if (!ptr_in_part(mem, ptr, &key))
+		return;
+
 	pevent_read_number_field(callsite_field, record->data, &callsite);
 	pevent_read_number_field(bytes_req_field, record->data, &val);
 	req = val;
 	pevent_read_number_field(bytes_alloc_field, record->data, &val);
 	alloc = val;
-	pevent_read_number_field(ptr_field, record->data, &ptr);
 
-	func = pevent_find_function(pevent, callsite);
+	func = pevent_find_function(mem->pevent, callsite);
 
-	add_kmalloc(func, ptr, req, alloc);
+	add_kmalloc(mem, func, ptr, key, req, alloc);
 }
 
 static void
-process_kfree(struct pevent *pevent, struct pevent_record *record,
+process_kfree(struct mem_data *mem, struct pevent_record *record,
 	      struct format_field *ptr_field)
 {
 	unsigned long long ptr;
+	unsigned long long key;
 
 	pevent_read_number_field(ptr_field, record->data, &ptr);
+	if (!ptr_in_part(mem, ptr, &key))
+		return;
 
-	remove_kmalloc(ptr);
+	remove_kmalloc(mem, key);
 }
 
 static void
-process_record(struct pevent *pevent, struct pevent_record *record)
+process_record(struct mem_data *mem, struct pevent_record *record)
 {
 	unsigned long long val;
 	int type;
@@ -372,35 +500,126 @@ process_record(struct pevent *pevent, struct pevent_record *record)
 	pevent_read_number_field(common_type_field, record->data, &val);
 	type = val;
 
+	/* All the parts see the same records, this orders their deltas */
+	mem->seq++;
+
 	if (type == kmalloc_type)
-		return process_kmalloc(pevent, record,
+		return process_kmalloc(mem, record,
 				       kmalloc_callsite_field,
 				       kmalloc_bytes_req_field,
 				       kmalloc_bytes_alloc_field,
 				       kmalloc_ptr_field);
 	if (type == kmalloc_node_type)
-		return process_kmalloc(pevent, record,
+		return process_kmalloc(mem, record,
 				       kmalloc_node_callsite_field,
 				       kmalloc_node_bytes_req_field,
 				       kmalloc_node_bytes_alloc_field,
 				       kmalloc_node_ptr_field);
 	if (type == kfree_type)
-		return process_kfree(pevent, record, kfree_ptr_field);
+		return process_kfree(mem, record, kfree_ptr_field);
 
 	if (type == kmem_cache_alloc_type)
-		return process_kmalloc(pevent, record,
+		return process_kmalloc(mem, record,
 				       kmem_cache_callsite_field,
 				       kmem_cache_bytes_req_field,
 				       kmem_cache_bytes_alloc_field,
 				       kmem_cache_ptr_field);
 	if (type == kmem_cache_alloc_node_type)
-		return process_kmalloc(pevent, record,
+		return process_kmalloc(mem, record,
 				       kmem_cache_node_callsite_field,
 				       kmem_cache_node_bytes_req_field,
 				       kmem_cache_node_bytes_alloc_field,
 				       kmem_cache_node_ptr_field);
 	if (type == kmem_cache_free_type)
-		return process_kfree(pevent, record, kmem_cache_free_ptr_field);
+		return process_kfree(mem, record, kmem_cache_free_ptr_field);
+}
+
+static void *process_part(void *data)
+{
+	struct mem_data *mem = data;
+	struct pevent_record *record;
+	int missed_events = 0;
+	int cpu;
+
+	while ((record = tracecmd_read_next_data(mem->handle, &cpu))) {
+
+		/* record missed event */
+		if (!missed_events && record->missed_events)
+			missed_events = 1;
+
+		process_record(mem, record);
+		free_record(record);
+	}
+
+	return NULL;
+}
+
+static int match_func_name(void *item, void *data)
+{
+	struct func_descr *funcd = item;
+	const char *func = data;
+
+	if (!funcd->func || !func)
+		return funcd->func == func;
+	return strcmp(funcd->func, func) == 0;
+}
+
+/*
+ * The function names of each part come from its own handle, find
+ * the ones of @part in @mem by name and add their totals.
+ */
+static void merge_part_funcs(struct mem_data *mem, struct mem_data *part)
+{
+	struct func_descr *funcd;
+	struct func_descr *global;
+	unsigned long long key;
+
+	for (funcd = part->funcs; funcd; funcd = funcd->next) {
+		key = funcd->func ? trace_hash_str((char *)funcd->func) : 0;
+		global = trace_ohash_find(&mem->func_hash, key,
+					  match_func_name, (void *)funcd->func);
+		if (!global)
+			global = create_func(mem, funcd->func, key);
+
+		global->total_alloc += funcd->total_alloc;
+		global->total_req += funcd->total_req;
+		funcd->global = global;
+	}
+}
+
+/* Apply the deltas of all the parts to @mem in the order of the records */
+static void merge_parts(struct mem_data *mem, struct mem_data *parts,
+			int nr_parts)
+{
+	struct mem_delta *delta;
+	unsigned long *next;
+	int min;
+	int i;
+
+	for (i = 0; i < nr_parts; i++)
+		merge_part_funcs(mem, &parts[i]);
+
+	next = calloc(nr_parts, sizeof(*next));
+	if (!next)
+		die("malloc");
+
+	for (;;) {
+		min = -1;
+		for (i = 0; i < nr_parts; i++) {
+			if (next[i] == parts[i].nr_deltas)
+				continue;
+			if (min < 0 || parts[i].deltas[next[i]].seq <
+			    parts[min].deltas[next[min]].seq)
+				min = i;
+		}
+		if (min < 0)
+			break;
+
+		delta = &parts[min].deltas[next[min]++];
+		update_current(delta->func->global, delta->alloc, delta->req);
+	}
+
+	free(next);
 }
 
 static int func_cmp(const void *a, const void *b)
@@ -412,31 +631,34 @@ static int func_cmp(const void *a, const void *b)
 		return -1;
 	if (fa->waste < fb->waste)
 		return 1;
-	return 0;
+
+	/* Do not let the order of the hash decide the ties */
+	if (!fa->func || !fb->func)
+		return !fa->func - !fb->func;
+	return strcmp(fa->func, fb->func);
 }
 
-static void sort_list(void)
+static void sort_list(struct mem_data *mem)
 {
 	struct func_descr *funcd;
-	int h;
 	int i = 0;
 
-	func_list = zalloc(sizeof(*func_list) * func_count);
+	func_list = zalloc(sizeof(*func_list) * mem->func_count);
+	if (!func_list && mem->func_count)
+		die("malloc");
 
-	for (h = 0; h < HASH_SIZE; h++) {
-		for (funcd = func_hash[h]; funcd; funcd = funcd->next) {
-			funcd->waste = funcd->current_alloc - funcd->current_req;
-			funcd->max_waste = funcd->max_alloc - funcd->max_req;
-			if (i == func_count)
-				die("more funcs than expected\n");
-			func_list[i++] = funcd;
-		}
+	for (funcd = mem->funcs; funcd; funcd = funcd->next) {
+		funcd->waste = funcd->current_alloc - funcd->current_req;
+		funcd->max_waste = funcd->max_alloc - funcd->max_req;
+		if (i == mem->func_count)
+			die("more funcs than expected\n");
+		func_list[i++] = funcd;
 	}
 
-	qsort(func_list, func_count, sizeof(*func_list), func_cmp);
+	qsort(func_list, mem->func_count, sizeof(*func_list), func_cmp);
 }
 
-static void print_list(void)
+static void print_list(struct mem_data *mem)
 {
 	struct func_descr *funcd;
 	int i;
@@ -448,7 +670,7 @@ static void print_list(void)
 	printf("-----\t-----\t---\t\t--------     ------\t\t--------     ------\t");
 	printf("--------\n");
 	
-	for (i = 0; i < func_count; i++) {
+	for (i = 0; i < mem->func_count; i++) {
 		funcd = func_list[i];
 
 		printf("%32s\t%ld\t%ld\t%ld\t\t%8ld   %8ld\t\t%8ld   %8ld\t%ld\n",
@@ -457,17 +679,24 @@ static void print_list(void)
 		       funcd->total_alloc, funcd->total_req,
 		       funcd->max_alloc, funcd->max_req, funcd->max_waste);
 	}
+
+	free(func_list);
+	func_list = NULL;
 }
 
-static void do_trace_mem(struct tracecmd_input *handle)
+static void do_trace_mem(struct tracecmd_input *handle, const char *file,
+			 int threads)
 {
 	struct pevent *pevent = tracecmd_get_pevent(handle);
+	struct tracecmd_input *part_handle;
 	struct event_format *event;
 	struct pevent_record *record;
-	int missed_events = 0;
+	struct mem_data *parts;
+	struct mem_data mem;
 	int cpus;
 	int cpu;
 	int ret;
+	int i;
 
 	ret = tracecmd_init_data(handle);
 	if (ret < 0)
@@ -501,30 +730,84 @@ static void do_trace_mem(struct tracecmd_input *handle)
 	update_kmem_cache_alloc_node(pevent);
 	update_kmem_cache_free(pevent);
 
-	while ((record = tracecmd_read_next_data(handle, &cpu))) {
+	if (threads <= 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads < 1)
+		threads = 1;
+
+	if (threads == 1) {
+		init_mem_data(&mem, handle, 0, 1);
+		process_part(&mem);
+		sort_list(&mem);
+		print_list(&mem);
+		free_mem_data(&mem);
+		return;
+	}
 
-		/* record missed event */
-		if (!missed_events && record->missed_events)
-			missed_events = 1;
+	parts = calloc(threads, sizeof(*parts));
+	if (!parts)
+		die("malloc");
 
-		process_record(pevent, record);
-		free_record(record);
+	/*
+	 * Each part reads the whole file with its own handle. The fields
+	 * found above only hold offsets, and work for all of them.
+	 * Loading the plugins is not thread safe, open the files here.
+	 */
+	init_mem_data(&parts[0], handle, 0, threads);
+	for (i = 1; i < threads; i++) {
+		part_handle = tracecmd_alloc(file);
+		if (!part_handle)
+			die("error opening %s", file);
+		if (tracecmd_read_headers(part_handle) < 0 ||
+		    tracecmd_init_data(part_handle) < 0)
+			die("error reading %s", file);
+		init_mem_data(&parts[i], part_handle, i, threads);
 	}
 
-	sort_list();
-	print_list();
+	for (i = 1; i < threads; i++) {
+		if (!pthread_create(&parts[i].thread, NULL,
+				    process_part, &parts[i]))
+			parts[i].started = 1;
+	}
+
+	/* The first part is this thread's */
+	process_part(&parts[0]);
+
+	for (i = 1; i < threads; i++) {
+		if (parts[i].started)
+			pthread_join(parts[i].thread, NULL);
+		else
+			process_part(&parts[i]);
+	}
+
+	/* The merged functions use the names of the part handles */
+	memset(&mem, 0, sizeof(mem));
+	trace_ohash_init(&mem.func_hash, 256);
+	merge_parts(&mem, parts, threads);
+
+	sort_list(&mem);
+	print_list(&mem);
+	free_mem_data(&mem);
+
+	for (i = 0; i < threads; i++) {
+		free_mem_data(&parts[i]);
+		if (i)
+			tracecmd_close(parts[i].handle);
+	}
+	free(parts);
 }
 
 void trace_mem(int argc, char **argv)
 {
 	struct tracecmd_input *handle;
 	const char *input_file = NULL;
+	int threads = 1;
 	int ret;
 
 	for (;;) {
 		int c;
 
-		c = getopt(argc-1, argv+1, "+hi:");
+		c = getopt(argc-1, argv+1, "+hi:j:");
 		if (c == -1)
 			break;
 		switch (c) {
@@ -536,6 +819,9 @@ void trace_mem(int argc, char **argv)
 				die("Only one input for mem");
 			input_file = optarg;
 			break;
+		case 'j':
+			threads = atoi(optarg);
+			break;
 		default:
 			usage(argv);
 		}
@@ -558,7 +844,7 @@ void trace_mem(int argc, char **argv)
 	if (ret)
 		return;
 
-	do_trace_mem(handle);
+	do_trace_mem(handle, input_file, threads);
 
 	tracecmd_close(handle);
 }
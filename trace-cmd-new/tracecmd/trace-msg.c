@@ -19,12 +19,21 @@
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <linux/types.h>
+#ifndef NO_ZLIB
+#include <zlib.h>
+#endif
 
 #include "trace-cmd-local.h"
 #include "trace-local.h"
 #include "trace-msg.h"
 
+#ifdef WARN_NO_ZLIB
+# warning "zlib not found, the metadata is sent uncompressed "	\
+	"(install zlib-devel and try again)"
+#endif
+
 typedef __u32 u32;
 typedef __be32 be32;
 
@@ -40,9 +49,6 @@ static inline void dprint(const char *fmt, ...)
 	va_end(ap);
 }
 
-/* Two (4k) pages is the max transfer for now */
-#define MSG_MAX_LEN			8192
-
 #define MSG_HDR_LEN			sizeof(struct tracecmd_msg_header)
 
 #define MSG_DATA_LEN			(MSG_MAX_LEN - MSG_HDR_LEN)
@@ -61,11 +67,43 @@ static inline void dprint(const char *fmt, ...)
 #define MIN_META_SIZE	(sizeof(struct tracecmd_msg_header) + \
 			 sizeof(struct tracecmd_msg_meta))
 
+#define MIN_DATA_SIZE	(sizeof(struct tracecmd_msg_header) + \
+			 sizeof(struct tracecmd_msg_data))
+
+					/* - header size for the data of a CPU */
+#define MSG_DATA_MAX_LEN		(MSG_MAX_LEN - MIN_DATA_SIZE)
+
+/* Writes of metadata smaller than this are gathered into one message */
+#define MSG_META_GATHER_LEN		4096
+
+/* Messages to write with one writev() */
+#define MSG_WRITEV_MAX			64
+
 unsigned int page_size;
 
 struct tracecmd_msg_server {
 	struct tracecmd_msg_handle handle;
 	int			done;
+	int			meta_done;
+#ifndef NO_ZLIB
+	z_stream		*zmeta;
+	char			*zbuf;
+	z_stream		*zdata;		/* for each CPU */
+	char			*dbuf;		/* the inflated data */
+	int			dbuf_size;
+#endif
+};
+
+struct tracecmd_msg_client {
+	struct tracecmd_msg_handle handle;
+	int			max_len;	/* the largest the server takes */
+	bool			server_zlib;
+	bool			server_zdata;
+	char			*meta;		/* metadata that is not sent yet */
+	int			meta_len;
+#ifndef NO_ZLIB
+	z_stream		*zmeta;
+#endif
 };
 
 static struct tracecmd_msg_server *
@@ -78,12 +116,36 @@ make_server(struct tracecmd_msg_handle *msg_handle)
 	return (struct tracecmd_msg_server *)msg_handle;
 }
 
+static struct tracecmd_msg_client *
+make_client(struct tracecmd_msg_handle *msg_handle)
+{
+	if (!(msg_handle->flags & TRACECMD_MSG_FL_CLIENT)) {
+		plog("Message handle not of type client\n");
+		return NULL;
+	}
+	return (struct tracecmd_msg_client *)msg_handle;
+}
+
 struct tracecmd_msg_opt {
 	be32 size;
 	be32 opt_cmd;
 	be32 padding;	/* for backward compatibility */
 };
 
+/*
+ * The options of the server follow the ports of the RINIT message,
+ * where clients that do not know them do not look.
+ */
+struct tracecmd_msg_server_opts {
+	be32				opt_num;
+	struct tracecmd_msg_opt		max_len;
+	be32				max_len_val;
+#ifndef NO_ZLIB
+	struct tracecmd_msg_opt		zlib;
+	struct tracecmd_msg_opt		zdata;
+#endif
+} __attribute__((packed));
+
 struct tracecmd_msg_tinit {
 	be32 cpus;
 	be32 page_size;
@@ -98,6 +160,11 @@ struct tracecmd_msg_meta {
 	be32 size;
 } __attribute__((packed));
 
+struct tracecmd_msg_data {
+	be32 cpu;
+	be32 size;
+} __attribute__((packed));
+
 struct tracecmd_msg_header {
 	be32	size;
 	be32	cmd;
@@ -111,7 +178,10 @@ struct tracecmd_msg_header {
 	C(TINIT,	4,	MIN_TINIT_SIZE),	\
 	C(RINIT,	5,	MIN_RINIT_SIZE),	\
 	C(SENDMETA,	6,	MIN_META_SIZE),		\
-	C(FINMETA,	7,	0),
+	C(FINMETA,	7,	0),			\
+	C(SENDDATA,	8,	MIN_DATA_SIZE),		\
+	C(ZMETA,	9,	MIN_META_SIZE),		\
+	C(ZDATA,	10,	MIN_DATA_SIZE),
 
 #undef C
 #define C(a,b,c)	MSG_##a = b
@@ -132,7 +202,7 @@ static const char *msg_names[] = { MSG_MAP };
 
 static const char *cmd_to_name(int cmd)
 {
-	if (cmd <= MSG_FINMETA)
+	if (cmd <= MSG_ZDATA)
 		return msg_names[cmd];
 	return "Unkown";
 }
@@ -143,6 +213,7 @@ struct tracecmd_msg {
 		struct tracecmd_msg_tinit	tinit;
 		struct tracecmd_msg_rinit	rinit;
 		struct tracecmd_msg_meta	meta;
+		struct tracecmd_msg_data	data;
 	};
 	union {
 		struct tracecmd_msg_opt		*opt;
@@ -159,7 +230,7 @@ static int msg_write(int fd, struct tracecmd_msg *msg)
 	int size;
 	int ret;
 
-	if (cmd > MSG_FINMETA)
+	if (cmd > MSG_ZDATA)
 		return -EINVAL;
 
 	dprint("msg send: %d (%s)\n", cmd, cmd_to_name(cmd));
@@ -178,6 +249,10 @@ static int msg_write(int fd, struct tracecmd_msg *msg)
 
 enum msg_opt_command {
 	MSGOPT_USETCP = 1,
+	/* of the server */
+	MSGOPT_MAXLEN = 2,	/* the largest message that it takes */
+	MSGOPT_ZLIB = 3,	/* it takes ZMETA, metadata compressed by zlib */
+	MSGOPT_ZDATA = 4,	/* it takes ZDATA, CPU data compressed by zlib */
 };
 
 static int make_tinit(struct tracecmd_msg_handle *msg_handle,
@@ -208,8 +283,32 @@ static int make_tinit(struct tracecmd_msg_handle *msg_handle,
 	return 0;
 }
 
+static void make_server_opts(struct tracecmd_msg_server_opts *opts)
+{
+	int opt_num = 0;
+
+	opts->max_len.size = htonl(sizeof(opts->max_len) +
+				   sizeof(opts->max_len_val));
+	opts->max_len.opt_cmd = htonl(MSGOPT_MAXLEN);
+	opts->max_len.padding = 0;
+	opts->max_len_val = htonl(MSG_LARGE_MAX_LEN);
+	opt_num++;
+#ifndef NO_ZLIB
+	opts->zlib.size = htonl(sizeof(opts->zlib));
+	opts->zlib.opt_cmd = htonl(MSGOPT_ZLIB);
+	opts->zlib.padding = 0;
+	opt_num++;
+	opts->zdata.size = htonl(sizeof(opts->zdata));
+	opts->zdata.opt_cmd = htonl(MSGOPT_ZDATA);
+	opts->zdata.padding = 0;
+	opt_num++;
+#endif
+	opts->opt_num = htonl(opt_num);
+}
+
 static int make_rinit(struct tracecmd_msg *msg, int total_cpus, int *ports)
 {
+	struct tracecmd_msg_server_opts *opts;
 	int size = MIN_RINIT_SIZE;
 	be32 *ptr;
 	be32 port;
@@ -217,11 +316,12 @@ static int make_rinit(struct tracecmd_msg *msg, int total_cpus, int *ports)
 
 	msg->rinit.cpus = htonl(total_cpus);
 
-	msg->port_array = malloc(sizeof(*ports) * total_cpus);
+	/* The v3 client sends the data of its CPUs over the connection */
+	msg->port_array = malloc(sizeof(*ports) * total_cpus + sizeof(*opts));
 	if (!msg->port_array)
 		return -ENOMEM;
 
-	size += sizeof(*ports) * total_cpus;
+	size += sizeof(*ports) * total_cpus + sizeof(*opts);
 
 	ptr = msg->port_array;
 
@@ -232,6 +332,9 @@ static int make_rinit(struct tracecmd_msg *msg, int total_cpus, int *ports)
 		ptr++;
 	}
 
+	opts = (struct tracecmd_msg_server_opts *)ptr;
+	make_server_opts(opts);
+
 	msg->hdr.size = htonl(size);
 
 	return 0;
@@ -252,7 +355,7 @@ static void msg_free(struct tracecmd_msg *msg)
 	int cmd = ntohl(msg->hdr.cmd);
 
 	/* If a min size is defined, then the buf needs to be freed */
-	if (cmd < MSG_FINMETA && (msg_min_sizes[cmd] > 0))
+	if (cmd <= MSG_ZDATA && (msg_min_sizes[cmd] > 0))
 		free(msg->buf);
 
 	memset(msg, 0, sizeof(*msg));
@@ -298,7 +401,7 @@ static int msg_read_extra(int fd, struct tracecmd_msg *msg,
 	int ret;
 
 	cmd = ntohl(msg->hdr.cmd);
-	if (cmd > MSG_FINMETA)
+	if (cmd > MSG_ZDATA)
 		return -EINVAL;
 
 	rsize = msg_min_sizes[cmd] - *n;
@@ -338,7 +441,7 @@ static int tracecmd_msg_recv(int fd, struct tracecmd_msg *msg)
 	       ntohl(msg->hdr.cmd), cmd_to_name(ntohl(msg->hdr.cmd)));
 
 	size = ntohl(msg->hdr.size);
-	if (size > MSG_MAX_LEN)
+	if (size > MSG_LARGE_MAX_LEN)
 		/* too big */
 		goto error;
 	else if (size < MSG_HDR_LEN)
@@ -408,6 +511,55 @@ static int tracecmd_msg_wait_for_msg(int fd, struct tracecmd_msg *msg)
 	return 0;
 }
 
+/* Options that a client does not know are left for newer clients */
+static void process_server_opts(struct tracecmd_msg_handle *msg_handle,
+				void *buf, int len)
+{
+	struct tracecmd_msg_client *msg_client = make_client(msg_handle);
+	struct tracecmd_msg_opt *opt;
+	int options, i;
+	u32 max_len;
+	u32 size;
+
+	/* An older server has no options */
+	if (len < sizeof(be32))
+		return;
+
+	options = ntohl(*(be32 *)buf);
+	buf += sizeof(be32);
+	len -= sizeof(be32);
+
+	for (i = 0; i < options; i++) {
+		if (len < sizeof(*opt))
+			break;
+		opt = buf;
+		size = ntohl(opt->size);
+		if (size < sizeof(*opt) || size > len)
+			break;
+
+		switch (ntohl(opt->opt_cmd)) {
+		case MSGOPT_MAXLEN:
+			if (size < sizeof(*opt) + sizeof(be32))
+				break;
+			max_len = ntohl(*(be32 *)(opt + 1));
+			if (max_len > MSG_LARGE_MAX_LEN)
+				max_len = MSG_LARGE_MAX_LEN;
+			if (max_len > MSG_MAX_LEN)
+				msg_client->max_len = max_len;
+			break;
+		case MSGOPT_ZLIB:
+			msg_client->server_zlib = true;
+			break;
+		case MSGOPT_ZDATA:
+			msg_client->server_zdata = true;
+			break;
+		}
+
+		buf += size;
+		len -= size;
+	}
+}
+
 int tracecmd_msg_send_init_data(struct tracecmd_msg_handle *msg_handle,
 				int **client_ports)
 {
@@ -416,9 +568,11 @@ int tracecmd_msg_send_init_data(struct tracecmd_msg_handle *msg_handle,
 	int fd = msg_handle->fd;
 	int *ports;
 	int i, cpus;
+	int len;
 	int ret;
 
 	*client_ports = NULL;
+	memset(&recv_msg, 0, sizeof(recv_msg));
 
 	tracecmd_msg_init(MSG_TINIT, &send_msg);
 	ret = make_tinit(msg_handle, &send_msg);
@@ -437,13 +591,26 @@ int tracecmd_msg_send_init_data(struct tracecmd_msg_handle *msg_handle,
 		return -EINVAL;
 
 	cpus = ntohl(recv_msg.rinit.cpus);
-	ports = malloc_or_die(sizeof(int) * cpus);
-	for (i = 0; i < cpus; i++)
-		ports[i] = ntohl(recv_msg.port_array[i]);
+	len = ntohl(recv_msg.hdr.size) - MIN_RINIT_SIZE;
+	if (cpus < 0 || cpus > len / sizeof(be32)) {
+		ret = -EINVAL;
+		goto out;
+	}
 
-	*client_ports = ports;
+	process_server_opts(msg_handle, recv_msg.port_array + cpus,
+			    len - cpus * sizeof(be32));
 
-	return 0;
+	/* The v3 client gets no ports */
+	if (cpus) {
+		ports = malloc_or_die(sizeof(int) * cpus);
+		for (i = 0; i < cpus; i++)
+			ports[i] = ntohl(recv_msg.port_array[i]);
+		*client_ports = ports;
+	}
+	ret = 0;
+ out:
+	free(recv_msg.buf);
+	return ret;
 }
 
 static bool process_option(struct tracecmd_msg_handle *msg_handle,
@@ -474,6 +641,8 @@ tracecmd_msg_handle_alloc(int fd, unsigned long flags)
 
 	if (flags == TRACECMD_MSG_FL_SERVER)
 		size = sizeof(struct tracecmd_msg_server);
+	else if (flags & TRACECMD_MSG_FL_CLIENT)
+		size = sizeof(struct tracecmd_msg_client);
 	else
 		size = sizeof(struct tracecmd_msg_handle);
 
@@ -483,21 +652,55 @@ tracecmd_msg_handle_alloc(int fd, unsigned long flags)
 
 	handle->fd = fd;
 	handle->flags = flags;
+
+	/* Until the server says that it takes more */
+	if (flags & TRACECMD_MSG_FL_CLIENT)
+		((struct tracecmd_msg_client *)handle)->max_len = MSG_MAX_LEN;
+
 	return handle;
 }
 
 void tracecmd_msg_handle_close(struct tracecmd_msg_handle *msg_handle)
 {
+	struct tracecmd_msg_server *msg_server;
+	struct tracecmd_msg_client *msg_client;
+	int cpu;
+
+	if (msg_handle->flags & TRACECMD_MSG_FL_SERVER) {
+		msg_server = make_server(msg_handle);
+#ifndef NO_ZLIB
+		if (msg_server->zmeta)
+			inflateEnd(msg_server->zmeta);
+		free(msg_server->zmeta);
+		free(msg_server->zbuf);
+		for (cpu = 0; msg_server->zdata &&
+			      cpu < msg_handle->cpu_count; cpu++) {
+			if (msg_server->zdata[cpu].state)
+				inflateEnd(&msg_server->zdata[cpu]);
+		}
+		free(msg_server->zdata);
+		free(msg_server->dbuf);
+#endif
+	} else if (msg_handle->flags & TRACECMD_MSG_FL_CLIENT) {
+		msg_client = make_client(msg_handle);
+#ifndef NO_ZLIB
+		if (msg_client->zmeta)
+			deflateEnd(msg_client->zmeta);
+		free(msg_client->zmeta);
+#endif
+		free(msg_client->meta);
+	}
+
 	close(msg_handle->fd);
 	free(msg_handle);
 }
 
 #define MAX_OPTION_SIZE 4096
 
-int tracecmd_msg_initial_setting(struct tracecmd_msg_handle *msg_handle)
+static int process_tinit(struct tracecmd_msg_handle *msg_handle,
+			 struct tracecmd_msg *msg)
 {
 	struct tracecmd_msg_opt *opt;
-	struct tracecmd_msg msg;
 	int pagesize;
 	int options, i, s;
 	int cpus;
@@ -506,20 +709,13 @@ int tracecmd_msg_initial_setting(struct tracecmd_msg_handle *msg_handle)
 	u32 size = MIN_TINIT_SIZE;
 	u32 cmd;
 
-	ret = tracecmd_msg_recv_wait(msg_handle->fd, &msg);
-	if (ret < 0) {
-		if (ret == -ETIMEDOUT)
-			warning("Connection timed out\n");
-		return ret;
-	}
-
-	cmd = ntohl(msg.hdr.cmd);
+	cmd = ntohl(msg->hdr.cmd);
 	if (cmd != MSG_TINIT) {
 		ret = -EINVAL;
 		goto error;
 	}
 
-	cpus = ntohl(msg.tinit.cpus);
+	cpus = ntohl(msg->tinit.cpus);
 	plog("cpus=%d\n", cpus);
 	if (cpus < 0) {
 		ret = -EINVAL;
@@ -528,24 +724,24 @@ int tracecmd_msg_initial_setting(struct tracecmd_msg_handle *msg_handle)
 
 	msg_handle->cpu_count = cpus;
 
-	pagesize = ntohl(msg.tinit.page_size);
+	pagesize = ntohl(msg->tinit.page_size);
 	plog("pagesize=%d\n", pagesize);
 	if (pagesize <= 0) {
 		ret = -EINVAL;
 		goto error;
 	}
 
-	options = ntohl(msg.tinit.opt_num);
+	options = ntohl(msg->tinit.opt_num);
 	for (i = 0; i < options; i++) {
-		if (size + sizeof(*opt) > ntohl(msg.hdr.size)) {
+		if (size + sizeof(*opt) > ntohl(msg->hdr.size)) {
 			plog("Not enough message for options\n");
 			ret = -EINVAL;
 			goto error;
 		}
-		opt = (void *)msg.opt + offset;
+		opt = (void *)msg->opt + offset;
 		offset += ntohl(opt->size);
 		size += ntohl(opt->size);
-		if (ntohl(msg.hdr.size) < size) {
+		if (ntohl(msg->hdr.size) < size) {
 			plog("Not enough message for options\n");
 			ret = -EINVAL;
 			goto error;
@@ -569,10 +765,25 @@ int tracecmd_msg_initial_setting(struct tracecmd_msg_handle *msg_handle)
 	return pagesize;
 
 error:
-	error_operation_for_server(&msg);
+	error_operation_for_server(msg);
 	return ret;
 }
 
+int tracecmd_msg_initial_setting(struct tracecmd_msg_handle *msg_handle)
+{
+	struct tracecmd_msg msg;
+	int ret;
+
+	ret = tracecmd_msg_recv_wait(msg_handle->fd, &msg);
+	if (ret < 0) {
+		if (ret == -ETIMEDOUT)
+			warning("Connection timed out\n");
+		return ret;
+	}
+
+	return process_tinit(msg_handle, &msg);
+}
+
 int tracecmd_msg_send_port_array(struct tracecmd_msg_handle *msg_handle,
 				 int *ports)
 {
@@ -580,7 +791,7 @@ int tracecmd_msg_send_port_array(struct tracecmd_msg_handle *msg_handle,
 	int ret;
 
 	tracecmd_msg_init(MSG_RINIT, &msg);
-	ret = make_rinit(&msg, msg_handle->cpu_count, ports);
+	ret = make_rinit(&msg, ports ? msg_handle->cpu_count : 0, ports);
 	if (ret < 0)
 		return ret;
 
@@ -599,65 +810,285 @@ void tracecmd_msg_send_close_msg(struct tracecmd_msg_handle *msg_handle)
 	tracecmd_msg_send(msg_handle->fd, &msg);
 }
 
-int tracecmd_msg_metadata_send(struct tracecmd_msg_handle *msg_handle,
-			       const char *buf, int size)
+struct tracecmd_msg_meta_header {
+	struct tracecmd_msg_header	hdr;
+	struct tracecmd_msg_meta	meta;
+} __attribute__((packed));
+
+static int writev_all(int fd, struct iovec *iov, int cnt)
 {
-	struct tracecmd_msg msg;
-	int fd = msg_handle->fd;
-	int n;
+	ssize_t r;
+
+	while (cnt) {
+		r = writev(fd, iov, cnt);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		while (cnt && r >= iov->iov_len) {
+			r -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+		if (cnt) {
+			iov->iov_base += r;
+			iov->iov_len -= r;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Send @pre followed by @buf as @cmd messages, as few and as large as
+ * the server takes, pointing the writes at the data instead of copying
+ * it. @pre must fit in one message. With @fin, FINMETA is sent with them.
+ */
+static int send_meta(struct tracecmd_msg_client *msg_client, u32 cmd,
+		     const char *pre, int pre_len,
+		     const char *buf, int size, bool fin)
+{
+	struct tracecmd_msg_meta_header hdrs[MSG_WRITEV_MAX];
+	struct iovec iov[MSG_WRITEV_MAX * 3 + 1];
+	struct tracecmd_msg_header fin_hdr;
+	int max = msg_client->max_len - MIN_META_SIZE;
+	int fd = msg_client->handle.fd;
+	int len, cnt, n;
 	int ret;
-	int count = 0;
 
-	tracecmd_msg_init(MSG_SENDMETA, &msg);
+	do {
+		for (n = 0, cnt = 0; n < MSG_WRITEV_MAX && (pre_len || size); n++) {
+			hdrs[n].hdr.cmd = htonl(cmd);
+			iov[cnt].iov_base = &hdrs[n];
+			iov[cnt++].iov_len = MIN_META_SIZE;
+			len = 0;
+			if (pre_len) {
+				iov[cnt].iov_base = (void *)pre;
+				iov[cnt++].iov_len = pre_len;
+				len = pre_len;
+				pre_len = 0;
+			}
+			if (size && len < max) {
+				iov[cnt].iov_base = (void *)buf;
+				iov[cnt].iov_len = size < max - len ? size : max - len;
+				len += iov[cnt].iov_len;
+				buf += iov[cnt].iov_len;
+				size -= iov[cnt++].iov_len;
+			}
+			hdrs[n].hdr.size = htonl(MIN_META_SIZE + len);
+			hdrs[n].meta.size = htonl(len);
+		}
+		if (fin && !size) {
+			fin_hdr.cmd = htonl(MSG_FINMETA);
+			fin_hdr.size = htonl(MSG_HDR_LEN);
+			iov[cnt].iov_base = &fin_hdr;
+			iov[cnt++].iov_len = MSG_HDR_LEN;
+		}
+		ret = writev_all(fd, iov, cnt);
+		if (ret < 0)
+			return ret;
+	} while (size);
+
+	return 0;
+}
+
+static int meta_alloc(struct tracecmd_msg_client *msg_client)
+{
+	if (msg_client->meta)
+		return 0;
+
+	msg_client->meta = malloc(msg_client->max_len - MIN_META_SIZE);
+	if (!msg_client->meta)
+		return -ENOMEM;
+	return 0;
+}
 
-	msg.buf = malloc(MSG_META_MAX_LEN);
-	if (!msg.buf)
+#ifndef NO_ZLIB
+static int zmeta_init(struct tracecmd_msg_client *msg_client)
+{
+	msg_client->zmeta = calloc(1, sizeof(*msg_client->zmeta));
+	if (!msg_client->zmeta)
 		return -ENOMEM;
 
-	msg.meta.size = htonl(MSG_META_MAX_LEN);
-	msg.hdr.size = htonl(MIN_META_SIZE + MSG_META_MAX_LEN);
+	/* The metadata is cheap to pack, keep it fast */
+	if (deflateInit(msg_client->zmeta, Z_BEST_SPEED) != Z_OK) {
+		free(msg_client->zmeta);
+		msg_client->zmeta = NULL;
+		return -EINVAL;
+	}
+	return 0;
+}
+
+/* Pack @buf into the pending metadata, sending it as ZMETA when full */
+static int zmeta_send(struct tracecmd_msg_client *msg_client,
+		      const char *buf, int size, int flush)
+{
+	z_stream *zmeta = msg_client->zmeta;
+	int max = msg_client->max_len - MIN_META_SIZE;
+	int zret;
+	int ret;
 
-	n = size;
+	zmeta->next_in = (Bytef *)buf;
+	zmeta->avail_in = size;
 	do {
-		if (n > MSG_META_MAX_LEN) {
-			memcpy(msg.buf, buf+count, MSG_META_MAX_LEN);
-			n -= MSG_META_MAX_LEN;
-			count += MSG_META_MAX_LEN;
-		} else {
-			msg.hdr.size = htonl(MIN_META_SIZE + n);
-			msg.meta.size = htonl(n);
-			memcpy(msg.buf, buf+count, n);
-			n = 0;
-		}
-		ret = msg_write(fd, &msg);
+		zmeta->next_out = (Bytef *)msg_client->meta + msg_client->meta_len;
+		zmeta->avail_out = max - msg_client->meta_len;
+		zret = deflate(zmeta, flush);
+		if (zret == Z_STREAM_ERROR)
+			return -EINVAL;
+		msg_client->meta_len = max - zmeta->avail_out;
+		if (zmeta->avail_out)
+			continue;
+		ret = send_meta(msg_client, MSG_ZMETA, msg_client->meta,
+				msg_client->meta_len, NULL, 0, false);
 		if (ret < 0)
-			break;
-	} while (n);
+			return ret;
+		msg_client->meta_len = 0;
+	} while (zmeta->avail_in ||
+		 (flush == Z_FINISH && zret != Z_STREAM_END));
 
-	msg_free(&msg);
+	return 0;
+}
+#endif
+
+int tracecmd_msg_metadata_send(struct tracecmd_msg_handle *msg_handle,
+			       const char *buf, int size)
+{
+	struct tracecmd_msg_client *msg_client = make_client(msg_handle);
+	int max;
+	int ret;
+
+	if (!msg_client)
+		return -EINVAL;
+
+	ret = meta_alloc(msg_client);
+	if (ret < 0)
+		return ret;
+
+	if (msg_handle->flags & TRACECMD_MSG_FL_COMPRESS) {
+#ifndef NO_ZLIB
+		if (msg_client->server_zlib) {
+			if (!msg_client->zmeta) {
+				ret = zmeta_init(msg_client);
+				if (ret < 0)
+					return ret;
+			}
+			return zmeta_send(msg_client, buf, size, Z_NO_FLUSH);
+		}
+		warning("Server does not take compressed metadata");
+#else
+		warning("Not built with zlib, not compressing metadata");
+#endif
+		msg_handle->flags &= ~TRACECMD_MSG_FL_COMPRESS;
+	}
+
+	/* Gather the small writes, a message for each one is slow */
+	max = msg_client->max_len - MIN_META_SIZE;
+	if (size < MSG_META_GATHER_LEN) {
+		if (msg_client->meta_len + size > max) {
+			ret = send_meta(msg_client, MSG_SENDMETA, msg_client->meta,
+					msg_client->meta_len, NULL, 0, false);
+			if (ret < 0)
+				return ret;
+			msg_client->meta_len = 0;
+		}
+		memcpy(msg_client->meta + msg_client->meta_len, buf, size);
+		msg_client->meta_len += size;
+		return 0;
+	}
+
+	ret = send_meta(msg_client, MSG_SENDMETA, msg_client->meta,
+			msg_client->meta_len, buf, size, false);
+	msg_client->meta_len = 0;
 	return ret;
 }
 
 int tracecmd_msg_finish_sending_metadata(struct tracecmd_msg_handle *msg_handle)
 {
-	struct tracecmd_msg msg;
+	struct tracecmd_msg_client *msg_client = make_client(msg_handle);
+	u32 cmd = MSG_SENDMETA;
 	int ret;
 
-	tracecmd_msg_init(MSG_FINMETA, &msg);
-	ret = tracecmd_msg_send(msg_handle->fd, &msg);
+	if (!msg_client)
+		return -EINVAL;
+
+#ifndef NO_ZLIB
+	if (msg_client->zmeta) {
+		ret = zmeta_send(msg_client, NULL, 0, Z_FINISH);
+		if (ret < 0)
+			return ret;
+		cmd = MSG_ZMETA;
+	}
+#endif
+
+	ret = send_meta(msg_client, cmd, msg_client->meta,
+			msg_client->meta_len, NULL, 0, true);
 	if (ret < 0)
-		return ret;
+		return -ECOMM;
+	msg_client->meta_len = 0;
+	return 0;
+}
+
+/* Write the metadata of a SENDMETA or ZMETA message to @ofd */
+static int write_meta(struct tracecmd_msg_handle *msg_handle, int ofd,
+		      u32 cmd, void *buf, u32 n)
+{
+#ifndef NO_ZLIB
+	struct tracecmd_msg_server *msg_server = make_server(msg_handle);
+	z_stream *zmeta;
+	int zret;
+	int ret;
+#endif
+
+	if (cmd == MSG_SENDMETA)
+		return __do_write_check(ofd, buf, n);
+
+#ifdef NO_ZLIB
+	warning("Client sent compressed metadata, but not built with zlib");
+	return -EINVAL;
+#else
+	if (!msg_server->zmeta) {
+		msg_server->zmeta = calloc(1, sizeof(*msg_server->zmeta));
+		msg_server->zbuf = malloc(MSG_LARGE_MAX_LEN);
+		if (!msg_server->zmeta || !msg_server->zbuf)
+			return -ENOMEM;
+		if (inflateInit(msg_server->zmeta) != Z_OK) {
+			free(msg_server->zmeta);
+			msg_server->zmeta = NULL;
+			return -EINVAL;
+		}
+	}
+	zmeta = msg_server->zmeta;
+
+	zmeta->next_in = buf;
+	zmeta->avail_in = n;
+	do {
+		zmeta->next_out = (Bytef *)msg_server->zbuf;
+		zmeta->avail_out = MSG_LARGE_MAX_LEN;
+		zret = inflate(zmeta, Z_NO_FLUSH);
+		if (zret != Z_OK && zret != Z_STREAM_END && zret != Z_BUF_ERROR) {
+			warning("bad compressed metadata");
+			return -EINVAL;
+		}
+		ret = __do_write_check(ofd, msg_server->zbuf,
+				       MSG_LARGE_MAX_LEN - zmeta->avail_out);
+		if (ret < 0)
+			return ret;
+	} while (zret != Z_STREAM_END && (zmeta->avail_in || !zmeta->avail_out));
+
 	return 0;
+#endif
 }
 
 int tracecmd_msg_collect_metadata(struct tracecmd_msg_handle *msg_handle, int ofd)
 {
 	struct tracecmd_msg msg;
-	u32 t, n, cmd;
-	ssize_t s;
+	u32 n, cmd;
 	int ret;
 
 	do {
+		memset(&msg, 0, sizeof(msg));
 		ret = tracecmd_msg_recv_wait(msg_handle->fd, &msg);
 		if (ret < 0) {
 			if (ret == -ETIMEDOUT)
@@ -671,24 +1102,26 @@ int tracecmd_msg_collect_metadata(struct tracecmd_msg_handle *msg_handle, int of
 		if (cmd == MSG_FINMETA) {
 			/* Finish receiving meta data */
 			break;
-		} else if (cmd != MSG_SENDMETA)
+		} else if (cmd != MSG_SENDMETA && cmd != MSG_ZMETA)
 			goto error;
 
 		n = ntohl(msg.meta.size);
-		t = n;
-		s = 0;
-		do {
-			s = write(ofd, msg.buf+s, t);
-			if (s < 0) {
-				if (errno == EINTR)
-					continue;
-				warning("writing to file");
-				return -errno;
-			}
-			t -= s;
-			s = n - t;
-		} while (t);
-	} while (cmd == MSG_SENDMETA);
+		if (n > ntohl(msg.hdr.size) - MIN_META_SIZE) {
+			ret = -EINVAL;
+			goto error;
+		}
+
+		ret = write_meta(msg_handle, ofd, cmd, msg.buf, n);
+		msg_free(&msg);
+		if (ret < 0) {
+			warning("writing to file");
+			return ret;
+		}
+	} while (1);
+
+	/* The data of the v3 client comes first, see tracecmd_msg_collect_data() */
+	if (msg_handle->version == V3_PROTOCOL)
+		return 0;
 
 	/* check the finish message of the client */
 	while (!tracecmd_msg_done(msg_handle)) {
@@ -715,3 +1148,615 @@ error:
 	error_operation_for_server(&msg);
 	return ret;
 }
+
+/*
+ * The v3 client sends the data of all its CPUs over its connection,
+ * after the metadata. Each SENDDATA message carries the CPU and the
+ * size of its part of the data.
+ */
+
+/* Messages to gather before writing them out */
+#define MSG_DATA_BATCH			32
+
+/* Reads the data of @cpu into a message at the end of @buf, like read() */
+static ssize_t read_cpu_data(int fd, int cpu, char *buf, int *len)
+{
+	struct tracecmd_msg_header *hdr = (void *)(buf + *len);
+	struct tracecmd_msg_data *data = (void *)(hdr + 1);
+	ssize_t r;
+
+	r = read(fd, buf + *len + MIN_DATA_SIZE, MSG_DATA_MAX_LEN);
+	if (r <= 0)
+		return r;
+
+	hdr->size = htonl(MIN_DATA_SIZE + r);
+	hdr->cmd = htonl(MSG_SENDDATA);
+	data->cpu = htonl(cpu);
+	data->size = htonl(r);
+	*len += MIN_DATA_SIZE + r;
+
+	return r;
+}
+
+#ifndef NO_ZLIB
+/*
+ * The data of each CPU is a stream of its own, at the fastest level.
+ * Smaller windows save memory, but cost both speed and size on ring
+ * buffer pages.
+ */
+static z_stream *zdata_init(int cpus)
+{
+	z_stream *zdata;
+	int cpu;
+
+	zdata = calloc(cpus, sizeof(*zdata));
+	if (!zdata)
+		return NULL;
+
+	for (cpu = 0; cpu < cpus; cpu++) {
+		if (deflateInit(&zdata[cpu], Z_BEST_SPEED) != Z_OK)
+			break;
+	}
+	if (cpu < cpus) {
+		while (cpu--)
+			deflateEnd(&zdata[cpu]);
+		free(zdata);
+		return NULL;
+	}
+
+	return zdata;
+}
+
+static void zdata_free(z_stream *zdata, int cpus)
+{
+	int cpu;
+
+	if (!zdata)
+		return;
+
+	for (cpu = 0; cpu < cpus; cpu++) {
+		if (zdata[cpu].state)
+			deflateEnd(&zdata[cpu]);
+	}
+	free(zdata);
+}
+
+/*
+ * Deflates @zdata into ZDATA messages at the end of @buf, writing out
+ * the messages in @buf when it fills up.
+ */
+static int deflate_cpu_data(int fd, z_stream *zdata, int cpu, int flush,
+			    char *buf, int *len, int size)
+{
+	struct tracecmd_msg_header *hdr;
+	struct tracecmd_msg_data *data;
+	int zret;
+	int ret;
+	int n;
+
+	do {
+		if (*len + MSG_MAX_LEN > size) {
+			ret = __do_write_check(fd, buf, *len);
+			if (ret < 0)
+				return ret;
+			*len = 0;
+		}
+
+		hdr = (void *)(buf + *len);
+		data = (void *)(hdr + 1);
+		zdata->next_out = (Bytef *)(data + 1);
+		zdata->avail_out = MSG_DATA_MAX_LEN;
+		zret = deflate(zdata, flush);
+		if (zret == Z_STREAM_ERROR)
+			return -EINVAL;
+
+		n = MSG_DATA_MAX_LEN - zdata->avail_out;
+		if (!n)
+			continue;
+		hdr->size = htonl(MIN_DATA_SIZE + n);
+		hdr->cmd = htonl(MSG_ZDATA);
+		data->cpu = htonl(cpu);
+		data->size = htonl(n);
+		*len += MIN_DATA_SIZE + n;
+	} while (zdata->avail_in || !zdata->avail_out ||
+		 (flush == Z_FINISH && zret != Z_STREAM_END));
+
+	if (flush == Z_FINISH)
+		deflateEnd(zdata);
+
+	return 0;
+}
+
+/* Like read_cpu_data(), but what is read goes through @zdata */
+static ssize_t read_cpu_zdata(int fd, z_stream *zdata, int cpu, char *in,
+			      int ofd, char *buf, int *len, int size)
+{
+	ssize_t r;
+	int ret;
+
+	r = read(fd, in, MSG_DATA_MAX_LEN);
+	if (r < 0)
+		return r;
+
+	zdata->next_in = (Bytef *)in;
+	zdata->avail_in = r;
+	ret = deflate_cpu_data(ofd, zdata, cpu, r ? Z_NO_FLUSH : Z_FINISH,
+			       buf, len, size);
+	if (ret < 0) {
+		errno = -ret;
+		return -1;
+	}
+
+	return r;
+}
+#endif
+
+/**
+ * tracecmd_msg_send_data - send the data of the CPUs over the connection
+ * @msg_handle: the handle of the v3 connection
+ * @fds: the file descriptor to read the data of each CPU from
+ * @cpus: the number of CPUs in @fds
+ *
+ * Reads the CPUs until all of them are at end of file. Each round
+ * takes at most one message of data from each CPU, so that a busy CPU
+ * can not starve the others, and the messages are written out together
+ * once there is no more data or the batch is full.
+ *
+ * With TRACECMD_MSG_FL_COMPRESS set, and a server that takes it, the
+ * data of each CPU is sent as a zlib stream of its own in ZDATA messages.
+ *
+ * Returns 0 when all the data was sent, or negative on error.
+ */
+int tracecmd_msg_send_data(struct tracecmd_msg_handle *msg_handle,
+			   int *fds, int cpus)
+{
+	struct tracecmd_msg_client *msg_client = make_client(msg_handle);
+	int size = MSG_MAX_LEN * MSG_DATA_BATCH;
+	struct pollfd *pfds;
+	int more, open = cpus;
+	ssize_t r;
+	int next = 0;
+	int len = 0;
+	char *buf;
+	int ret = -ENOMEM;
+	int cpu, i;
+#ifndef NO_ZLIB
+	z_stream *zdata = NULL;
+	char *in = NULL;
+#endif
+
+	if (!msg_client)
+		return -EINVAL;
+
+	buf = malloc(size);
+	pfds = calloc(cpus, sizeof(*pfds));
+	if (!buf || !pfds)
+		goto out;
+
+	if (msg_handle->flags & TRACECMD_MSG_FL_COMPRESS) {
+#ifndef NO_ZLIB
+		if (msg_client->server_zdata) {
+			zdata = zdata_init(cpus);
+			in = malloc(MSG_DATA_MAX_LEN);
+			if (!zdata || !in)
+				goto out;
+		} else
+			warning("Server does not take compressed data");
+#else
+		warning("Not built with zlib, not compressing data");
+#endif
+	}
+
+	for (cpu = 0; cpu < cpus; cpu++) {
+		pfds[cpu].fd = fds[cpu];
+		pfds[cpu].events = POLLIN;
+		fcntl(fds[cpu], F_SETFL, fcntl(fds[cpu], F_GETFL) | O_NONBLOCK);
+	}
+
+	while (open || len) {
+		if (!len && poll(pfds, cpus, -1) < 0 && errno != EINTR) {
+			ret = -errno;
+			goto out;
+		}
+
+		more = 0;
+		for (i = 0; i < cpus && len + MSG_MAX_LEN <= size; i++) {
+			cpu = (next + i) % cpus;
+			if (pfds[cpu].fd < 0)
+				continue;
+#ifndef NO_ZLIB
+			if (zdata)
+				r = read_cpu_zdata(fds[cpu], &zdata[cpu], cpu, in,
+						   msg_handle->fd, buf, &len, size);
+			else
+#endif
+				r = read_cpu_data(fds[cpu], cpu, buf, &len);
+			if (r < 0) {
+				if (errno == EAGAIN || errno == EINTR)
+					continue;
+				ret = -errno;
+				goto out;
+			}
+			if (!r) {
+				pfds[cpu].fd = -1;
+				open--;
+				continue;
+			}
+			more = 1;
+		}
+		/* The CPUs that did not fit go first next time */
+		next = (next + i) % cpus;
+
+		if (len && (!more || len + MSG_MAX_LEN > size)) {
+			ret = __do_write_check(msg_handle->fd, buf, len);
+			if (ret < 0)
+				goto out;
+			len = 0;
+		}
+	}
+	ret = 0;
+ out:
+#ifndef NO_ZLIB
+	zdata_free(zdata, cpus);
+	free(in);
+#endif
+	free(pfds);
+	free(buf);
+	return ret;
+}
+
+/*
+ * Inflates the ZDATA of @cpu into the buffer of the server, and points
+ * @data at it. Returns the size of the data, or negative on error.
+ */
+static int inflate_cpu_data(struct tracecmd_msg_handle *msg_handle, int cpu,
+			    void *buf, u32 n, void **data)
+{
+#ifdef NO_ZLIB
+	warning("Client sent compressed data, but not built with zlib");
+	return -EINVAL;
+#else
+	struct tracecmd_msg_server *msg_server = make_server(msg_handle);
+	z_stream *zdata;
+	char *dbuf;
+	int size;
+	int len = 0;
+	int zret;
+
+	if (!msg_server->zdata) {
+		msg_server->zdata = calloc(msg_handle->cpu_count,
+					   sizeof(*msg_server->zdata));
+		if (!msg_server->zdata)
+			return -ENOMEM;
+	}
+	zdata = &msg_server->zdata[cpu];
+	if (!zdata->state && inflateInit(zdata) != Z_OK)
+		return -EINVAL;
+
+	zdata->next_in = buf;
+	zdata->avail_in = n;
+	do {
+		if (len == msg_server->dbuf_size) {
+			size = len ? len * 2 : MSG_LARGE_MAX_LEN;
+			dbuf = realloc(msg_server->dbuf, size);
+			if (!dbuf)
+				return -ENOMEM;
+			msg_server->dbuf = dbuf;
+			msg_server->dbuf_size = size;
+		}
+		zdata->next_out = (Bytef *)msg_server->dbuf + len;
+		zdata->avail_out = msg_server->dbuf_size - len;
+		zret = inflate(zdata, Z_NO_FLUSH);
+		if (zret != Z_OK && zret != Z_STREAM_END && zret != Z_BUF_ERROR) {
+			warning("bad compressed data for CPU %d", cpu);
+			return -EINVAL;
+		}
+		len = msg_server->dbuf_size - zdata->avail_out;
+	} while (zret != Z_STREAM_END && (zdata->avail_in || !zdata->avail_out));
+
+	*data = msg_server->dbuf;
+	return len;
+#endif
+}
+
+/**
+ * tracecmd_msg_collect_data - write the data of the CPUs of a v3 client
+ * @msg_handle: the handle of the client connection
+ * @cpu_fds: the file to write the data of each CPU to
+ *
+ * Called after tracecmd_msg_collect_metadata(), reads the data of the
+ * CPUs until the client closes the connection.
+ *
+ * Returns 0 when the client is done, or negative on error.
+ */
+int tracecmd_msg_collect_data(struct tracecmd_msg_handle *msg_handle,
+			      int *cpu_fds)
+{
+	struct tracecmd_msg msg;
+	u32 cmd, cpu, n;
+	void *data;
+	int ret;
+
+	while (!tracecmd_msg_done(msg_handle)) {
+		memset(&msg, 0, sizeof(msg));
+		ret = tracecmd_msg_recv(msg_handle->fd, &msg);
+		if (ret < 0) {
+			warning("reading client");
+			return ret;
+		}
+
+		cmd = ntohl(msg.hdr.cmd);
+		if (cmd == MSG_CLOSE)
+			/* Finish this connection */
+			break;
+
+		ret = -EINVAL;
+		if (cmd != MSG_SENDDATA && cmd != MSG_ZDATA)
+			goto error;
+
+		cpu = ntohl(msg.data.cpu);
+		n = ntohl(msg.data.size);
+		if (cpu >= msg_handle->cpu_count ||
+		    ntohl(msg.hdr.size) < MIN_DATA_SIZE ||
+		    n > ntohl(msg.hdr.size) - MIN_DATA_SIZE)
+			goto error;
+
+		data = msg.buf;
+		if (cmd == MSG_ZDATA) {
+			ret = inflate_cpu_data(msg_handle, cpu, msg.buf, n, &data);
+			if (ret < 0)
+				goto error;
+			n = ret;
+		}
+
+		ret = __do_write_check(cpu_fds[cpu], data, n);
+		msg_free(&msg);
+		if (ret < 0) {
+			warning("writing to file");
+			return ret;
+		}
+	}
+
+	return 0;
+
+error:
+	error_operation_for_server(&msg);
+	msg_free(&msg);
+	return ret;
+}
+
+/*
+ * The event driven listener reads the messages of its clients into
+ * buffers on its own, and hands over the messages that are complete.
+ */
+
+/**
+ * tracecmd_msg_buf_len - get the size of the message that starts a buffer
+ * @buf: the data that was read from the connection
+ * @len: the number of bytes in @buf
+ *
+ * Returns the size of the message, or 0 if all of its header is not
+ * in @buf yet, or -ENOMSG if the size in the header is not valid.
+ */
+int tracecmd_msg_buf_len(const void *buf, int len)
+{
+	const struct tracecmd_msg_header *hdr = buf;
+	u32 size;
+
+	if (len < MSG_HDR_LEN)
+		return 0;
+
+	size = ntohl(hdr->size);
+	if (size > MSG_LARGE_MAX_LEN || size < MSG_HDR_LEN) {
+		plog("Receive an invalid message(size=%d)\n", size);
+		return -ENOMSG;
+	}
+
+	return size;
+}
+
+/*
+ * Point @msg at a message in a buffer, the extra data is not copied
+ * and must not be freed.
+ */
+static int msg_from_buf(struct tracecmd_msg *msg, void *buf, int len)
+{
+	u32 min_size;
+	u32 cmd;
+
+	memset(msg, 0, sizeof(*msg));
+	memcpy(&msg->hdr, buf, MSG_HDR_LEN);
+
+	cmd = ntohl(msg->hdr.cmd);
+	if (cmd > MSG_ZDATA)
+		return -EINVAL;
+
+	dprint("msg received: %d (%s)\n", cmd, cmd_to_name(cmd));
+
+	min_size = msg_min_sizes[cmd];
+	if (!min_size)
+		return 0;
+	if (min_size > len)
+		return -EINVAL;
+
+	memcpy(msg, buf, min_size);
+	if (len > min_size)
+		msg->buf = buf + min_size;
+
+	return 0;
+}
+
+/**
+ * tracecmd_msg_initial_setting_buf - handle the init message of a client
+ * @msg_handle: the handle of the client connection
+ * @buf: the message, as returned by tracecmd_msg_buf_len()
+ * @len: the size of the message
+ *
+ * Like tracecmd_msg_initial_setting() but for a message that was
+ * already read.
+ *
+ * Returns the page size of the client, or negative on error.
+ */
+int tracecmd_msg_initial_setting_buf(struct tracecmd_msg_handle *msg_handle,
+				     void *buf, int len)
+{
+	struct tracecmd_msg msg;
+	int ret;
+
+	ret = msg_from_buf(&msg, buf, len);
+	if (ret < 0)
+		return ret;
+
+	return process_tinit(msg_handle, &msg);
+}
+
+/**
+ * tracecmd_msg_port_array_buf - make the message with the ports of the CPUs
+ * @msg_handle: the handle of the client connection
+ * @ports: the port of each CPU of the client, NULL for a v3 client
+ * @buf: returns the allocated message, that the caller must free
+ *
+ * Like tracecmd_msg_send_port_array() but the message is left for the
+ * caller to send.
+ *
+ * Returns the size of the message, or negative on error.
+ */
+int tracecmd_msg_port_array_buf(struct tracecmd_msg_handle *msg_handle,
+				int *ports, char **buf)
+{
+	struct tracecmd_msg msg;
+	int size;
+	int ret;
+
+	tracecmd_msg_init(MSG_RINIT, &msg);
+	ret = make_rinit(&msg, ports ? msg_handle->cpu_count : 0, ports);
+	if (ret < 0)
+		return ret;
+
+	size = ntohl(msg.hdr.size);
+	*buf = malloc(size);
+	if (!*buf) {
+		msg_free(&msg);
+		return -ENOMEM;
+	}
+
+	memcpy(*buf, &msg, MIN_RINIT_SIZE);
+	if (size > MIN_RINIT_SIZE)
+		memcpy(*buf + MIN_RINIT_SIZE, msg.port_array,
+		       size - MIN_RINIT_SIZE);
+	msg_free(&msg);
+
+	return size;
+}
+
+/**
+ * tracecmd_msg_collect_metadata_buf - handle a message after the setup
+ * @msg_handle: the handle of the client connection
+ * @buf: the message, as returned by tracecmd_msg_buf_len()
+ * @len: the size of the message
+ * @ofd: the file to write the metadata to
+ *
+ * Like tracecmd_msg_collect_metadata() but for one message at a time
+ * that was already read.
+ *
+ * Returns 1 when the client closed the connection, 0 if more messages
+ * are expected, or negative on error.
+ */
+int tracecmd_msg_collect_metadata_buf(struct tracecmd_msg_handle *msg_handle,
+				      void *buf, int len, int ofd)
+{
+	struct tracecmd_msg_server *msg_server = make_server(msg_handle);
+	struct tracecmd_msg msg;
+	u32 cmd, n;
+	int ret;
+
+	ret = msg_from_buf(&msg, buf, len);
+	if (ret < 0)
+		return ret;
+
+	cmd = ntohl(msg.hdr.cmd);
+
+	if (!msg_server->meta_done) {
+		if (cmd == MSG_FINMETA) {
+			/* Finish receiving meta data */
+			msg_server->meta_done = true;
+			return 0;
+		}
+		ret = -EINVAL;
+		if (cmd != MSG_SENDMETA && cmd != MSG_ZMETA)
+			goto error;
+
+		n = ntohl(msg.meta.size);
+		if (n > len - MIN_META_SIZE)
+			goto error;
+
+		ret = write_meta(msg_handle, ofd, cmd, msg.buf, n);
+		if (ret < 0) {
+			warning("writing to file");
+			return ret;
+		}
+		return 0;
+	}
+
+	/* check the finish message of the client */
+	if (cmd == MSG_CLOSE)
+		return 1;
+
+	warning("Not accept the message %d", cmd);
+	ret = -EINVAL;
+error:
+	error_operation_for_server(&msg);
+	return ret;
+}
+
+/**
+ * tracecmd_msg_data_buf - get the data of a CPU out of a message
+ * @msg_handle: the handle of the v3 client connection
+ * @buf: the message, as returned by tracecmd_msg_buf_len()
+ * @len: the size of the message
+ * @cpu: returns the CPU that the data belongs to
+ * @data: returns the data in @buf
+ *
+ * The data of ZDATA messages is inflated into a buffer of the handle,
+ * that is good until the next call.
+ *
+ * Returns the size of the data, 0 with @data set to NULL if the message
+ * is not one with the data of a CPU (it is left for
+ * tracecmd_msg_collect_metadata_buf()), or negative on error.
+ */
+int tracecmd_msg_data_buf(struct tracecmd_msg_handle *msg_handle,
+			  void *buf, int len, int *cpu, void **data)
+{
+	struct tracecmd_msg_server *msg_server = make_server(msg_handle);
+	struct tracecmd_msg msg;
+	u32 cmd, n;
+	int ret;
+
+	*data = NULL;
+
+	ret = msg_from_buf(&msg, buf, len);
+	if (ret < 0)
+		return ret;
+
+	cmd = ntohl(msg.hdr.cmd);
+	if (cmd != MSG_SENDDATA && cmd != MSG_ZDATA)
+		return 0;
+
+	n = ntohl(msg.data.size);
+	*cpu = ntohl(msg.data.cpu);
+	if (!msg_server->meta_done || *cpu < 0 ||
+	    *cpu >= msg_handle->cpu_count || n > len - MIN_DATA_SIZE) {
+		error_operation_for_server(&msg);
+		return -EINVAL;
+	}
+
+	if (cmd == MSG_ZDATA) {
+		ret = inflate_cpu_data(msg_handle, *cpu, msg.buf, n, data);
+		if (ret < 0)
+			error_operation_for_server(&msg);
+		return ret;
+	}
+
+	*data = msg.buf;
+	return n;
+}
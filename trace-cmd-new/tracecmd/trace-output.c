@@ -30,6 +30,9 @@
 typedef unsigned long long	tsize_t;
 typedef long long		stsize_t;
 
+/* The most that copy_file_range() is asked for at a time */
+#define COPY_RANGE_SIZE		(1ULL << 30)
+
 static struct tracecmd_event_list all_event_list = {
 	.next = NULL,
 	.glob = "all"
@@ -174,21 +177,31 @@ static unsigned long get_size(const char *file)
 	return size;
 }
 
+/* Large reads let the metadata go to a listener in large messages */
+#define COPY_BUF_SIZE	(64 * 1024)
+
 static tsize_t copy_file_fd(struct tracecmd_output *handle, int fd)
 {
 	tsize_t size = 0;
-	char buf[BUFSIZ];
 	stsize_t r;
+	char *buf;
+
+	buf = malloc(COPY_BUF_SIZE);
+	if (!buf)
+		return 0;
 
 	do {
-		r = read(fd, buf, BUFSIZ);
+		r = read(fd, buf, COPY_BUF_SIZE);
 		if (r > 0) {
 			size += r;
-			if (do_write_check(handle, buf, r))
-				return 0;
+			if (do_write_check(handle, buf, r)) {
+				size = 0;
+				break;
+			}
 		}
 	} while (r > 0);
 
+	free(buf);
 	return size;
 }
 
@@ -209,6 +222,125 @@ static tsize_t copy_file(struct tracecmd_output *handle,
 	return size;
 }
 
+/*
+ * The CPU data files are the bulk of what is written. They are regular
+ * files written by trace-cmd, let the kernel copy them when it can.
+ * Files of the tracing and proc file systems may claim to have no data
+ * to copy this way, those go through copy_file().
+ */
+static tsize_t copy_data_segments(struct tracecmd_output *handle,
+				  const char *file,
+				  struct tracecmd_segment *segs, int nr_segs)
+{
+	unsigned long long offset;
+	unsigned long long left;
+	tsize_t size = 0;
+	char *buf = NULL;
+	stsize_t r;
+	int fd;
+	int i;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		warning("Can't read '%s'", file);
+		return 0;
+	}
+
+	for (i = 0; i < nr_segs; i++) {
+		offset = segs[i].offset;
+		left = segs[i].size;
+
+		while (left && !handle->msg_handle &&
+		       (r = tracecmd_copy_file_range(fd, &offset, handle->fd,
+						     left)) > 0) {
+			left -= r;
+			size += r;
+		}
+
+		/* Read and write what is left, if it could not be copied */
+		while (left) {
+			if (!buf) {
+				buf = malloc(COPY_BUF_SIZE);
+				if (!buf)
+					goto out;
+			}
+			r = pread64(fd, buf, left < COPY_BUF_SIZE ?
+				    left : COPY_BUF_SIZE, offset);
+			if (r <= 0 || do_write_check(handle, buf, r))
+				goto out;
+			offset += r;
+			left -= r;
+			size += r;
+		}
+	}
+
+ out:
+	free(buf);
+	close(fd);
+
+	return size;
+}
+
+/*
+ * A CPU data file that was recorded in segments holds the data of the
+ * segments in its manifest, oldest first. Only these are the data of
+ * the CPU, the rest of the file are segments that were written over.
+ * Returns the number of segments, or -1 if the file is not in segments.
+ */
+static int get_data_segments(const char *file,
+			     struct tracecmd_segment **segs, tsize_t *size)
+{
+	int nr;
+	int i;
+
+	nr = tracecmd_read_segments(file, segs);
+	if (nr < 0)
+		return -1;
+
+	*size = 0;
+	for (i = 0; i < nr; i++)
+		*size += (*segs)[i].size;
+
+	return nr;
+}
+
+static tsize_t copy_data_file(struct tracecmd_output *handle,
+			      const char *file)
+{
+	struct tracecmd_segment *segs;
+	tsize_t size = 0;
+	stsize_t r;
+	int fd;
+
+	r = get_data_segments(file, &segs, &size);
+	if (r >= 0) {
+		size = copy_data_segments(handle, file, segs, r);
+		free(segs);
+		return size;
+	}
+
+	if (handle->msg_handle)
+		return copy_file(handle, file);
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		warning("Can't read '%s'", file);
+		return 0;
+	}
+
+	while ((r = tracecmd_copy_file_range(fd, NULL, handle->fd,
+					     COPY_RANGE_SIZE)) > 0)
+		size += r;
+
+	/* Read and write what is left, if it could not be copied */
+	if (r < 0)
+		size += copy_file_fd(handle, fd);
+
+	close(fd);
+
+	return size;
+}
+
 /*
  * Finds the path to the debugfs/tracing
  * Allocates the string and stores it.
@@ -1085,7 +1217,9 @@ static int __tracecmd_append_cpu_data(struct tracecmd_output *handle,
 	unsigned long long *sizes = NULL;
 	off64_t offset;
 	unsigned long long endian8;
+	struct tracecmd_segment *segs;
 	off64_t check_size;
+	tsize_t size;
 	char *file;
 	struct stat st;
 	int ret;
@@ -1138,7 +1272,11 @@ static int __tracecmd_append_cpu_data(struct tracecmd_output *handle,
 		}
 		offsets[i] = offset;
 		sizes[i] = st.st_size;
-		offset += st.st_size;
+		if (get_data_segments(file, &segs, &size) >= 0) {
+			sizes[i] = size;
+			free(segs);
+		}
+		offset += sizes[i];
 		offset = (offset + (handle->page_size - 1)) & ~(handle->page_size - 1);
 
 		endian8 = convert_endian_8(handle, offsets[i]);
@@ -1161,7 +1299,7 @@ static int __tracecmd_append_cpu_data(struct tracecmd_output *handle,
 			warning("could not seek to %lld\n", offsets[i]);
 			goto out_free;
 		}
-		check_size = copy_file(handle, cpu_data_files[i]);
+		check_size = copy_data_file(handle, cpu_data_files[i]);
 		if (check_size != sizes[i]) {
 			errno = EINVAL;
 			warning("did not match size of %lld to %lld",
@@ -1228,6 +1366,16 @@ int tracecmd_append_buffer_cpu_data(struct tracecmd_output *handle,
 	return __tracecmd_append_cpu_data(handle, cpus, cpu_data_files);
 }
 
+/**
+ * tracecmd_attach_cpu_data_fd - append the CPU data to a file of headers
+ * @fd: the file descriptor of the file with the headers
+ * @cpus: the number of CPU data files
+ * @cpu_data_files: the files with the raw data of each CPU
+ *
+ * The file descriptor is closed, whether it succeeds or not.
+ *
+ * Returns 0 on success and -1 on error.
+ */
 int tracecmd_attach_cpu_data_fd(int fd, int cpus, char * const *cpu_data_files)
 {
 	struct tracecmd_input *ihandle;
@@ -1236,13 +1384,17 @@ int tracecmd_attach_cpu_data_fd(int fd, int cpus, char * const *cpu_data_files)
 	int ret = -1;
 
 	/* Move the file descriptor to the beginning */
-	if (lseek(fd, 0, SEEK_SET) == (off_t)-1)
+	if (lseek(fd, 0, SEEK_SET) == (off_t)-1) {
+		close(fd);
 		return -1;
+	}
 
 	/* get a input handle from this */
 	ihandle = tracecmd_alloc_fd(fd);
-	if (!ihandle)
+	if (!ihandle) {
+		close(fd);
 		return -1;
+	}
 
 	/* move the file descriptor to the end */
 	if (lseek(fd, 0, SEEK_END) == (off_t)-1)
@@ -1268,6 +1420,8 @@ int tracecmd_attach_cpu_data_fd(int fd, int cpus, char * const *cpu_data_files)
 	if (tracecmd_append_cpu_data(handle, cpus, cpu_data_files) >= 0)
 		ret = 0;
 
+	/* The input handle closes the file descriptor */
+	handle->fd = -1;
 	tracecmd_output_close(handle);
  out_free:
 	tracecmd_close(ihandle);
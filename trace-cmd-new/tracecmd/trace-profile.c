@@ -9,6 +9,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
 #ifndef NO_AUDIT
 #include <libaudit.h>
 #endif
@@ -27,10 +29,7 @@
 #define TASK_STATE_TO_CHAR_STR "RSDTtXZxKWP"
 #define TASK_STATE_MAX		1024
 
-#define task_from_item(item)	container_of(item, struct task_data, hash)
 #define start_from_item(item)	container_of(item, struct start_data, hash)
-#define event_from_item(item)	container_of(item, struct event_hash, hash)
-#define stack_from_item(item)	container_of(item, struct stack_data, hash)
 #define group_from_item(item)	container_of(item, struct group_data, hash)
 #define event_data_from_item(item)	container_of(item, struct event_data, hash)
 
@@ -90,7 +89,7 @@ struct event_data {
 };
 
 struct stack_data {
-	struct trace_hash_item  hash;
+	unsigned long long	key;
 	unsigned long long	count;
 	unsigned long long	time;
 	unsigned long long	time_min;
@@ -122,7 +121,7 @@ struct start_data {
 };
 
 struct event_hash {
-	struct trace_hash_item	hash;
+	unsigned long long	key;
 	struct event_data	*event_data;
 	unsigned long long	search_val;
 	unsigned long long	val;
@@ -136,24 +135,24 @@ struct event_hash {
 	unsigned long long	time_std;
 	unsigned long long	last_time;
 
-	struct trace_hash	stacks;
+	struct trace_ohash	stacks;
 };
 
 struct group_data {
 	struct trace_hash_item	hash;
 	char			*comm;
-	struct trace_hash	event_hash;
+	struct trace_ohash	event_hash;
 };
 
 struct task_data {
-	struct trace_hash_item	hash;
 	int			pid;
-	int			sleeping;
+	int			sleeping;	/* -1 if not known yet */
+	int			execed;
 
 	char			*comm;
 
 	struct trace_hash	start_hash;
-	struct trace_hash	event_hash;
+	struct trace_ohash	event_hash;
 
 	struct task_data	*proxy;
 	struct start_data	*last_start;
@@ -172,6 +171,25 @@ struct sched_switch_data {
 	int			match_state;
 };
 
+enum defer_type {
+	DEFER_END,
+	DEFER_WAKEUP,
+	DEFER_MISSED,
+};
+
+/*
+ * What a slice of the file could not do without the slices
+ * before it, to be done again when the slices are merged.
+ */
+struct defer_data {
+	enum defer_type		type;
+	struct task_data	*task;
+	struct event_data	*event_data;
+	unsigned long long	ts;
+	unsigned long long	search_val;
+	int			cpu;
+};
+
 struct handle_data {
 	struct handle_data	*next;
 	struct tracecmd_input	*handle;
@@ -190,14 +208,24 @@ struct handle_data {
 	struct sched_switch_data sched_switch_blocked;
 	struct sched_switch_data sched_switch_preempt;
 
-	struct trace_hash	task_hash;
+	struct trace_ohash	task_hash;
 	struct list_head	*cpu_starts;
 	struct list_head	migrate_starts;
 
 	struct task_data	*global_task;
 	struct task_data	*global_percpu_tasks;
+	struct task_data	*last_task;
 
 	int			cpus;
+
+	/* Set for the slices of a file profiled by other threads */
+	int			slice;
+	struct defer_data	*defers;
+	int			nr_defers;
+	int			defers_size;
+
+	struct tracecmd_input	**slice_handles;
+	int			nr_slice_handles;
 };
 
 static struct handle_data *handles;
@@ -209,10 +237,18 @@ void trace_profile_set_merge_like_comms(void)
 	merge_like_comms = true;
 }
 
+static void add_start_list(struct handle_data *h, struct start_data *start)
+{
+	if (start->event_data->migrate)
+		list_add(&start->list, &h->migrate_starts);
+	else
+		list_add(&start->list, &h->cpu_starts[start->cpu]);
+}
+
 static struct start_data *
-add_start(struct task_data *task,
-	  struct event_data *event_data, struct pevent_record *record,
-	  unsigned long long search_val, unsigned long long val)
+__add_start(struct task_data *task, struct event_data *event_data,
+	    unsigned long long ts, int cpu,
+	    unsigned long long search_val, unsigned long long val)
 {
 	struct start_data *start;
 
@@ -223,18 +259,48 @@ add_start(struct task_data *task,
 	start->hash.key = trace_hash(search_val);
 	start->search_val = search_val;
 	start->val = val;
-	start->timestamp = record->ts;
+	start->timestamp = ts;
 	start->event_data = event_data;
-	start->cpu = record->cpu;
+	start->cpu = cpu;
 	start->task = task;
 	trace_hash_add(&task->start_hash, &start->hash);
-	if (event_data->migrate)
-		list_add(&start->list, &task->handle->migrate_starts);
-	else
-		list_add(&start->list, &task->handle->cpu_starts[record->cpu]);
+	add_start_list(task->handle, start);
 	return start;
 }
 
+static struct start_data *
+add_start(struct task_data *task,
+	  struct event_data *event_data, struct pevent_record *record,
+	  unsigned long long search_val, unsigned long long val)
+{
+	return __add_start(task, event_data, record->ts, record->cpu,
+			   search_val, val);
+}
+
+static void add_defer(struct handle_data *h, enum defer_type type,
+		      struct task_data *task, struct event_data *event_data,
+		      unsigned long long ts, unsigned long long search_val,
+		      int cpu)
+{
+	struct defer_data *defer;
+
+	if (h->nr_defers == h->defers_size) {
+		h->defers_size = h->defers_size ? h->defers_size * 2 : 64;
+		h->defers = realloc(h->defers,
+				    sizeof(*h->defers) * h->defers_size);
+		if (!h->defers)
+			die("Failed to allocate deferred events");
+	}
+
+	defer = &h->defers[h->nr_defers++];
+	defer->type = type;
+	defer->task = task;
+	defer->event_data = event_data;
+	defer->ts = ts;
+	defer->search_val = search_val;
+	defer->cpu = cpu;
+}
+
 struct event_data_match {
 	struct event_data	*event_data;
 	unsigned long long	search_val;
@@ -250,10 +316,10 @@ static int match_start(struct trace_hash_item *item, void *data)
 		start->search_val == edata->search_val;
 }
 
-static int match_event(struct trace_hash_item *item, void *data)
+static int match_event(void *item, void *data)
 {
 	struct event_data_match *edata = data;
-	struct event_hash *event = event_from_item(item);
+	struct event_hash *event = item;
 
 	return event->event_data == edata->event_data &&
 		event->search_val == edata->search_val &&
@@ -264,16 +330,15 @@ static struct event_hash *
 find_event_hash(struct task_data *task, struct event_data_match *edata)
 {
 	struct event_hash *event_hash;
-	struct trace_hash_item *item;
 	unsigned long long key;
 
 	key = (unsigned long)edata->event_data +
 		(unsigned long)edata->search_val +
 		(unsigned long)edata->val;
 	key = trace_hash(key);
-	item = trace_hash_find(&task->event_hash, key, match_event, edata);
-	if (item)
-		return event_from_item(item);
+	event_hash = trace_ohash_find(&task->event_hash, key, match_event, edata);
+	if (event_hash)
+		return event_hash;
 
 	event_hash = malloc(sizeof(*event_hash));
 	if (!event_hash)
@@ -283,10 +348,14 @@ find_event_hash(struct task_data *task, struct event_data_match *edata)
 	event_hash->event_data = edata->event_data;
 	event_hash->search_val = edata->search_val;
 	event_hash->val = edata->val;
-	event_hash->hash.key = key;
-	trace_hash_init(&event_hash->stacks, 32);
+	event_hash->key = key;
+	trace_ohash_init(&event_hash->stacks, 32);
 
-	trace_hash_add(&task->event_hash, &event_hash->hash);
+	if (trace_ohash_add(&task->event_hash, key, event_hash) < 0) {
+		trace_ohash_free(&event_hash->stacks);
+		free(event_hash);
+		return NULL;
+	}
 
 	return event_hash;
 }
@@ -330,9 +399,9 @@ struct stack_match {
 	unsigned long	size;
 };
 
-static int match_stack(struct trace_hash_item *item, void *data)
+static int match_stack(void *item, void *data)
 {
-	struct stack_data *stack = stack_from_item(item);
+	struct stack_data *stack = item;
 	struct stack_match *match = data;
 
 	if (match->size != stack->size)
@@ -349,7 +418,6 @@ static void add_event_stack(struct event_hash *event_hash,
 	unsigned long long key;
 	struct stack_data *stack;
 	struct stack_match match;
-	struct trace_hash_item *item;
 	int i;
 
 	match.caller = caller;
@@ -361,8 +429,8 @@ static void add_event_stack(struct event_hash *event_hash,
 	for (key = 0, i = 0; i <= size - sizeof(int); i += sizeof(int))
 		key += trace_hash(*(int *)(caller + i));
 
-	item = trace_hash_find(&event_hash->stacks, key, match_stack, &match);
-	if (!item) {
+	stack = trace_ohash_find(&event_hash->stacks, key, match_stack, &match);
+	if (!stack) {
 		stack = malloc(sizeof(*stack) + size);
 		if (!stack) {
 			warning("Could not allocate stack");
@@ -371,10 +439,13 @@ static void add_event_stack(struct event_hash *event_hash,
 		memset(stack, 0, sizeof(*stack));
 		memcpy(&stack->caller, caller, size);
 		stack->size = size;
-		stack->hash.key = key;
-		trace_hash_add(&event_hash->stacks, &stack->hash);
-	} else
-		stack = stack_from_item(item);
+		stack->key = key;
+		if (trace_ohash_add(&event_hash->stacks, key, stack) < 0) {
+			warning("Could not allocate stack");
+			free(stack);
+			return;
+		}
+	}
 
 	stack->count++;
 	stack->time += time;
@@ -458,15 +529,20 @@ find_and_update_start(struct task_data *task, struct event_data *event_data,
 	struct start_data *start;
 
 	start = find_start(task, event_data, search_val);
-	if (!start)
+	if (!start) {
+		/* The start may be in one of the slices before this one */
+		if (task->handle->slice && event_data)
+			add_defer(task->handle, DEFER_END, task, event_data,
+				  ts, search_val, -1);
 		return NULL;
+	}
 	return add_and_free_start(task, start, event_data, ts);
 }
 
-static int match_task(struct trace_hash_item *item, void *data)
+static int match_task(void *item, void *data)
 {
-	struct task_data *task = task_from_item(item);
-	int pid = *(unsigned long *)data;
+	struct task_data *task = item;
+	int pid = *(int *)data;
 
 	return task->pid == pid;
 }
@@ -476,7 +552,7 @@ static void init_task(struct handle_data *h, struct task_data *task)
 	task->handle = h;
 
 	trace_hash_init(&task->start_hash, 16);
-	trace_hash_init(&task->event_hash, 32);
+	trace_ohash_init(&task->event_hash, 32);
 }
 
 static struct task_data *
@@ -493,11 +569,20 @@ add_task(struct handle_data *h, int pid)
 	memset(task, 0, sizeof(*task));
 
 	task->pid = pid;
-	task->hash.key = key;
-	trace_hash_add(&h->task_hash, &task->hash);
+
+	/* Only the slices before this one know if it is sleeping */
+	if (h->slice)
+		task->sleeping = -1;
 
 	init_task(h, task);
 
+	if (trace_ohash_add(&h->task_hash, key, task) < 0) {
+		warning("Could not allocate task");
+		trace_ohash_free(&task->event_hash);
+		free(task);
+		return NULL;
+	}
+
 	return task;
 }
 
@@ -505,21 +590,18 @@ static struct task_data *
 find_task(struct handle_data *h, int pid)
 {
 	unsigned long long key = trace_hash(pid);
-	struct trace_hash_item *item;
-	static struct task_data *last_task;
-	void *data = (unsigned long *)&pid;
+	struct task_data *task;
 
-	if (last_task && last_task->pid == pid)
-		return last_task;
+	if (h->last_task && h->last_task->pid == pid)
+		return h->last_task;
 
-	item = trace_hash_find(&h->task_hash, key, match_task, data);
+	task = trace_ohash_find(&h->task_hash, key, match_task, &pid);
+	if (!task)
+		task = add_task(h, pid);
 
-	if (item)
-		last_task = task_from_item(item);
-	else
-		last_task = add_task(h, pid);
+	h->last_task = task;
 
-	return last_task;
+	return h->last_task;
 }
 
 static int match_group(struct trace_hash_item *item, void *data)
@@ -710,6 +792,10 @@ static void handle_missed_events(struct handle_data *h, int cpu)
 	list_for_each_entry_safe(start, n, &h->migrate_starts, list) {
 		free_start(start);
 	}
+
+	/* And those of the slices before this one */
+	if (h->slice)
+		add_defer(h, DEFER_MISSED, NULL, NULL, 0, 0, cpu);
 }
 
 static int match_event_data(struct trace_hash_item *item, void *data)
@@ -733,31 +819,16 @@ find_event_data(struct handle_data *h, int id)
 	return NULL;
 }
 
-static void trace_profile_record(struct tracecmd_input *handle,
-				struct pevent_record *record)
+static void profile_record(struct handle_data *h, struct pevent_record *record)
 {
-	static struct handle_data *last_handle;
 	struct pevent_record *stack_record;
 	struct event_data *event_data;
 	struct task_data *task;
-	struct handle_data *h;
 	struct pevent *pevent;
 	unsigned long long pid;
 	int cpu = record->cpu;
 	int id;
 
-	if (last_handle && last_handle->handle == handle)
-		h = last_handle;
-	else {
-		for (h = handles; h; h = h->next) {
-			if (h->handle == handle)
-				break;
-		}
-		if (!h)
-			die("Handle not found?");
-		last_handle = h;
-	}
-
 	if (record->missed_events)
 		handle_missed_events(h, cpu);
 
@@ -791,6 +862,27 @@ static void trace_profile_record(struct tracecmd_input *handle,
 	}
 }
 
+static void trace_profile_record(struct tracecmd_input *handle,
+				struct pevent_record *record)
+{
+	static struct handle_data *last_handle;
+	struct handle_data *h;
+
+	if (last_handle && last_handle->handle == handle)
+		h = last_handle;
+	else {
+		for (h = handles; h; h = h->next) {
+			if (h->handle == handle)
+				break;
+		}
+		if (!h)
+			die("Handle not found?");
+		last_handle = h;
+	}
+
+	profile_record(h, record);
+}
+
 static struct event_data *
 add_event(struct handle_data *h, const char *system, const char *event_name,
 	  enum event_data_type type)
@@ -1197,6 +1289,7 @@ static int handle_process_exec(struct handle_data *h,
 
 	free(task->comm);
 	task->comm = NULL;
+	task->execed = 1;
 
 	return 0;
 }
@@ -1235,6 +1328,17 @@ static int handle_sched_wakeup_event(struct handle_data *h,
 	if (!task->comm)
 		add_task_comm(task, h->wakeup_comm, record);
 
+	/*
+	 * If this slice of the file has not seen the task go to sleep,
+	 * let the merge with the slices before it find out if this
+	 * woke it up. Either way, it is running now.
+	 */
+	if (task->sleeping < 0) {
+		add_defer(h, DEFER_WAKEUP, task, event_data, record->ts,
+			  pid, record->cpu);
+		task->sleeping = 0;
+	}
+
 	/* if the task isn't sleeping, then ignore the wake up */
 	if (!task->sleeping) {
 		/* Ignore any following stack traces */
@@ -1299,7 +1403,7 @@ void trace_init_profile(struct tracecmd_input *handle, struct hook_list *hook,
 	h->next = handles;
 	handles = h;
 
-	trace_hash_init(&h->task_hash, 1024);
+	trace_ohash_init(&h->task_hash, 1024);
 	trace_hash_init(&h->events, 1024);
 	trace_hash_init(&h->group_hash, 512);
 
@@ -1878,10 +1982,10 @@ static int compare_stacks(const void *a, const void *b)
 	return 0;
 }
 
-static void output_stacks(struct pevent *pevent, struct trace_hash *stack_hash)
+static void output_stacks(struct pevent *pevent, struct trace_ohash *stack_hash)
 {
-	struct trace_hash_item **bucket;
-	struct trace_hash_item *item;
+	struct trace_ohash_slot *slot;
+	struct stack_data *stack;
 	struct stack_data **stacks;
 	struct stack_chain *chain;
 	unsigned long long mask = 0;
@@ -1890,12 +1994,7 @@ static void output_stacks(struct pevent *pevent, struct trace_hash *stack_hash)
 	int nr_stacks;
 	int i;
 
-	nr_stacks = 0;
-	trace_hash_for_each_bucket(bucket, stack_hash) {
-		trace_hash_for_each_item(item, bucket) {
-			nr_stacks++;
-		}
-	}
+	nr_stacks = stack_hash->nr_items;
 
 	stacks = malloc(sizeof(*stacks) * nr_stacks);
 	if (!stacks) {
@@ -1904,11 +2003,8 @@ static void output_stacks(struct pevent *pevent, struct trace_hash *stack_hash)
 	}
 
 	nr_stacks = 0;
-	trace_hash_for_each_bucket(bucket, stack_hash) {
-		trace_hash_for_each_item(item, bucket) {
-			stacks[nr_stacks++] = stack_from_item(item);
-		}
-	}
+	trace_ohash_for_each_item(stack, slot, stack_hash)
+		stacks[nr_stacks++] = stack;
 
 	qsort(stacks, nr_stacks, sizeof(*stacks), compare_stacks);
 
@@ -2004,11 +2100,11 @@ static int compare_events(const void *a, const void *b)
 
 static void output_task(struct handle_data *h, struct task_data *task)
 {
-	struct trace_hash_item **bucket;
-	struct trace_hash_item *item;
+	struct trace_ohash_slot *slot;
+	struct event_hash *event_hash;
 	struct event_hash **events;
 	const char *comm;
-	int nr_events = 0;
+	int nr_events;
 	int i;
 
 	if (task->group)
@@ -2024,11 +2120,7 @@ static void output_task(struct handle_data *h, struct task_data *task)
 	else
 		printf("\ntask: %s-%d\n", comm, task->pid);
 
-	trace_hash_for_each_bucket(bucket, &task->event_hash) {
-		trace_hash_for_each_item(item, bucket) {
-			nr_events++;
-		}
-	}
+	nr_events = task->event_hash.nr_items;
 
 	events = malloc(sizeof(*events) * nr_events);
 	if (!events) {
@@ -2037,11 +2129,8 @@ static void output_task(struct handle_data *h, struct task_data *task)
 	}
 
 	i = 0;
-	trace_hash_for_each_bucket(bucket, &task->event_hash) {
-		trace_hash_for_each_item(item, bucket) {
-			events[i++] = event_from_item(item);
-		}
-	}
+	trace_ohash_for_each_item(event_hash, slot, &task->event_hash)
+		events[i++] = event_hash;
 
 	qsort(events, nr_events, sizeof(*events), compare_events);
 
@@ -2053,19 +2142,15 @@ static void output_task(struct handle_data *h, struct task_data *task)
 
 static void output_group(struct handle_data *h, struct group_data *group)
 {
-	struct trace_hash_item **bucket;
-	struct trace_hash_item *item;
+	struct trace_ohash_slot *slot;
+	struct event_hash *event_hash;
 	struct event_hash **events;
-	int nr_events = 0;
+	int nr_events;
 	int i;
 
 	printf("\ngroup: %s\n", group->comm);
 
-	trace_hash_for_each_bucket(bucket, &group->event_hash) {
-		trace_hash_for_each_item(item, bucket) {
-			nr_events++;
-		}
-	}
+	nr_events = group->event_hash.nr_items;
 
 	events = malloc(sizeof(*events) * nr_events);
 	if (!events) {
@@ -2074,11 +2159,8 @@ static void output_group(struct handle_data *h, struct group_data *group)
 	}
 
 	i = 0;
-	trace_hash_for_each_bucket(bucket, &group->event_hash) {
-		trace_hash_for_each_item(item, bucket) {
-			events[i++] = event_from_item(item);
-		}
-	}
+	trace_ohash_for_each_item(event_hash, slot, &group->event_hash)
+		events[i++] = event_hash;
 
 	qsort(events, nr_events, sizeof(*events), compare_events);
 
@@ -2110,18 +2192,12 @@ static int compare_groups(const void *a, const void *b)
 
 static void free_event_hash(struct event_hash *event_hash)
 {
-	struct trace_hash_item **bucket;
-	struct trace_hash_item *item;
+	struct trace_ohash_slot *slot;
 	struct stack_data *stack;
 
-	trace_hash_for_each_bucket(bucket, &event_hash->stacks) {
-		trace_hash_while_item(item, bucket) {
-			stack = stack_from_item(item);
-			trace_hash_del(&stack->hash);
-			free(stack);
-		}
-	}
-	trace_hash_free(&event_hash->stacks);
+	trace_ohash_for_each_item(stack, slot, &event_hash->stacks)
+		free(stack);
+	trace_ohash_free(&event_hash->stacks);
 	free(event_hash);
 }
 
@@ -2129,6 +2205,7 @@ static void __free_task(struct task_data *task)
 {
 	struct trace_hash_item **bucket;
 	struct trace_hash_item *item;
+	struct trace_ohash_slot *slot;
 	struct start_data *start;
 	struct event_hash *event_hash;
 
@@ -2146,14 +2223,9 @@ static void __free_task(struct task_data *task)
 	}
 	trace_hash_free(&task->start_hash);
 
-	trace_hash_for_each_bucket(bucket, &task->event_hash) {
-		trace_hash_while_item(item, bucket) {
-			event_hash = event_from_item(item);
-			trace_hash_del(item);
-			free_event_hash(event_hash);
-		}
-	}
-	trace_hash_free(&task->event_hash);
+	trace_ohash_for_each_item(event_hash, slot, &task->event_hash)
+		free_event_hash(event_hash);
+	trace_ohash_free(&task->event_hash);
 
 	if (task->last_stack)
 		free_record(task->last_stack);
@@ -2167,27 +2239,21 @@ static void free_task(struct task_data *task)
 
 static void free_group(struct group_data *group)
 {
-	struct trace_hash_item **bucket;
-	struct trace_hash_item *item;
+	struct trace_ohash_slot *slot;
 	struct event_hash *event_hash;
 
 	free(group->comm);
 
-	trace_hash_for_each_bucket(bucket, &group->event_hash) {
-		trace_hash_while_item(item, bucket) {
-			event_hash = event_from_item(item);
-			trace_hash_del(item);
-			free_event_hash(event_hash);
-		}
-	}
-	trace_hash_free(&group->event_hash);
+	trace_ohash_for_each_item(event_hash, slot, &group->event_hash)
+		free_event_hash(event_hash);
+	trace_ohash_free(&group->event_hash);
 	free(group);
 }
 
 static void show_global_task(struct handle_data *h,
 			     struct task_data *task)
 {
-	if (trace_hash_empty(&task->event_hash))
+	if (trace_ohash_empty(&task->event_hash))
 		return;
 
 	output_task(h, task);
@@ -2195,17 +2261,13 @@ static void show_global_task(struct handle_data *h,
 
 static void output_tasks(struct handle_data *h)
 {
-	struct trace_hash_item **bucket;
-	struct trace_hash_item *item;
+	struct trace_ohash_slot *slot;
+	struct task_data *task;
 	struct task_data **tasks;
-	int nr_tasks = 0;
+	int nr_tasks;
 	int i;
 
-	trace_hash_for_each_bucket(bucket, &h->task_hash) {
-		trace_hash_for_each_item(item, bucket) {
-			nr_tasks++;
-		}
-	}
+	nr_tasks = h->task_hash.nr_items;
 
 	tasks = malloc(sizeof(*tasks) * nr_tasks);
 	if (!tasks) {
@@ -2215,12 +2277,9 @@ static void output_tasks(struct handle_data *h)
 
 	nr_tasks = 0;
 
-	trace_hash_for_each_bucket(bucket, &h->task_hash) {
-		trace_hash_while_item(item, bucket) {
-			tasks[nr_tasks++] = task_from_item(item);
-			trace_hash_del(item);
-		}
-	}
+	trace_ohash_for_each_item(task, slot, &h->task_hash)
+		tasks[nr_tasks++] = task;
+	trace_ohash_free(&h->task_hash);
 
 	qsort(tasks, nr_tasks, sizeof(*tasks), compare_tasks);
 
@@ -2290,26 +2349,32 @@ static void merge_event_stack(struct event_hash *event,
 			      struct stack_data *stack)
 {
 	struct stack_data *exist;
-	struct trace_hash_item *item;
 	struct stack_match match;
 
 	match.caller = stack->caller;
 	match.size = stack->size;
-	item = trace_hash_find(&event->stacks, stack->hash.key, match_stack,
-			       &match);
-	if (!item) {
-		trace_hash_add(&event->stacks, &stack->hash);
+	exist = trace_ohash_find(&event->stacks, stack->key, match_stack,
+				 &match);
+	if (!exist) {
+		if (trace_ohash_add(&event->stacks, stack->key, stack) < 0) {
+			warning("Could not allocate stack");
+			free(stack);
+		}
 		return;
 	}
-	exist = stack_from_item(item);
 	exist->count += stack->count;
 	exist->time += stack->time;
 
-	if (exist->time_max < stack->time_max) {
+	/* On a tie, keep the first one like adding the stacks in order does */
+	if (exist->time_max < stack->time_max ||
+	    (exist->time_max == stack->time_max &&
+	     exist->ts_max > stack->ts_max)) {
 		exist->time_max = stack->time_max;
 		exist->ts_max = stack->ts_max;
 	}
-	if (exist->time_min > stack->time_min) {
+	if (exist->time_min > stack->time_min ||
+	    (exist->time_min == stack->time_min &&
+	     exist->ts_min > stack->ts_min)) {
 		exist->time_min = stack->time_min;
 		exist->ts_min = stack->ts_min;
 	}
@@ -2318,62 +2383,50 @@ static void merge_event_stack(struct event_hash *event,
 
 static void merge_stacks(struct event_hash *exist, struct event_hash *event)
 {
+	struct trace_ohash_slot *slot;
 	struct stack_data *stack;
-	struct trace_hash_item *item;
-	struct trace_hash_item **bucket;
 
-	trace_hash_for_each_bucket(bucket, &event->stacks) {
-		trace_hash_while_item(item, bucket) {
-			stack = stack_from_item(item);
-			trace_hash_del(&stack->hash);
-			merge_event_stack(exist, stack);
-		}
-	}
+	trace_ohash_for_each_item(stack, slot, &event->stacks)
+		merge_event_stack(exist, stack);
+
+	/* They all belong to @exist now */
+	trace_ohash_free(&event->stacks);
 }
 
-static void merge_event_into_group(struct group_data *group,
-				   struct event_hash *event)
+/* Merge @event into the event of @hash with the same @key, or add it */
+static void merge_event(struct trace_ohash *hash, struct event_hash *event,
+			unsigned long long key)
 {
 	struct event_hash *exist;
-	struct trace_hash_item *item;
 	struct event_data_match edata;
-	unsigned long long key;
-
-	if (event->event_data->type == EVENT_TYPE_WAKEUP) {
-		edata.event_data = event->event_data;
-		event->search_val = 0;
-		event->val = 0;
-		key = trace_hash((unsigned long)event->event_data);
-	} else if (event->event_data->type == EVENT_TYPE_SCHED_SWITCH) {
-		edata.event_data = event->event_data;
-		event->search_val = event->val;
-		key = (unsigned long)event->event_data +
-			((unsigned long)event->val * 2);
-		key = trace_hash(key);
-	} else {
-		key = event->hash.key;
-	}
 
 	edata.event_data = event->event_data;
 	edata.search_val = event->search_val;
 	edata.val = event->val;
 
-	item = trace_hash_find(&group->event_hash, key, match_event, &edata);
-	if (!item) {
-		event->hash.key = key;
-		trace_hash_add(&group->event_hash, &event->hash);
+	exist = trace_ohash_find(hash, key, match_event, &edata);
+	if (!exist) {
+		event->key = key;
+		if (trace_ohash_add(hash, key, event) < 0) {
+			warning("Could not allocate event");
+			free_event_hash(event);
+		}
 		return;
 	}
 
-	exist = event_from_item(item);
 	exist->count += event->count;
 	exist->time_total += event->time_total;
 
-	if (exist->time_max < event->time_max) {
+	/* On a tie, keep the first one like adding the events in order does */
+	if (exist->time_max < event->time_max ||
+	    (exist->time_max == event->time_max &&
+	     exist->ts_max > event->ts_max)) {
 		exist->time_max = event->time_max;
 		exist->ts_max = event->ts_max;
 	}
-	if (exist->time_min > event->time_min) {
+	if (exist->time_min > event->time_min ||
+	    (exist->time_min == event->time_min &&
+	     exist->ts_min > event->ts_min)) {
 		exist->time_min = event->time_min;
 		exist->ts_min = event->ts_min;
 	}
@@ -2382,12 +2435,34 @@ static void merge_event_into_group(struct group_data *group,
 	free_event_hash(event);
 }
 
+static void merge_event_into_group(struct group_data *group,
+				   struct event_hash *event)
+{
+	unsigned long long key;
+
+	if (event->event_data->type == EVENT_TYPE_WAKEUP) {
+		event->search_val = 0;
+		event->val = 0;
+		key = trace_hash((unsigned long)event->event_data);
+	} else if (event->event_data->type == EVENT_TYPE_SCHED_SWITCH) {
+		event->search_val = event->val;
+		key = (unsigned long)event->event_data +
+			((unsigned long)event->val * 2);
+		key = trace_hash(key);
+	} else {
+		key = event->key;
+	}
+
+	merge_event(&group->event_hash, event, key);
+}
+
 static void add_group(struct handle_data *h, struct task_data *task)
 {
 	unsigned long long key;
 	struct trace_hash_item *item;
 	struct group_data *grp;
-	struct trace_hash_item **bucket;
+	struct trace_ohash_slot *slot;
+	struct event_hash *event_hash;
 	void *data = task->comm;
 
 	if (!task->comm)
@@ -2411,33 +2486,455 @@ static void add_group(struct handle_data *h, struct task_data *task)
 			die("strdup");
 		grp->hash.key = key;
 		trace_hash_add(&h->group_hash, &grp->hash);
-		trace_hash_init(&grp->event_hash, 32);
+		trace_ohash_init(&grp->event_hash, 32);
 	}
 	task->group = grp;
 
-	trace_hash_for_each_bucket(bucket, &task->event_hash) {
-		trace_hash_while_item(item, bucket) {
-			struct event_hash *event_hash;
+	trace_ohash_for_each_item(event_hash, slot, &task->event_hash)
+		merge_event_into_group(grp, event_hash);
+
+	/* The events all belong to the group now */
+	trace_ohash_free(&task->event_hash);
+}
+
+static void merge_tasks(struct handle_data *h)
+{
+	struct trace_ohash_slot *slot;
+	struct task_data *task;
+
+	if (!merge_like_comms)
+		return;
+
+	trace_ohash_for_each_item(task, slot, &h->task_hash)
+		add_group(h, task);
+}
+
+/* Do not bother with threads for slices smaller than this */
+#define PROFILE_SLICE_RECORDS	10000
+
+struct profile_slice {
+	struct handle_data	*h;
+	struct tracecmd_input	*handle;
+	unsigned long long	start;
+	unsigned long long	end;
+	pthread_t		thread;
+	int			started;
+};
+
+static struct handle_data *
+alloc_slice(struct handle_data *h, struct tracecmd_input *handle)
+{
+	struct handle_data *slice;
+	int i;
+
+	slice = malloc(sizeof(*slice));
+	if (!slice)
+		die("malloc");
+
+	/* The events and their fields are shared, the tasks are not */
+	*slice = *h;
+	slice->next = NULL;
+	slice->handle = handle;
+	slice->pevent = tracecmd_get_pevent(handle);
+	slice->cpu_data = NULL;
+	slice->last_task = NULL;
+	slice->slice = 1;
+	slice->defers = NULL;
+	slice->nr_defers = 0;
+	slice->defers_size = 0;
+	slice->slice_handles = NULL;
+	slice->nr_slice_handles = 0;
+	memset(&slice->group_hash, 0, sizeof(slice->group_hash));
+
+	trace_ohash_init(&slice->task_hash, 1024);
+
+	list_head_init(&slice->migrate_starts);
+	slice->cpu_starts = malloc(sizeof(*slice->cpu_starts) * slice->cpus);
+	if (!slice->cpu_starts)
+		die("malloc");
+	for (i = 0; i < slice->cpus; i++)
+		list_head_init(&slice->cpu_starts[i]);
 
-			event_hash = event_from_item(item);
-			trace_hash_del(&event_hash->hash);
-			merge_event_into_group(grp, event_hash);
+	slice->global_task = calloc(1, sizeof(struct task_data));
+	slice->global_percpu_tasks = calloc(slice->cpus,
+					    sizeof(struct task_data));
+	if (!slice->global_task || !slice->global_percpu_tasks)
+		die("malloc");
+
+	init_task(slice, slice->global_task);
+	slice->global_task->pid = -1;
+	for (i = 0; i < slice->cpus; i++) {
+		init_task(slice, &slice->global_percpu_tasks[i]);
+		slice->global_percpu_tasks[i].pid = -1 - i;
+	}
+
+	return slice;
+}
+
+/* Find the task of @h for the @task of @slice */
+static struct task_data *
+slice_task(struct handle_data *h, struct handle_data *slice,
+	   struct task_data *task)
+{
+	if (task == slice->global_task)
+		return h->global_task;
+
+	if (task >= slice->global_percpu_tasks &&
+	    task < slice->global_percpu_tasks + slice->cpus)
+		return &h->global_percpu_tasks[task - slice->global_percpu_tasks];
+
+	return find_task(h, task->pid);
+}
+
+static void replay_defers(struct handle_data *h, struct handle_data *slice)
+{
+	struct defer_data *defer;
+	struct task_data *task;
+	int i;
+
+	for (i = 0; i < slice->nr_defers; i++) {
+		defer = &slice->defers[i];
+
+		switch (defer->type) {
+		case DEFER_END:
+			task = slice_task(h, slice, defer->task);
+			if (!task)
+				break;
+			find_and_update_start(task, defer->event_data,
+					      defer->ts, defer->search_val);
+			break;
+
+		case DEFER_WAKEUP:
+			/* Same as handle_sched_wakeup_event() */
+			task = slice_task(h, slice, defer->task);
+			if (!task || !task->sleeping)
+				break;
+			task->sleeping = 0;
+			find_and_update_start(task, defer->event_data->start,
+					      defer->ts, defer->search_val);
+			__add_start(task, defer->event_data, defer->ts,
+				    defer->cpu, defer->search_val,
+				    defer->search_val);
+			break;
+
+		case DEFER_MISSED:
+			handle_missed_events(h, defer->cpu);
+			break;
 		}
 	}
 }
 
-static void merge_tasks(struct handle_data *h)
+static void merge_slice_task(struct handle_data *h, struct task_data *task,
+			     struct task_data *src)
 {
 	struct trace_hash_item **bucket;
 	struct trace_hash_item *item;
+	struct trace_hash_item *prev;
+	struct trace_ohash_slot *slot;
+	struct event_hash *event_hash;
+	struct start_data *start;
 
-	if (!merge_like_comms)
-		return;
+	trace_ohash_for_each_item(event_hash, slot, &src->event_hash)
+		merge_event(&task->event_hash, event_hash, event_hash->key);
+	trace_ohash_free(&src->event_hash);
+
+	/*
+	 * The starts still waiting for their ends are newer than the
+	 * ones of @task. Add them oldest first, to find the newest first.
+	 */
+	trace_hash_for_each_bucket(bucket, &src->start_hash) {
+		for (item = *bucket; item && item->next; item = item->next)
+			;
+		for (; item && item != (struct trace_hash_item *)bucket;
+		     item = prev) {
+			prev = item->prev;
+			start = start_from_item(item);
+			trace_hash_del(item);
+			list_del(&start->list);
+			start->task = task;
+			trace_hash_add(&task->start_hash, item);
+			add_start_list(h, start);
+		}
+	}
+
+	if (src->sleeping >= 0)
+		task->sleeping = src->sleeping;
+
+	/* Once a task has execed, only its new comm is good */
+	if (src->execed || !task->comm) {
+		free(task->comm);
+		task->comm = src->comm;
+		src->comm = NULL;
+	}
+
+	/* Stack traces do not carry over from one slice to the next */
+	task->proxy = NULL;
+	task->last_start = NULL;
+	task->last_event = NULL;
+}
+
+/* Merge the tasks of @slice, which follows the ones merged into @h */
+static void merge_slice(struct handle_data *h, struct handle_data *slice)
+{
+	struct trace_ohash_slot *slot;
+	struct task_data *task;
+	struct task_data *src;
+	int i;
+
+	replay_defers(h, slice);
+
+	trace_ohash_for_each_item(src, slot, &slice->task_hash) {
+		task = find_task(h, src->pid);
+		if (task)
+			merge_slice_task(h, task, src);
+		free_task(src);
+	}
+	trace_ohash_free(&slice->task_hash);
+
+	merge_slice_task(h, h->global_task, slice->global_task);
+	free_task(slice->global_task);
+
+	for (i = 0; i < slice->cpus; i++) {
+		merge_slice_task(h, &h->global_percpu_tasks[i],
+				 &slice->global_percpu_tasks[i]);
+		__free_task(&slice->global_percpu_tasks[i]);
+	}
+	free(slice->global_percpu_tasks);
+
+	free(slice->cpu_starts);
+	free(slice->defers);
+	free(slice);
+
+	h->last_task = NULL;
+}
+
+static void *profile_slice(void *data)
+{
+	struct profile_slice *slice = data;
+	struct tracecmd_input *handle = slice->handle;
+	struct pevent_record *record;
+	int cpu;
+
+	if (slice->start) {
+		/* This leaves the CPUs before the start, read up to it */
+		tracecmd_set_all_cpus_to_timestamp(handle, slice->start);
+		for (cpu = 0; cpu < tracecmd_cpus(handle); cpu++) {
+			while ((record = tracecmd_peek_data(handle, cpu)) &&
+			       record->ts < slice->start)
+				free_record(tracecmd_read_data(handle, cpu));
+		}
+	}
+
+	while ((record = tracecmd_read_next_data(handle, &cpu))) {
+		if (record->ts >= slice->end) {
+			free_record(record);
+			break;
+		}
+		profile_record(slice->h, record);
+		free_record(record);
+	}
+
+	return NULL;
+}
+
+static int compare_pages(const void *a, const void *b)
+{
+	struct tracecmd_page_index * const *A = a;
+	struct tracecmd_page_index * const *B = b;
+
+	if ((*A)->ts > (*B)->ts)
+		return 1;
+	if ((*A)->ts < (*B)->ts)
+		return -1;
+	return 0;
+}
+
+/*
+ * Split the file into up to @nr slices of time that have about the
+ * same number of records, and save the time each one ends at in @ends.
+ * Returns the number of slices.
+ */
+static int split_profile(struct tracecmd_input *handle,
+			 unsigned long long *ends, int nr)
+{
+	struct tracecmd_page_index **index;
+	struct tracecmd_page_index **pages = NULL;
+	unsigned long long total = 0;
+	unsigned long long sum = 0;
+	int cpus = tracecmd_cpus(handle);
+	int *nr_pages;
+	int slices = 1;
+	int cnt = 0;
+	int cpu;
+	int i;
+
+	index = calloc(cpus, sizeof(*index));
+	nr_pages = calloc(cpus, sizeof(*nr_pages));
+	if (!index || !nr_pages ||
+	    tracecmd_read_page_index(handle, index, nr_pages) < 0)
+		goto out;
+
+	for (cpu = 0; cpu < cpus; cpu++)
+		cnt += nr_pages[cpu];
+
+	pages = malloc(sizeof(*pages) * cnt);
+	if (!pages)
+		goto out;
+
+	cnt = 0;
+	for (cpu = 0; cpu < cpus; cpu++) {
+		for (i = 0; i < nr_pages[cpu]; i++) {
+			pages[cnt++] = &index[cpu][i];
+			total += index[cpu][i].nr_records;
+		}
+	}
+
+	qsort(pages, cnt, sizeof(*pages), compare_pages);
+
+	if (nr > total / PROFILE_SLICE_RECORDS)
+		nr = total / PROFILE_SLICE_RECORDS;
+
+	/* A slice ends at the page that starts after its share of records */
+	for (i = 0; i < cnt && slices < nr; i++) {
+		if (sum >= total * slices / nr &&
+		    (slices == 1 || pages[i]->ts > ends[slices - 2])) {
+			ends[slices - 1] = pages[i]->ts;
+			slices++;
+		}
+		sum += pages[i]->nr_records;
+	}
 
-	trace_hash_for_each_bucket(bucket, &h->task_hash) {
-		trace_hash_for_each_item(item, bucket)
-			add_group(h, task_from_item(item));
+ out:
+	if (index && nr_pages) {
+		for (cpu = 0; cpu < cpus; cpu++)
+			free(index[cpu]);
 	}
+	free(pages);
+	free(index);
+	free(nr_pages);
+
+	ends[slices - 1] = -1ULL;
+	return slices;
+}
+
+/**
+ * trace_profile_parallel - profile the records of a file on several threads
+ * @handle: The input handle of @file, set up by trace_init_profile()
+ * @file: The trace.dat file of @handle
+ * @threads: The number of threads to use, 0 for one per CPU
+ *
+ * Splits the file into slices of time with about the same number of
+ * records, and profiles each slice on its own thread into tasks of
+ * its own. This thread takes the first slice on @handle, the others
+ * open @file again. The slices are then merged in order, and what a
+ * slice could not do without the ones before it (the ends of events
+ * that started before it, the wakeups of tasks that went to sleep
+ * before it, and missed events) is done on the merged tasks.
+ *
+ * Use do_trace_profile() to output the result, as with the records
+ * passed to the show data function of @handle one by one.
+ */
+void trace_profile_parallel(struct tracecmd_input *handle, const char *file,
+			    int threads)
+{
+	struct tracecmd_input *slice_handle;
+	struct profile_slice *slices;
+	unsigned long long *ends;
+	struct handle_data *h;
+	int nr_slices = 1;
+	int i;
+
+	for (h = handles; h; h = h->next) {
+		if (h->handle == handle)
+			break;
+	}
+	if (!h)
+		die("Handle not found for trace profile");
+
+	if (threads <= 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads < 1)
+		threads = 1;
+
+	ends = malloc(sizeof(*ends) * threads);
+	slices = calloc(threads, sizeof(*slices));
+	if (!ends || !slices)
+		die("malloc");
+
+	ends[0] = -1ULL;
+	if (threads > 1)
+		nr_slices = split_profile(handle, ends, threads);
+
+	if (nr_slices > 1) {
+		h->slice_handles = calloc(nr_slices - 1,
+					  sizeof(*h->slice_handles));
+		if (!h->slice_handles)
+			die("malloc");
+	}
+
+	slices[0].h = h;
+	slices[0].handle = handle;
+	slices[0].end = ends[0];
+
+	/* Loading the plugins is not thread safe, open the files here */
+	for (i = 1; i < nr_slices; i++) {
+		slice_handle = tracecmd_alloc(file);
+		if (!slice_handle)
+			die("error opening %s", file);
+		tracecmd_set_flag(slice_handle, tracecmd_get_flags(handle) &
+				  TRACECMD_FL_IGNORE_DATE);
+		if (tracecmd_read_headers(slice_handle) < 0 ||
+		    tracecmd_init_data(slice_handle) < 0)
+			die("error reading %s", file);
+		h->slice_handles[h->nr_slice_handles++] = slice_handle;
+
+		slices[i].h = alloc_slice(h, slice_handle);
+		slices[i].handle = slice_handle;
+		slices[i].start = ends[i - 1];
+		slices[i].end = ends[i];
+	}
+
+	for (i = 1; i < nr_slices; i++) {
+		if (!pthread_create(&slices[i].thread, NULL,
+				    profile_slice, &slices[i]))
+			slices[i].started = 1;
+	}
+
+	/* The first slice is this thread's */
+	profile_slice(&slices[0]);
+
+	for (i = 1; i < nr_slices; i++) {
+		if (slices[i].started)
+			pthread_join(slices[i].thread, NULL);
+		else
+			profile_slice(&slices[i]);
+		merge_slice(h, slices[i].h);
+	}
+
+	free(slices);
+	free(ends);
+}
+
+static void close_slices(struct handle_data *h)
+{
+	int i;
+
+	if (!h->nr_slice_handles)
+		return;
+
+	/* The starts left in the global tasks may hold records of the slices */
+	free_task(h->global_task);
+	h->global_task = NULL;
+	for (i = 0; i < h->cpus; i++)
+		__free_task(&h->global_percpu_tasks[i]);
+	free(h->global_percpu_tasks);
+	h->global_percpu_tasks = NULL;
+
+	for (i = 0; i < h->nr_slice_handles; i++)
+		tracecmd_close(h->slice_handles[i]);
+	free(h->slice_handles);
+	h->slice_handles = NULL;
+	h->nr_slice_handles = 0;
 }
 
 int do_trace_profile(void)
@@ -2448,7 +2945,8 @@ int do_trace_profile(void)
 		if (merge_like_comms)
 			merge_tasks(h);
 		output_handle(h);
-		trace_hash_free(&h->task_hash);
+		trace_ohash_free(&h->task_hash);
+		close_slices(h);
 	}
 
 	return 0;
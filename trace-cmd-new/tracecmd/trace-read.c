@@ -17,6 +17,7 @@
 #include <pthread.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <time.h>
 #include <unistd.h>
 #include <ctype.h>
 #include <errno.h>
@@ -92,6 +93,7 @@ static int sched_id;
 static int stacktrace_id;
 
 static int profile;
+static int profile_threads = 1;
 
 static int buffer_breaks = 0;
 
@@ -1110,6 +1112,24 @@ enum output_type {
 	OUTPUT_UNAME_ONLY,
 };
 
+/*
+ * The profile threads read the file on their own, without the
+ * filters and the other files and instances the report loop merges.
+ */
+static int profile_in_parallel(struct list_head *handle_list)
+{
+	struct handle_list *handles;
+
+	if (profile_threads == 1 || multi_inputs || instances || filter_cpus)
+		return 0;
+
+	handles = container_of(handle_list->next, struct handle_list, list);
+	if (handles->event_filters || handles->event_filter_out)
+		return 0;
+
+	return 1;
+}
+
 static void read_data_info(struct list_head *handle_list, enum output_type otype,
 			   int global)
 {
@@ -1199,6 +1219,14 @@ static void read_data_info(struct list_head *handle_list, enum output_type otype
 	if (otype != OUTPUT_NORMAL)
 		return;
 
+	if (profile && profile_in_parallel(handle_list)) {
+		handles = container_of(handle_list->next, struct handle_list, list);
+		trace_profile_parallel(handles->handle, input_file,
+				       profile_threads);
+		do_trace_profile();
+		goto out;
+	}
+
 	do {
 		last_handle = NULL;
 		last_record = NULL;
@@ -1221,6 +1249,7 @@ static void read_data_info(struct list_head *handle_list, enum output_type otype
 	if (profile)
 		do_trace_profile();
 
+ out:
 	list_for_each_entry(handles, handle_list, list) {
 		free_filters(handles->event_filters);
 		free_filters(handles->event_filter_out);
@@ -1238,6 +1267,88 @@ struct tracecmd_input *read_trace_header(const char *file)
 	return tracecmd_alloc_fd(input_fd);
 }
 
+static unsigned long long get_time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void print_phase(const char *name, unsigned long long ns,
+			unsigned long long total)
+{
+	printf("  %-12s %12.3f ms %6.1f%%", name, ns / 1000000.0,
+	       total ? ns * 100.0 / total : 0.0);
+}
+
+static void print_self_profile(struct list_head *handle_list,
+			       unsigned long long total)
+{
+	struct tracecmd_input_stats istats;
+	struct tracecmd_input_stats input;
+	struct pevent_stats pstats;
+	struct pevent_stats events;
+	struct handle_list *handles;
+	unsigned long long other;
+	struct pevent *pevent;
+
+	memset(&input, 0, sizeof(input));
+	memset(&events, 0, sizeof(events));
+
+	list_for_each_entry(handles, handle_list, list) {
+		if (tracecmd_get_stats(handles->handle, &istats) < 0) {
+			printf("\ntrace-cmd was built with NO_SELF_STATS, "
+			       "no self profile available\n");
+			return;
+		}
+		input.pages_mapped += istats.pages_mapped;
+		input.pages_unmapped += istats.pages_unmapped;
+		input.pages_read += istats.pages_read;
+		input.bytes_read += istats.bytes_read;
+		input.records += istats.records;
+		input.open_ns += istats.open_ns;
+		input.page_ns += istats.page_ns;
+
+		/* Instances share the pevent of their parent */
+		if (tracecmd_is_buffer_instance(handles->handle))
+			continue;
+
+		pevent = tracecmd_get_pevent(handles->handle);
+		pevent_get_stats(pevent, &pstats);
+		events.formats_parsed += pstats.formats_parsed;
+		events.parse_ns += pstats.parse_ns;
+		events.filter_evals += pstats.filter_evals;
+		events.filter_ns += pstats.filter_ns;
+		events.format_calls += pstats.format_calls;
+		events.format_ns += pstats.format_ns;
+	}
+
+	other = total - input.open_ns - input.page_ns -
+		events.filter_ns - events.format_ns;
+	/* The clocks are read at different times, do not underflow */
+	if ((long long)other < 0)
+		other = 0;
+
+	printf("\nSelf profile:\n");
+	print_phase("open", input.open_ns, total);
+	printf("   %llu formats parsed in %.3f ms\n",
+	       events.formats_parsed, events.parse_ns / 1000000.0);
+	print_phase("load pages", input.page_ns, total);
+	printf("   %llu pages mapped, %llu unmapped, %llu read\n",
+	       input.pages_mapped, input.pages_unmapped, input.pages_read);
+	print_phase("filter", events.filter_ns, total);
+	printf("   %llu evaluations\n", events.filter_evals);
+	print_phase("format", events.format_ns, total);
+	printf("   %llu events\n", events.format_calls);
+	print_phase("other", other, total);
+	printf("\n");
+	print_phase("total", total, total);
+	printf("\n");
+	printf("  %llu records decoded, %llu bytes read\n",
+	       input.records, input.bytes_read);
+}
+
 static void sig_end(int sig)
 {
 	fprintf(stderr, "trace-cmd: Received SIGINT\n");
@@ -1382,6 +1493,8 @@ static void add_hook(const char *arg)
 }
 
 enum {
+	OPT_profile_threads	= 237,
+	OPT_profile_self	= 238,
 	OPT_tsdiff	= 239,
 	OPT_ts2secs	= 240,
 	OPT_tsoffset	= 241,
@@ -1434,6 +1547,8 @@ void trace_report (int argc, char **argv)
 	int neg = 0;
 	int ret = 0;
 	int check_event_parsing = 0;
+	int profile_self = 0;
+	unsigned long long start = 0;
 	int c;
 
 	list_head_init(&handle_list);
@@ -1464,6 +1579,9 @@ void trace_report (int argc, char **argv)
 			{"boundary", no_argument, NULL, OPT_boundary},
 			{"debug", no_argument, NULL, OPT_debug},
 			{"profile", no_argument, NULL, OPT_profile},
+			{"profile-self", no_argument, NULL, OPT_profile_self},
+			{"profile-threads", required_argument, NULL,
+				OPT_profile_threads},
 			{"uname", no_argument, NULL, OPT_uname},
 			{"by-comm", no_argument, NULL, OPT_bycomm},
 			{"ts-offset", required_argument, NULL, OPT_tsoffset},
@@ -1612,6 +1730,12 @@ void trace_report (int argc, char **argv)
 		case OPT_profile:
 			profile = 1;
 			break;
+		case OPT_profile_self:
+			profile_self = 1;
+			break;
+		case OPT_profile_threads:
+			profile_threads = atoi(optarg);
+			break;
 		case OPT_uname:
 			show_uname = 1;
 			break;
@@ -1656,6 +1780,9 @@ void trace_report (int argc, char **argv)
 	} else if (show_wakeup)
 		die("Wakeup tracing can only be done on a single input file");
 
+	if (profile_self)
+		start = get_time_ns();
+
 	list_for_each_entry(inputs, &input_files, list) {
 		handle = read_trace_header(inputs->file);
 		if (!handle)
@@ -1684,11 +1811,18 @@ void trace_report (int argc, char **argv)
 		else if (ts2secs)
 			tracecmd_set_ts2secs(handle, ts2secs);
 
+		/* The profile threads open the file again, without these */
+		if (inputs->tsoffset || inputs->ts2secs || ts2secs)
+			profile_threads = 1;
+
 		pevent = tracecmd_get_pevent(handle);
 
 		if (nanosec)
 			pevent->flags |= PEVENT_NSEC_OUTPUT;
 
+		if (profile_self)
+			pevent->flags |= PEVENT_PROFILE_SELF;
+
 		if (raw)
 			pevent->print_raw = 1;
 
@@ -1717,6 +1851,8 @@ void trace_report (int argc, char **argv)
 
 		ret = tracecmd_read_headers(handle);
 		if (check_event_parsing) {
+			/* The formats are only parsed when used */
+			pevent_parse_lazy_events(pevent);
 			if (ret || pevent->parsing_failures)
 				exit(EINVAL);
 			else
@@ -1766,6 +1902,9 @@ void trace_report (int argc, char **argv)
 		otype = OUTPUT_UNAME_ONLY;
 	read_data_info(&handle_list, otype, global);
 
+	if (profile_self)
+		print_self_profile(&handle_list, get_time_ns() - start);
+
 	list_for_each_entry(handles, &handle_list, list) {
 		tracecmd_close(handles->handle);
 	}
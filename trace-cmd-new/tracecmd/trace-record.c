@@ -79,9 +79,22 @@ static int sfd;
 
 /* Max size to let a per cpu file get */
 static int max_kb;
+static int max_segs;
+
+/* For --telemetry, the stats of all the recorders and of this one */
+static const char *telemetry_file;
+static int telemetry_secs = 1;
+static struct tracecmd_recorder_stats *telemetry_stats;
+static struct tracecmd_recorder_stats *recorder_stats;
 
 static bool use_tcp;
 
+/* Send the data of all CPUs over the one connection (protocol v3) */
+static bool use_mux;
+
+/* Compress the metadata sent to the listener */
+static bool use_compress;
+
 static int do_ptrace;
 
 static int filter_task;
@@ -503,6 +516,7 @@ static void delete_temp_file(struct buffer_instance *instance, int cpu)
 	else
 		snprintf(file, PATH_MAX, "%s.cpu%d", output_file, cpu);
 	unlink(file);
+	tracecmd_delete_segments(file);
 }
 
 static int kill_thread_instance(int start, struct buffer_instance *instance)
@@ -510,6 +524,11 @@ static int kill_thread_instance(int start, struct buffer_instance *instance)
 	int n = start;
 	int i;
 
+	if (instance->mux_pid > 0) {
+		kill(instance->mux_pid, SIGKILL);
+		instance->mux_pid = 0;
+	}
+
 	for (i = 0; i < instance->cpu_count; i++) {
 		if (pids[n].pid > 0) {
 			kill(pids[n].pid, SIGKILL);
@@ -529,6 +548,8 @@ static void kill_threads(void)
 	struct buffer_instance *instance;
 	int i = 0;
 
+	trace_telemetry_kill();
+
 	if (!recorder_threads || !pids)
 		return;
 
@@ -595,6 +616,7 @@ static void delete_thread_data(void)
 
 static void stop_threads(enum trace_type type)
 {
+	struct buffer_instance *instance;
 	struct timeval tv = { 0, 0 };
 	int ret;
 	int i;
@@ -622,6 +644,24 @@ static void stop_threads(enum trace_type type)
 			pids[i].pid = -1;
 		}
 	}
+
+	trace_telemetry_stop();
+
+	/* And what the recorders wrote as they finished */
+	if (type & TRACE_TYPE_STREAM) {
+		do {
+			ret = trace_stream_read(pids, recorder_threads, &tv);
+		} while (ret > 0);
+		trace_stream_finish();
+	}
+
+	/* The muxes are done once all the recorders of their instance are */
+	for_all_instances(instance) {
+		if (instance->mux_pid > 0) {
+			waitpid(instance->mux_pid, NULL, 0);
+			instance->mux_pid = 0;
+		}
+	}
 }
 
 static int create_recorder(struct buffer_instance *instance, int cpu,
@@ -2593,12 +2633,13 @@ create_recorder_instance(struct buffer_instance *instance, const char *file, int
 		return create_recorder_instance_pipe(instance, cpu, brass);
 
 	if (!instance->name)
-		return tracecmd_create_recorder_maxkb(file, cpu, recorder_flags, max_kb);
+		return tracecmd_create_recorder_segs(file, cpu, recorder_flags,
+						     max_kb, max_segs);
 
 	path = get_instance_dir(instance);
 
-	record = tracecmd_create_buffer_recorder_maxkb(file, cpu, recorder_flags,
-						       path, max_kb);
+	record = tracecmd_create_buffer_recorder_segs(file, cpu, recorder_flags,
+						      path, max_kb, max_segs);
 	tracecmd_put_tracing_file(path);
 
 	return record;
@@ -2654,6 +2695,9 @@ static int create_recorder(struct buffer_instance *instance, int cpu,
 	if (!recorder)
 		die ("can't create recorder");
 
+	if (recorder_stats)
+		tracecmd_recorder_set_stats(recorder, recorder_stats);
+
 	if (type == TRACE_TYPE_EXTRACT) {
 		ret = tracecmd_flush_recording(recorder);
 		tracecmd_free_recorder(recorder);
@@ -2762,6 +2806,25 @@ static void check_protocol_version(struct tracecmd_msg_handle *msg_handle)
 
 	check_first_msg_from_server(msg_handle);
 
+	if (msg_handle->version == V3_PROTOCOL) {
+		/*
+		 * A server that does not know v3 replies with the highest
+		 * protocol that it has, and reads the version again.
+		 */
+		write(fd, V3_CPU, sizeof(V3_CPU));
+
+		n = read(fd, buf, BUFSIZ - 1);
+		if (n <= 0)
+			die("Cannot read the protocol of the server");
+		buf[n] = 0;
+		if (memcmp(buf, "V2", n) == 0) {
+			warning("The listener can not take all CPUs over one connection,\n"
+				"  using one connection per CPU");
+			msg_handle->version = V2_PROTOCOL;
+		} else if (memcmp(buf, "V3", n) != 0)
+			die("Cannot handle the protocol %s", buf);
+	}
+
 	/*
 	 * Write the protocol version, the magic number, and the dummy
 	 * option(0) (in ASCII). The client understands whether the client
@@ -2774,28 +2837,31 @@ static void check_protocol_version(struct tracecmd_msg_handle *msg_handle)
 	 * So, we add the dummy number (the magic number and 0 option) to the
 	 * first client message.
 	 */
-	write(fd, V2_CPU, sizeof(V2_CPU));
+	if (msg_handle->version == V2_PROTOCOL) {
+		write(fd, V2_CPU, sizeof(V2_CPU));
 
-	/* read a reply message */
-	n = read(fd, buf, BUFSIZ);
+		/* read a reply message */
+		n = read(fd, buf, BUFSIZ);
 
-	if (n < 0 || !buf[0]) {
-		/* the server uses the v1 protocol, so we'll use it */
-		msg_handle->version = V1_PROTOCOL;
-		plog("Use the v1 protocol\n");
-	} else {
+		if (n < 0 || !buf[0]) {
+			/* the server uses the v1 protocol, so we'll use it */
+			msg_handle->version = V1_PROTOCOL;
+			plog("Use the v1 protocol\n");
+			return;
+		}
 		if (memcmp(buf, "V2", n) != 0)
 			die("Cannot handle the protocol %s", buf);
-		/* OK, let's use v2 protocol */
-		write(fd, V2_MAGIC, sizeof(V2_MAGIC));
+	}
 
-		n = read(fd, buf, BUFSIZ - 1);
-		if (n != 2 || memcmp(buf, "OK", 2) != 0) {
-			if (n < 0)
-				n  = 0;
-			buf[n] = 0;
-			die("Cannot handle the protocol %s", buf);
-		}
+	/* OK, let's use v2 protocol (v3 is set up the same way) */
+	write(fd, V2_MAGIC, sizeof(V2_MAGIC));
+
+	n = read(fd, buf, BUFSIZ - 1);
+	if (n != 2 || memcmp(buf, "OK", 2) != 0) {
+		if (n < 0)
+			n  = 0;
+		buf[n] = 0;
+		die("Cannot handle the protocol %s", buf);
 	}
 }
 
@@ -2856,13 +2922,15 @@ again:
 			die("Failed to allocate message handle");
 
 		msg_handle->cpu_count = local_cpu_count;
-		msg_handle->version = V2_PROTOCOL;
+		msg_handle->version = use_mux ? V3_PROTOCOL : V2_PROTOCOL;
 	}
 
 	if (use_tcp)
 		msg_handle->flags |= TRACECMD_MSG_FL_USE_TCP;
+	if (use_compress)
+		msg_handle->flags |= TRACECMD_MSG_FL_COMPRESS;
 
-	if (msg_handle->version == V2_PROTOCOL) {
+	if (msg_handle->version >= V2_PROTOCOL) {
 		check_protocol_version(msg_handle);
 		if (msg_handle->version == V1_PROTOCOL) {
 			/* reconnect to the server for using the v1 protocol */
@@ -2887,7 +2955,7 @@ setup_connection(struct buffer_instance *instance)
 	msg_handle = setup_network();
 
 	/* Now create the handle through this socket */
-	if (msg_handle->version == V2_PROTOCOL) {
+	if (msg_handle->version >= V2_PROTOCOL) {
 		network_handle = tracecmd_create_init_fd_msg(msg_handle, listed_events);
 		tracecmd_msg_finish_sending_metadata(msg_handle);
 	} else
@@ -2902,12 +2970,56 @@ setup_connection(struct buffer_instance *instance)
 
 static void finish_network(struct tracecmd_msg_handle *msg_handle)
 {
-	if (msg_handle->version == V2_PROTOCOL)
+	if (msg_handle->version >= V2_PROTOCOL)
 		tracecmd_msg_send_close_msg(msg_handle);
 	tracecmd_msg_handle_close(msg_handle);
 	free(host);
 }
 
+/* Pages that the pipe of each CPU holds while the mux sends the others */
+#define MUX_PIPE_PAGES		256
+
+/*
+ * With the v3 protocol, the recorders of the instance write into pipes,
+ * and the mux process sends what comes out of them over the connection.
+ */
+static int start_mux(struct buffer_instance *instance,
+		     struct pid_record_data *cpu_pids)
+{
+	int *fds;
+	int pid;
+	int i;
+
+	fflush(stdout);
+	pid = fork();
+	if (pid < 0)
+		die("fork");
+
+	if (pid) {
+		for (i = 0; i < instance->cpu_count; i++) {
+			close(cpu_pids[i].brass[0]);
+			cpu_pids[i].brass[0] = -1;
+		}
+		return pid;
+	}
+
+	fds = malloc(sizeof(*fds) * instance->cpu_count);
+	if (!fds)
+		die("Failed to allocate the pipes of %d cpus",
+		    instance->cpu_count);
+
+	for (i = 0; i < instance->cpu_count; i++) {
+		fds[i] = cpu_pids[i].brass[0];
+		fcntl(fds[i], F_SETPIPE_SZ, page_size * MUX_PIPE_PAGES);
+	}
+
+	if (tracecmd_msg_send_data(instance->msg_handle, fds,
+				   instance->cpu_count) < 0)
+		die("sending the data to %s", host);
+
+	exit(0);
+}
+
 void start_threads(enum trace_type type, int global)
 {
 	struct buffer_instance *instance;
@@ -2926,13 +3038,21 @@ void start_threads(enum trace_type type, int global)
 
 	memset(pids, 0, sizeof(*pids) * total_cpu_count * (buffers + 1));
 
+	if (telemetry_file)
+		telemetry_stats = trace_telemetry_init(telemetry_file,
+						       telemetry_secs,
+						       total_cpu_count);
+
 	for_all_instances(instance) {
+		bool mux = false;
+		int start = i;
 		int x, pid;
 
 		if (host) {
 			instance->msg_handle = setup_connection(instance);
 			if (!instance->msg_handle)
 				die("Failed to make connection");
+			mux = instance->msg_handle->version == V3_PROTOCOL;
 		}
 
 		for (x = 0; x < instance->cpu_count; x++) {
@@ -2948,10 +3068,20 @@ void start_threads(enum trace_type type, int global)
 								   global);
 				if (!pids[i].stream)
 					die("Creating stream for %d", i);
-			} else
+			} else if (mux) {
+				/* The recorders feed the mux */
+				brass = pids[i].brass;
+				ret = pipe(brass);
+				if (ret < 0)
+					die("pipe");
+			} else {
 				pids[i].brass[0] = -1;
+				brass = NULL;
+			}
 			pids[i].cpu = x;
 			pids[i].instance = instance;
+			if (telemetry_stats)
+				recorder_stats = &telemetry_stats[i];
 			/* Make sure all output is flushed before forking */
 			fflush(stdout);
 			pid = pids[i++].pid = create_recorder(instance, x, type, brass);
@@ -2960,7 +3090,24 @@ void start_threads(enum trace_type type, int global)
 			if (pid > 0)
 				add_filter_pid(pid, 1);
 		}
+
+		if (mux) {
+			instance->mux_pid = start_mux(instance, &pids[start]);
+			add_filter_pid(instance->mux_pid, 1);
+		}
 	}
+	recorder_stats = NULL;
+
+	/*
+	 * Before recorder_threads is set, so that a die() in the reporter
+	 * does not kill the recorders.
+	 */
+	if (telemetry_stats) {
+		int pid = trace_telemetry_start(pids, i);
+
+		add_filter_pid(pid, 1);
+	}
+
 	recorder_threads = i;
 }
 
@@ -4286,6 +4433,13 @@ void update_first_instance(struct buffer_instance *instance, int topt)
 
 enum {
 
+	OPT_telemetry		= 239,
+	OPT_io_uring		= 240,
+	OPT_segments		= 241,
+	OPT_stats_interval	= 242,
+	OPT_reorder_window	= 243,
+	OPT_compress		= 244,
+	OPT_mux			= 245,
 	OPT_quiet		= 246,
 	OPT_debug		= 247,
 	OPT_max_graph_depth	= 248,
@@ -4485,6 +4639,8 @@ struct common_record_context {
 	int topt;
 	int do_child;
 	int run_command;
+	unsigned long long reorder_window;
+	int stats_interval;
 };
 
 static void init_common_record_context(struct common_record_context *ctx,
@@ -4538,6 +4694,13 @@ static void parse_record_options(int argc,
 			{"quiet", no_argument, NULL, OPT_quiet},
 			{"help", no_argument, NULL, '?'},
 			{"module", required_argument, NULL, OPT_module},
+			{"mux", no_argument, NULL, OPT_mux},
+			{"compress", no_argument, NULL, OPT_compress},
+			{"reorder-window", required_argument, NULL, OPT_reorder_window},
+			{"stats-interval", required_argument, NULL, OPT_stats_interval},
+			{"segments", required_argument, NULL, OPT_segments},
+			{"io-uring", no_argument, NULL, OPT_io_uring},
+			{"telemetry", required_argument, NULL, OPT_telemetry},
 			{NULL, 0, NULL, 0}
 		};
 
@@ -4822,6 +4985,39 @@ static void parse_record_options(int argc,
 		case 'q':
 			quiet = 1;
 			break;
+		case OPT_mux:
+			use_mux = true;
+			break;
+		case OPT_compress:
+			use_compress = true;
+			break;
+		case OPT_reorder_window:
+			if (!IS_STREAM(ctx))
+				die("--reorder-window is only for stream");
+			ctx->reorder_window = strtoull(optarg, NULL, 0);
+			break;
+		case OPT_stats_interval:
+			if (!IS_STREAM(ctx) && !IS_RECORD(ctx))
+				die("--stats-interval is only for stream and record");
+			ctx->stats_interval = atoi(optarg);
+			if (ctx->stats_interval < 0)
+				die("bad --stats-interval %s", optarg);
+			break;
+		case OPT_segments:
+			if (!IS_RECORD(ctx))
+				die("--segments is only for record");
+			max_segs = atoi(optarg);
+			if (max_segs < 2)
+				die("--segments needs at least 2 segments");
+			break;
+		case OPT_io_uring:
+			recorder_flags |= TRACECMD_RECORD_URING;
+			break;
+		case OPT_telemetry:
+			if (!IS_RECORD(ctx))
+				die("--telemetry is only for record");
+			telemetry_file = optarg;
+			break;
 		default:
 			usage(argv);
 		}
@@ -4831,6 +5027,18 @@ static void parse_record_options(int argc,
 		add_func(&ctx->instance->filter_funcs,
 			 ctx->instance->filter_mod, "*");
 
+	if (max_segs && !max_kb)
+		die("--segments can only be used with -m");
+
+	if ((recorder_flags & TRACECMD_RECORD_URING) && max_kb)
+		die("--io-uring can not be used with -m");
+
+	if (IS_RECORD(ctx) && ctx->stats_interval) {
+		if (!telemetry_file)
+			die("--stats-interval can only be used with --telemetry for record");
+		telemetry_secs = ctx->stats_interval;
+	}
+
 	if (do_ptrace && !filter_task && (filter_pid < 0))
 		die(" -c can only be used with -F (or -P with event-fork support)");
 	if (ctx->do_child && !filter_task &&! filter_pid)
@@ -5098,6 +5306,7 @@ void trace_stream(int argc, char **argv)
 	struct common_record_context ctx;
 
 	parse_record_options(argc, argv, CMD_stream, &ctx);
+	trace_stream_config(ctx.reorder_window, ctx.stats_interval);
 	record_trace(argc, argv, &ctx);
 	exit(0);
 }
@@ -27,6 +27,14 @@ static unsigned int page_size;
 static const char *default_input_file = "trace.dat";
 static const char *input_file;
 
+/*
+ * The pages of the input, to copy the ones that fall entirely into
+ * an output as they are. Not set when they can not be copied.
+ */
+static struct tracecmd_page_index **page_index;
+static int *nr_index_pages;
+static int input_fd = -1;
+
 enum split_types {
 	SPLIT_NONE,
 	/* The order of these must be reverse of the case statement in the options */
@@ -50,6 +58,20 @@ struct cpu_data {
 	char				*file;
 };
 
+struct split_thread {
+	struct tracecmd_input		*handle;
+	struct cpu_data			*cpu_data;
+	unsigned long long		start;
+	unsigned long long		first;
+	unsigned long long		end;
+	enum split_types		type;
+	pthread_t			thread;
+	int				started;
+	int				count;
+	int				nr_threads;
+	int				idx;
+};
+
 static int create_type_len(struct pevent *pevent, int time, int len)
 {
 	static int bigendian = -1;
@@ -173,21 +195,146 @@ static void set_cpu_time(struct tracecmd_input *handle,
 	return;
 }
 
+static void copy_pages(struct cpu_data *cpu_data,
+		       unsigned long long offset, unsigned long long size)
+{
+	long long r = -1;
+	void *buf;
+
+	while (size) {
+		r = tracecmd_copy_file_range(input_fd, &offset, cpu_data->fd,
+					     size);
+		if (r <= 0)
+			break;
+		size -= r;
+	}
+
+	if (!size)
+		return;
+
+	if (!r)
+		die("Unexpected end of %s", input_file);
+
+	/* The kernel could not copy it, read and write it instead */
+	buf = malloc(page_size);
+	if (!buf)
+		die("Failed to allocate page");
+
+	while (size) {
+		r = pread(input_fd, buf, size < page_size ? size : page_size,
+			  offset);
+		if (r <= 0)
+			die("Failed to read %s", input_file);
+		if (write(cpu_data->fd, buf, r) != r)
+			die("Failed to write %s", cpu_data->file);
+		offset += r;
+		size -= r;
+	}
+
+	free(buf);
+}
+
+/*
+ * The number of pages starting at the one of @record that can be
+ * copied as they are: all their records are up to @limit, and there
+ * are less than @nr_records of them (if not zero). The records of the
+ * page after the last one are then still to be written, the last
+ * record written is never on a copied page.
+ */
+static int copy_page_count(struct tracecmd_input *handle,
+			   struct pevent_record *record,
+			   unsigned long long limit, int nr_records,
+			   int *copied_records)
+{
+	struct tracecmd_page_index *index;
+	int records = 0;
+	int first;
+	int nr;
+	int i;
+
+	if (!page_index || !tracecmd_record_at_buffer_start(handle, record))
+		return 0;
+
+	index = page_index[record->cpu];
+	nr = nr_index_pages[record->cpu];
+	if (!nr)
+		return 0;
+
+	first = (record->offset - index[0].offset) / page_size;
+
+	/*
+	 * The records of a page are older than the first one of the next,
+	 * a page can be copied if the next one starts before the limit.
+	 */
+	for (i = first; i + 1 < nr; i++) {
+		if (!index[i + 1].nr_records || index[i + 1].ts > limit)
+			break;
+		if (nr_records && records + index[i].nr_records >= nr_records)
+			break;
+		records += index[i].nr_records;
+	}
+
+	*copied_records = records;
+	return i - first;
+}
+
+static struct pevent_record *
+copy_record_pages(struct tracecmd_input *handle, struct pevent_record *record,
+		  struct cpu_data *cpu_data, int pages, int percpu, int *cpu)
+{
+	struct tracecmd_page_index *index = page_index[record->cpu];
+	struct pevent *pevent = tracecmd_get_pevent(handle);
+	unsigned long long offset;
+	int first;
+
+	first = (record->offset - index[0].offset) / page_size;
+
+	/* Finish the page that was being written first */
+	if (cpu_data->page) {
+		write_page(pevent, cpu_data, tracecmd_long_size(handle));
+		free(cpu_data->page);
+		cpu_data->page = NULL;
+	}
+	cpu_data->index = page_size + 1;
+
+	offset = index[first].offset;
+	copy_pages(cpu_data, offset, (unsigned long long)pages * page_size);
+
+	free_record(record);
+
+	/* Continue at the first record of the page after the copied ones */
+	if (tracecmd_set_cursor(handle, cpu_data->cpu,
+				index[first + pages].offset) < 0)
+		die("Failed to move to offset %llu",
+		    index[first + pages].offset);
+
+	return read_record(handle, percpu, cpu);
+}
+
+/*
+ * Without a @start, the split is timed from @first, or from the first
+ * record read when that is zero too.
+ */
 static int parse_cpu(struct tracecmd_input *handle,
 		     struct cpu_data *cpu_data,
 		     unsigned long long start,
+		     unsigned long long first,
 		     unsigned long long end,
 		     int count_limit, int percpu, int cpu,
 		     enum split_types type)
 {
 	struct pevent_record *record;
 	struct pevent *pevent;
+	unsigned long long limit;
 	void *ptr;
 	int page_size;
 	int long_size = 0;
 	int cpus;
 	int count = 0;
 	int pages = 0;
+	int copy = 0;
+	int copied;
+	int nr;
 
 	cpus = tracecmd_cpus(handle);
 
@@ -219,10 +366,53 @@ static int parse_cpu(struct tracecmd_input *handle,
 			free_record(record);
 			record = read_record(handle, percpu, &cpu);
 		}
-	} else if (record)
+	} else if (first)
+		start = first;
+	else if (record)
 		start = record->ts;
 
+	/* The time of the last record that can go into this file */
+	limit = end ? end : -1ULL;
+	switch (type) {
+	case SPLIT_NONE:
+		copy = 1;
+		break;
+	case SPLIT_SECONDS:
+		limit = min(limit, start + (unsigned long long)count_limit * 1000000000ULL);
+		copy = 1;
+		break;
+	case SPLIT_MSECS:
+		limit = min(limit, start + (unsigned long long)count_limit * 1000000ULL);
+		copy = 1;
+		break;
+	case SPLIT_USECS:
+		limit = min(limit, start + (unsigned long long)count_limit * 1000ULL);
+		copy = 1;
+		break;
+	case SPLIT_EVENTS:
+		/* The events are counted over all CPUs in time order otherwise */
+		copy = percpu;
+		break;
+	default:
+		break;
+	}
+
 	while (record && (!end || record->ts <= end)) {
+		/* Copy the pages that fall entirely into this file as they are */
+		if (copy) {
+			nr = copy_page_count(handle, record, limit,
+					     type == SPLIT_EVENTS ?
+					     count_limit - count : 0,
+					     &copied);
+			if (nr) {
+				count += copied;
+				record = copy_record_pages(handle, record,
+							   &cpu_data[cpu], nr,
+							   percpu, &cpu);
+				continue;
+			}
+		}
+
 		if (cpu_data[cpu].index + record->record_size > page_size) {
 
 			if (type == SPLIT_PAGES && ++pages > count_limit)
@@ -324,12 +514,96 @@ static int parse_cpu(struct tracecmd_input *handle,
 	return 0;
 }
 
-static double parse_file(struct tracecmd_input *handle,
+static void *split_thread(void *data)
+{
+	struct split_thread *split = data;
+	int cpus = tracecmd_cpus(split->handle);
+	int cpu;
+
+	/* A CPU is always read by the same handle, that keeps its place */
+	for (cpu = split->idx; cpu < cpus; cpu += split->nr_threads)
+		parse_cpu(split->handle, split->cpu_data, split->start,
+			  split->first, split->end, split->count, 1, cpu, split->type);
+
+	return NULL;
+}
+
+/*
+ * Write the files of the CPUs at the same time, each of @nr_threads
+ * threads reads its CPUs with its own handle. When the CPUs are not
+ * split each on its own, they are split at the same times, from the
+ * first record of all CPUs when there is no start.
+ */
+static void parse_cpus_threads(struct tracecmd_input **handles,
+			       int nr_threads, struct cpu_data *cpu_data,
+			       unsigned long long start,
+			       unsigned long long end, int count, int percpu,
+			       enum split_types type)
+{
+	struct pevent_record *record;
+	struct split_thread *threads;
+	unsigned long long first = 0;
+	int cpus = tracecmd_cpus(handles[0]);
+	int cpu;
+	int i;
+
+	for (cpu = 0; cpu < cpus; cpu++) {
+		struct tracecmd_input *handle = handles[cpu % nr_threads];
+
+		if (start) {
+			tracecmd_set_cpu_to_timestamp(handle, cpu, start);
+			continue;
+		}
+		if (percpu)
+			continue;
+		record = tracecmd_peek_data(handle, cpu);
+		if (record && (!first || record->ts < first))
+			first = record->ts;
+	}
+
+	threads = calloc(nr_threads, sizeof(*threads));
+	if (!threads)
+		die("Failed to allocate threads");
+
+	for (i = 0; i < nr_threads; i++) {
+		threads[i].handle = handles[i];
+		threads[i].cpu_data = cpu_data;
+		threads[i].start = start;
+		threads[i].first = first;
+		threads[i].end = end;
+		threads[i].count = count;
+		threads[i].type = type;
+		threads[i].idx = i;
+		threads[i].nr_threads = nr_threads;
+	}
+
+	for (i = 1; i < nr_threads; i++) {
+		if (pthread_create(&threads[i].thread, NULL,
+				   split_thread, &threads[i]))
+			warning("failed to create thread, splitting inline");
+		else
+			threads[i].started = 1;
+	}
+
+	split_thread(&threads[0]);
+
+	for (i = 1; i < nr_threads; i++) {
+		if (threads[i].started)
+			pthread_join(threads[i].thread, NULL);
+		else
+			split_thread(&threads[i]);
+	}
+
+	free(threads);
+}
+
+static double parse_file(struct tracecmd_input **handles, int nr_threads,
 			 const char *output_file,
 			 unsigned long long start,
 			 unsigned long long end, int percpu, int only_cpu,
 			 int count, enum split_types type)
 {
+	struct tracecmd_input *handle = handles[0];
 	unsigned long long current;
 	struct tracecmd_output *ohandle;
 	struct cpu_data *cpu_data;
@@ -339,6 +613,7 @@ static double parse_file(struct tracecmd_input *handle,
 	char *base;
 	char *file;
 	char *dir;
+	int threaded = 0;
 	int cpus;
 	int cpu;
 	int fd;
@@ -370,21 +645,28 @@ static double parse_file(struct tracecmd_input *handle,
 	}
 
 	if (only_cpu >= 0) {
-		parse_cpu(handle, cpu_data, start, end, count,
+		parse_cpu(handle, cpu_data, start, 0, end, count,
 			  1, only_cpu, type);
+	} else if (nr_threads > 1 && (percpu || type != SPLIT_EVENTS)) {
+		/* Events not split per CPU are counted in the order of all CPUs */
+		parse_cpus_threads(handles, nr_threads, cpu_data, start,
+				   end, count, percpu, type);
+		threaded = 1;
 	} else if (percpu) {
 		for (cpu = 0; cpu < cpus; cpu++)
-			parse_cpu(handle, cpu_data, start,
+			parse_cpu(handle, cpu_data, start, 0,
 				  end, count, percpu, cpu, type);
 	} else
-		parse_cpu(handle, cpu_data, start,
+		parse_cpu(handle, cpu_data, start, 0,
 			  end, count, percpu, -1, type);
 
 	cpu_list = malloc(sizeof(*cpu_list) * cpus);
 	if (!cpu_list)
 		die("Failed to allocate cpu_list for %d cpus", cpus);
-	for (cpu = 0; cpu < cpus; cpu ++)
+	for (cpu = 0; cpu < cpus; cpu ++) {
 		cpu_list[cpu] = cpu_data[cpu].file;
+		close(cpu_data[cpu].fd);
+	}
 
 	tracecmd_append_cpu_data(ohandle, cpus, cpu_list);
 
@@ -392,6 +674,8 @@ static double parse_file(struct tracecmd_input *handle,
 	for (cpu = 0; cpu < cpus; cpu++) {
 		/* Set the tracecmd cursor to the next set of records */
 		if (cpu_data[cpu].offset) {
+			if (threaded)
+				handle = handles[cpu % nr_threads];
 			record = tracecmd_read_at(handle, cpu_data[cpu].offset, NULL);
 			if (record && (!current || record->ts > current))
 				current = record->ts + 1;
@@ -408,8 +692,52 @@ static double parse_file(struct tracecmd_input *handle,
 	return current;
 }
 
+/*
+ * Index the pages of the input, for parse_cpu() to copy the ones that
+ * go entirely into one output. The time stamps in the pages must be
+ * the ones that are split on.
+ */
+static void load_page_index(struct tracecmd_input *handle)
+{
+	int cpus = tracecmd_cpus(handle);
+
+	if (tracecmd_ts_adjusted(handle))
+		return;
+
+	input_fd = open(input_file, O_RDONLY | O_LARGEFILE);
+	if (input_fd < 0)
+		return;
+
+	page_index = calloc(cpus, sizeof(*page_index));
+	nr_index_pages = calloc(cpus, sizeof(*nr_index_pages));
+	if (!page_index || !nr_index_pages ||
+	    tracecmd_read_page_index(handle, page_index, nr_index_pages) < 0) {
+		free(page_index);
+		free(nr_index_pages);
+		page_index = NULL;
+		nr_index_pages = NULL;
+		close(input_fd);
+		input_fd = -1;
+	}
+}
+
+static void free_page_index(struct tracecmd_input *handle)
+{
+	int cpu;
+
+	if (!page_index)
+		return;
+
+	for (cpu = 0; cpu < tracecmd_cpus(handle); cpu++)
+		free(page_index[cpu]);
+	free(page_index);
+	free(nr_index_pages);
+	close(input_fd);
+}
+
 void trace_split (int argc, char **argv)
 {
+	struct tracecmd_input **handles;
 	struct tracecmd_input *handle;
 	unsigned long long start_ns = 0, end_ns = 0;
 	unsigned long long current;
@@ -422,14 +750,16 @@ void trace_split (int argc, char **argv)
 	int count;
 	int repeat = 0;
 	int percpu = 0;
+	int nr_threads = 1;
 	int cpu = -1;
 	int ac;
 	int c;
+	int i;
 
 	if (strcmp(argv[1], "split") != 0)
 		usage(argv);
 
-	while ((c = getopt(argc-1, argv+1, "+ho:i:s:m:u:e:p:rcC:")) >= 0) {
+	while ((c = getopt(argc-1, argv+1, "+ho:i:s:m:u:e:p:rcC:j:")) >= 0) {
 		switch (c) {
 		case 'h':
 			usage(argv);
@@ -472,6 +802,11 @@ void trace_split (int argc, char **argv)
 		case 'i':
 			input_file = optarg;
 			break;
+		case 'j':
+			nr_threads = atoi(optarg);
+			if (nr_threads <= 0)
+				nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+			break;
 		default:
 			usage(argv);
 		}
@@ -517,6 +852,25 @@ void trace_split (int argc, char **argv)
 
 	page_size = tracecmd_page_size(handle);
 
+	load_page_index(handle);
+
+	if (nr_threads > tracecmd_cpus(handle))
+		nr_threads = tracecmd_cpus(handle);
+	if (nr_threads < 1)
+		nr_threads = 1;
+
+	handles = malloc(sizeof(*handles) * nr_threads);
+	if (!handles)
+		die("Failed to allocate handles");
+
+	/* Loading the plugins is not thread safe, open them all here */
+	handles[0] = handle;
+	for (i = 1; i < nr_threads; i++) {
+		handles[i] = tracecmd_open(input_file);
+		if (!handles[i])
+			die("error reading %s", input_file);
+	}
+
 	if (!output)
 		output = strdup(input_file);
 
@@ -537,8 +891,8 @@ void trace_split (int argc, char **argv)
 		else
 			strcpy(output_file, output);
 			
-		current = parse_file(handle, output_file, start_ns, end_ns,
-				     percpu, cpu, count, type);
+		current = parse_file(handles, nr_threads, output_file,
+				     start_ns, end_ns, percpu, cpu, count, type);
 		if (!repeat)
 			break;
 		start_ns = 0;
@@ -547,6 +901,12 @@ void trace_split (int argc, char **argv)
 	free(output);
 	free(output_file);
 
+	free_page_index(handle);
+
+	for (i = 1; i < nr_threads; i++)
+		tracecmd_close(handles[i]);
+	free(handles);
+
 	tracecmd_close(handle);
 
 	return;
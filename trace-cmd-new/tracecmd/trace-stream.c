@@ -4,10 +4,15 @@
  *
  */
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <time.h>
 
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
 #include <sys/time.h>
 #include <sys/types.h>
 
@@ -85,56 +90,418 @@ trace_stream_init(struct buffer_instance *instance, int cpu, int fd, int cpus,
 	return NULL;
 }
 
-int trace_stream_read(struct pid_record_data *pids, int nr_pids, struct timeval *tv)
+/*
+ * The records of each CPU are decoded in batches into a queue of the
+ * CPU, and the CPUs with records are kept in a heap by the timestamp
+ * of their first record. A record is shown once every CPU that is still
+ * open has records queued (nothing can come before it then), or once it
+ * is older than the newest record decoded by the reorder window. The
+ * window is how far apart the CPUs may be, a record that comes later
+ * than that is shown out of order and counted as late.
+ */
+
+/* Records to decode from a CPU before going to the others */
+#define STREAM_BATCH		256
+
+/* Longest to wait on the pipes while records are held back */
+#define STREAM_HOLD_MSEC	100
+
+#define STREAM_MAX_EVENTS	64
+#define STREAM_BUF_SIZE		(64 * 1024)
+
+struct stream_cpu {
+	struct pid_record_data	*pid;
+	struct pevent_record	**queue;
+	int			size;
+	int			head;
+	int			tail;
+	int			heap_idx;
+	bool			more;	/* stopped at STREAM_BATCH */
+};
+
+static struct stream {
+	struct stream_cpu	*cpus;
+	struct stream_cpu	**heap;
+	int			nr_cpus;
+	int			nr_heap;
+	int			nr_open;
+	int			nr_empty;	/* open CPUs with nothing queued */
+	int			nr_more;
+	int			queued;
+	int			efd;
+	unsigned long long	newest;		/* newest timestamp decoded */
+	unsigned long long	last;		/* of the last record shown */
+	unsigned long long	events;
+	unsigned long long	dropped;
+	unsigned long long	unknown_drops;	/* pages that lost some */
+	unsigned long long	late;
+	unsigned long long	max_lag;
+	unsigned long long	stats_events;
+	time_t			stats_time;
+	time_t			start_time;
+} stream;
+
+static unsigned long long reorder_window;
+static int stats_interval;
+
+/**
+ * trace_stream_config - set up how stream shows the records
+ * @window_usecs: how far apart in time the CPUs may be, in microseconds
+ * @stats_secs: how often to write the lag and drops to stderr (0 never)
+ */
+void trace_stream_config(unsigned long long window_usecs, int stats_secs)
+{
+	reorder_window = window_usecs * 1000;
+	stats_interval = stats_secs;
+}
+
+/* Ties go to the lower CPU, as they do in report */
+static bool cpu_before(struct stream_cpu *a, struct stream_cpu *b)
+{
+	unsigned long long ts_a = a->queue[a->head]->ts;
+	unsigned long long ts_b = b->queue[b->head]->ts;
+
+	return ts_a < ts_b || (ts_a == ts_b && a < b);
+}
+
+static void heap_swap(int a, int b)
+{
+	struct stream_cpu *cpu = stream.heap[a];
+
+	stream.heap[a] = stream.heap[b];
+	stream.heap[b] = cpu;
+	stream.heap[a]->heap_idx = a;
+	stream.heap[b]->heap_idx = b;
+}
+
+static void heap_up(int i)
+{
+	int parent;
+
+	while (i) {
+		parent = (i - 1) / 2;
+		if (!cpu_before(stream.heap[i], stream.heap[parent]))
+			break;
+		heap_swap(i, parent);
+		i = parent;
+	}
+}
+
+static void heap_down(int i)
+{
+	int child;
+
+	for (;;) {
+		child = i * 2 + 1;
+		if (child >= stream.nr_heap)
+			break;
+		if (child + 1 < stream.nr_heap &&
+		    cpu_before(stream.heap[child + 1], stream.heap[child]))
+			child++;
+		if (!cpu_before(stream.heap[child], stream.heap[i]))
+			break;
+		heap_swap(i, child);
+		i = child;
+	}
+}
+
+static void heap_push(struct stream_cpu *cpu)
+{
+	cpu->heap_idx = stream.nr_heap++;
+	stream.heap[cpu->heap_idx] = cpu;
+	heap_up(cpu->heap_idx);
+}
+
+static void heap_pop(void)
 {
+	stream.nr_heap--;
+	if (!stream.nr_heap)
+		return;
+	stream.heap[0] = stream.heap[stream.nr_heap];
+	stream.heap[0]->heap_idx = 0;
+	heap_down(0);
+}
+
+static void queue_add(struct stream_cpu *cpu, struct pevent_record *record)
+{
+	if (cpu->tail == cpu->size) {
+		if (cpu->head) {
+			cpu->tail -= cpu->head;
+			memmove(cpu->queue, cpu->queue + cpu->head,
+				sizeof(*cpu->queue) * cpu->tail);
+			cpu->head = 0;
+		} else {
+			cpu->size = cpu->size ? cpu->size * 2 : STREAM_BATCH;
+			cpu->queue = realloc(cpu->queue,
+					     sizeof(*cpu->queue) * cpu->size);
+			if (!cpu->queue)
+				die("Allocating stream records");
+		}
+	}
+	cpu->queue[cpu->tail++] = record;
+}
+
+static void stream_close(struct stream_cpu *cpu)
+{
+	cpu->pid->closed = 1;
+	epoll_ctl(stream.efd, EPOLL_CTL_DEL, cpu->pid->brass[0], NULL);
+	stream.nr_open--;
+	if (cpu->head == cpu->tail)
+		stream.nr_empty--;
+	if (cpu->more) {
+		cpu->more = false;
+		stream.nr_more--;
+	}
+}
+
+static void stream_decode(struct stream_cpu *cpu)
+{
+	struct pid_record_data *pid = cpu->pid;
 	struct pevent_record *record;
-	struct pid_record_data *pid;
-	struct pid_record_data *last_pid;
-	fd_set rfds;
-	int top_rfd = 0;
-	int ret;
+	bool empty = cpu->head == cpu->tail;
 	int i;
 
-	last_pid = NULL;
+	if (pid->closed)
+		return;
 
- again:
-	for (i = 0; i < nr_pids; i++) {
-		pid = &pids[i];
-
-		if (!pid->record)
-			pid->record = tracecmd_read_data(pid->instance->handle, pid->cpu);
-		record = pid->record;
-		if (!record && errno == EINVAL)
+	for (i = 0; i < STREAM_BATCH; i++) {
+		record = tracecmd_read_data(pid->instance->handle, pid->cpu);
+		if (!record) {
 			/* pipe has closed */
-			pid->closed = 1;
+			if (errno == EINVAL)
+				stream_close(cpu);
+			break;
+		}
+
+		if (record->missed_events > 0)
+			stream.dropped += record->missed_events;
+		else if (record->missed_events < 0)
+			stream.unknown_drops++;
+		if (record->ts > stream.newest)
+			stream.newest = record->ts;
+
+		queue_add(cpu, record);
+		stream.queued++;
+		if (empty) {
+			empty = false;
+			stream.nr_empty--;
+			heap_push(cpu);
+		}
+	}
+
+	if (cpu->more != (i == STREAM_BATCH)) {
+		cpu->more = !cpu->more;
+		stream.nr_more += cpu->more ? 1 : -1;
+	}
+}
 
-		if (record &&
-		    (!last_pid || record->ts < last_pid->record->ts))
-			last_pid = pid;
+static int stream_show(bool force)
+{
+	struct pevent_record *record;
+	struct stream_cpu *cpu;
+	int shown = 0;
+
+	while (stream.nr_heap) {
+		cpu = stream.heap[0];
+		record = cpu->queue[cpu->head];
+
+		if (!force && stream.nr_empty &&
+		    record->ts + reorder_window > stream.newest)
+			break;
+
+		trace_show_data(cpu->pid->instance->handle, record);
+
+		if (record->ts < stream.last)
+			stream.late++;
+		else
+			stream.last = record->ts;
+		if (stream.newest - record->ts > stream.max_lag)
+			stream.max_lag = stream.newest - record->ts;
+
+		free_record(record);
+		stream.queued--;
+		stream.events++;
+		shown++;
+
+		if (++cpu->head == cpu->tail) {
+			cpu->head = cpu->tail = 0;
+			if (!cpu->pid->closed)
+				stream.nr_empty++;
+			heap_pop();
+		} else
+			heap_down(0);
 	}
-	if (last_pid) {
-		trace_show_data(last_pid->instance->handle, last_pid->record);
-		free_record(last_pid->record);
-		last_pid->record = NULL;
-		return 1;
+
+	return shown;
+}
+
+static time_t stream_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+/* The data that the pipes hold, that the recorders are ahead of us by */
+static int stream_backlog(void)
+{
+	int backlog = 0;
+	int bytes;
+	int i;
+
+	for (i = 0; i < stream.nr_cpus; i++) {
+		if (stream.cpus[i].pid->closed)
+			continue;
+		if (ioctl(stream.cpus[i].pid->brass[0], FIONREAD, &bytes) == 0)
+			backlog += bytes;
+	}
+
+	return backlog;
+}
+
+static void stream_stats(bool final)
+{
+	unsigned long long lag;
+	time_t now;
+	time_t secs;
+
+	if (!stats_interval)
+		return;
+
+	now = stream_now();
+	if (!final && now < stream.stats_time + stats_interval)
+		return;
+
+	/* The last line has the rate of all of the run */
+	if (final) {
+		stream.stats_events = 0;
+		stream.stats_time = stream.start_time;
 	}
 
-	FD_ZERO(&rfds);
+	secs = now - stream.stats_time;
+	if (!secs)
+		secs = 1;
+	lag = stream.newest - stream.last;
+
+	fprintf(stderr, "stream: %llu events (%llu/s) lag %llu.%03llu ms "
+		"(max %llu.%03llu) queued %d backlog %d KB dropped %llu",
+		stream.events, (stream.events - stream.stats_events) / secs,
+		lag / 1000000, (lag / 1000) % 1000,
+		stream.max_lag / 1000000, (stream.max_lag / 1000) % 1000,
+		stream.queued, stream_backlog() / 1024, stream.dropped);
+	if (stream.unknown_drops)
+		fprintf(stderr, " (and %llu pages lost some)",
+			stream.unknown_drops);
+	fprintf(stderr, " late %llu\n", stream.late);
+
+	stream.stats_events = stream.events;
+	stream.stats_time = now;
+	stream.max_lag = 0;
+}
+
+static int stream_setup(struct pid_record_data *pids, int nr_pids)
+{
+	struct epoll_event ev;
+	int i;
+
+	stream.efd = epoll_create1(EPOLL_CLOEXEC);
+	if (stream.efd < 0)
+		return -1;
+
+	stream.cpus = calloc(nr_pids, sizeof(*stream.cpus));
+	stream.heap = calloc(nr_pids, sizeof(*stream.heap));
+	if (!stream.cpus || !stream.heap)
+		die("Allocating stream");
+	stream.nr_cpus = nr_pids;
 
 	for (i = 0; i < nr_pids; i++) {
-		/* Do not process closed pipes */
+		stream.cpus[i].pid = &pids[i];
 		if (pids[i].closed)
 			continue;
-		if (pids[i].brass[0] > top_rfd)
-			top_rfd = pids[i].brass[0];
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = &stream.cpus[i];
+		if (epoll_ctl(stream.efd, EPOLL_CTL_ADD, pids[i].brass[0], &ev) < 0)
+			die("epoll_ctl");
+		stream.nr_open++;
+	}
+	stream.nr_empty = stream.nr_open;
+	stream.start_time = stream_now();
+	stream.stats_time = stream.start_time;
+
+	/* The records are written out once per read, not once per line */
+	fflush(stdout);
+	setvbuf(stdout, NULL, _IOFBF, STREAM_BUF_SIZE);
+
+	return 0;
+}
+
+int trace_stream_read(struct pid_record_data *pids, int nr_pids, struct timeval *tv)
+{
+	struct epoll_event events[STREAM_MAX_EVENTS];
+	int timeout;
+	int shown;
+	int ret;
+	int i;
 
-		FD_SET(pids[i].brass[0], &rfds);
+	if (!stream.cpus && stream_setup(pids, nr_pids) < 0)
+		return -1;
+
+	timeout = tv->tv_sec * 1000 + tv->tv_usec / 1000;
+	if (stream.nr_more)
+		timeout = 0;
+	else if (stream.nr_heap && timeout > STREAM_HOLD_MSEC)
+		timeout = STREAM_HOLD_MSEC;
+
+	ret = epoll_wait(stream.efd, events, STREAM_MAX_EVENTS, timeout);
+	if (ret < 0) {
+		if (errno != EINTR)
+			return ret;
+		ret = 0;
 	}
 
-	ret = select(top_rfd + 1, &rfds, NULL, NULL, tv);
+	for (i = 0; i < ret; i++)
+		stream_decode(events[i].data.ptr);
+
+	/* Those that stopped at a batch still have records to decode */
+	for (i = 0; stream.nr_more && i < stream.nr_cpus; i++) {
+		if (stream.cpus[i].more)
+			stream_decode(&stream.cpus[i]);
+	}
+
+	/* Nothing more came in, show what is held back */
+	shown = stream_show(!ret && !stream.nr_more);
+	fflush(stdout);
+
+	stream_stats(false);
+
+	return shown ? shown : ret;
+}
 
-	if (ret > 0)
-		goto again;
+/**
+ * trace_stream_finish - show what is left and free the stream
+ *
+ * Called once the recorders are done and the pipes are read.
+ */
+void trace_stream_finish(void)
+{
+	int i, r;
 
-	return ret;
+	if (!stream.cpus)
+		return;
+
+	stream_show(true);
+	fflush(stdout);
+	stream_stats(true);
+
+	for (i = 0; i < stream.nr_cpus; i++) {
+		for (r = stream.cpus[i].head; r < stream.cpus[i].tail; r++)
+			free_record(stream.cpus[i].queue[r]);
+		free(stream.cpus[i].queue);
+	}
+	free(stream.cpus);
+	free(stream.heap);
+	close(stream.efd);
+	memset(&stream, 0, sizeof(stream));
 }
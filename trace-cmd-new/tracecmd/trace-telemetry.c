@@ -0,0 +1,332 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * The live health of the recorders of trace-cmd record (--telemetry).
+ *
+ * The recorders keep a struct tracecmd_recorder_stats each in a shared
+ * mapping that is set up before they are forked. A reporter process
+ * reads them, and the stats files of the ring buffers of the CPUs, every
+ * so many seconds, and writes a line of JSON for each recorder.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "trace-local.h"
+
+/* What the stats files of the ring buffer say, -1 if it does not */
+struct ring_stats {
+	long long		entries;
+	long long		overrun;
+	long long		commit_overrun;
+	long long		bytes;
+	long long		dropped;
+	long long		size_kb;
+};
+
+static struct telemetry {
+	FILE				*fp;
+	int				secs;
+	int				nr_stats;
+	struct tracecmd_recorder_stats	*stats;
+	struct tracecmd_recorder_stats	*prev;
+	unsigned long long		prev_time;
+	int				pid;
+} telemetry;
+
+static volatile sig_atomic_t telemetry_done;
+
+static unsigned long long mono_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * trace_telemetry_init - set up the shared stats of the recorders
+ * @file: the file to write the JSON lines to
+ * @secs: how often to write them
+ * @nr_recorders: the number of recorders that will be started
+ *
+ * Must be called before the recorders are forked, so that they share
+ * the mapping with the reporter.
+ *
+ * Returns an array of @nr_recorders stats, one for each recorder.
+ */
+struct tracecmd_recorder_stats *
+trace_telemetry_init(const char *file, int secs, int nr_recorders)
+{
+	size_t size = sizeof(*telemetry.stats) * nr_recorders;
+
+	telemetry.fp = fopen(file, "w");
+	if (!telemetry.fp)
+		die("can not create %s", file);
+
+	telemetry.stats = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (telemetry.stats == MAP_FAILED)
+		die("mapping the stats of the recorders");
+
+	telemetry.secs = secs;
+	telemetry.nr_stats = nr_recorders;
+
+	return telemetry.stats;
+}
+
+/* Find "name: value" at the start of a line of @buf */
+static long long stat_value(const char *buf, const char *name)
+{
+	int len = strlen(name);
+	const char *p = buf;
+
+	while (p) {
+		if (strncmp(p, name, len) == 0 && p[len] == ':')
+			return strtoll(p + len + 1, NULL, 0);
+		p = strchr(p, '\n');
+		if (p)
+			p++;
+	}
+	return -1;
+}
+
+static int read_cpu_file(struct buffer_instance *instance, int cpu,
+			 const char *name, char *buf, int size)
+{
+	char file[64];
+	char *path;
+	int fd;
+	int r;
+
+	snprintf(file, 64, "per_cpu/cpu%d/%s", cpu, name);
+	path = get_instance_file(instance, file);
+	if (!path)
+		return -1;
+	fd = open(path, O_RDONLY);
+	tracecmd_put_tracing_file(path);
+	if (fd < 0)
+		return -1;
+
+	r = read(fd, buf, size - 1);
+	close(fd);
+	if (r < 0)
+		return -1;
+	buf[r] = '\0';
+
+	return r;
+}
+
+static void read_ring_stats(struct buffer_instance *instance, int cpu,
+			    struct ring_stats *ring)
+{
+	char buf[BUFSIZ];
+	char *p;
+
+	memset(ring, -1, sizeof(*ring));
+
+	if (read_cpu_file(instance, cpu, "stats", buf, BUFSIZ) > 0) {
+		ring->entries = stat_value(buf, "entries");
+		ring->overrun = stat_value(buf, "overrun");
+		ring->commit_overrun = stat_value(buf, "commit overrun");
+		ring->bytes = stat_value(buf, "bytes");
+		ring->dropped = stat_value(buf, "dropped events");
+	}
+
+	/* Before the buffer is first used it shows "7 (expanded: 1408)" */
+	if (read_cpu_file(instance, cpu, "buffer_size_kb", buf, BUFSIZ) > 0) {
+		p = strstr(buf, "expanded:");
+		ring->size_kb = strtoll(p ? p + 9 : buf, NULL, 0);
+	}
+}
+
+static void print_value(const char *name, long long val)
+{
+	if (val < 0)
+		fprintf(telemetry.fp, ",\"%s\":null", name);
+	else
+		fprintf(telemetry.fp, ",\"%s\":%lld", name, val);
+}
+
+static void report(struct pid_record_data *pids, int nr_pids, bool final)
+{
+	struct tracecmd_recorder_stats *prev;
+	struct tracecmd_recorder_stats now;
+	struct buffer_instance *instance;
+	struct ring_stats ring;
+	struct timespec wall;
+	unsigned long long mono = mono_time();
+	double secs;
+	int i;
+
+	clock_gettime(CLOCK_REALTIME, &wall);
+	secs = (mono - telemetry.prev_time) / 1000000000.0;
+
+	for (i = 0; i < nr_pids && i < telemetry.nr_stats; i++) {
+		instance = pids[i].instance;
+		prev = &telemetry.prev[i];
+
+		now.bytes = __atomic_load_n(&telemetry.stats[i].bytes, __ATOMIC_RELAXED);
+		now.pages = __atomic_load_n(&telemetry.stats[i].pages, __ATOMIC_RELAXED);
+		now.rounds = __atomic_load_n(&telemetry.stats[i].rounds, __ATOMIC_RELAXED);
+		now.busy_ns = __atomic_load_n(&telemetry.stats[i].busy_ns, __ATOMIC_RELAXED);
+		now.max_ns = __atomic_load_n(&telemetry.stats[i].max_ns, __ATOMIC_RELAXED);
+		now.last_ns = __atomic_load_n(&telemetry.stats[i].last_ns, __ATOMIC_RELAXED);
+
+		read_ring_stats(instance, pids[i].cpu, &ring);
+
+		fprintf(telemetry.fp,
+			"{\"time\":%lld.%03ld,\"instance\":\"%s\",\"cpu\":%d",
+			(long long)wall.tv_sec, wall.tv_nsec / 1000000,
+			instance->name ? instance->name : "top", pids[i].cpu);
+
+		fprintf(telemetry.fp,
+			",\"bytes\":%llu,\"pages\":%llu"
+			",\"bytes_per_sec\":%.0f,\"pages_per_sec\":%.1f",
+			now.bytes, now.pages,
+			secs > 0 ? (now.bytes - prev->bytes) / secs : 0,
+			secs > 0 ? (now.pages - prev->pages) / secs : 0);
+
+		print_value("ring_bytes", ring.bytes);
+		print_value("ring_kb", ring.size_kb);
+		if (ring.bytes >= 0 && ring.size_kb > 0)
+			fprintf(telemetry.fp, ",\"fill\":%.3f",
+				ring.bytes / (ring.size_kb * 1024.0));
+		else
+			fprintf(telemetry.fp, ",\"fill\":null");
+		print_value("entries", ring.entries);
+		print_value("overrun", ring.overrun);
+		print_value("commit_overrun", ring.commit_overrun);
+		print_value("dropped", ring.dropped);
+
+		/* The latency of the rounds since the last line */
+		if (now.rounds > prev->rounds)
+			fprintf(telemetry.fp, ",\"latency_avg_us\":%.1f",
+				(now.busy_ns - prev->busy_ns) / 1000.0 /
+				(now.rounds - prev->rounds));
+		else
+			fprintf(telemetry.fp, ",\"latency_avg_us\":null");
+		fprintf(telemetry.fp, ",\"latency_max_us\":%.1f",
+			now.max_ns / 1000.0);
+		if (now.last_ns)
+			fprintf(telemetry.fp, ",\"idle_ms\":%llu",
+				(mono - now.last_ns) / 1000000);
+		else
+			fprintf(telemetry.fp, ",\"idle_ms\":null");
+
+		fprintf(telemetry.fp, ",\"final\":%s}\n",
+			final ? "true" : "false");
+
+		*prev = now;
+	}
+
+	fflush(telemetry.fp);
+	telemetry.prev_time = mono;
+}
+
+static void telemetry_stop(int sig)
+{
+	telemetry_done = 1;
+}
+
+/**
+ * trace_telemetry_start - start the reporter
+ * @pids: the recorders, in the order of the stats they were given
+ * @nr_pids: the number of recorders
+ *
+ * Forks the process that writes the lines, until trace_telemetry_stop()
+ * is called.
+ *
+ * Returns the pid of the reporter.
+ */
+int trace_telemetry_start(struct pid_record_data *pids, int nr_pids)
+{
+	struct timespec ts;
+	int ppid = getpid();
+	int pid;
+
+	fflush(stdout);
+
+	pid = fork();
+	if (pid < 0)
+		die("fork");
+	if (pid) {
+		telemetry.pid = pid;
+		return pid;
+	}
+
+	/* Ctrl^C is for the recorders, we go after they are done */
+	signal(SIGINT, SIG_IGN);
+	signal(SIGTERM, telemetry_stop);
+
+	/* Do not outlive trace-cmd, if it goes without stopping us */
+	prctl(PR_SET_PDEATHSIG, SIGTERM);
+	if (getppid() != ppid)
+		exit(0);
+
+	telemetry.prev = calloc(telemetry.nr_stats, sizeof(*telemetry.prev));
+	if (!telemetry.prev) {
+		warning("telemetry: malloc");
+		exit(-1);
+	}
+	telemetry.prev_time = mono_time();
+
+	while (!telemetry_done) {
+		ts.tv_sec = telemetry.secs;
+		ts.tv_nsec = 0;
+		/* A signal cuts the sleep short */
+		if (nanosleep(&ts, NULL) < 0 && errno != EINTR)
+			break;
+		if (telemetry_done)
+			break;
+		report(pids, nr_pids, false);
+	}
+
+	/* What the recorders had when they finished */
+	report(pids, nr_pids, true);
+	fclose(telemetry.fp);
+
+	exit(0);
+}
+
+/**
+ * trace_telemetry_stop - have the reporter write the last lines
+ *
+ * To be called once the recorders have exited.
+ */
+void trace_telemetry_stop(void)
+{
+	if (telemetry.pid <= 0)
+		return;
+
+	kill(telemetry.pid, SIGTERM);
+	waitpid(telemetry.pid, NULL, 0);
+	telemetry.pid = 0;
+
+	fclose(telemetry.fp);
+	munmap(telemetry.stats, sizeof(*telemetry.stats) * telemetry.nr_stats);
+	telemetry.stats = NULL;
+}
+
+/**
+ * trace_telemetry_kill - kill the reporter
+ *
+ * For when trace-cmd dies, and the recorders are killed too.
+ */
+void trace_telemetry_kill(void)
+{
+	if (telemetry.pid <= 0)
+		return;
+
+	kill(telemetry.pid, SIGKILL);
+	telemetry.pid = 0;
+}
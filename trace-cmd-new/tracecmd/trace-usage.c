@@ -33,6 +33,7 @@ static struct usage_help usage_help[] = {
 		"          -g set graph function\n"
 		"          -n do not trace function\n"
 		"          -m max size per CPU in kilobytes\n"
+		"          --segments used with -m, keep the newest data in this many segments\n"
 		"          -M set CPU mask to trace\n"
 		"          -v will negate all -e after it (disable those events)\n"
 		"          -d disable function tracer when running\n"
@@ -41,9 +42,14 @@ static struct usage_help usage_help[] = {
 		"          -O option to enable (or disable)\n"
 		"          -r real time priority to run the capture threads\n"
 		"          -s sleep interval between recording (in usecs) [default: 1000]\n"
+		"          --io-uring batch the reads and writes of the recorders with io_uring\n"
+		"          --telemetry write the health of the recorders to a file, as JSON lines\n"
+		"          --stats-interval used with --telemetry, seconds between the lines [default: 1]\n"
 		"          -S used with --profile, to enable only events in command line\n"
 		"          -N host:port to connect to (see listen)\n"
 		"          -t used with -N, forces use of tcp in live trace\n"
+		"          --mux used with -N, sends all CPUs over one connection\n"
+		"          --compress used with -N, compresses what is sent (the data only with --mux)\n"
 		"          -b change kernel buffersize (in kilobytes per CPU)\n"
 		"          -B create sub buffer and folling events will be enabled here\n"
 		"          -k do not reset the buffers after tracing.\n"
@@ -170,6 +176,9 @@ static struct usage_help usage_help[] = {
 		"          -H Allows users to hook two events together for timings\n"
 		"             (used with --profile)\n"
 		"          --by-comm used with --profile, merge events for related comms\n"
+		"          --profile-threads N used with --profile, profile slices of the file\n"
+		"                     on N threads (0 for one per CPU)\n"
+		"          --profile-self show where trace-cmd itself spent its time\n"
 		"          --ts-offset will add amount to timestamp of all events of the\n"
 		"                     previous data file.\n"
 		"          --ts2secs HZ, pass in the timestamp frequency (per second)\n"
@@ -183,6 +192,8 @@ static struct usage_help usage_help[] = {
 		"Start tracing and read the output directly",
 		" %s stream [-e event][-p plugin][-d][-O option ][-P pid]\n"
 		"          Uses same options as record but does not write to files or the network.\n"
+		"          --reorder-window how far apart the CPUs may be (usecs) [default: 0]\n"
+		"          --stats-interval write the lag and drops to stderr every so many seconds\n"
 	},
 	{
 		"profile",
@@ -195,8 +206,9 @@ static struct usage_help usage_help[] = {
 	{
 		"hist",
 		"show a historgram of the trace.dat information",
-		" %s hist [-i file][-P] [file]"
+		" %s hist [-i file][-P][-j threads] [file]"
 		"          -P ignore pids (compact all functions)\n"
+		"          -j build the call chains of the pids on this many threads\n"
 	},
 	{
 		"stat",
@@ -215,6 +227,7 @@ static struct usage_help usage_help[] = {
 		"          -p n  split file up by n pages\n"
 		"          -r    repeat from start to end\n"
 		"          -c    per cpu, that is -p 2 will be 2 pages for each CPU\n"
+		"          -j n  write the files of the CPUs on n threads\n"
 		"          if option is specified, it will split the file\n"
 		"           up starting at start, and ending at end\n"
 		"          start - decimal start time in seconds (ex: 75678.923853)\n"
@@ -229,12 +242,13 @@ static struct usage_help usage_help[] = {
 	{
 		"listen",
 		"listen on a network socket for trace clients",
-		" %s listen -p port[-D][-o file][-d dir][-l logfile]\n"
+		" %s listen -p port[-D][-o file][-d dir][-l logfile][--epoll]\n"
 		"          Creates a socket to listen for clients.\n"
 		"          -D create it in daemon mode.\n"
 		"          -o file name to use for clients.\n"
 		"          -d diretory to store client files.\n"
 		"          -l logfile to write messages to.\n"
+		"          --epoll serve all clients from one process\n"
 	},
 	{
 		"list",